@@ -0,0 +1,546 @@
+// Benchmarks for the storage engine. db.c is compiled in with its main left out, so the
+// workloads drive db_open, prepared statements and the stats counters directly:
+//
+//     gcc -O2 bench.c -o bench -lpthread -lm
+//     ./bench [--rows=20000,1000000] [--ops=100000] [--cache-size=8M] [--workloads=lookup_zipf,...]
+//
+// Every workload runs against every table size and prints one JSON object per line: throughput,
+// latency percentiles and the I/O it caused, so two builds can be compared run for run.
+#define DB_NO_MAIN
+#include "db.c"
+
+#include <math.h>
+
+#define BENCH_MAX_SIZES 8
+#define BENCH_DEFAULT_OPS 100000
+#define BENCH_DEFAULT_COMMIT_EVERY 1000  // Statements per WAL commit, like a client pipelining them
+#define BENCH_RANGE_ROWS 100              // Rows per range_scan
+#define BENCH_FULL_SCANS 3
+#define BENCH_ZIPF_THETA 0.99             // YCSB's default skew
+
+typedef struct {
+    DbOptions db;
+    const char* filename;
+    uint32_t sizes[BENCH_MAX_SIZES];
+    uint32_t num_sizes;
+    uint64_t ops;
+    uint64_t commit_every;
+    uint64_t seed;
+    const char* workloads;  // Comma-separated names to run, NULL for all
+} BenchOptions;
+
+// Zipfian ranks over [0, n), generated as in Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases" (the YCSB generator)
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+} Zipf;
+
+typedef struct {
+    const BenchOptions* options;
+    Table* table;
+    FILE* sink;               // /dev/null: selects format their rows as they would for a client
+    uint32_t rows;            // Rows the table was loaded with, ids 1..rows
+    uint32_t next_id;         // Inserts past the loaded rows take ids from here
+    uint64_t rng;
+    uint64_t ops_since_commit;
+    uint64_t rows_read;
+    Zipf zipf;
+    LatencyHistogram latency;
+    PreparedStatement* insert;
+    PreparedStatement* lookup;
+    PreparedStatement* range;
+    PreparedStatement* scan;
+    PreparedStatement* count;
+    PreparedStatement* page;
+    PreparedStatement* filter;
+} Bench;
+
+typedef struct {
+    const char* name;
+    bool needs_rows;  // Runs against the loaded table rather than building its own
+    uint64_t (*run)(Bench* bench);
+} Workload;
+
+/* Function Prototypes */
+uint64_t bench_random(Bench* bench);
+void zipf_init(Zipf* zipf, uint64_t n, double theta);
+uint64_t zipf_next(Zipf* zipf, Bench* bench);
+uint32_t bench_zipf_id(Bench* bench);
+void bench_open(Bench* bench, bool fresh);
+void bench_close(Bench* bench);
+PreparedStatement* bench_prepare(Bench* bench, const char* text);
+void bench_execute(Bench* bench, PreparedStatement* prepared);
+void bench_insert(Bench* bench, uint32_t id);
+void bench_lookup(Bench* bench, uint32_t id);
+void bench_range(Bench* bench, uint32_t id, uint32_t limit);
+void bench_commit(Bench* bench);
+uint64_t workload_seq_insert(Bench* bench);
+uint64_t workload_rand_insert(Bench* bench);
+uint64_t workload_lookup_uniform(Bench* bench);
+uint64_t workload_lookup_zipf(Bench* bench);
+uint64_t workload_range_scan(Bench* bench);
+uint64_t workload_full_scan(Bench* bench);
+uint64_t workload_count_range(Bench* bench);
+uint64_t workload_offset_page(Bench* bench);
+uint64_t workload_filter_scan(Bench* bench);
+uint64_t workload_mixed(Bench* bench);
+bool bench_selected(const BenchOptions* options, const char* name);
+void bench_run(Bench* bench, const Workload* workload);
+bool parse_sizes(char* text, BenchOptions* options);
+
+static const Workload workloads[] = {
+    { "rand_insert", false, workload_rand_insert },
+    { "seq_insert", false, workload_seq_insert },
+    { "lookup_uniform", true, workload_lookup_uniform },
+    { "lookup_zipf", true, workload_lookup_zipf },
+    { "range_scan", true, workload_range_scan },
+    { "full_scan", true, workload_full_scan },
+    { "count_range", true, workload_count_range },
+    { "offset_page", true, workload_offset_page },
+    { "filter_scan", true, workload_filter_scan },
+    { "mixed", true, workload_mixed },
+};
+
+/* --- Random Numbers --- */
+
+// splitmix64: fast, and the same sequence for the same --seed on every machine
+uint64_t bench_random(Bench* bench) {
+    uint64_t z = (bench->rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void zipf_init(Zipf* zipf, uint64_t n, double theta) {
+    double zeta_n = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        zeta_n += 1.0 / pow((double)i, theta);
+    }
+    double zeta_2 = 1.0 + 1.0 / pow(2.0, theta);
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zeta_n = zeta_n;
+    zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n);
+}
+
+uint64_t zipf_next(Zipf* zipf, Bench* bench) {
+    double u = (double)(bench_random(bench) >> 11) / (double)(1ull << 53);
+    double uz = u * zipf->zeta_n;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        return 1;
+    }
+    uint64_t rank = (uint64_t)((double)zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+// A skewed id: the popular ranks are scattered over the key space (as YCSB's scrambled zipfian
+// does) rather than all sitting in the first leaves
+uint32_t bench_zipf_id(Bench* bench) {
+    uint64_t rank = zipf_next(&bench->zipf, bench);
+    uint32_t hash = index_hash((const char*)&rank, sizeof(rank));
+    return hash % bench->rows + 1;
+}
+
+/* --- Harness --- */
+
+// Opens the benchmark database, deleting any earlier one (and its log and hot page list) first when fresh is set
+void bench_open(Bench* bench, bool fresh) {
+    const BenchOptions* options = bench->options;
+    if (fresh) {
+        char* log = wal_path(options->filename);
+        char* hot = hot_pages_path(options->filename);
+        unlink(options->filename);
+        unlink(log);
+        unlink(hot);
+        free(log);
+        free(hot);
+    }
+    bench->table = db_open(options->filename, &options->db);
+    bench->insert = bench_prepare(bench, "insert ? ? ?");
+    bench->lookup = bench_prepare(bench, "select ?");
+    bench->range = bench_prepare(bench, "select where id >= ? limit ?");
+    bench->scan = bench_prepare(bench, "select");
+    bench->count = bench_prepare(bench, "select count(*) where id >= ? and id <= ?");
+    bench->page = bench_prepare(bench, "select limit ? offset ?");
+    bench->filter = bench_prepare(bench, "select where email like ?");
+    bench->ops_since_commit = 0;
+}
+
+void bench_close(Bench* bench) {
+    bench_commit(bench);
+    free_prepared_statement(bench->insert);
+    free_prepared_statement(bench->lookup);
+    free_prepared_statement(bench->range);
+    free_prepared_statement(bench->scan);
+    free_prepared_statement(bench->count);
+    free_prepared_statement(bench->page);
+    free_prepared_statement(bench->filter);
+    free_table(bench->table);
+    bench->table = NULL;
+}
+
+PreparedStatement* bench_prepare(Bench* bench, const char* text) {
+    PreparedStatement* prepared;
+    if (db_prepare(text, &prepared) != PREPARE_SUCCESS) {
+        fprintf(stderr, "Error: could not prepare '%s'\n", text);
+        exit(EXIT_FAILURE);
+    }
+    prepared->statement.output = bench->sink;
+    prepared->statement.output_direct = true;
+    return prepared;
+}
+
+// Runs one operation and times it. A write that fills up a commit batch also pays for the commit,
+// so the tail latencies show the syncs and checkpoints.
+void bench_execute(Bench* bench, PreparedStatement* prepared) {
+    uint64_t start_ns = stats_now_ns();
+    ExecuteResult result = prepared_execute(prepared, bench->table);
+    if (result != EXECUTE_SUCCESS) {
+        print_execute_result(stderr, result);
+        exit(EXIT_FAILURE);
+    }
+    if (statement_writes(&prepared->statement)) {
+        if (++bench->ops_since_commit >= bench->options->commit_every) {
+            bench_commit(bench);
+        }
+    } else if (prepared->statement.type != STATEMENT_COUNT) {
+        bench->rows_read += prepared->statement.rows_affected;  // A count's result isn't rows read
+    }
+    latency_record(&bench->latency, stats_now_ns() - start_ns);
+}
+
+void bench_insert(Bench* bench, uint32_t id) {
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    int username_length = snprintf(username, sizeof(username), "user%u", id);
+    int email_length = snprintf(email, sizeof(email), "user%u@example.com", id);
+    prepared_bind_uint64(bench->insert, 0, id);
+    prepared_bind_text(bench->insert, 1, username, (size_t)username_length);
+    prepared_bind_text(bench->insert, 2, email, (size_t)email_length);
+    bench_execute(bench, bench->insert);
+}
+
+void bench_lookup(Bench* bench, uint32_t id) {
+    prepared_bind_uint64(bench->lookup, 0, id);
+    bench_execute(bench, bench->lookup);
+}
+
+void bench_range(Bench* bench, uint32_t id, uint32_t limit) {
+    prepared_bind_uint64(bench->range, 0, id);
+    prepared_bind_uint64(bench->range, 1, limit);
+    bench_execute(bench, bench->range);
+}
+
+void bench_commit(Bench* bench) {
+    table_commit(bench->table);
+    bench->ops_since_commit = 0;
+}
+
+/* --- Workloads --- */
+
+// Each returns the number of operations it timed
+
+uint64_t workload_seq_insert(Bench* bench) {
+    for (uint32_t id = 1; id <= bench->rows; id++) {
+        bench_insert(bench, id);
+    }
+    return bench->rows;
+}
+
+uint64_t workload_rand_insert(Bench* bench) {
+    uint32_t* ids = malloc(sizeof(uint32_t) * bench->rows);
+    if (ids == NULL) {
+        fprintf(stderr, "Error: malloc failed for benchmark ids\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < bench->rows; i++) {
+        ids[i] = i + 1;
+    }
+    for (uint32_t i = bench->rows - 1; i > 0; i--) {
+        uint32_t j = (uint32_t)(bench_random(bench) % (i + 1));
+        uint32_t id = ids[i];
+        ids[i] = ids[j];
+        ids[j] = id;
+    }
+    for (uint32_t i = 0; i < bench->rows; i++) {
+        bench_insert(bench, ids[i]);
+    }
+    free(ids);
+    return bench->rows;
+}
+
+uint64_t workload_lookup_uniform(Bench* bench) {
+    for (uint64_t i = 0; i < bench->options->ops; i++) {
+        bench_lookup(bench, (uint32_t)(bench_random(bench) % bench->rows) + 1);
+    }
+    return bench->options->ops;
+}
+
+uint64_t workload_lookup_zipf(Bench* bench) {
+    for (uint64_t i = 0; i < bench->options->ops; i++) {
+        bench_lookup(bench, bench_zipf_id(bench));
+    }
+    return bench->options->ops;
+}
+
+uint64_t workload_range_scan(Bench* bench) {
+    uint64_t scans = bench->options->ops / 10;
+    for (uint64_t i = 0; i < scans; i++) {
+        bench_range(bench, (uint32_t)(bench_random(bench) % bench->rows) + 1, BENCH_RANGE_ROWS);
+    }
+    return scans;
+}
+
+uint64_t workload_full_scan(Bench* bench) {
+    for (uint32_t i = 0; i < BENCH_FULL_SCANS; i++) {
+        bench_execute(bench, bench->scan);
+    }
+    return BENCH_FULL_SCANS;
+}
+
+// Counts over random id ranges, which only descend the two edges of the range
+uint64_t workload_count_range(Bench* bench) {
+    for (uint64_t i = 0; i < bench->options->ops; i++) {
+        uint32_t low = (uint32_t)(bench_random(bench) % bench->rows) + 1;
+        uint32_t high = (uint32_t)(bench_random(bench) % bench->rows) + 1;
+        prepared_bind_uint64(bench->count, 0, low < high ? low : high);
+        prepared_bind_uint64(bench->count, 1, low < high ? high : low);
+        bench_execute(bench, bench->count);
+    }
+    return bench->options->ops;
+}
+
+// Pages of BENCH_RANGE_ROWS rows at random offsets, as a paginated listing fetches them
+uint64_t workload_offset_page(Bench* bench) {
+    uint64_t pages = bench->options->ops / 10;
+    prepared_bind_uint64(bench->page, 0, BENCH_RANGE_ROWS);
+    for (uint64_t i = 0; i < pages; i++) {
+        prepared_bind_uint64(bench->page, 1, (uint32_t)(bench_random(bench) % bench->rows));
+        bench_execute(bench, bench->page);
+    }
+    return pages;
+}
+
+// Unindexed scans of the whole table for emails containing a random four-digit string
+uint64_t workload_filter_scan(Bench* bench) {
+    for (uint32_t i = 0; i < BENCH_FULL_SCANS; i++) {
+        char pattern[16];
+        int length = snprintf(pattern, sizeof(pattern), "%%%04u@%%", (unsigned)(bench_random(bench) % 10000));
+        prepared_bind_text(bench->filter, 0, pattern, (size_t)length);
+        bench_execute(bench, bench->filter);
+    }
+    return BENCH_FULL_SCANS;
+}
+
+// 70% skewed lookups, 20% short range scans, 10% inserts appending new ids
+uint64_t workload_mixed(Bench* bench) {
+    for (uint64_t i = 0; i < bench->options->ops; i++) {
+        uint64_t choice = bench_random(bench) % 10;
+        if (choice < 7) {
+            bench_lookup(bench, bench_zipf_id(bench));
+        } else if (choice < 9) {
+            bench_range(bench, bench_zipf_id(bench), 10);
+        } else {
+            bench_insert(bench, bench->next_id++);
+        }
+    }
+    return bench->options->ops;
+}
+
+bool bench_selected(const BenchOptions* options, const char* name) {
+    if (options->workloads == NULL) {
+        return true;
+    }
+    size_t length = strlen(name);
+    for (const char* position = options->workloads; *position != '\0';) {
+        size_t token = strcspn(position, ",");
+        if (token == length && strncmp(position, name, length) == 0) {
+            return true;
+        }
+        position += token;
+        position += strspn(position, ",");
+    }
+    return false;
+}
+
+// Runs workload with fresh counters and prints its line of results
+void bench_run(Bench* bench, const Workload* workload) {
+    memset(&bench->latency, 0, sizeof(bench->latency));
+    bench->rows_read = 0;
+    stats_reset(bench->table->pager);
+    uint64_t start_ns = stats_now_ns();
+    uint64_t ops = workload->run(bench);
+    bench_commit(bench);
+    double seconds = (double)(stats_now_ns() - start_ns) / 1e9;
+
+    Stats* snapshot = malloc(sizeof(Stats));
+    if (snapshot == NULL) {
+        fprintf(stderr, "Error: malloc failed for stats\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_snapshot(bench->table->pager, snapshot);
+    printf("{\"workload\":\"%s\",\"rows\":%u,\"cache_size\":%zu,\"ops\":%llu,\"seconds\":%.3f,"
+           "\"ops_per_sec\":%.0f,\"rows_read\":%llu,",
+           workload->name, bench->rows, bench->options->db.cache_size, (unsigned long long)ops, seconds,
+           seconds > 0 ? (double)ops / seconds : 0, (unsigned long long)bench->rows_read);
+    print_latency(stdout, "latency_us", &bench->latency, true);
+    printf(",\"page_hits\":%llu,\"page_misses\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,"
+           "\"wal_bytes_written\":%llu,\"syncs\":%llu,\"wal_syncs\":%llu,\"pages\":%u}\n",
+           (unsigned long long)snapshot->page_hits, (unsigned long long)snapshot->page_misses,
+           (unsigned long long)snapshot->bytes_read, (unsigned long long)snapshot->bytes_written,
+           (unsigned long long)snapshot->wal_bytes_written, (unsigned long long)snapshot->syncs.count,
+           (unsigned long long)snapshot->wal_syncs.count, bench->table->pager->num_pages);
+    fflush(stdout);
+    free(snapshot);
+}
+
+// --rows=<n>[,<n>]...
+bool parse_sizes(char* text, BenchOptions* options) {
+    options->num_sizes = 0;
+    char* position;
+    for (char* token = strtok_r(text, ",", &position); token != NULL; token = strtok_r(NULL, ",", &position)) {
+        uint32_t rows;
+        if (options->num_sizes == BENCH_MAX_SIZES || !parse_uint32(token, &rows) || rows == 0 ||
+            rows == UINT32_MAX) {
+            return false;
+        }
+        options->sizes[options->num_sizes++] = rows;
+    }
+    return options->num_sizes > 0;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options = {
+        .db = {
+            .cache_size = DEFAULT_CACHE_SIZE,
+            .wal = true,
+            .wal_autocheckpoint = DEFAULT_WAL_AUTOCHECKPOINT,
+        },
+        .filename = "bench.db",
+        // One table that fits in the default buffer pool, one five times larger than it
+        .sizes = { 20000, 1000000 },
+        .num_sizes = 2,
+        .ops = BENCH_DEFAULT_OPS,
+        .commit_every = BENCH_DEFAULT_COMMIT_EVERY,
+        .seed = 1,
+        .workloads = NULL,
+    };
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.db.scan_threads = num_cpus < 1 ? 1 : (uint32_t)num_cpus;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--rows=", 7) == 0) {
+            if (!parse_sizes(argv[i] + 7, &options)) {
+                printf("Invalid row counts '%s'.\n", argv[i] + 7);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--ops=", 6) == 0) {
+            options.ops = strtoull(argv[i] + 6, NULL, 10);
+        } else if (strncmp(argv[i], "--commit-every=", 15) == 0) {
+            options.commit_every = strtoull(argv[i] + 15, NULL, 10);
+            if (options.commit_every == 0) {
+                options.commit_every = 1;
+            }
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options.seed = strtoull(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--workloads=", 12) == 0) {
+            options.workloads = argv[i] + 12;
+        } else if (strncmp(argv[i], "--file=", 7) == 0) {
+            options.filename = argv[i] + 7;
+        } else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            if (!parse_size(argv[i] + 13, &options.db.cache_size)) {
+                printf("Invalid cache size '%s'.\n", argv[i] + 13);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+            size_t size;
+            if (!parse_size(argv[i] + 12, &size) || size > MAX_PAGE_SIZE || !page_size_valid((uint32_t)size)) {
+                printf("Invalid page size '%s' (a power of two from 4K to 64K).\n", argv[i] + 12);
+                exit(EXIT_FAILURE);
+            }
+            options.db.page_size = (uint32_t)size;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.db.mmap = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.db.compress = true;
+        } else if (strcmp(argv[i], "--no-wal") == 0) {
+            options.db.wal = false;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            options.db.io_uring = true;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            options.db.direct_io = true;
+        } else if (strcmp(argv[i], "--warm-start") == 0) {
+            options.db.warm_start = true;
+        } else if (strncmp(argv[i], "--scan-threads=", 15) == 0) {
+            options.db.scan_threads = (uint32_t)strtoul(argv[i] + 15, NULL, 10);
+        } else {
+            printf("Unrecognized option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Bench bench = { .options = &options, .rng = options.seed };
+    bench.sink = fopen("/dev/null", "w");
+    if (bench.sink == NULL) {
+        fprintf(stderr, "Error opening /dev/null: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t s = 0; s < options.num_sizes; s++) {
+        bench.rows = options.sizes[s];
+        bench.next_id = bench.rows + 1;
+
+        // The insert workloads build their own tables; the last one built is kept for the rest
+        bool loaded = false;
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            if (!workloads[w].needs_rows && bench_selected(&options, workloads[w].name)) {
+                bench_open(&bench, true);
+                bench_run(&bench, &workloads[w]);
+                bench_close(&bench);
+                loaded = workloads[w].run == workload_seq_insert;
+            }
+        }
+
+        bool reads_selected = false;
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            reads_selected |= workloads[w].needs_rows && bench_selected(&options, workloads[w].name);
+        }
+        if (!reads_selected) {
+            continue;
+        }
+        if (!loaded) {
+            // Loaded in order, untimed, so every read workload sees the same dense tree
+            bench_open(&bench, true);
+            workload_seq_insert(&bench);
+            bench_close(&bench);
+        }
+
+        // Reopened before each one so its buffer pool starts cold instead of with the pages the
+        // previous workload left (the OS page cache may still hold the file)
+        zipf_init(&bench.zipf, bench.rows, BENCH_ZIPF_THETA);
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            if (workloads[w].needs_rows && bench_selected(&options, workloads[w].name)) {
+                bench_open(&bench, false);
+                bench_run(&bench, &workloads[w]);
+                bench_close(&bench);
+            }
+        }
+    }
+
+    char* log = wal_path(options.filename);
+    char* hot = hot_pages_path(options.filename);
+    unlink(options.filename);
+    unlink(log);
+    unlink(hot);
+    free(log);
+    free(hot);
+    fclose(bench.sink);
+    return 0;
+}
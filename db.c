@@ -1,24 +1,124 @@
+#define _GNU_SOURCE  // mremap
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <sys/stat.h>
-#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /* getline prototype for portability */
 ssize_t getline(char **lineptr, size_t *n, FILE *stream);
 
 /* Macros and Constants */
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-#define TABLE_MAX_PAGES 100
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
-#define PAGE_SIZE 4096
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536  // Leaf value offsets are 16 bits
+#define INVALID_PAGE_NUM UINT32_MAX
+#define DB_HEADER_MAGIC 0x31424453  // "SDB1"
+#define DB_HEADER_VERSION 1
+#define DB_HEADER_SIZE (offsetof(DbHeader, checksum) + sizeof(uint32_t))  // Bytes of page 0 it uses
+#define HEADER_PAGE_NUM 0
+#define DB_ROOT_PAGE_NUM 2  // Where a new database puts the table's root, after the catalog
+#define INVALID_FRAME UINT32_MAX
+#define DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+#define PAGER_MIN_FRAMES 16
+#define FLUSH_MAX_IOV 1024  // Linux IOV_MAX: pages per pwritev call
+#define WAL_MAGIC 0x57414c32  // "WAL2"
+#define WAL_NARROW_MAGIC 0x57414c31  // "WAL1": logs from before 64-bit ids
+#define HOT_PAGES_MAGIC 0x31544f48  // "HOT1"
+#define WAL_HEADER_SIZE 8     // magic, salt
+#define WAL_RECORD_HEADER_SIZE 12  // type, payload length, checksum
+#define WAL_BUFFER_FLUSH_SIZE (1024 * 1024)
+// Bytes of the database file, far past any page, that processes lock to coordinate (see pager_lock)
+#define LOCK_WRITER_BYTE ((off_t)1 << 40)
+#define LOCK_READERS_BYTE (LOCK_WRITER_BYTE + 1)
+#define DEFAULT_WAL_AUTOCHECKPOINT (4 * 1024 * 1024)
+#define WAL_INSERT_BATCH_ROWS 4096  // Rows per insert record when logging a multi-row insert
+#define SERVER_LISTEN_BACKLOG 128
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE (64 * 1024)
+#define SERVER_MAX_LINE (16 * 1024 * 1024)   // Longest statement a client may send
+#define SERVER_SEND_TIMEOUT_MS 30000         // A client that stops reading its results for this long is dropped
+#define PROTOCOL_MAGIC "\0DBP"  // A binary client's first bytes; no text statement starts with a NUL
+#define PROTOCOL_MAGIC_SIZE 4
+#define PROTOCOL_HEADER_SIZE 5  // payload length, message type
+#define PROTOCOL_MAX_PREPARED 4096  // Prepared statements one connection may hold open
+#define RESULT_BUFFER_SIZE (64 * 1024)  // Formatted rows collected before a select writes them out
+#define CONSOLE_BUFFER_SIZE (64 * 1024)
+#define CONSOLE_MAX_PENDING (1024 * 1024)  // Results the prompt holds before it commits early to show them
+#define RESULT_MAX_PENDING_ROWS (FLUSH_MAX_IOV / 2)  // Binary rows per writev: frame header + id, then the value
+#define RESULT_MAX_PINS 8  // Leaves a binary result keeps pinned until their rows are written
+#define RESULT_ROW_MAX_TEXT (32 + 2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE))  // A row formatted with every character escaped
+#define PARALLEL_SCAN_MORSEL_ROWS 16384  // Rows a scan worker claims at a time
+#define PARALLEL_SCAN_MIN_ROWS (4 * PARALLEL_SCAN_MORSEL_ROWS)  // Smaller scans stay on one thread
+#define PARALLEL_SCAN_WINDOW 4  // Morsels per worker that may be claimed ahead of the one being collected
+#define PARALLEL_SCAN_MAX_THREADS 1024
+#define DEFAULT_IMPORT_FILL_PERCENT 100
+#define IMPORT_MIN_FILL_PERCENT 10
+#define IMPORT_MIN_SORT_MEMORY (1024 * 1024)
+#define IMPORT_RUN_BUFFER_CELLS 256   // Cells read at a time from each spilled run
+#define IMPORT_WRITE_BATCH_PAGES 256  // Pages written per pwritev while building the tree
+#define IMPORT_MAX_LEVELS 32
+#define IMPORT_CELL_SIZE ROW_MAX_SIZE  // Sort buffer slot holding one serialized row
+#define PAGE_MAP_MAGIC 0x4d50425a  // "ZBPM"
+#define EXTENT_SECTOR_SIZE 512     // Allocation unit of compressed page images
+#define EXTENT_MAX_SECTORS (page_size / EXTENT_SECTOR_SIZE)
+#define EXTENT_SIZE_CLASSES (MAX_PAGE_SIZE / EXTENT_SECTOR_SIZE + 1)  // Free lists for 0 to EXTENT_MAX_SECTORS sectors
+#define PAGE_MAP_DATA_START_SECTOR (DEFAULT_PAGE_SIZE / EXTENT_SECTOR_SIZE)  // The first 4 KB hold the two map headers
+#define PAGE_MAP_WRITE_BUFFER (256 * 1024)  // Images of consecutive extents written with one pwrite
+#define BACKUP_COPY_CHUNK (1024 * 1024)  // Bytes per read and write where copy_file_range can't be used
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5   // The block format ends with at least this many literals
+#define LZ4_MATCH_FIND_LIMIT 12  // and no match may start closer than this to the end
+#define LZ4_MAX_OFFSET 65535
+#define IO_RING_ENTRIES 256       // Submission queue size; a flush queues one write per run of pages
+#define IO_RING_READ_SLOTS 32     // Pages the io_uring backend can have prefetched at once
+#define IO_RING_PREFETCH_LEAVES 16  // How far ahead of a scan it reads
+#define IO_RING_TAG_READ (1ull << 32)   // user_data of a prefetch: tag | slot index
+#define IO_RING_TAG_WRITE (2ull << 32)  // flush: tag | run index
+#define IO_RING_TAG_SYNC (3ull << 32)
+#define IO_RING_TAG_MASK (0xffffffffull << 32)
+#define LATENCY_SUB_BUCKET_BITS 4  // Histogram buckets per power of two: 2^4, so within 1/16 of the true value
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)  // Covers every uint64_t
+#define NUM_STATEMENT_TYPES (STATEMENT_ROLLBACK + 1)
+// Bytes the text filter kernels compare at once; 0 leaves them to memcmp
+#if defined(__AVX2__)
+#define TEXT_VECTOR_SIZE 32
+#elif defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+#define TEXT_VECTOR_SIZE 16
+#else
+#define TEXT_VECTOR_SIZE 0
+#endif
+#define TEXT_VECTOR_PADDING 32  // The widest vector, read past the end of a filter's text
+#define TEXT_VECTOR_ALL ((uint32_t)((1ull << TEXT_VECTOR_SIZE) - 1))
 
 /* Data Structures */
 typedef struct {
@@ -37,36 +137,359 @@ typedef enum {
     PREPARE_NEGATIVE_ID,
     PREPARE_STRING_TOO_LONG,
     PREPARE_SYNTAX_ERROR,
-    PREPARE_UNRECOGNIZED_STATEMENT
+    PREPARE_UNRECOGNIZED_STATEMENT,
+    PREPARE_BAD_PARAMETER
 } PrepareResult;
 
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_INSERT_BATCH,
+    STATEMENT_SELECT,
+    STATEMENT_LOOKUP,
+    STATEMENT_COUNT,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_ROLLBACK
 } StatementType;
 
 typedef enum {
     EXECUTE_SUCCESS,
-    EXECUTE_TABLE_FULL,
-    EXECUTE_DUPLICATE_KEY
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_READ_ONLY,
+    EXECUTE_UNBOUND_PARAMETER,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_NO_CATALOG,  // The file predates secondary indexes and has no catalog page for them
+    EXECUTE_TRANSACTION_OPEN,   // begin while one is open, or a statement a transaction can't hold
+    EXECUTE_NO_TRANSACTION,     // commit or rollback without a begin
+    EXECUTE_NO_SERVER_TRANSACTIONS  // Server connections share the table, so each statement commits alone
 } ExecuteResult;
 
+// How execute prints the rows it returns
+typedef enum {
+    RESULT_TEXT,    // "(id, username, email)" lines
+    RESULT_CSV,     // id,username,email, fields quoted when they hold a comma, quote or line break
+    RESULT_TSV,     // Tab-separated, with tabs, line breaks and backslashes escaped
+    RESULT_BINARY   // MESSAGE_ROW frames holding the serialized row, and no other output
+} ResultFormat;
+
+// How a text predicate compares its column: username = <text> is MATCH_EQUAL, and a like pattern
+// starting or ending with % becomes one of the others
+typedef enum {
+    MATCH_EQUAL,
+    MATCH_PREFIX,    // like <text>%
+    MATCH_SUFFIX,    // like %<text>
+    MATCH_CONTAINS   // like %<text>%
+} MatchOp;
+
+// The comparisons a where clause can place on id
+typedef enum {
+    RANGE_EQUAL,
+    RANGE_AT_LEAST,
+    RANGE_ABOVE,
+    RANGE_AT_MOST,
+    RANGE_BELOW
+} RangeOp;
+
+// What a '?' placeholder of a prepared statement stands for
+typedef enum {
+    PARAMETER_ID,        // insert: the row's id
+    PARAMETER_USERNAME,  // insert: text columns, copied into the row as they are bound
+    PARAMETER_EMAIL,
+    PARAMETER_KEY,       // select ?, delete ?
+    PARAMETER_BOUND,     // where id <op> ?
+    PARAMETER_LIMIT,     // limit ?
+    PARAMETER_OFFSET,    // offset ?
+    PARAMETER_MATCH      // where username = ?, where email like ?
+} ParameterKind;
+
+// The text columns a where clause can compare and an index can be built on
+typedef enum {
+    COLUMN_NONE,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} Column;
+
+// Binary protocol messages. Every frame is [uint32 payload length][uint8 type][payload], numbers
+// little-endian. Each request is answered by zero or more MESSAGE_ROW frames and then exactly one
+// MESSAGE_PREPARED, MESSAGE_DONE or MESSAGE_ERROR.
+typedef enum {
+    MESSAGE_PREPARE = 'P',   // Statement text with '?' placeholders
+    MESSAGE_EXECUTE = 'E',   // uint32 handle, then each parameter: uint64, or uint8 length + bytes for text
+    MESSAGE_QUERY = 'Q',     // Statement text without placeholders, run once
+    MESSAGE_CLOSE = 'C',     // uint32 handle
+    MESSAGE_PREPARED = 'p',  // uint32 handle, uint32 parameter count, one uint8 per parameter: 0 number, 1 text
+    MESSAGE_ROW = 'r',       // One serialized row: uint64 id, username length, username, email length, email
+    MESSAGE_DONE = 'd',      // uint8 ExecuteResult, uint32 rows returned, inserted or deleted
+    MESSAGE_ERROR = 'e'      // Message text
+} MessageType;
+
 typedef struct {
-    uint32_t id;
+    uint64_t id;
     char username[COLUMN_USERNAME_SIZE + 1];
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+// Settings chosen when the database is opened
+typedef struct {
+    size_t cache_size;  // Buffer pool memory budget in bytes
+    bool wal;           // Log inserts to <file>-wal for per-statement durability
+    uint32_t group_commit_window_us;  // How long a commit leader waits for others to join its fsync
+    size_t wal_autocheckpoint;        // WAL size in bytes that triggers a checkpoint
+    bool mmap;          // Serve reads straight from a shared mapping of the file
+    bool compress;      // Create a new database in the compressed page format
+    bool read_only;     // Open for reading only, next to a writer and other readers
+    bool io_uring;      // Batch page reads and writes through an io_uring, if the kernel has one
+    bool direct_io;     // Bypass the kernel's page cache (O_DIRECT) for the database file
+    uint32_t scan_threads;  // Threads a large scan is split across; 0 or 1 scans on the calling thread
+    uint32_t page_size;     // Page size of a new database, 0 for DEFAULT_PAGE_SIZE; an existing file keeps its own
+    bool warm_start;        // Save the cached page numbers to <file>-hot at checkpoints and read them back in at open
+} DbOptions;
+
+typedef enum {
+    WAL_RECORD_INSERT = 1,   // Payload: one or more serialized rows
+    WAL_RECORD_PAGE = 2,     // Payload: page number + page image, written during a checkpoint
+    WAL_RECORD_CHECKPOINT = 3, // All page images of the checkpoint are in the log
+    WAL_RECORD_DELETE = 4,     // Payload: inclusive first and last key of the deleted range
+    WAL_RECORD_TRANSACTION = 5 // Payload: the insert and delete records of one commit, whose own checksums are 0
+} WalRecordType;
+
+// Write-ahead log. An LSN is the byte offset just past a record in the log file.
+typedef struct {
+    int file_descriptor;
+    char* path;
+    uint32_t salt;           // Changes on every reset so stale records are never replayed
+    uint64_t base_lsn;       // LSN of the log file's first byte; moves forward at every reset so LSNs never repeat
+    uint64_t end_lsn;        // LSN just past the last appended record
+    char* buffer;            // Records appended but not yet written, ending at end_lsn
+    size_t buffer_length;
+    size_t buffer_capacity;
+    char* spare_buffer;      // Swapped in while a commit leader writes the other one
+    size_t spare_capacity;
+    uint64_t flushed_lsn;    // Everything before this is on disk and synced
+    bool flushing;           // A commit leader is writing and syncing
+    uint32_t group_commit_window_us;
+    size_t autocheckpoint;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    char* replay;            // Insert and delete records left by recovery for db_open to re-apply
+    size_t replay_length;
+} Wal;
+
+// One slot of the buffer pool. A pinned frame is never picked for eviction.
+typedef struct {
+    uint32_t page_num;
+    uint32_t pin_count;
+    bool referenced;  // CLOCK bit, set on every access and cleared by the sweeping hand
+    bool dirty;       // Modified since it was last written to the file
+    bool mapped;      // data points into the pager's mmap instead of buffer
+    bool loading;     // Claimed by a miss whose read runs outside pool_lock; pinned until it is done
+    void* data;       // The page contents
+    void* buffer;     // Private page buffer owned by the frame, allocated on first use
+    void* shadow;     // In a transaction that changed the page: its contents at begin, for rollback
+    bool shadow_dirty;  // Whether it was dirty at begin
+} Frame;
+
+// Where a page lives in a compressed database file
+typedef struct {
+    uint32_t sector;  // First sector of the page image
+    uint32_t length;  // Bytes of the image: page_size when stored uncompressed, 0 if never written
+} PageExtent;
+
+// Root of a compressed file. Two copies alternate in the first two sectors, each with its own
+// region for the extent array; the valid one with the higher sequence is current, so a torn
+// commit never loses the map.
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t map_sector;    // The PageExtent array, one entry per page
+    uint32_t map_capacity;  // Sectors reserved for it
+    uint32_t num_pages;
+    uint32_t map_checksum;
+    uint32_t checksum;      // Over the fields above
+    uint32_t page_size;     // Added later, so outside the checksum: 0 in older files, which have 4 KB pages.
+                            // The header page repeats it under a checksum of its own.
+} PageMapHeader;
+
+// Page 0 of the database, written at every checkpoint. It says how to read the rest of the file,
+// so it is read first; everything in it after these fields is zero.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;       // Chosen when the file is created, never changed afterwards
+    uint32_t root_page_num;   // The table's root. The catalog is always at CATALOG_PAGE_NUM.
+    uint32_t num_pages;       // Including the header itself
+    uint32_t free_list_head;  // First page of the free list, 0 when it is empty
+    uint64_t row_count;
+    uint32_t checksum;        // Over the fields above
+} DbHeader;
+
+// Start of <file>-hot, the page numbers a writer had cached at its last checkpoint. It is only a
+// hint for the next open, so it is never synced; a torn or stale list is ignored or trimmed.
+typedef struct {
+    uint32_t magic;
+    uint32_t count;     // Page numbers that follow, most important first
+    uint32_t checksum;  // Over the page numbers
+} HotPagesHeader;
+
+// Compressed page storage: translates page numbers to variable-size extents. A page is never
+// rewritten in place. Its new image goes to a free extent, and the old one is only reused once
+// a map that no longer points at it is durable, so the file always holds a complete old version.
+typedef struct {
+    PageExtent* extents;    // Indexed by page number
+    uint32_t* written_in;   // Per page: sequence of the commit that will include its extent
+    uint32_t capacity;
+    uint32_t* free_extents[EXTENT_SIZE_CLASSES];  // Free extents by size in sectors
+    uint32_t free_count[EXTENT_SIZE_CLASSES];
+    uint32_t free_capacity[EXTENT_SIZE_CLASSES];
+    uint32_t* pending;      // (sector, count) pairs released since the last commit
+    uint32_t num_pending;
+    uint32_t pending_capacity;
+    uint32_t end_sector;    // Sectors up to here are allocated
+    uint32_t map_sector[2]; // Extent array region of each header copy
+    uint32_t map_capacity[2];
+    uint32_t sequence;
+    bool dirty;             // Extents changed since the last commit
+    char* write_buffer;     // Images bound for consecutive sectors, not yet written
+    uint32_t write_start;
+    uint32_t write_sectors;
+    char* scratch;          // One compressed image
+} PageMap;
+
+typedef enum {
+    PAGER_ACCESS_RANDOM,     // Point lookups: no readahead
+    PAGER_ACCESS_SEQUENTIAL  // Scans: aggressive readahead
+} PagerAccessPattern;
+
+// What a read-only pager last saw of the database. The writer only changes the file while it
+// holds LOCK_READERS_BYTE, and each such change moves at least one of these.
+typedef struct {
+    bool valid;
+    dev_t device;
+    ino_t inode;             // Changes when .vacuum renames a new file over the old one
+    off_t size;
+    struct timespec mtime;
+    bool has_wal;
+    uint32_t wal_salt;       // The writer starts a new salt after every checkpoint
+} FileSnapshot;
+
+// A page read ahead by the io_uring backend into a buffer of its own, until get_page wants it
+typedef struct {
+    uint32_t page_num;  // INVALID_PAGE_NUM when the slot is free
+    bool in_flight;
+    int32_t result;     // Once completed: bytes read, or -errno
+} IoRingReadSlot;
+
+// One coalesced run of dirty pages a flush has submitted
+typedef struct {
+    uint32_t first_page_num;
+    struct iovec* iov;
+    int iov_count;
+    int32_t result;  // Bytes written, or -errno, once completed
+} IoRingWrite;
+
+// An io_uring driven through the raw system calls. The kernel shares the submission and completion
+// rings with us; the head of one and the tail of the other are ours to advance.
+typedef struct {
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;      // Same mapping as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    struct io_uring_cqe* cqes;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    uint32_t to_submit;  // Queued since the last io_uring_enter
+    uint32_t in_flight;  // Submitted and not yet reaped, kept within cq_entries so nothing overflows
+    IoRingReadSlot slots[IO_RING_READ_SLOTS];
+    char* slot_buffers;      // IO_RING_READ_SLOTS pages, registered with the ring when the kernel allows
+    bool buffers_registered;
+    uint32_t next_slot;      // Round-robin choice of the slot the next prefetch reuses
+    IoRingWrite* writes;     // The flush waiting for its completions, NULL otherwise
+    int32_t sync_result;     // The flush's fdatasync
+} IoRing;
+
+// What the last .backup of a writer left behind, so the next one to the same file only copies
+// the pages written to the database since. The file's identity, size and modification time tell
+// whether anything else changed it in the meantime.
+typedef struct {
+    char* path;             // NULL until a backup has completed
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    uint64_t* changed;      // One bit per page written to the database file since that backup began
+    uint32_t changed_capacity;  // Pages the bitmap covers, a multiple of 64
+} BackupState;
+
+typedef struct {
+    uint32_t pages_copied;
+    uint32_t num_pages;     // In the backup
+    bool incremental;       // Only the changed pages were copied, into the previous backup
+} BackupResult;
+
 typedef struct {
     int file_descriptor;
-    uint32_t file_length;
+    off_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+    Frame* frames;
+    uint32_t num_frames;     // Capacity derived from the memory budget
+    uint32_t frames_in_use;  // Frames handed out so far; they are allocated lazily
+    uint32_t clock_hand;
+    uint32_t* page_table;    // Open-addressed hash table from page_num to frame index
+    uint32_t page_table_bits;
+    uint32_t frame_budget;   // num_frames may temporarily exceed this while dirty frames are pinned by the WAL
+    uint32_t num_dirty;
+    Wal* wal;                // NULL when the WAL is off. With it on, dirty frames are never evicted.
+    bool in_transaction;     // Dirty frames are never evicted either, and get a shadow copy when first changed
+    uint32_t transaction_num_pages;  // num_pages at begin; later pages are simply dropped by a rollback
+    char* map;               // Read-only shared mapping of the file in mmap mode, NULL otherwise
+    size_t map_length;
+    bool use_mmap;
+    PagerAccessPattern access_pattern;
+    PageMap* page_map;       // Compressed format only, NULL for a plain file of consecutive pages
+    DbHeader header;         // Page 0 as of the last checkpoint, except that the free list head is current.
+                             // magic is 0 for a file from before the header page, until db_open upgrades it.
+    char* filename;          // Kept so .vacuum can replace the file
+    bool read_only;
+    FileSnapshot snapshot;   // Read-only mode: the version of the file the cached pages belong to
+    bool concurrent;         // Server mode: several threads fetch pages, so pool_lock is taken
+    pthread_mutex_t pool_lock;  // Guards the frames, page table and CLOCK hand while concurrent
+    pthread_cond_t frame_loaded;  // Broadcast under pool_lock when a loading frame is filled
+    IoRing* ring;            // --io-uring: batched reads and writes, NULL for plain system calls
+    bool direct_io;          // The file is open with O_DIRECT, so every buffer given to it is page-aligned
+    char* bounce;            // direct_io: aligned copy of a page written from an unaligned buffer
+    bool warm_start;         // Checkpoints save the cached page numbers to <file>-hot
+    BackupState* backup;     // Plain files, from a writer's first .backup on; NULL otherwise
 } Pager;
 
+// What a rollback restores apart from the pages, and the log records a commit appends as one
+typedef struct {
+    DbHeader header;
+    uint32_t root_page_num;
+    char* log;           // Insert and delete records, in the WAL's format
+    size_t log_length;
+    size_t log_capacity;
+} Transaction;
+
 typedef struct {
     Pager* pager;
     uint32_t root_page_num;
+    uint32_t append_page_num;  // The rightmost leaf as last seen by an insert, INVALID_PAGE_NUM if unknown
+    uint32_t scan_threads;     // Workers a scan of at least PARALLEL_SCAN_MIN_ROWS rows is split across
+    Transaction* transaction;  // Between begin and commit or rollback, NULL otherwise
+    bool backup_running;       // Checkpoints that can wait are put off until the backup has copied the file
+    pthread_rwlock_t latch;  // Server mode: shared by reads, exclusive for writes and checkpoints
 } Table;
 
 typedef struct {
@@ -78,22 +501,280 @@ typedef struct {
 
 typedef enum {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_FREE,    // On the free list, waiting to be reused
+    NODE_CATALOG  // Page CATALOG_PAGE_NUM: the roots of the secondary indexes
 } NodeType;
 
+// Outcome of a bulk import
+typedef struct {
+    uint64_t rows_loaded;
+    uint64_t duplicates;  // Ids repeated in the input (the first one wins) or already in the table
+    uint64_t rejected;    // Lines that did not parse as <id> <username> <email>
+} ImportStats;
+
+typedef struct {
+    uint64_t key;
+    uint32_t index;       // Cell position in the sort buffer, so equal keys keep their input order
+    uint32_t value_size;  // Bytes the row takes in a leaf heap
+} ImportSortEntry;
+
+// A sorted run of serialized rows, one per fixed-size cell. Runs that did not fit in memory together are spilled back to back
+// into one temporary file; only their sorted keys stay in memory.
+typedef struct {
+    ImportSortEntry* entries;
+    uint64_t count;
+    uint64_t position;      // Next entry to merge
+    bool spilled;
+    char* cells;            // In memory: the unsorted cells entries index into. Spilled: read buffer.
+    off_t file_offset;      // Spilled: where the run's sorted cells start
+    uint64_t buffer_start;  // Spilled: entry index of the first cell in the read buffer
+    uint64_t buffer_count;
+} ImportRun;
+
+// K-way merge over the sorted runs
+typedef struct {
+    ImportRun* runs;
+    uint32_t num_runs;
+    uint32_t* heap;         // Runs with entries left, smallest current key first, ties in run order
+    uint32_t heap_size;
+    FILE* spill_file;       // NULL while everything fits in memory
+    off_t spill_length;
+    bool have_last_key;
+    uint64_t last_key;      // Last key handed out, to drop repeats
+} ImportMerge;
+
+// Collects the pages of a bulk-built tree. Every page but the root is numbered consecutively and
+// written in batches straight to the file; the root is kept until the rest is on disk.
+typedef struct {
+    Pager* pager;
+    char* pages;
+    uint32_t first_page_num;  // Page number of pages[0]
+    uint32_t num_batched;
+    uint32_t root_page_num;
+    char* root;
+} ImportWriter;
+
+// An entry of an index being built, copied out of the table into a batch
+typedef struct {
+    uint32_t hash;
+    uint32_t size;      // Bytes of the entry, [row id][column text]
+    const char* entry;
+} IndexBuildEntry;
+
+// A text predicate ready for the leaf scan. The text is followed by TEXT_VECTOR_PADDING zeros so the
+// kernels can read whole vectors of it; first and last repeat its first and last byte across a
+// vector for MATCH_CONTAINS.
+typedef struct {
+    Column column;
+    MatchOp op;
+    uint32_t length;
+    uint8_t text[COLUMN_EMAIL_SIZE + TEXT_VECTOR_PADDING];
+    uint8_t first[TEXT_VECTOR_PADDING];
+    uint8_t last[TEXT_VECTOR_PADDING];
+} TextFilter;
+
+// A node under an internal node that table_upgrade is rewriting
+typedef struct {
+    uint32_t page_num;
+    uint64_t max_key;
+    uint32_t count;   // Rows in its subtree
+    uint32_t parent;  // What its parent pointer holds, INVALID_PAGE_NUM if that isn't known
+} UpgradeChild;
+
+typedef struct {
+    UpgradeChild* children;
+    uint32_t num_children;
+    uint32_t capacity;
+} UpgradeList;
+
+typedef struct {
+    Pager* pager;
+    uint32_t format;         // The FILE_FORMAT_VERSION the file is being upgraded from
+    bool index;              // The tree is an index, whose entries start with a row id
+    bool relocate;           // The file has no catalog yet and a tree page sits in its place
+    uint32_t previous_leaf;  // The last leaf visited, whose next pointer follows a moved leaf
+    uint32_t num_pages;      // Of the file before the upgrade, for upgrade_check_tree
+    uint64_t* visited;       // A bit per page, set by upgrade_check_tree
+    uint32_t next_leaf;      // Where the last leaf upgrade_check_tree reached points to next
+} Upgrade;
+
+typedef struct {
+    ParameterKind kind;
+    RangeOp op;          // PARAMETER_BOUND: the comparison the value completes
+    uint32_t row_index;  // insert values: the row of the list the column belongs to
+    uint64_t value;      // Numbers; text is copied straight into the row
+    bool bound;
+} Parameter;
+
 typedef struct {
     StatementType type;
     Row row_to_insert;
+    Row* rows;        // insert values: the rows of the list, reused by later statements
+    uint32_t num_rows;
+    uint32_t rows_capacity;
+    uint64_t id_min;  // select, delete: inclusive key range, empty when id_min > id_max; lookup: the key
+    uint64_t id_max;
+    uint32_t limit;   // select: maximum rows returned, UINT32_MAX for no limit
+    uint32_t offset;  // select: rows of the result skipped before the first one returned
+    FILE* output;     // Where results are printed: stdout, or a connection's response in server mode
+    bool output_direct;  // Large results may bypass output and go straight to its file descriptor
+    ResultFormat format;
+    uint32_t rows_affected;  // Set by execute: rows returned, inserted, deleted or counted
+    Parameter* parameters;   // While db_prepare parses a template: where its '?' placeholders are recorded
+    uint32_t num_parameters;
+    Column match_column;     // select: only rows whose column matches match_value; create index: the column
+    bool match_like;         // match_value is a like pattern rather than the text itself
+    char match_value[COLUMN_EMAIL_SIZE + 3];  // Room for a pattern's two %
 } Statement;
 
+// A statement parsed once and run many times with different values bound to its placeholders
+typedef struct {
+    Statement statement;  // Rebuilt from the fields below and the bound values on every execute
+    StatementType type;   // As prepared; a select runs as a lookup once its bounds pin a single key
+    uint64_t id_min;      // The key range the template's literal predicates allow
+    uint64_t id_max;
+    uint32_t limit;
+    uint32_t offset;
+} PreparedStatement;
+
+// Collects the rows of a select and writes them out in large pieces. Small results are copied
+// into the statement's output stream when the select ends. Once a result outgrows the buffer and
+// the output is direct, the stream is flushed and the rest goes straight to its descriptor; binary
+// rows are then written with writev from the leaves themselves, which stay pinned until then.
+typedef struct {
+    Statement* statement;
+    Pager* pager;
+    Wal* wal;
+    bool direct;              // The stream was flushed and the log synced: bytes go to the descriptor
+    char buffer[RESULT_BUFFER_SIZE];
+    size_t length;
+    struct iovec iov[FLUSH_MAX_IOV];
+    int iov_count;
+    uint8_t prefixes[RESULT_MAX_PENDING_ROWS][PROTOCOL_HEADER_SIZE + sizeof(uint64_t)];  // Frame header and id of each pending binary row
+    uint32_t num_pending;
+    uint32_t pinned[RESULT_MAX_PINS];
+    uint32_t num_pinned;
+} ResultSink;
+
+// A run of consecutive rows, by rank, that a worker of a parallel scan takes on at a time
+typedef struct {
+    uint64_t rank;      // Of its first row in key order
+    uint64_t num_rows;
+    uint64_t matches;   // Rows that passed the filter
+    char* output;       // Those rows formatted, unless the scan only counts them
+    size_t length;
+    size_t capacity;
+    bool done;
+} ScanMorsel;
+
+// A scan split into morsels. Workers claim the next unclaimed one whenever they finish one, so a
+// morsel that is slow to filter or read doesn't hold the others up. The thread that started the
+// scan collects the morsels in order, and claims stay within window morsels of it, which bounds
+// the output waiting in memory.
+typedef struct {
+    Table* table;
+    ResultFormat format;
+    const TextFilter* filter;  // NULL to take every row
+    bool counting;
+    ScanMorsel* morsels;
+    uint32_t num_morsels;
+    uint32_t next_morsel;
+    uint32_t collected;
+    uint32_t window;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // A morsel was finished or collected
+} ParallelScan;
+
+// One client of the server. Its socket is armed in epoll with EPOLLONESHOT, so at most one worker
+// serves it at a time and results go back in the order the statements arrived.
+typedef struct Connection {
+    int socket;
+    char* input;              // Bytes received but not yet run, possibly ending in a partial line
+    size_t input_length;
+    size_t input_capacity;
+    Statement statement;      // Kept so insert values can reuse its row buffer
+    bool binary;              // Speaks the binary protocol; decided by the first bytes received
+    bool protocol_known;
+    PreparedStatement** prepared;  // Binary protocol handles, NULL once closed
+    uint32_t num_prepared;
+    struct Connection* next_ready;
+} Connection;
+
+typedef struct {
+    Table* table;
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;            // Delivers SIGINT and SIGTERM to the event loop
+    char* socket_path;        // Unix socket to remove on shutdown, NULL for TCP
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Connection* ready_head;   // Connections with input waiting for a worker, oldest first
+    Connection* ready_tail;
+    bool stopping;
+} Server;
+
+// Log-linear latency buckets in nanoseconds, like HdrHistogram: values below 16 get a bucket each,
+// every power of two above that is split into 16. Recording is a few relaxed atomic adds.
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Engine counters since the process started (or .stats reset). Only uint64_t fields, so a
+// snapshot or reset can go through them as an array.
+typedef struct {
+    // Updated under the pool lock (or by the only thread): plain increments on the hottest path
+    uint64_t page_hits;
+    uint64_t page_misses;
+    // Updated by writers, which hold the table exclusively
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t pages_warmed;       // Read back in at open from <file>-hot
+    // The rest happens outside any lock (group commit syncs, reader evictions), so it is atomic
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t wal_bytes_written;
+    LatencyHistogram syncs;      // The database file
+    LatencyHistogram wal_syncs;
+    LatencyHistogram statements[NUM_STATEMENT_TYPES];
+} Stats;
+
+// The shape of one B-tree, collected by walking every page
+typedef struct {
+    uint32_t height;
+    uint64_t leaves;
+    uint64_t internal_nodes;
+    uint64_t cells;
+    uint64_t leaf_bytes_used;
+    uint64_t internal_keys;
+    uint64_t wide_nodes;  // Internal nodes holding whole 64-bit keys, at half the capacity
+} TreeStats;
+
+// The prompt's stdout. Everything printed is held in pending and reaches the terminal or pipe only
+// through console_release, which runs once the statements it acknowledges are durable.
+typedef struct {
+    FILE* stream;  // Installed as stdout; NULL until console_open
+    char* pending;
+    size_t length;
+    size_t capacity;
+} Console;
+
+Stats stats;  // See Statistics
+Console console;
+uint32_t page_size = DEFAULT_PAGE_SIZE;  // Of the open database, see Database Header
+uint32_t open_pagers = 0;  // Pagers sharing page_size, so a second database has to match it
+
 /* B-Tree Layout */
+// A serialized row is [id][username length][username][email length][email]. Leaves keep the id
+// in the slot, so only the value (everything after the id) goes in the heap.
 #define ID_SIZE size_of_attribute(Row, id)
-#define USERNAME_SIZE size_of_attribute(Row, username)
-#define EMAIL_SIZE size_of_attribute(Row, email)
-#define ID_OFFSET 0
-#define USERNAME_OFFSET (ID_OFFSET + ID_SIZE)
-#define EMAIL_OFFSET (USERNAME_OFFSET + USERNAME_SIZE)
-#define ROW_SIZE (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
+#define ROW_COLUMN_LENGTH_SIZE sizeof(uint8_t)
+#define ROW_VALUE_MIN_SIZE (2 * ROW_COLUMN_LENGTH_SIZE)
+#define ROW_VALUE_MAX_SIZE (ROW_VALUE_MIN_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+#define ROW_MAX_SIZE (ID_SIZE + ROW_VALUE_MAX_SIZE)
 
 /* Common Node Header Layout */
 #define NODE_TYPE_SIZE sizeof(uint8_t)
@@ -107,32 +788,98 @@ typedef struct {
 /* Leaf Node Header Layout */
 #define LEAF_NODE_NUM_CELLS_SIZE sizeof(uint32_t)
 #define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_HEADER_SIZE
-#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
+#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_HEAP_START_SIZE sizeof(uint16_t)
+#define LEAF_NODE_HEAP_START_OFFSET (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_HEAP_START_SIZE)
 
 /* Leaf Node Body Layout */
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
-#define LEAF_NODE_KEY_OFFSET 0
-#define LEAF_NODE_VALUE_SIZE ROW_SIZE
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = LEAF_NODE_MAX_CELLS / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = LEAF_NODE_MAX_CELLS - (LEAF_NODE_MAX_CELLS / 2);
+// Slotted page: the sorted keys sit in one array right after the header, followed by a value
+// slot (offset, length) per key, and the variable-length row values they point at grow down
+// from the end of the page. Keeping the keys contiguous lets a search scan them with SIMD.
+#define LEAF_NODE_KEY_SIZE sizeof(uint64_t)
+#define LEAF_NODE_KEYS_OFFSET LEAF_NODE_HEADER_SIZE
+#define LEAF_NODE_VALUE_OFFSET_SIZE sizeof(uint16_t)
+#define LEAF_NODE_VALUE_OFFSET_OFFSET 0
+#define LEAF_NODE_VALUE_LENGTH_SIZE sizeof(uint16_t)
+#define LEAF_NODE_VALUE_LENGTH_OFFSET (LEAF_NODE_VALUE_OFFSET_OFFSET + LEAF_NODE_VALUE_OFFSET_SIZE)
+#define LEAF_NODE_VALUE_SLOT_SIZE (LEAF_NODE_VALUE_OFFSET_SIZE + LEAF_NODE_VALUE_LENGTH_SIZE)
+// Directory bytes each cell takes besides its value
+#define LEAF_NODE_SLOT_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SLOT_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS (page_size - LEAF_NODE_HEADER_SIZE)
+// Upper bound on the cells of one leaf, and the same for the largest page size, for sizing scratch arrays
+#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + ROW_VALUE_MIN_SIZE))
+#define LEAF_NODE_CELLS_BOUND ((MAX_PAGE_SIZE - LEAF_NODE_HEADER_SIZE) / (LEAF_NODE_SLOT_SIZE + ROW_VALUE_MIN_SIZE))
+// A non-root leaf using fewer bytes than this after a delete is merged with or refilled from a sibling
+#define LEAF_NODE_MIN_FILL (LEAF_NODE_SPACE_FOR_CELLS / 4)
 
 #define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_NUM_KEYS_OFFSET COMMON_NODE_HEADER_SIZE
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
-#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-
+#define INTERNAL_NODE_KEY_WIDTH_SIZE sizeof(uint8_t)
+#define INTERNAL_NODE_KEY_WIDTH_OFFSET (INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+#define INTERNAL_NODE_KEY_BASE_SIZE sizeof(uint64_t)
+#define INTERNAL_NODE_KEY_BASE_OFFSET 16  // The first 8-byte boundary past the key width
+#define INTERNAL_NODE_HEADER_SIZE (INTERNAL_NODE_KEY_BASE_OFFSET + INTERNAL_NODE_KEY_BASE_SIZE)
+
+/* Internal Node Body Layout */
+// All keys in one array, then all children, so a search only touches the keys. Last come the
+// row counts of the children's subtrees, one more than the cells since the right child has one too.
+// The keys of a node cover one stretch of the key space, so they are kept as 32-bit offsets from
+// the base in the header whenever they lie within 2^32 of each other. A node whose keys don't is
+// wide: the same bytes hold half as many whole 64-bit keys. Either way the search runs on the
+// stored form, and a narrow node has the fanout 32-bit keys had.
 #define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_WIDE_KEY_SIZE sizeof(uint64_t)
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
-
-#define INTERNAL_NODE_MAX_CELLS ((PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE)
-const uint32_t INTERNAL_NODE_RIGHT_SPLIT_COUNT = INTERNAL_NODE_MAX_CELLS / 2;
-const uint32_t INTERNAL_NODE_LEFT_SPLIT_COUNT = INTERNAL_NODE_MAX_CELLS - (INTERNAL_NODE_MAX_CELLS / 2);
+#define INTERNAL_NODE_COUNT_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE)
+#define INTERNAL_NODE_KEYS_OFFSET INTERNAL_NODE_HEADER_SIZE
+
+// Rounded down to even, so that a wide node holds exactly half as many cells
+#define INTERNAL_NODE_CELLS_IN(size) ((((size) - INTERNAL_NODE_KEYS_OFFSET - INTERNAL_NODE_COUNT_SIZE) / INTERNAL_NODE_CELL_SIZE) & ~1u)
+#define INTERNAL_NODE_MAX_CELLS INTERNAL_NODE_CELLS_IN(page_size)
+#define INTERNAL_NODE_WIDE_MAX_CELLS (INTERNAL_NODE_MAX_CELLS / 2)
+#define INTERNAL_NODE_CELLS_BOUND INTERNAL_NODE_CELLS_IN(MAX_PAGE_SIZE)  // For sizing scratch arrays
+#define INTERNAL_NODE_CHILDREN_OFFSET (INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE)
+#define INTERNAL_NODE_COUNTS_OFFSET (INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CHILD_SIZE)
+
+// Files written before FILE_FORMAT_VERSION 2 have 32-bit keys: in leaves, and in internal nodes
+// straight after a header without the key base
+#define NARROW_KEY_SIZE sizeof(uint32_t)
+#define NARROW_INTERNAL_NODE_KEYS_OFFSET 16
+#define NARROW_INTERNAL_NODE_MAX_CELLS ((page_size - NARROW_INTERNAL_NODE_KEYS_OFFSET - INTERNAL_NODE_COUNT_SIZE) / INTERNAL_NODE_CELL_SIZE)
+#define NARROW_INTERNAL_NODE_CHILDREN_OFFSET (NARROW_INTERNAL_NODE_KEYS_OFFSET + NARROW_INTERNAL_NODE_MAX_CELLS * NARROW_KEY_SIZE)
+
+// Internal nodes of files written before the counts: keys and children only, so more of them
+#define LEGACY_INTERNAL_NODE_MAX_CELLS ((page_size - NARROW_INTERNAL_NODE_KEYS_OFFSET) / (INTERNAL_NODE_CHILD_SIZE + NARROW_KEY_SIZE))
+#define LEGACY_INTERNAL_NODE_CHILDREN_OFFSET (NARROW_INTERNAL_NODE_KEYS_OFFSET + LEGACY_INTERNAL_NODE_MAX_CELLS * NARROW_KEY_SIZE)
+// A tree of 2^32 pages is shallower than this, so a deeper one is damaged (or loops)
+#define UPGRADE_MAX_DEPTH 64
+
+// The first version of the database kept the whole table in one 4 KB root leaf of fixed-size cells:
+// [key][id][username][email], the strings NUL-padded to one byte more than their column
+#define BASELINE_LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE)
+#define BASELINE_USERNAME_OFFSET (2 * NARROW_KEY_SIZE)
+#define BASELINE_EMAIL_OFFSET (BASELINE_USERNAME_OFFSET + COLUMN_USERNAME_SIZE + 1)
+#define BASELINE_LEAF_NODE_CELL_SIZE (BASELINE_EMAIL_OFFSET + COLUMN_EMAIL_SIZE + 1)
+#define BASELINE_LEAF_NODE_MAX_CELLS ((DEFAULT_PAGE_SIZE - BASELINE_LEAF_NODE_HEADER_SIZE) / BASELINE_LEAF_NODE_CELL_SIZE)
+
+/* Secondary Indexes */
+// An index is a B-tree of its own in the same file, keyed by a hash of the column value. Its cells
+// hold [row id][column text], sorted by id among equal hashes, so duplicates and hash collisions
+// are just adjacent cells. The catalog page right after the header records each index root.
+#define CATALOG_PAGE_NUM 1
+#define CATALOG_INDEX_ROOTS_OFFSET COMMON_NODE_HEADER_SIZE  // One uint32 root per Column, 0 for none
+#define CATALOG_FORMAT_OFFSET (CATALOG_INDEX_ROOTS_OFFSET + COLUMN_EMAIL * sizeof(uint32_t))
+#define FILE_FORMAT_VERSION 2  // 0: before internal nodes counted rows, 1: 32-bit keys; db_open upgrades both
+#define INDEX_ENTRY_MAX_SIZE (ID_SIZE + COLUMN_EMAIL_SIZE)
+
+#define KEY_SEARCH_WINDOW 16  // Keys left for the vector scan once binary search has narrowed a node's range
+// Likewise for a non-root internal node with fewer keys than this
+#define INTERNAL_NODE_MIN_KEYS (INTERNAL_NODE_MAX_CELLS / 4)
 
 uint32_t* internal_node_num_keys(void* node) {
     return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
@@ -147,43 +894,314 @@ uint32_t* internal_node_right_child(void* node) {
 InputBuffer* new_input_buffer(void);
 void close_input_buffer(InputBuffer* input_buffer);
 void print_prompt(void);
-void read_input(InputBuffer* input_buffer);
-void print_row(Row* row);
-void serialize_row(Row* source, void* destination);
-void deserialize_row(void* source, Row* destination);
+bool read_input(InputBuffer* input_buffer);
+bool input_pending(void);
+ssize_t console_write(void* cookie, const char* data, size_t length);
+void console_open(void);
+void console_release(void);
+bool console_full(void);
+int output_descriptor(FILE* output);
+void print_row(FILE* output, ResultFormat format, Row* row);
+uint32_t row_value_size(Row* row);
+uint32_t serialize_row_value(Row* source, void* destination);
+uint32_t deserialize_row_value(const void* source, Row* destination);
+uint32_t serialize_row(Row* source, void* destination);
+uint32_t deserialize_row(const void* source, Row* destination);
+ExecuteResult execute_insert(Statement* statement, Table* table);
+ExecuteResult execute_insert_batch(Statement* statement, Table* table);
 ExecuteResult execute_select(Statement* statement, Table* table);
+ExecuteResult execute_filter_select(Statement* statement, Table* table, const TextFilter* filter);
+ExecuteResult execute_index_select(Statement* statement, Table* table, Table* index, const TextFilter* filter);
+ExecuteResult execute_parallel_select(Statement* statement, Table* table, const TextFilter* filter,
+                                      uint64_t first_rank, uint64_t num_rows);
+ExecuteResult execute_lookup(Statement* statement, Table* table);
+ExecuteResult execute_count(Statement* statement, Table* table);
+ExecuteResult execute_delete(Statement* statement, Table* table);
+ExecuteResult execute_create_index(Statement* statement, Table* table);
+ExecuteResult execute_transaction(Statement* statement, Table* table);
+bool statement_writes(Statement* statement);
+bool print_prepare_error(FILE* output, PrepareResult result, const char* input);
+void print_execute_result(FILE* output, ExecuteResult result);
 ExecuteResult execute_statement(Statement* statement, Table* table);
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement);
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table);
-Table* db_open(const char* filename);
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_create_index(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_where(Statement* statement, char** token, char** position);
+PrepareResult prepare_insert_values(char* text, Statement* statement);
+bool prepare_placeholder(Statement* statement, const char* token, ParameterKind kind, RangeOp op);
+bool parse_range_op(const char* text, RangeOp* op);
+void statement_narrow_range(Statement* statement, RangeOp op, uint64_t value);
+bool parse_column(const char* text, Column* column);
+uint32_t column_size(Column column);
+bool parse_uint32(const char* text, uint32_t* value);
+bool parse_uint64(const char* text, uint64_t* value);
+PrepareResult parse_row(char* text, Row* row, Statement* statement);
+PrepareResult db_prepare(const char* text, PreparedStatement** prepared);
+PrepareResult prepared_bind_uint64(PreparedStatement* prepared, uint32_t index, uint64_t value);
+PrepareResult prepared_bind_text(PreparedStatement* prepared, uint32_t index, const char* text, size_t length);
+Row* prepared_row(PreparedStatement* prepared, Parameter* parameter);
+bool parameter_is_text(ParameterKind kind);
+ExecuteResult prepared_execute(PreparedStatement* prepared, Table* table);
+bool prepared_fill(PreparedStatement* prepared);
+void free_prepared_statement(PreparedStatement* prepared);
+char* format_uint64(char* destination, uint64_t value);
+char* format_field(char* destination, ResultFormat format, const uint8_t* text, uint8_t length);
+size_t format_cell(char* destination, ResultFormat format, uint64_t key, const void* value);
+void result_sink_open(ResultSink* sink, Statement* statement, Table* table);
+void result_sink_cell(ResultSink* sink, uint32_t page_num, uint64_t key, const void* value);
+void result_sink_flush(ResultSink* sink);
+void result_sink_close(ResultSink* sink);
+void result_sink_formatted(ResultSink* sink, const char* text, size_t length);
+void result_sink_writev(int file_descriptor, struct iovec* iov, int iov_count);
+bool parallel_scan_worth(Table* table, uint64_t num_rows);
+uint64_t parallel_scan(Table* table, ResultSink* sink, const TextFilter* filter, bool counting,
+                       uint64_t first_rank, uint64_t num_rows);
+void* parallel_scan_worker(void* argument);
+void parallel_scan_morsel(ParallelScan* scan, ScanMorsel* morsel);
+void scan_morsel_reserve(ScanMorsel* morsel, size_t bytes);
+void protocol_write_header(FILE* output, MessageType type, uint32_t length);
+void protocol_write_frame(FILE* output, MessageType type, const void* payload, uint32_t length);
+void protocol_write_done(FILE* output, ExecuteResult result, uint32_t rows_affected);
+void protocol_write_error(FILE* output, const char* message);
+void protocol_write_prepare_error(FILE* output, PrepareResult result, const char* input);
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table, Statement* statement);
+Table* db_open(const char* filename, const DbOptions* options);
 void free_table(Table* table);
-Pager* pager_open(const char* filename);
+ExecuteResult table_insert(Table* table, Row* row);
+uint32_t table_insert_batch(Table* table, Row** rows, uint32_t num_rows);
+uint32_t table_delete_range(Table* table, uint64_t id_min, uint64_t id_max);
+uint32_t table_vacuum(Table* table);
+void table_upgrade(Table* table);
+ExecuteResult table_begin(Table* table);
+void table_log(Table* table, WalRecordType type, const void* payload, uint32_t payload_length);
+ExecuteResult table_commit_transaction(Table* table);
+ExecuteResult table_rollback(Table* table);
+void table_add_header(Table* table);
+bool table_is_baseline(Table* table);
+void table_upgrade_baseline(Table* table);
+void table_check_format(Table* table);
+bool table_backup(Table* table, const char* path, bool full, BackupResult* result);
+bool backup_matches(const BackupState* backup, const char* path);
+bool backup_copy_range(int from_fd, int to_fd, off_t offset, off_t length);
+char* backup_partial_path(const char* path);
+bool backup_finish(int fd, char* partial, const char* path, bool ok);
+bool backup_write_full(int source_fd, const char* path, off_t length);
+bool backup_write_changed(int source_fd, const char* path, const uint64_t* changed, uint32_t changed_capacity,
+                          off_t length, uint32_t* pages_copied);
+void backup_state_free(BackupState* backup);
+bool sync_directory_of(const char* path);
+void backup_command(FILE* output, Table* table, char* arguments);
+void upgrade_tree(Upgrade* upgrade, uint32_t root_page_num);
+void upgrade_node(Upgrade* upgrade, uint32_t page_num, uint64_t max_key, UpgradeList* out);
+void upgrade_write_nodes(Pager* pager, UpgradeList* list, uint32_t home_page_num, uint32_t home_parent, UpgradeList* out);
+void upgrade_leaf(Upgrade* upgrade, uint32_t page_num, bool relocate, uint64_t max_key, UpgradeList* out);
+void upgrade_list_add(UpgradeList* list, UpgradeChild child);
+bool upgrade_check_tree(Upgrade* upgrade, uint32_t page_num, uint32_t depth);
+bool upgrade_node_valid(Upgrade* upgrade, void* node, uint32_t page_num, bool root);
+bool match_fits(const Statement* statement, const char* text, size_t length);
+void text_filter_init(TextFilter* filter, const Statement* statement);
+#if TEXT_VECTOR_SIZE > 0
+uint32_t text_vector_equal_mask(const uint8_t* a, const uint8_t* b);
+#endif
+bool text_equal(const uint8_t* text, const uint8_t* pattern, uint32_t length, const uint8_t* limit);
+bool text_contains(const uint8_t* text, uint32_t text_length, const TextFilter* filter, const uint8_t* limit);
+bool text_filter_match(const TextFilter* filter, const void* value, const uint8_t* limit);
+uint32_t leaf_node_filter(void* node, uint32_t first_cell, uint32_t end_cell, const TextFilter* filter, uint16_t* matches);
+uint32_t index_hash(const void* text, uint32_t length);
+uint32_t* catalog_index_root(void* catalog, Column column);
+uint32_t* catalog_format(void* catalog);
+void initialize_catalog(void* node);
+uint32_t table_format(Table* table);
+bool table_has_catalog(Table* table);
+bool table_index(Table* table, Column column, Table* index);
+bool table_has_indexes(Table* table);
+void table_index_row(Table* table, Row* row, bool remove);
+int compare_index_build_entries(const void* a, const void* b);
+ExecuteResult table_create_index(Table* table, Column column);
+const char* row_column(Row* row, Column column);
+uint32_t value_column(const void* value, Column column, const uint8_t** text);
+uint64_t index_entry_id(void* node, uint32_t cell_num);
+void index_seek(Table* index, uint32_t hash, uint64_t id, Cursor* cursor);
+void index_insert(Table* index, Column column, Row* row);
+void index_insert_entry(Table* index, uint32_t hash, const char* entry, uint32_t size);
+void index_delete(Table* index, Column column, Row* row);
+void table_commit(Table* table);
+bool table_checkpoint_due(Table* table);
+void table_checkpoint(Table* table);
+void table_write_header(Table* table);
+bool table_import(Table* table, FILE* input, uint32_t fill_percent, ImportStats* stats);
+uint64_t import_group_start(uint64_t group, uint64_t items, uint64_t groups);
+Pager* pager_open(const char* filename, const DbOptions* options);
+void pager_open_wal(Pager* pager, const DbOptions* options);
+bool page_size_valid(uint32_t size);
+uint32_t db_header_checksum(const DbHeader* header);
+void db_header_init(DbHeader* header);
+uint32_t pager_file_page_size(int file_descriptor, off_t file_length, const PageMapHeader* map_header);
+void pager_read_header(Pager* pager);
 void* get_page(Pager* pager, uint32_t page_num);
-void pager_flush(Pager* pager, uint32_t page_num);
+void* get_page_for_write(Pager* pager, uint32_t page_num);
+void pager_shrink_to_budget(Pager* pager);
+void* pager_pin(Pager* pager, uint32_t page_num);
+void pager_unpin(Pager* pager, uint32_t page_num);
+void pager_write_page(Pager* pager, uint32_t page_num, void* data);
+void pager_write_run(Pager* pager, uint32_t first_page_num, struct iovec* iov, int iov_count);
+void pager_track_write(Pager* pager, uint32_t first_page_num, uint32_t num_pages);
+void pager_flush(Pager* pager);
+bool pager_sync(Pager* pager);
+IoRing* io_ring_open(void);
+void io_ring_close(IoRing* ring);
+void io_ring_enter(IoRing* ring, uint32_t min_complete);
+struct io_uring_sqe* io_ring_get_sqe(IoRing* ring);
+void io_ring_push(IoRing* ring);
+void io_ring_reap(IoRing* ring, bool wait);
+bool pager_ring_prefetch(Pager* pager, uint32_t page_num);
+ssize_t pager_ring_take(Pager* pager, uint32_t page_num, void* page);
+void pager_ring_forget(Pager* pager, uint32_t first_page_num, uint32_t num_pages);
+void pager_ring_flush(Pager* pager, Frame** dirty, uint32_t num_dirty);
+bool pager_enable_direct_io(Pager* pager);
+void pager_replace_file(Pager* pager, Pager* replacement);
+bool pager_lock(int file_descriptor, short type, off_t byte, bool wait);
+void pager_lock_pool(Pager* pager);
+void pager_unlock_pool(Pager* pager);
+void pager_exclude_readers(Pager* pager);
+void pager_admit_readers(Pager* pager);
+void pager_drop_frames(Pager* pager);
+void pager_end_transaction(Pager* pager, bool rollback);
+void pager_load_snapshot(Pager* pager);
+void pager_begin_read(Pager* pager);
+void table_begin_read(Table* table);
+void pager_end_read(Pager* pager);
+void page_map_close(PageMap* map);
+void pager_remap(Pager* pager);
+void pager_set_access_pattern(Pager* pager, PagerAccessPattern pattern);
+void pager_prefetch(Pager* pager, uint32_t page_num);
+void pager_prefetch_batch(Pager* pager, const uint32_t* page_nums, uint32_t count);
+char* hot_pages_path(const char* db_filename);
+void pager_save_hot_pages(Pager* pager);
+int compare_page_nums(const void* a, const void* b);
+void pager_load_hot_pages(Pager* pager);
 void* cursor_value(Cursor* cursor);
 void cursor_advance(Cursor* cursor);
-Cursor* table_start(Table* table);
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
-uint32_t leaf_node_find_cell(void* node, uint32_t key);
+void cursor_skip_exhausted_leaves(Cursor* cursor);
+void cursor_prefetch_leaves(Cursor* cursor, void* node);
+uint64_t cursor_key(Cursor* cursor);
+void cursor_close(Cursor* cursor);
+void table_seek(Table* table, uint64_t key, Cursor* cursor);
+void table_seek_rank(Table* table, uint64_t rank, Cursor* cursor);
+uint64_t table_count_below(Table* table, uint64_t key);
+uint64_t table_count_range(Table* table, uint64_t id_min, uint64_t id_max);
+bool table_get(Table* table, uint64_t key, Row* row);
+uint32_t key_count_below(const uint32_t* keys, uint32_t count, uint32_t key);
+uint32_t key_lower_bound(const uint32_t* keys, uint32_t count, uint32_t key);
+uint32_t wide_key_count_below(const uint64_t* keys, uint32_t count, uint64_t key);
+uint32_t wide_key_lower_bound(const uint64_t* keys, uint32_t count, uint64_t key);
+uint32_t leaf_node_find_cell(void* node, uint64_t key);
 uint32_t* leaf_node_num_cells(void* node);
-void* leaf_node_cell(void* node, uint32_t cell_num);
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+uint32_t* leaf_node_next_leaf(void* node);
+uint16_t* leaf_node_heap_start(void* node);
+uint64_t* leaf_node_keys(void* node);
+uint64_t* leaf_node_key(void* node, uint32_t cell_num);
+void* leaf_node_value_slot(void* node, uint32_t cell_num);
+uint16_t* leaf_node_value_offset(void* node, uint32_t cell_num);
+uint16_t* leaf_node_value_length(void* node, uint32_t cell_num);
+void leaf_node_set_num_cells(void* node, uint32_t num_cells);
+void leaf_node_open_cell(void* node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
+uint32_t leaf_node_free_space(void* node);
+void leaf_node_set_cell(void* node, uint32_t cell_num, uint64_t key, const void* value, uint32_t value_size);
+void leaf_node_set_row(void* node, uint32_t cell_num, uint64_t key, Row* row);
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* row);
+void leaf_node_remove_cells(void* node, uint32_t first_cell, uint32_t count);
+void leaf_node_rebalance(Table* table, uint32_t page_num);
 void initialize_leaf_node(void* node);
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
-void print_leaf_node(void* node);
+void initialize_internal_node(void* node);
+uint32_t* node_parent(void* node);
+uint64_t get_node_max_key(Pager* pager, void* node);
+void leaf_node_insert(Cursor* cursor, uint64_t key, Row* value);
+void leaf_node_insert_cell(Cursor* cursor, uint64_t key, const void* value, uint32_t value_size);
+void leaf_node_split_and_insert(Cursor* cursor, uint64_t key, const void* value, uint32_t value_size);
 uint32_t get_unused_page_num(Pager* pager);
+void release_page_num(Pager* pager, uint32_t page_num);
+uint32_t* free_list_next(void* node);
 bool is_node_root(void* node);
 void set_node_root(void* node, bool is_root);
 NodeType get_node_type(void* node);
 void set_node_type(void* node, NodeType type);
 void create_new_root(Table* table, uint32_t right_child_page_num);
-uint32_t internal_node_find_child(void* node, uint32_t key);
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_index, uint32_t new_child_page_num, uint32_t new_key);
+uint32_t internal_node_find_child(void* node, uint64_t key);
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_index, uint32_t new_child_page_num, uint64_t new_key);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
-Cursor* table_find(Table* table, uint32_t key);
+uint8_t* internal_node_key_width(void* node);
+uint64_t* internal_node_key_base(void* node);
+bool internal_node_is_wide(void* node);
+void* internal_node_keys(void* node);
+uint32_t* internal_node_children(void* node);
+uint64_t internal_node_key(void* node, uint32_t key_num);
+bool internal_node_key_fits(void* node, uint64_t key);
+void internal_node_store_key(void* node, uint32_t key_num, uint64_t key);
+uint32_t internal_node_capacity(const uint64_t* keys, uint32_t num_keys);
+bool internal_node_keys_fit(const uint64_t* keys, uint32_t num_keys);
+void internal_node_set_keys(void* node, const uint64_t* keys, uint32_t num_keys);
+void internal_node_get_keys(void* node, uint64_t* keys);
+bool internal_node_replace_key(void* node, uint32_t key_num, uint64_t key);
+uint32_t* internal_node_counts(void* node);
+uint32_t* internal_node_count(void* node, uint32_t child_num);
+uint64_t node_row_count(void* node);
+void tree_add_count(Pager* pager, uint32_t page_num, uint64_t key, int32_t delta);
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num);
+void internal_node_merge_children(void* node, uint32_t left_index);
+void internal_node_rebalance(Table* table, uint32_t page_num);
+void internal_node_find(Table* table, uint32_t page_num, uint64_t key, Cursor* cursor);
+void table_find(Table* table, uint64_t key, Cursor* cursor);
+bool table_find_append(Table* table, uint64_t key, Cursor* cursor);
+void table_remember_append(Table* table, uint32_t page_num);
+bool node_is_rightmost(Pager* pager, uint32_t page_num);
+bool parse_size(const char* text, size_t* size);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t length);
+char* wal_path(const char* db_filename);
+bool wal_exists(const char* db_filename);
+Wal* wal_open(const char* db_filename, const DbOptions* options);
+char* wal_read_log(int file_descriptor, off_t* length, uint32_t* salt, bool* narrow_ids);
+size_t wal_widen_records(const char* records, size_t length, char* out);
+size_t wal_scan(const char* log, size_t length, uint32_t salt, size_t* previous_checkpoint, size_t* last_checkpoint);
+bool wal_checkpoint_interrupted(const char* db_filename);
+bool wal_read_salt(const char* db_filename, uint32_t* salt);
+void wal_recover(Wal* wal, Pager* pager);
+uint64_t wal_append(Wal* wal, WalRecordType type, const void* payload, uint32_t payload_length);
+void wal_commit(Wal* wal, uint64_t lsn);
+void wal_checkpoint(Wal* wal, Pager* pager);
+void wal_close(Wal* wal);
+int server_listen(const char* address, char** socket_path);
+void server_run(Table* table, const char* address, uint32_t num_workers);
+void server_accept(Server* server);
+void server_enqueue(Server* server, Connection* connection);
+void* server_worker(void* argument);
+void server_serve(Server* server, Connection* connection);
+bool server_receive(Connection* connection);
+bool server_execute(Server* server, Connection* connection, char* line, size_t line_length, uint64_t* commit_lsn);
+bool server_execute_message(Server* server, Connection* connection, MessageType type, const char* payload, uint32_t length, uint64_t* commit_lsn);
+ExecuteResult server_execute_statement(Server* server, Statement* statement, uint64_t* commit_lsn);
+void server_close(Connection* connection);
+void server_commit(Server* server, uint64_t commit_lsn);
+bool server_send(int socket, const char* data, size_t length);
+uint64_t stats_now_ns(void);
+void stats_add(uint64_t* counter, uint64_t amount);
+void latency_record(LatencyHistogram* histogram, uint64_t ns);
+uint32_t latency_bucket(uint64_t ns);
+uint64_t latency_bucket_max(uint32_t bucket);
+uint64_t latency_percentile(const LatencyHistogram* histogram, double fraction);
+int stats_fdatasync(int file_descriptor, LatencyHistogram* histogram);
+const char* statement_type_name(StatementType type);
+void stats_snapshot(Pager* pager, Stats* snapshot);
+void stats_reset(Pager* pager);
+void tree_stats(Pager* pager, uint32_t page_num, uint32_t depth, TreeStats* tree);
+uint32_t count_free_pages(Pager* pager);
+void print_stats(FILE* output, Table* table, bool json);
+void print_latency(FILE* output, const char* name, const LatencyHistogram* histogram, bool json);
+void print_tree_stats(FILE* output, const char* name, const TreeStats* tree, bool json);
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+void indent(uint32_t level);
 
 /* --- REPL & Frontend Implementation --- */
 
@@ -204,8 +1222,8 @@ InputBuffer* new_input_buffer(void) {
     return input_buffer;
 }
 
-// Reads input from the InputBuffer
-void read_input(InputBuffer* input_buffer) {
+// Reads input from the InputBuffer, returns false once there is no more input
+bool read_input(InputBuffer* input_buffer) {
     // Gets each line from the input_buffer
     ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
     if (bytes_read <= 0) {
@@ -214,11 +1232,72 @@ void read_input(InputBuffer* input_buffer) {
         } else {
             fprintf(stderr, "Error reading input: %s\n", strerror(errno));
         }
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     input_buffer->input_length = bytes_read - 1;
     input_buffer->buffer[bytes_read - 1] = 0;
+    return true;
+}
+
+// True when the next read will not block, i.e. the client has already queued more statements
+bool input_pending(void) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Collects what stdout's buffer hands on, until console_release
+ssize_t console_write(void* cookie, const char* data, size_t length) {
+    (void)cookie;
+    if (console.length + length > console.capacity) {
+        while (console.length + length > console.capacity) {
+            console.capacity = console.capacity == 0 ? CONSOLE_BUFFER_SIZE : console.capacity * 2;
+        }
+        console.pending = realloc(console.pending, console.capacity);
+        if (console.pending == NULL) {
+            fprintf(stderr, "Error: malloc failed for output\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(console.pending + console.length, data, length);
+    console.length += length;
+    return (ssize_t)length;
+}
+
+// Puts the console in place of stdout. What was printed before goes out first.
+void console_open(void) {
+    static char buffer[CONSOLE_BUFFER_SIZE];
+    fflush(stdout);
+    console.stream = fopencookie(NULL, "w", (cookie_io_functions_t){ .write = console_write });
+    if (console.stream == NULL) {
+        fprintf(stderr, "Error: unable to set up output: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(console.stream, buffer, _IOFBF, sizeof(buffer));
+    stdout = console.stream;
+}
+
+// Writes out everything printed so far. The caller has made the statements it acknowledges durable.
+void console_release(void) {
+    if (console.stream == NULL) {
+        return;
+    }
+    fflush(console.stream);
+    struct iovec pending = { .iov_base = console.pending, .iov_len = console.length };
+    if (console.length > 0) {
+        result_sink_writev(STDOUT_FILENO, &pending, 1);
+    }
+    console.length = 0;
+}
+
+// Whether the results held have grown large enough to be worth a commit of their own
+bool console_full(void) {
+    return console.length >= CONSOLE_MAX_PENDING;
+}
+
+// Where results that bypass output are written: its file, or for the console stdout's
+int output_descriptor(FILE* output) {
+    return output == console.stream ? STDOUT_FILENO : fileno(output);
 }
 
 // Shut down input_buffer stops getting input
@@ -228,21 +1307,121 @@ void close_input_buffer(InputBuffer* input_buffer) {
 }
 
 // Checks input_buffer for MetaCommands
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table, Statement* statement) {
     // If user types .exit it will close the program and return with EXIT_SUCCESS;
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
         close_input_buffer(input_buffer);
         free_table(table);
+        console_release();
         exit(EXIT_SUCCESS);
     } else if (strcmp(input_buffer->buffer, ".help") == 0) {
         printf("Available commands:\n");
         printf(" .exit    - Exit the database\n");
         printf(" .help    - Show this help message\n");
+        printf(" .import  - Bulk load rows from a file (.import <file> [fill-percent])\n");
+        printf(" .mode    - Set how rows are printed (.mode text|csv|tsv|binary)\n");
+        printf(" .stats   - Show engine counters, latencies and tree shapes (.stats [json|reset])\n");
+        printf(" .btree   - Print every level of the table or an index (.btree [username|email])\n");
+        printf(" .vacuum  - Rewrite the file without free pages\n");
+        printf(" .backup  - Copy the database while it is in use (.backup <file> [full])\n");
         printf(" insert   - Insert a row (insert <id> <username> <email>)\n");
+        printf(" delete   - Delete rows (delete <id> | delete where id <op> <n> [and ...])\n");
+        printf(" select   - Select rows (select where username|email =|like <text> [and id <op> <n>]...)\n");
+        printf(" count    - Count rows (select count(*) [where ...]); select ... limit <n> offset <n> pages\n");
+        printf(" create   - Index a text column (create index on username|email)\n");
+        printf(" begin    - Start a transaction, ended by commit (one fsync for all of it) or rollback\n");
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        if (table->pager->read_only) {
+            printf("Error: database is open read-only.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (table->transaction != NULL) {
+            print_execute_result(stdout, EXECUTE_TRANSACTION_OPEN);
+            return META_COMMAND_SUCCESS;
+        }
+        strtok(input_buffer->buffer, " ");
+        char* path = strtok(NULL, " ");
+        char* fill_string = strtok(NULL, " ");
+        uint32_t fill_percent = DEFAULT_IMPORT_FILL_PERCENT;
+        if (path == NULL || strtok(NULL, " ") != NULL ||
+            (fill_string != NULL && (!parse_uint32(fill_string, &fill_percent) ||
+                                     fill_percent < IMPORT_MIN_FILL_PERCENT || fill_percent > 100))) {
+            printf("Usage: .import <file> [fill-percent %d-100]\n", IMPORT_MIN_FILL_PERCENT);
+            return META_COMMAND_SUCCESS;
+        }
+
+        FILE* input = fopen(path, "r");
+        if (input == NULL) {
+            printf("Unable to open '%s': %s\n", path, strerror(errno));
+            return META_COMMAND_SUCCESS;
+        }
+        ImportStats stats;
+        table_import(table, input, fill_percent, &stats);
+        fclose(input);
+        printf("Imported %llu rows (%llu duplicates, %llu bad lines).\n",
+               (unsigned long long)stats.rows_loaded, (unsigned long long)stats.duplicates,
+               (unsigned long long)stats.rejected);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".mode", 5) == 0 &&
+               (input_buffer->buffer[5] == '\0' || input_buffer->buffer[5] == ' ')) {
+        static const char* const mode_names[] = { "text", "csv", "tsv", "binary" };
+        char* mode = input_buffer->buffer + 5;
+        mode += strspn(mode, " ");
+        if (*mode == '\0') {
+            printf("%s\n", mode_names[statement->format]);
+            return META_COMMAND_SUCCESS;
+        }
+        for (ResultFormat format = RESULT_TEXT; format <= RESULT_BINARY; format++) {
+            if (strcmp(mode, mode_names[format]) == 0) {
+                // Like the server's greeting: where the prompt's text ends and the frames begin
+                if (format == RESULT_BINARY && statement->format != RESULT_BINARY) {
+                    fwrite(PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE, 1, stdout);
+                }
+                statement->format = format;
+                return META_COMMAND_SUCCESS;
+            }
+        }
+        printf("Usage: .mode text|csv|tsv|binary\n");
         return META_COMMAND_SUCCESS;
-    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+    } else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0) {
+        backup_command(stdout, table, input_buffer->buffer + 8);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+        if (table->pager->read_only) {
+            printf("Error: database is open read-only.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (table->transaction != NULL) {
+            print_execute_result(stdout, EXECUTE_TRANSACTION_OPEN);
+            return META_COMMAND_SUCCESS;
+        }
+        uint32_t old_num_pages = table->pager->num_pages;
+        uint32_t num_pages = table_vacuum(table);
+        printf("Vacuumed %u pages down to %u.\n", old_num_pages, num_pages);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".btree", 6) == 0 &&
+               (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+        char* name = input_buffer->buffer + 6;
+        name += strspn(name, " ");
+        Table index = *table;
+        Column column;
+        if (*name != '\0' && !parse_column(name, &column)) {
+            printf("Usage: .btree [username|email]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (*name != '\0' && !table_index(table, column, &index)) {
+            printf("No index on %s.\n", name);
+            return META_COMMAND_SUCCESS;
+        }
         printf("Tree:\n");
-        print_leaf_node(get_page(table->pager, 0));
+        print_tree(table->pager, index.root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0 || strcmp(input_buffer->buffer, ".stats json") == 0) {
+        print_stats(stdout, table, input_buffer->buffer[6] != '\0');
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+        stats_reset(table->pager);
         return META_COMMAND_SUCCESS;
     } else {
         return META_COMMAND_UNRECOGNIZED_COMMAND;
@@ -253,755 +1432,8964 @@ PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement)
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
         statement->type = STATEMENT_INSERT;
 
-        strtok(input_buffer->buffer, " ");
-        char* id_string = strtok(NULL, " ");
-        char* username = strtok(NULL, " ");
-        char* email = strtok(NULL, " ");
-
-        if (id_string == NULL || username == NULL || email == NULL) {
+        char* fields = strchr(input_buffer->buffer, ' ');
+        if (fields == NULL) {
             return PREPARE_SYNTAX_ERROR;
         }
+        fields += strspn(fields, " ");
+        if (strncmp(fields, "values", 6) == 0 && (fields[6] == ' ' || fields[6] == '(')) {
+            return prepare_insert_values(fields + 6, statement);
+        }
+        return parse_row(fields, &statement->row_to_insert, statement);
+    }
 
-        int id = atoi(id_string);
-        if (id < 0) return PREPARE_NEGATIVE_ID;
-        if (strlen(username) > COLUMN_USERNAME_SIZE) return PREPARE_STRING_TOO_LONG;
-        if (strlen(email) > COLUMN_EMAIL_SIZE) return PREPARE_STRING_TOO_LONG;
+    if (strncmp(input_buffer->buffer, "select", 6) == 0 &&
+        (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+        return prepare_select(input_buffer, statement);
+    }
 
-        statement->row_to_insert.id = id;
-        strcpy(statement->row_to_insert.username, username);
-        strcpy(statement->row_to_insert.email, email);
+    if (strncmp(input_buffer->buffer, "delete", 6) == 0 &&
+        (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+        return prepare_delete(input_buffer, statement);
+    }
 
-        return PREPARE_SUCCESS;
+    if (strncmp(input_buffer->buffer, "create", 6) == 0 &&
+        (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+        return prepare_create_index(input_buffer, statement);
     }
 
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
+    if (strcmp(input_buffer->buffer, "begin") == 0) {
+        statement->type = STATEMENT_BEGIN;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, "commit") == 0) {
+        statement->type = STATEMENT_COMMIT;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(input_buffer->buffer, "rollback") == 0) {
+        statement->type = STATEMENT_ROLLBACK;
         return PREPARE_SUCCESS;
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
-/* --- Execution Logic --- */
-
-// Executes our statement execute_statement which will execute our statements for example if its insert then execute insert statement and if its select execute select statement
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT): {
-            void* node = get_page(table->pager, table->root_page_num);
-            uint32_t num_cells = *leaf_node_num_cells(node);
-
-            if (num_cells >= LEAF_NODE_MAX_CELLS) {
-                return EXECUTE_TABLE_FULL;
-            }
-
-            Row* row_to_insert = &(statement->row_to_insert);
-            uint32_t key_to_insert = row_to_insert->id;
-            Cursor* cursor = table_find(table, key_to_insert);
-            // Check for duplicate key
-            if (cursor->cell_num < num_cells) {
-                uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-                if (key_at_index == key_to_insert) {
-                    free(cursor);
-                    return EXECUTE_DUPLICATE_KEY;
-                }
-            }
-
-            leaf_node_insert(cursor, key_to_insert, row_to_insert);
-
-            free(cursor);
-            return EXECUTE_SUCCESS;
-        }
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+// Parses a decimal number that must fit in 32 bits
+bool parse_uint32(const char* text, uint32_t* value) {
+    uint64_t parsed;
+    if (!parse_uint64(text, &parsed) || parsed > UINT32_MAX) {
+        return false;
     }
-    return EXECUTE_SUCCESS;
+    *value = (uint32_t)parsed;
+    return true;
 }
 
-// Bascially executes the result of execute_select whenever it's detected it gets the raw data from our row then prints our rows
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    (void)statement;
-    // Tells our cursor to start the table
-    Cursor* cursor = table_start(table);
-    // Creates an row from the struct
-    Row row;
+// Parses a decimal number that must fit in 64 bits, such as an id
+bool parse_uint64(const char* text, uint64_t* value) {
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-') {
+        return false;
+    }
+    *value = (uint64_t)parsed;
+    return true;
+}
 
-    if (cursor == NULL) {
-        printf("Error: Cursor is NULL");
-        exit(EXIT_FAILURE);
+// Parses "<id> <username> <email>", the column values of an insert or an imported line, and
+// nothing after them. statement is the insert being parsed, or NULL for an imported line.
+PrepareResult parse_row(char* text, Row* row, Statement* statement) {
+    // strtok_r: server workers parse statements at the same time
+    char* position;
+    char* id_string = strtok_r(text, " \t", &position);
+    char* username = strtok_r(NULL, " \t", &position);
+    char* email = strtok_r(NULL, " \t", &position);
+
+    if (id_string == NULL || username == NULL || email == NULL || strtok_r(NULL, " \t", &position) != NULL) {
+        return PREPARE_SYNTAX_ERROR;
     }
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+
+    if (!prepare_placeholder(statement, id_string, PARAMETER_ID, RANGE_EQUAL)) {
+        if (id_string[0] == '-') return PREPARE_NEGATIVE_ID;
+        if (!parse_uint64(id_string, &row->id)) return PREPARE_SYNTAX_ERROR;
     }
+    if (strlen(username) > COLUMN_USERNAME_SIZE) return PREPARE_STRING_TOO_LONG;
+    if (strlen(email) > COLUMN_EMAIL_SIZE) return PREPARE_STRING_TOO_LONG;
+
+    // Placeholder columns stay empty until they are bound
+    bool username_parameter = prepare_placeholder(statement, username, PARAMETER_USERNAME, RANGE_EQUAL);
+    bool email_parameter = prepare_placeholder(statement, email, PARAMETER_EMAIL, RANGE_EQUAL);
+    strcpy(row->username, username_parameter ? "" : username);
+    strcpy(row->email, email_parameter ? "" : email);
+    return PREPARE_SUCCESS;
+}
 
-    free(cursor);
-    return EXECUTE_SUCCESS;
+// Records token as the next parameter if it is a '?' and the statement is being prepared as a
+// template. Returns false for every other token, which the caller then parses as a value.
+bool prepare_placeholder(Statement* statement, const char* token, ParameterKind kind, RangeOp op) {
+    if (statement == NULL || statement->parameters == NULL || strcmp(token, "?") != 0) {
+        return false;
+    }
+    Parameter* parameter = &statement->parameters[statement->num_parameters++];
+    *parameter = (Parameter){
+        .kind = kind,
+        .op = op,
+        .row_index = statement->type == STATEMENT_INSERT_BATCH ? statement->num_rows : 0,
+    };
+    return true;
 }
 
-/* --- Serialization --- */
+// insert values (<id>, <username>, <email>)[, (<id>, <username>, <email>)]...
+PrepareResult prepare_insert_values(char* text, Statement* statement) {
+    statement->type = STATEMENT_INSERT_BATCH;
+    statement->num_rows = 0;
 
-void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+    char* position = text;
+    while (true) {
+        position += strspn(position, " ");
+        char* end = strchr(position, ')');
+        if (*position != '(' || end == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        *end = '\0';
+        // Exactly three fields: once the commas are spaces, parse_row no longer sees an empty one
+        uint32_t separators = 0;
+        for (char* c = position + 1; c < end; c++) {
+            if (*c == ',') {
+                *c = ' ';
+                separators++;
+            }
+        }
+        if (separators != 2) {
+            return PREPARE_SYNTAX_ERROR;
+        }
 
-// We Convert Row struct into raw bytes and then write to page memory
-// We do this so we can store our Row struct into raw bytes and write it to page memory for later use
-void serialize_row(Row* source, void* destination) {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
-}
+        if (statement->num_rows == statement->rows_capacity) {
+            statement->rows_capacity = statement->rows_capacity == 0 ? 16 : statement->rows_capacity * 2;
+            statement->rows = realloc(statement->rows, sizeof(Row) * statement->rows_capacity);
+            if (statement->rows == NULL) {
+                fprintf(stderr, "Error: malloc failed for insert values\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        PrepareResult result = parse_row(position + 1, &statement->rows[statement->num_rows], statement);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        statement->num_rows++;
 
-// Convert raw bytes from page memory back into a Row struct
-void deserialize_row(void* source, Row* destination) {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+        position = end + 1;
+        position += strspn(position, " ");
+        if (*position == '\0') {
+            return PREPARE_SUCCESS;
+        }
+        if (*position != ',') {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        position++;
+    }
 }
 
-/* --- Table Management --- */
+// select <id> | select [count(*)] [where <predicate> [and <predicate>]...] [limit <n>] [offset <n>]
+// The id predicates are folded into one inclusive key range.
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->id_min = 0;
+    statement->id_max = UINT64_MAX;
+    statement->limit = UINT32_MAX;
+    statement->offset = 0;
+    statement->match_column = COLUMN_NONE;
+    statement->match_like = false;
+
+    char* position;
+    strtok_r(input_buffer->buffer, " ", &position);
+    char* token = strtok_r(NULL, " ", &position);
+
+    if (token != NULL && strcmp(token, "count(*)") == 0) {
+        statement->type = STATEMENT_COUNT;
+        token = strtok_r(NULL, " ", &position);
+        if (token != NULL && strcmp(token, "where") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
 
-Table* db_open(const char* filename) {
-    // 1. Open the database file and get a pager
-    Pager* pager = pager_open(filename);
+    if (token != NULL && (token[0] == '-' || (token[0] >= '0' && token[0] <= '9'))) {
+        if (token[0] == '-') return PREPARE_NEGATIVE_ID;
+        if (!parse_uint64(token, &statement->id_min) || strtok_r(NULL, " ", &position) != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->type = STATEMENT_LOOKUP;
+        statement->id_max = statement->id_min;
+        return PREPARE_SUCCESS;
+    }
+    if (token != NULL && prepare_placeholder(statement, token, PARAMETER_KEY, RANGE_EQUAL)) {
+        statement->type = STATEMENT_LOOKUP;
+        return strtok_r(NULL, " ", &position) == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+    }
 
-    Table* table = malloc(sizeof(Table));
-    if (table == NULL) {
-        fprintf(stderr, "Error: malloc failed for Table\n");
-        exit(EXIT_FAILURE);
+    if (token != NULL && strcmp(token, "where") == 0) {
+        PrepareResult result = prepare_where(statement, &token, &position);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
     }
 
-    table->pager = pager;
-    table->root_page_num = 0;
+    // A count is a single number; limit and offset have nothing to apply to
+    if (statement->type == STATEMENT_COUNT && token != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
 
-    if (pager->file_length == 0) {
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+    if (token != NULL && strcmp(token, "limit") == 0) {
+        char* limit_string = strtok_r(NULL, " ", &position);
+        if (limit_string == NULL || (!prepare_placeholder(statement, limit_string, PARAMETER_LIMIT, RANGE_EQUAL) &&
+                                     !parse_uint32(limit_string, &statement->limit))) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok_r(NULL, " ", &position);
     }
 
-    return table;
+    if (token != NULL && strcmp(token, "offset") == 0) {
+        char* offset_string = strtok_r(NULL, " ", &position);
+        if (offset_string == NULL || (!prepare_placeholder(statement, offset_string, PARAMETER_OFFSET, RANGE_EQUAL) &&
+                                      !parse_uint32(offset_string, &statement->offset))) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok_r(NULL, " ", &position);
+    }
+
+    if (token != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // 'where id = n' needs no scan at all
+    if (statement->type == STATEMENT_SELECT && statement->id_min == statement->id_max && statement->limit > 0 &&
+        statement->offset == 0 && statement->match_column == COLUMN_NONE) {
+        statement->type = STATEMENT_LOOKUP;
+    }
+    return PREPARE_SUCCESS;
 }
 
-// This gives the memory back to the computer so other programs can use it when we're done.
-void free_table(Table* table) {
-    Pager* pager = table->pager;
+// where id <op> <n> [and id <op> <n>]..., with *token on "where" and position the strtok_r state.
+// The predicates narrow the statement's key range; *token is left on whatever follows them.
+// A select or count may also have one text predicate among them: "username = <text>", or a like
+// pattern such as "email like %@example.com" with % at either end (elsewhere it is an ordinary
+// character).
+PrepareResult prepare_where(Statement* statement, char** token, char** position) {
+    do {
+        char* column = strtok_r(NULL, " ", position);
+        char* op = strtok_r(NULL, " ", position);
+        char* value_string = strtok_r(NULL, " ", position);
+        if (column == NULL || op == NULL || value_string == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        if (pager->pages[i] != NULL) {
-            // Flush pages that are within the valid range
-            if (i < pager->num_pages) {
-                pager_flush(pager, i);
+        Column text_column;
+        if ((statement->type == STATEMENT_SELECT || statement->type == STATEMENT_COUNT) && parse_column(column, &text_column)) {
+            if ((strcmp(op, "=") != 0 && strcmp(op, "like") != 0) || statement->match_column != COLUMN_NONE) {
+                return PREPARE_SYNTAX_ERROR;
             }
-            free(pager->pages[i]);
-            pager->pages[i] = NULL;
+            statement->match_column = text_column;
+            statement->match_like = strcmp(op, "like") == 0;
+            if (!prepare_placeholder(statement, value_string, PARAMETER_MATCH, RANGE_EQUAL)) {
+                if (!match_fits(statement, value_string, strlen(value_string))) return PREPARE_STRING_TOO_LONG;
+                strcpy(statement->match_value, value_string);
+            }
+            *token = strtok_r(NULL, " ", position);
+            continue;
         }
-    }
 
-    close(pager->file_descriptor);
-    free(pager);
-    free(table);
+        if (strcmp(column, "id") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (value_string[0] == '-') return PREPARE_NEGATIVE_ID;
+
+        RangeOp range_op;
+        if (!parse_range_op(op, &range_op)) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (!prepare_placeholder(statement, value_string, PARAMETER_BOUND, range_op)) {
+            uint64_t value;
+            if (!parse_uint64(value_string, &value)) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement_narrow_range(statement, range_op, value);
+        }
+        *token = strtok_r(NULL, " ", position);
+    } while (*token != NULL && strcmp(*token, "and") == 0);
+    return PREPARE_SUCCESS;
 }
 
-/* --- Cursor Management --- */
+bool parse_range_op(const char* text, RangeOp* op) {
+    if (strcmp(text, "=") == 0) {
+        *op = RANGE_EQUAL;
+    } else if (strcmp(text, ">=") == 0) {
+        *op = RANGE_AT_LEAST;
+    } else if (strcmp(text, ">") == 0) {
+        *op = RANGE_ABOVE;
+    } else if (strcmp(text, "<=") == 0) {
+        *op = RANGE_AT_MOST;
+    } else if (strcmp(text, "<") == 0) {
+        *op = RANGE_BELOW;
+    } else {
+        return false;
+    }
+    return true;
+}
 
-// Find the memory address where a specific row is stored
-// Calculates which page the row is on and the byte offset within that page
-void* cursor_value(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+bool parse_column(const char* text, Column* column) {
+    if (strcmp(text, "username") == 0) {
+        *column = COLUMN_USERNAME;
+    } else if (strcmp(text, "email") == 0) {
+        *column = COLUMN_EMAIL;
+    } else {
+        return false;
+    }
+    return true;
 }
 
-// Adds one to our row_num and checks if cursor is to row num and cursor is to table and num_rows then cursor end_of_table = true
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+// Longest text the column holds
+uint32_t column_size(Column column) {
+    return column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+}
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        cursor->end_of_table = true;
+// Intersects the statement's key range with "id <op> value"
+void statement_narrow_range(Statement* statement, RangeOp op, uint64_t value) {
+    uint64_t low = 0;
+    uint64_t high = UINT64_MAX;
+    bool empty = false;
+    switch (op) {
+        case (RANGE_EQUAL):
+            low = value;
+            high = value;
+            break;
+        case (RANGE_AT_LEAST):
+            low = value;
+            break;
+        case (RANGE_ABOVE):
+            empty = (value == UINT64_MAX);
+            low = value + 1;
+            break;
+        case (RANGE_AT_MOST):
+            high = value;
+            break;
+        case (RANGE_BELOW):
+            empty = (value == 0);
+            high = value - 1;
+            break;
     }
-}
 
-Cursor* table_start(Table* table) {
-    Cursor* cursor = malloc(sizeof(Cursor));
-    if (cursor == NULL) {
-        fprintf(stderr, "Error: malloc failed for Cursor\n");
-        exit(EXIT_FAILURE);
+    if (empty) {
+        statement->id_min = 1;
+        statement->id_max = 0;
+    } else {
+        if (low > statement->id_min) statement->id_min = low;
+        if (high < statement->id_max) statement->id_max = high;
     }
+}
 
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-    cursor->cell_num = 0;
+// delete <id> | delete [where id <op> <n> [and id <op> <n>]...]
+// Without a where clause every row goes.
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    statement->id_min = 0;
+    statement->id_max = UINT64_MAX;
 
-    void* root_node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (num_cells == 0);
+    char* position;
+    strtok_r(input_buffer->buffer, " ", &position);
+    char* token = strtok_r(NULL, " ", &position);
 
-    return cursor;
-}
+    if (token != NULL && (token[0] == '-' || (token[0] >= '0' && token[0] <= '9'))) {
+        if (token[0] == '-') return PREPARE_NEGATIVE_ID;
+        if (!parse_uint64(token, &statement->id_min) || strtok_r(NULL, " ", &position) != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->id_max = statement->id_min;
+        return PREPARE_SUCCESS;
+    }
+    if (token != NULL && prepare_placeholder(statement, token, PARAMETER_KEY, RANGE_EQUAL)) {
+        return strtok_r(NULL, " ", &position) == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+    }
 
-/* --- Leaf Node Management --- */
+    if (token != NULL && strcmp(token, "where") == 0) {
+        PrepareResult result = prepare_where(statement, &token, &position);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    }
 
-uint32_t* leaf_node_num_cells(void* node) {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+    if (token != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+// create index on <username|email>
+PrepareResult prepare_create_index(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    char* position;
+    strtok_r(input_buffer->buffer, " ", &position);
+    char* index = strtok_r(NULL, " ", &position);
+    char* on = strtok_r(NULL, " ", &position);
+    char* column = strtok_r(NULL, " ", &position);
+    if (index == NULL || on == NULL || column == NULL || strcmp(index, "index") != 0 || strcmp(on, "on") != 0 ||
+        !parse_column(column, &statement->match_column) || strtok_r(NULL, " ", &position) != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num);
+/* --- Execution Logic --- */
+
+// True for statements that change the table
+bool statement_writes(Statement* statement) {
+    return statement->type == STATEMENT_INSERT || statement->type == STATEMENT_INSERT_BATCH ||
+           statement->type == STATEMENT_DELETE || statement->type == STATEMENT_CREATE_INDEX ||
+           statement->type == STATEMENT_BEGIN || statement->type == STATEMENT_COMMIT ||
+           statement->type == STATEMENT_ROLLBACK;
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+// Prints why input could not be prepared; returns false when it was prepared and there is nothing to say
+bool print_prepare_error(FILE* output, PrepareResult result, const char* input) {
+    switch (result) {
+        case (PREPARE_SUCCESS):
+            return false;
+        case (PREPARE_STRING_TOO_LONG):
+            fprintf(output, "String is too long.\n");
+            break;
+        case (PREPARE_SYNTAX_ERROR):
+            fprintf(output, "Syntax error. Could not parse statement.\n");
+            break;
+        case (PREPARE_UNRECOGNIZED_STATEMENT):
+            fprintf(output, "Unrecognized keyword at start of '%s'.\n", input);
+            break;
+        case (PREPARE_NEGATIVE_ID):
+            fprintf(output, "ID must be positive.\n");
+            break;
+        case (PREPARE_BAD_PARAMETER):
+            fprintf(output, "No parameter of that number and type.\n");
+            break;
+    }
+    return true;
 }
 
-void* internal_node_cell(void* node, uint32_t cell_num){
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+// Every statement's output ends with exactly one of these lines
+void print_execute_result(FILE* output, ExecuteResult result) {
+    switch (result) {
+        case (EXECUTE_SUCCESS):
+            fprintf(output, "Executed.\n");
+            break;
+        case (EXECUTE_DUPLICATE_KEY):
+            fprintf(output, "Error: Duplicate key.\n");
+            break;
+        case (EXECUTE_READ_ONLY):
+            fprintf(output, "Error: database is open read-only.\n");
+            break;
+        case (EXECUTE_UNBOUND_PARAMETER):
+            fprintf(output, "Error: statement has unbound parameters.\n");
+            break;
+        case (EXECUTE_INDEX_EXISTS):
+            fprintf(output, "Error: index already exists.\n");
+            break;
+        case (EXECUTE_NO_CATALOG):
+            fprintf(output, "Error: this database predates indexes; run .vacuum to upgrade it.\n");
+            break;
+        case (EXECUTE_TRANSACTION_OPEN):
+            fprintf(output, "Error: a transaction is open; commit or roll it back first.\n");
+            break;
+        case (EXECUTE_NO_TRANSACTION):
+            fprintf(output, "Error: no transaction is open.\n");
+            break;
+        case (EXECUTE_NO_SERVER_TRANSACTIONS):
+            fprintf(output, "Error: transactions are only available on the prompt.\n");
+            break;
+    }
 }
-uint32_t* internal_node_key(void* node, uint32_t key_num){
-    return (uint32_t*)(internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+
+// Executes our statement execute_statement which will execute our statements for example if its insert then execute insert statement and if its select execute select statement
+ExecuteResult execute_statement(Statement* statement, Table* table) {
+    if (statement_writes(statement) && table->pager->read_only) {
+        return EXECUTE_READ_ONLY;
+    }
+    uint64_t start_ns = stats_now_ns();
+    ExecuteResult result = EXECUTE_SUCCESS;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            result = execute_insert(statement, table);
+            break;
+        case (STATEMENT_INSERT_BATCH):
+            result = execute_insert_batch(statement, table);
+            break;
+        case (STATEMENT_SELECT):
+            result = execute_select(statement, table);
+            break;
+        case (STATEMENT_LOOKUP):
+            result = execute_lookup(statement, table);
+            break;
+        case (STATEMENT_COUNT):
+            result = execute_count(statement, table);
+            break;
+        case (STATEMENT_DELETE):
+            result = execute_delete(statement, table);
+            break;
+        case (STATEMENT_CREATE_INDEX):
+            result = execute_create_index(statement, table);
+            break;
+        case (STATEMENT_BEGIN):
+        case (STATEMENT_COMMIT):
+        case (STATEMENT_ROLLBACK):
+            result = execute_transaction(statement, table);
+            break;
+    }
+    // Execution only: a write's commit (the WAL sync) is timed in stats.wal_syncs
+    latency_record(&stats.statements[statement->type], stats_now_ns() - start_ns);
+    return result;
 }
-NodeType get_node_type(void* node) {
-    uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+
+// Inserts the row and logs it. The insert is durable once table_commit returns.
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+    Row* row_to_insert = &(statement->row_to_insert);
+    ExecuteResult result = table_insert(table, row_to_insert);
+    statement->rows_affected = result == EXECUTE_SUCCESS ? 1 : 0;
+
+    Wal* wal = table->pager->wal;
+    if (result == EXECUTE_SUCCESS && wal != NULL) {
+        char payload[ROW_MAX_SIZE];
+        uint32_t payload_length = serialize_row(row_to_insert, payload);
+        table_log(table, WAL_RECORD_INSERT, payload, payload_length);
+    }
+    return result;
 }
 
-void set_node_type(void* node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+// Inserts every row of the list and logs the new ones in a few large records.
+// Rows whose id already exists are skipped and reported as a duplicate.
+ExecuteResult execute_insert_batch(Statement* statement, Table* table) {
+    uint32_t num_rows = statement->num_rows;
+    Row** rows = malloc(sizeof(Row*) * num_rows);
+    if (rows == NULL) {
+        fprintf(stderr, "Error: malloc failed for insert values\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < num_rows; i++) {
+        rows[i] = &statement->rows[i];
+    }
+    uint32_t inserted = table_insert_batch(table, rows, num_rows);
+    statement->rows_affected = inserted;
+
+    Wal* wal = table->pager->wal;
+    if (wal != NULL && inserted > 0) {
+        uint32_t chunk_rows = inserted < WAL_INSERT_BATCH_ROWS ? inserted : WAL_INSERT_BATCH_ROWS;
+        char* payload = malloc((size_t)chunk_rows * ROW_MAX_SIZE);
+        if (payload == NULL) {
+            fprintf(stderr, "Error: malloc failed for insert values\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t first = 0; first < inserted; first += chunk_rows) {
+            uint32_t count = inserted - first < chunk_rows ? inserted - first : chunk_rows;
+            uint32_t payload_length = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                payload_length += serialize_row(rows[first + i], payload + payload_length);
+            }
+            table_log(table, WAL_RECORD_INSERT, payload, payload_length);
+        }
+        free(payload);
+    }
+
+    free(rows);
+    return inserted == num_rows ? EXECUTE_SUCCESS : EXECUTE_DUPLICATE_KEY;
 }
 
-bool is_node_root(void* node) {
-    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
+// Bascially executes the result of execute_select whenever it's detected it gets the raw data from our row then prints our rows
+// Seeks to the lower bound of the id range through the tree and walks the leaves until the upper bound or the limit.
+// A text match goes to the column's index when it is an equality and there is one, otherwise to the leaf filter.
+ExecuteResult execute_select(Statement* statement, Table* table) {
+    statement->rows_affected = 0;
+    if (statement->id_min > statement->id_max || statement->limit == 0) {
+        return EXECUTE_SUCCESS;
+    }
+    if (statement->match_column != COLUMN_NONE) {
+        TextFilter filter;
+        text_filter_init(&filter, statement);
+        Table index;
+        if (filter.op == MATCH_EQUAL && table_index(table, statement->match_column, &index)) {
+            return execute_index_select(statement, table, &index, &filter);
+        }
+        return execute_filter_select(statement, table, &filter);
+    }
+
+    // The counts say exactly which rows the range, offset and limit select, so a big enough result
+    // can be split up by rank. Small limits don't need the two extra descents to find out.
+    if (table->scan_threads > 1 && statement->limit >= PARALLEL_SCAN_MIN_ROWS) {
+        uint64_t in_range = table_count_range(table, statement->id_min, statement->id_max);
+        uint64_t num_rows = in_range > statement->offset ? in_range - statement->offset : 0;
+        if (num_rows > statement->limit) {
+            num_rows = statement->limit;
+        }
+        if (parallel_scan_worth(table, num_rows)) {
+            uint64_t first_rank = table_count_below(table, statement->id_min) + statement->offset;
+            return execute_parallel_select(statement, table, NULL, first_rank, num_rows);
+        }
+    }
+
+    // Tells our cursor to start at the first row in range, skipping the offset by rank in one descent
+    Cursor cursor;
+    if (statement->offset > 0) {
+        table_seek_rank(table, table_count_below(table, statement->id_min) + statement->offset, &cursor);
+    } else {
+        table_seek(table, statement->id_min, &cursor);
+    }
+    ResultSink sink;
+    result_sink_open(&sink, statement, table);
+
+    // Only unbounded selects are worth telling the kernel to read ahead for
+    bool full_scan = statement->id_min == 0 && statement->id_max == UINT64_MAX && statement->limit == UINT32_MAX;
+    if (full_scan) {
+        pager_set_access_pattern(table->pager, PAGER_ACCESS_SEQUENTIAL);
+    }
+
+    uint32_t rows_returned = 0;
+    while (!(cursor.end_of_table) && rows_returned < statement->limit) {
+        uint64_t key = cursor_key(&cursor);
+        if (key > statement->id_max) {
+            break;
+        }
+        // Formatted straight from the leaf's serialized value, without a Row in between
+        result_sink_cell(&sink, cursor.page_num, key, cursor_value(&cursor));
+        rows_returned++;
+        cursor_advance(&cursor);
+    }
+    result_sink_close(&sink);
+    statement->rows_affected = rows_returned;
+
+    if (full_scan) {
+        pager_set_access_pattern(table->pager, PAGER_ACCESS_RANDOM);
+    }
+
+    cursor_close(&cursor);
+    return EXECUTE_SUCCESS;
 }
 
-void set_node_root(void* node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+// A select with a text predicate and no index to answer it: each leaf of the id range is checked
+// in one pass over its stored values, and only the cells that pass are formatted. A count runs the
+// same scan and only counts them.
+ExecuteResult execute_filter_select(Statement* statement, Table* table, const TextFilter* filter) {
+    Pager* pager = table->pager;
+    bool counting = statement->type == STATEMENT_COUNT;
+
+    // Without a limit or offset every row of the range is checked, and the parts can be checked at once
+    if (table->scan_threads > 1 && statement->limit == UINT32_MAX && statement->offset == 0) {
+        uint64_t num_rows = table_count_range(table, statement->id_min, statement->id_max);
+        if (parallel_scan_worth(table, num_rows)) {
+            return execute_parallel_select(statement, table, filter, table_count_below(table, statement->id_min), num_rows);
+        }
+    }
+    Cursor cursor;
+    table_seek(table, statement->id_min, &cursor);
+    ResultSink sink;
+    result_sink_open(&sink, statement, table);
+
+    // The filter reads every leaf of an unbounded range however few rows it returns
+    bool full_scan = statement->id_min == 0 && statement->id_max == UINT64_MAX;
+    if (full_scan) {
+        pager_set_access_pattern(pager, PAGER_ACCESS_SEQUENTIAL);
+    }
+
+    uint16_t matches[LEAF_NODE_CELLS_BOUND];
+    uint32_t to_skip = statement->offset;
+    uint32_t rows_returned = 0;
+    while (!(cursor.end_of_table) && rows_returned < statement->limit) {
+        void* node = get_page(pager, cursor.page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        bool last_leaf = *leaf_node_key(node, num_cells - 1) > statement->id_max;
+        uint32_t end_cell = last_leaf ? leaf_node_find_cell(node, statement->id_max + 1) : num_cells;
+
+        uint32_t num_matches = leaf_node_filter(node, cursor.cell_num, end_cell, filter, matches);
+        uint32_t match = to_skip < num_matches ? to_skip : num_matches;
+        to_skip -= match;
+        for (; match < num_matches && rows_returned < statement->limit; match++) {
+            uint32_t cell_num = matches[match];
+            if (!counting) {
+                result_sink_cell(&sink, cursor.page_num, *leaf_node_key(node, cell_num), leaf_node_value(node, cell_num));
+            }
+            rows_returned++;
+        }
+        if (last_leaf) {
+            break;
+        }
+        cursor.cell_num = num_cells;
+        cursor_skip_exhausted_leaves(&cursor);
+    }
+    result_sink_close(&sink);
+    statement->rows_affected = rows_returned;
+
+    if (full_scan) {
+        pager_set_access_pattern(pager, PAGER_ACCESS_RANDOM);
+    }
+
+    cursor_close(&cursor);
+    return EXECUTE_SUCCESS;
 }
 
-void initialize_leaf_node(void* node) {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
+// A select (or a count, with a filter) of the num_rows rows from rank first_rank on, run by the
+// scan threads
+ExecuteResult execute_parallel_select(Statement* statement, Table* table, const TextFilter* filter,
+                                      uint64_t first_rank, uint64_t num_rows) {
+    bool full_scan = statement->id_min == 0 && statement->id_max == UINT64_MAX;
+    if (full_scan) {
+        pager_set_access_pattern(table->pager, PAGER_ACCESS_SEQUENTIAL);
+    }
+    ResultSink sink;
+    result_sink_open(&sink, statement, table);
+    uint64_t rows = parallel_scan(table, &sink, filter, statement->type == STATEMENT_COUNT, first_rank, num_rows);
+    result_sink_close(&sink);
+    statement->rows_affected = (uint32_t)rows;
+    if (full_scan) {
+        pager_set_access_pattern(table->pager, PAGER_ACCESS_RANDOM);
+    }
+    return EXECUTE_SUCCESS;
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+// A select with a text match that the column's index answers. The entries under the text's hash
+// are in id order, so the id range bounds the walk; each entry whose text matches is then looked
+// up in the table and formatted from there.
+ExecuteResult execute_index_select(Statement* statement, Table* table, Table* index, const TextFilter* filter) {
+    Pager* pager = table->pager;
+    const char* text = (const char*)filter->text;
+    uint32_t length = filter->length;
+    uint32_t hash = index_hash(text, length);
+
+    Cursor cursor;
+    index_seek(index, hash, statement->id_min, &cursor);
+    cursor_skip_exhausted_leaves(&cursor);
+    ResultSink sink;
+    result_sink_open(&sink, statement, table);
+
+    uint32_t rows_returned = 0;
+    uint32_t to_skip = statement->offset;
+    while (!(cursor.end_of_table) && rows_returned < statement->limit && cursor_key(&cursor) == hash) {
+        const char* entry = cursor_value(&cursor);
+        uint64_t id;
+        memcpy(&id, entry, ID_SIZE);
+        if (id > statement->id_max) {
+            break;
+        }
+        uint32_t entry_length = *leaf_node_value_length(get_page(pager, cursor.page_num), cursor.cell_num);
+        if (entry_length == ID_SIZE + length && memcmp(entry + ID_SIZE, text, length) == 0) {
+            Cursor row_cursor;
+            table_find(table, id, &row_cursor);
+            void* node = get_page(pager, row_cursor.page_num);
+            if (row_cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, row_cursor.cell_num) == id) {
+                if (to_skip > 0) {
+                    to_skip--;
+                } else {
+                    if (statement->type != STATEMENT_COUNT) {
+                        result_sink_cell(&sink, row_cursor.page_num, id, leaf_node_value(node, row_cursor.cell_num));
+                    }
+                    rows_returned++;
+                }
+            }
+            cursor_close(&row_cursor);
+        }
+        cursor_advance(&cursor);
+    }
+    result_sink_close(&sink);
+    statement->rows_affected = rows_returned;
 
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        leaf_node_split_and_insert(cursor, key, value);
+    cursor_close(&cursor);
+    return EXECUTE_SUCCESS;
+}
+
+// select count(*): the rows of the id range come straight from the subtree counts; a text match
+// has to look at the rows and runs as a select that doesn't return them
+ExecuteResult execute_count(Statement* statement, Table* table) {
+    uint64_t count;
+    if (statement->match_column != COLUMN_NONE) {
+        execute_select(statement, table);
+        count = statement->rows_affected;
+    } else {
+        count = table_count_range(table, statement->id_min, statement->id_max);
+    }
+    statement->rows_affected = (uint32_t)count;
+    if (statement->format != RESULT_BINARY) {
+        fprintf(statement->output, "%llu\n", (unsigned long long)count);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// Point lookup: one descent, then only the matching row is copied out of the leaf
+ExecuteResult execute_lookup(Statement* statement, Table* table) {
+    Row row;
+    statement->rows_affected = 0;
+    if (table_get(table, statement->id_min, &row)) {
+        print_row(statement->output, statement->format, &row);
+        statement->rows_affected = 1;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// Removes every row in the key range and logs the range, which replays to the same rows
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+    uint32_t deleted = 0;
+    if (statement->id_min <= statement->id_max) {
+        deleted = table_delete_range(table, statement->id_min, statement->id_max);
+    }
+
+    Wal* wal = table->pager->wal;
+    if (wal != NULL && deleted > 0) {
+        uint64_t payload[2] = { statement->id_min, statement->id_max };
+        table_log(table, WAL_RECORD_DELETE, payload, sizeof(payload));
+    }
+    statement->rows_affected = deleted;
+    if (statement->format != RESULT_BINARY) {
+        fprintf(statement->output, "Deleted %u rows.\n", deleted);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+// Indexes are not logged: the build ends with a checkpoint, which makes it durable. That would
+// also write out an open transaction, so one can't hold an index build.
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+    statement->rows_affected = 0;
+    if (table->transaction != NULL) {
+        return EXECUTE_TRANSACTION_OPEN;
+    }
+    return table_create_index(table, statement->match_column);
+}
+
+// begin, commit and rollback
+ExecuteResult execute_transaction(Statement* statement, Table* table) {
+    statement->rows_affected = 0;
+    switch (statement->type) {
+        case (STATEMENT_BEGIN):
+            return table_begin(table);
+        case (STATEMENT_COMMIT):
+            return table_commit_transaction(table);
+        default:
+            return table_rollback(table);
+    }
+}
+
+/* --- Prepared Statements --- */
+
+// Parses text once into a statement that can run many times. Each '?' standing where an insert
+// column, a key, a where value, a limit or an offset would go becomes a parameter, numbered from 0 in order.
+// All must be bound before the first execute; they keep their values across executes.
+PrepareResult db_prepare(const char* text, PreparedStatement** prepared) {
+    *prepared = NULL;
+    uint32_t max_parameters = 0;
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '?') max_parameters++;
+    }
+
+    PreparedStatement* template = calloc(1, sizeof(PreparedStatement));
+    char* buffer = strdup(text);
+    Parameter* parameters = max_parameters > 0 ? malloc(sizeof(Parameter) * max_parameters) : NULL;
+    if (template == NULL || buffer == NULL || (max_parameters > 0 && parameters == NULL)) {
+        fprintf(stderr, "Error: malloc failed for prepared statement\n");
+        exit(EXIT_FAILURE);
+    }
+    Statement* statement = &template->statement;
+    statement->output = stdout;
+    statement->parameters = parameters;
+
+    size_t length = strlen(buffer);
+    InputBuffer input_buffer = { .buffer = buffer, .buffer_length = length + 1, .input_length = (ssize_t)length };
+    PrepareResult result = prepare_statement(&input_buffer, statement);
+    free(buffer);
+    if (result != PREPARE_SUCCESS) {
+        free_prepared_statement(template);
+        return result;
+    }
+
+    template->type = statement->type == STATEMENT_LOOKUP ? STATEMENT_SELECT : statement->type;
+    template->id_min = statement->id_min;
+    template->id_max = statement->id_max;
+    template->limit = statement->limit;
+    template->offset = statement->offset;
+    *prepared = template;
+    return PREPARE_SUCCESS;
+}
+
+// Text parameters are bound with prepared_bind_text, the others with prepared_bind_uint64
+bool parameter_is_text(ParameterKind kind) {
+    return kind == PARAMETER_USERNAME || kind == PARAMETER_EMAIL || kind == PARAMETER_MATCH;
+}
+
+// The row an insert parameter fills in
+Row* prepared_row(PreparedStatement* prepared, Parameter* parameter) {
+    Statement* statement = &prepared->statement;
+    return prepared->type == STATEMENT_INSERT_BATCH ? &statement->rows[parameter->row_index] : &statement->row_to_insert;
+}
+
+PrepareResult prepared_bind_uint64(PreparedStatement* prepared, uint32_t index, uint64_t value) {
+    Statement* statement = &prepared->statement;
+    if (index >= statement->num_parameters) {
+        return PREPARE_BAD_PARAMETER;
+    }
+    Parameter* parameter = &statement->parameters[index];
+    if (parameter_is_text(parameter->kind)) {
+        return PREPARE_BAD_PARAMETER;
+    }
+    parameter->value = value;
+    parameter->bound = true;
+    return PREPARE_SUCCESS;
+}
+
+// Copies length bytes of text (no terminator needed) into the column the parameter stands for
+PrepareResult prepared_bind_text(PreparedStatement* prepared, uint32_t index, const char* text, size_t length) {
+    Statement* statement = &prepared->statement;
+    if (index >= statement->num_parameters) {
+        return PREPARE_BAD_PARAMETER;
+    }
+    Parameter* parameter = &statement->parameters[index];
+    if (!parameter_is_text(parameter->kind)) {
+        return PREPARE_BAD_PARAMETER;
+    }
+    Column column_bound = parameter->kind == PARAMETER_MATCH ? statement->match_column :
+                          parameter->kind == PARAMETER_USERNAME ? COLUMN_USERNAME : COLUMN_EMAIL;
+    if (parameter->kind == PARAMETER_MATCH ? !match_fits(statement, text, length) : length > column_size(column_bound)) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (memchr(text, '\0', length) != NULL) {
+        return PREPARE_BAD_PARAMETER;
+    }
+
+    char* column;
+    if (parameter->kind == PARAMETER_MATCH) {
+        column = statement->match_value;
+    } else {
+        Row* row = prepared_row(prepared, parameter);
+        column = column_bound == COLUMN_USERNAME ? row->username : row->email;
+    }
+    memcpy(column, text, length);
+    column[length] = '\0';
+    parameter->bound = true;
+    return PREPARE_SUCCESS;
+}
+
+// Runs the statement with the values bound to it. Results go to statement.output in
+// statement.format, as for a statement typed at the prompt.
+ExecuteResult prepared_execute(PreparedStatement* prepared, Table* table) {
+    if (!prepared_fill(prepared)) {
+        return EXECUTE_UNBOUND_PARAMETER;
+    }
+    return execute_statement(&prepared->statement, table);
+}
+
+// Rebuilds the statement from the template and the bound values, ready for execute_statement.
+// Returns false if a parameter has not been bound.
+bool prepared_fill(PreparedStatement* prepared) {
+    Statement* statement = &prepared->statement;
+    statement->type = prepared->type;
+    statement->id_min = prepared->id_min;
+    statement->id_max = prepared->id_max;
+    statement->limit = prepared->limit;
+    statement->offset = prepared->offset;
+    statement->rows_affected = 0;
+
+    for (uint32_t i = 0; i < statement->num_parameters; i++) {
+        Parameter* parameter = &statement->parameters[i];
+        if (!parameter->bound) {
+            return false;
+        }
+        switch (parameter->kind) {
+            case (PARAMETER_ID):
+                prepared_row(prepared, parameter)->id = parameter->value;
+                break;
+            case (PARAMETER_USERNAME):
+            case (PARAMETER_EMAIL):
+            case (PARAMETER_MATCH):
+                break;
+            case (PARAMETER_KEY):
+                statement->id_min = parameter->value;
+                statement->id_max = parameter->value;
+                break;
+            case (PARAMETER_BOUND):
+                statement_narrow_range(statement, parameter->op, parameter->value);
+                break;
+            // Limits and offsets stay 32-bit, so larger values are clamped
+            case (PARAMETER_LIMIT):
+                statement->limit = parameter->value > UINT32_MAX ? UINT32_MAX : (uint32_t)parameter->value;
+                break;
+            case (PARAMETER_OFFSET):
+                statement->offset = parameter->value > UINT32_MAX ? UINT32_MAX : (uint32_t)parameter->value;
+                break;
+        }
+    }
+
+    if (statement->type == STATEMENT_SELECT && statement->id_min == statement->id_max && statement->limit > 0 &&
+        statement->offset == 0 && statement->match_column == COLUMN_NONE) {
+        statement->type = STATEMENT_LOOKUP;
+    }
+    return true;
+}
+
+void free_prepared_statement(PreparedStatement* prepared) {
+    if (prepared == NULL) {
         return;
     }
+    free(prepared->statement.rows);
+    free(prepared->statement.parameters);
+    free(prepared);
+}
+
+/* --- Binary Protocol --- */
+
+void protocol_write_header(FILE* output, MessageType type, uint32_t length) {
+    uint8_t header[PROTOCOL_HEADER_SIZE];
+    memcpy(header, &length, sizeof(length));
+    header[sizeof(length)] = (uint8_t)type;
+    fwrite(header, sizeof(header), 1, output);
+}
+
+void protocol_write_frame(FILE* output, MessageType type, const void* payload, uint32_t length) {
+    protocol_write_header(output, type, length);
+    if (length > 0) {
+        fwrite(payload, length, 1, output);
+    }
+}
+
+// Ends the answer to an execute or a query
+void protocol_write_done(FILE* output, ExecuteResult result, uint32_t rows_affected) {
+    uint8_t payload[1 + sizeof(rows_affected)];
+    payload[0] = (uint8_t)result;
+    memcpy(payload + 1, &rows_affected, sizeof(rows_affected));
+    protocol_write_frame(output, MESSAGE_DONE, payload, sizeof(payload));
+}
+
+void protocol_write_error(FILE* output, const char* message) {
+    protocol_write_frame(output, MESSAGE_ERROR, message, (uint32_t)strlen(message));
+}
+
+// The message the prompt would print, as a MESSAGE_ERROR frame
+void protocol_write_prepare_error(FILE* output, PrepareResult result, const char* input) {
+    char* message = NULL;
+    size_t message_length = 0;
+    FILE* stream = open_memstream(&message, &message_length);
+    if (stream == NULL) {
+        fprintf(stderr, "Error: malloc failed for response\n");
+        exit(EXIT_FAILURE);
+    }
+    print_prepare_error(stream, result, input);
+    fclose(stream);
+    // Without the trailing newline
+    protocol_write_frame(output, MESSAGE_ERROR, message, message_length > 0 ? (uint32_t)message_length - 1 : 0);
+    free(message);
+}
+
+/* --- Result Output --- */
+
+// Writes value in decimal, returns the end
+char* format_uint64(char* destination, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (count > 0) {
+        *destination++ = digits[--count];
+    }
+    return destination;
+}
 
-    if (cursor->cell_num < num_cells) {
-        // Make room for new cell
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+// Writes one column, quoted or escaped as the format needs. Returns the end.
+char* format_field(char* destination, ResultFormat format, const uint8_t* text, uint8_t length) {
+    static const bool csv_special[256] = { ['\n'] = true, ['\r'] = true, [','] = true, ['"'] = true };
+    static const bool tsv_special[256] = { ['\n'] = true, ['\r'] = true, ['\t'] = true, ['\\'] = true };
+    bool plain = true;
+    if (format == RESULT_CSV || format == RESULT_TSV) {
+        const bool* special = format == RESULT_CSV ? csv_special : tsv_special;
+        for (uint32_t i = 0; i < length; i++) {
+            if (special[text[i]]) {
+                plain = false;
+                break;
+            }
         }
     }
+    if (plain) {
+        memcpy(destination, text, length);
+        return destination + length;
+    }
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    if (format == RESULT_CSV) {
+        *destination++ = '"';
+        for (uint32_t i = 0; i < length; i++) {
+            if (text[i] == '"') *destination++ = '"';
+            *destination++ = (char)text[i];
+        }
+        *destination++ = '"';
+        return destination;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        char escape = text[i] == '\t' ? 't' : text[i] == '\n' ? 'n' : text[i] == '\r' ? 'r' : text[i] == '\\' ? '\\' : 0;
+        if (escape != 0) {
+            *destination++ = '\\';
+            *destination++ = escape;
+        } else {
+            *destination++ = (char)text[i];
+        }
+    }
+    return destination;
 }
 
-// Binary search within a leaf node to find the correct position for a key
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+// Formats one row from its id and serialized value, without printf. A binary row is a
+// MESSAGE_ROW frame. Writes at most RESULT_ROW_MAX_TEXT bytes and returns how many.
+size_t format_cell(char* destination, ResultFormat format, uint64_t key, const void* value) {
+    const uint8_t* username = (const uint8_t*)value + ROW_COLUMN_LENGTH_SIZE;
+    uint8_t username_length = username[-1];
+    const uint8_t* email = username + username_length + ROW_COLUMN_LENGTH_SIZE;
+    uint8_t email_length = email[-1];
+    char* end = destination;
+
+    switch (format) {
+        case (RESULT_BINARY): {
+            uint32_t value_length = ROW_VALUE_MIN_SIZE + username_length + email_length;
+            uint32_t frame_length = ID_SIZE + value_length;
+            memcpy(end, &frame_length, sizeof(frame_length));
+            end[sizeof(frame_length)] = MESSAGE_ROW;
+            end += PROTOCOL_HEADER_SIZE;
+            memcpy(end, &key, ID_SIZE);
+            memcpy(end + ID_SIZE, value, value_length);
+            return PROTOCOL_HEADER_SIZE + frame_length;
+        }
+        case (RESULT_TEXT):
+            *end++ = '(';
+            end = format_uint64(end, key);
+            *end++ = ',';
+            *end++ = ' ';
+            end = format_field(end, format, username, username_length);
+            *end++ = ',';
+            *end++ = ' ';
+            end = format_field(end, format, email, email_length);
+            *end++ = ')';
+            break;
+        case (RESULT_CSV):
+        case (RESULT_TSV): {
+            char separator = format == RESULT_CSV ? ',' : '\t';
+            end = format_uint64(end, key);
+            *end++ = separator;
+            end = format_field(end, format, username, username_length);
+            *end++ = separator;
+            end = format_field(end, format, email, email_length);
+            break;
+        }
+    }
+    *end++ = '\n';
+    return (size_t)(end - destination);
+}
+
+void result_sink_open(ResultSink* sink, Statement* statement, Table* table) {
+    sink->statement = statement;
+    sink->pager = table->pager;
+    sink->wal = table->pager->wal;
+    sink->direct = false;
+    sink->length = 0;
+    sink->iov_count = 0;
+    sink->num_pending = 0;
+    sink->num_pinned = 0;
+}
+
+// Adds a row whose serialized value lies in leaf page_num, pinned by the caller
+void result_sink_cell(ResultSink* sink, uint32_t page_num, uint64_t key, const void* value) {
+    Statement* statement = sink->statement;
+    if (statement->format != RESULT_BINARY || !statement->output_direct) {
+        if (sink->length + RESULT_ROW_MAX_TEXT > RESULT_BUFFER_SIZE) {
+            result_sink_flush(sink);
+        }
+        sink->length += format_cell(sink->buffer + sink->length, statement->format, key, value);
+        return;
+    }
+
+    // Binary rows are the leaf's bytes behind a small prefix, so only the prefix is copied
+    if (sink->num_pending == RESULT_MAX_PENDING_ROWS) {
+        result_sink_flush(sink);
+    }
+    if (sink->num_pinned == 0 || sink->pinned[sink->num_pinned - 1] != page_num) {
+        if (sink->num_pinned == RESULT_MAX_PINS) {
+            result_sink_flush(sink);
+        }
+        pager_pin(sink->pager, page_num);
+        sink->pinned[sink->num_pinned++] = page_num;
+    }
+    const uint8_t* bytes = value;
+    uint32_t value_length = ROW_VALUE_MIN_SIZE + bytes[0] + bytes[ROW_COLUMN_LENGTH_SIZE + bytes[0]];
+    uint32_t frame_length = ID_SIZE + value_length;
+    uint8_t* prefix = sink->prefixes[sink->num_pending++];
+    memcpy(prefix, &frame_length, sizeof(frame_length));
+    prefix[sizeof(frame_length)] = MESSAGE_ROW;
+    memcpy(prefix + PROTOCOL_HEADER_SIZE, &key, ID_SIZE);
+    sink->iov[sink->iov_count++] = (struct iovec){ .iov_base = prefix, .iov_len = PROTOCOL_HEADER_SIZE + ID_SIZE };
+    sink->iov[sink->iov_count++] = (struct iovec){ .iov_base = (void*)value, .iov_len = value_length };
+}
+
+// Writes out everything collected so far. The first time rows bypass the stream, whatever the
+// stream (and the console behind it) holds goes first, and before that the log is synced: it may
+// be holding results of inserts that must not be shown until they are durable.
+void result_sink_flush(ResultSink* sink) {
+    Statement* statement = sink->statement;
+    if (!statement->output_direct) {
+        fwrite(sink->buffer, 1, sink->length, statement->output);
+        sink->length = 0;
+        return;
+    }
+
+    if (!sink->direct) {
+        if (sink->wal != NULL) {
+            pthread_mutex_lock(&sink->wal->lock);
+            uint64_t lsn = sink->wal->end_lsn;
+            pthread_mutex_unlock(&sink->wal->lock);
+            wal_commit(sink->wal, lsn);
+        }
+        fflush(statement->output);
+        if (statement->output == console.stream) {
+            console_release();
+        }
+        sink->direct = true;
+    }
+    int file_descriptor = output_descriptor(statement->output);
+    if (sink->length > 0) {
+        struct iovec buffer = { .iov_base = sink->buffer, .iov_len = sink->length };
+        result_sink_writev(file_descriptor, &buffer, 1);
+        sink->length = 0;
+    }
+    if (sink->iov_count > 0) {
+        result_sink_writev(file_descriptor, sink->iov, sink->iov_count);
+        sink->iov_count = 0;
+        sink->num_pending = 0;
+    }
+    for (uint32_t i = 0; i < sink->num_pinned; i++) {
+        pager_unpin(sink->pager, sink->pinned[i]);
+    }
+    sink->num_pinned = 0;
+}
+
+// Ends the result. One that never outgrew the buffer joins the rest of the statement's output in
+// the stream, so a small select costs no extra write or sync.
+void result_sink_close(ResultSink* sink) {
+    if (sink->direct) {
+        result_sink_flush(sink);
+        return;
+    }
+    FILE* output = sink->statement->output;
+    fwrite(sink->buffer, 1, sink->length, output);
+    for (int i = 0; i < sink->iov_count; i++) {
+        fwrite(sink->iov[i].iov_base, 1, sink->iov[i].iov_len, output);
+    }
+    for (uint32_t i = 0; i < sink->num_pinned; i++) {
+        pager_unpin(sink->pager, sink->pinned[i]);
+    }
+}
+
+// Adds rows formatted elsewhere (by a parallel scan) after the ones collected so far
+void result_sink_formatted(ResultSink* sink, const char* text, size_t length) {
+    if (sink->iov_count == 0 && sink->length + length <= RESULT_BUFFER_SIZE) {
+        memcpy(sink->buffer + sink->length, text, length);
+        sink->length += length;
+        return;
+    }
+    result_sink_flush(sink);
+    if (length <= RESULT_BUFFER_SIZE) {
+        memcpy(sink->buffer, text, length);
+        sink->length = length;
+    } else if (!sink->direct) {
+        fwrite(text, 1, length, sink->statement->output);
+    } else {
+        struct iovec piece = { .iov_base = (void*)text, .iov_len = length };
+        result_sink_writev(output_descriptor(sink->statement->output), &piece, 1);
+    }
+}
+
+// writev that finishes partial writes
+void result_sink_writev(int file_descriptor, struct iovec* iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t written = writev(file_descriptor, iov, iov_count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: writing results failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+}
+
+/* --- Parallel Scans --- */
 
-    Cursor* cursor = malloc(sizeof(Cursor));
-    if (cursor == NULL) {
-        fprintf(stderr, "Error: malloc failed for Cursor\n");
+// Whether a scan of num_rows rows is big enough to be split across the table's scan threads
+bool parallel_scan_worth(Table* table, uint64_t num_rows) {
+    return table->scan_threads > 1 && num_rows >= PARALLEL_SCAN_MIN_ROWS;
+}
+
+// Sends the num_rows rows from rank first_rank on that pass filter (every one without a filter) to
+// the sink in key order, scanned by the table's scan threads a morsel at a time. Returns how many
+// rows passed. The workers only read, so the caller must keep writers out as for any select.
+uint64_t parallel_scan(Table* table, ResultSink* sink, const TextFilter* filter, bool counting,
+                       uint64_t first_rank, uint64_t num_rows) {
+    Pager* pager = table->pager;
+    ParallelScan scan = {
+        .table = table,
+        .format = sink->statement->format,
+        .filter = filter,
+        .counting = counting,
+        .num_morsels = (uint32_t)((num_rows + PARALLEL_SCAN_MORSEL_ROWS - 1) / PARALLEL_SCAN_MORSEL_ROWS),
+    };
+    scan.morsels = calloc(scan.num_morsels, sizeof(ScanMorsel));
+    uint32_t num_threads = table->scan_threads < scan.num_morsels ? table->scan_threads : scan.num_morsels;
+    pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+    if (scan.morsels == NULL || threads == NULL) {
+        fprintf(stderr, "Error: malloc failed for a parallel scan\n");
         exit(EXIT_FAILURE);
     }
+    for (uint32_t i = 0; i < scan.num_morsels; i++) {
+        uint64_t offset = (uint64_t)i * PARALLEL_SCAN_MORSEL_ROWS;
+        scan.morsels[i].rank = first_rank + offset;
+        scan.morsels[i].num_rows = num_rows - offset < PARALLEL_SCAN_MORSEL_ROWS ? num_rows - offset : PARALLEL_SCAN_MORSEL_ROWS;
+    }
+    scan.window = num_threads * PARALLEL_SCAN_WINDOW;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.changed, NULL);
+
+    // The workers fetch pages at the same time, as the server's readers do. A server's pool
+    // already locks, and its other workers read the flag, so it is only set when it is off.
+    bool concurrent = pager->concurrent;
+    if (!concurrent) {
+        pager->concurrent = true;
+    }
+    for (uint32_t i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_scan_worker, &scan) != 0) {
+            fprintf(stderr, "Error: could not start a scan thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    cursor->table = table;
-    cursor->page_num = page_num;
+    uint64_t matches = 0;
+    for (uint32_t i = 0; i < scan.num_morsels; i++) {
+        ScanMorsel* morsel = &scan.morsels[i];
+        pthread_mutex_lock(&scan.lock);
+        while (!morsel->done) {
+            pthread_cond_wait(&scan.changed, &scan.lock);
+        }
+        pthread_mutex_unlock(&scan.lock);
+
+        if (morsel->length > 0) {
+            result_sink_formatted(sink, morsel->output, morsel->length);
+        }
+        free(morsel->output);
+        matches += morsel->matches;
+
+        pthread_mutex_lock(&scan.lock);
+        scan.collected = i + 1;
+        pthread_cond_broadcast(&scan.changed);
+        pthread_mutex_unlock(&scan.lock);
+    }
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (!concurrent) {
+        pager->concurrent = false;
+    }
+    pthread_cond_destroy(&scan.changed);
+    pthread_mutex_destroy(&scan.lock);
+    free(threads);
+    free(scan.morsels);
+    return matches;
+}
+
+void* parallel_scan_worker(void* argument) {
+    ParallelScan* scan = argument;
+    pthread_mutex_lock(&scan->lock);
+    while (true) {
+        while (scan->next_morsel < scan->num_morsels && scan->next_morsel >= scan->collected + scan->window) {
+            pthread_cond_wait(&scan->changed, &scan->lock);
+        }
+        if (scan->next_morsel == scan->num_morsels) {
+            break;
+        }
+        ScanMorsel* morsel = &scan->morsels[scan->next_morsel++];
+        pthread_mutex_unlock(&scan->lock);
+
+        parallel_scan_morsel(scan, morsel);
 
-    // Binary search
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
-        }
-        if (key < key_at_index) {
-            one_past_max_index = index;
+        pthread_mutex_lock(&scan->lock);
+        morsel->done = true;
+        pthread_cond_broadcast(&scan->changed);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+// Scans a morsel's rows a leaf at a time, from one descent by rank to its first row, and
+// formats those that pass the filter into the morsel's output
+void parallel_scan_morsel(ParallelScan* scan, ScanMorsel* morsel) {
+    Pager* pager = scan->table->pager;
+    Cursor cursor;
+    table_seek_rank(scan->table, morsel->rank, &cursor);
+
+    uint16_t matches[LEAF_NODE_CELLS_BOUND];
+    uint64_t remaining = morsel->num_rows;
+    while (!(cursor.end_of_table) && remaining > 0) {
+        void* node = get_page(pager, cursor.page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t end_cell = num_cells - cursor.cell_num > remaining ? cursor.cell_num + (uint32_t)remaining : num_cells;
+
+        uint32_t num_matches = 0;
+        if (scan->filter != NULL) {
+            num_matches = leaf_node_filter(node, cursor.cell_num, end_cell, scan->filter, matches);
         } else {
-            min_index = index + 1;
+            for (uint32_t cell_num = cursor.cell_num; cell_num < end_cell; cell_num++) {
+                matches[num_matches++] = (uint16_t)cell_num;
+            }
         }
+        morsel->matches += num_matches;
+        if (!scan->counting) {
+            for (uint32_t i = 0; i < num_matches; i++) {
+                scan_morsel_reserve(morsel, RESULT_ROW_MAX_TEXT);
+                morsel->length += format_cell(morsel->output + morsel->length, scan->format,
+                                              *leaf_node_key(node, matches[i]), leaf_node_value(node, matches[i]));
+            }
+        }
+
+        remaining -= end_cell - cursor.cell_num;
+        cursor.cell_num = end_cell;
+        cursor_skip_exhausted_leaves(&cursor);
     }
+    cursor_close(&cursor);
+}
 
-    cursor->cell_num = min_index;
-    return cursor;
+// Makes room for at least bytes more output in the morsel
+void scan_morsel_reserve(ScanMorsel* morsel, size_t bytes) {
+    if (morsel->length + bytes <= morsel->capacity) {
+        return;
+    }
+    size_t capacity = morsel->capacity > 0 ? morsel->capacity * 2 : RESULT_BUFFER_SIZE;
+    while (capacity < morsel->length + bytes) {
+        capacity *= 2;
+    }
+    char* output = realloc(morsel->output, capacity);
+    if (output == NULL) {
+        fprintf(stderr, "Error: malloc failed for scan output\n");
+        exit(EXIT_FAILURE);
+    }
+    morsel->output = output;
+    morsel->capacity = capacity;
+}
+
+/* --- Serialization --- */
+
+void print_row(FILE* output, ResultFormat format, Row* row) {
+    char value[ROW_VALUE_MAX_SIZE];
+    char line[RESULT_ROW_MAX_TEXT];
+    serialize_row_value(row, value);
+    fwrite(line, format_cell(line, format, row->id, value), 1, output);
+}
+
+// Bytes the row's value (username and email) takes once serialized
+uint32_t row_value_size(Row* row) {
+    return ROW_VALUE_MIN_SIZE + (uint32_t)strlen(row->username) + (uint32_t)strlen(row->email);
+}
+
+// We Convert Row struct into raw bytes and then write to page memory
+// Each column is stored as a length byte followed by just the characters it uses. Returns the bytes written.
+uint32_t serialize_row_value(Row* source, void* destination) {
+    uint8_t* bytes = destination;
+    uint8_t username_length = (uint8_t)strlen(source->username);
+    uint8_t email_length = (uint8_t)strlen(source->email);
+    bytes[0] = username_length;
+    memcpy(bytes + ROW_COLUMN_LENGTH_SIZE, source->username, username_length);
+    bytes += ROW_COLUMN_LENGTH_SIZE + username_length;
+    bytes[0] = email_length;
+    memcpy(bytes + ROW_COLUMN_LENGTH_SIZE, source->email, email_length);
+    return ROW_VALUE_MIN_SIZE + username_length + email_length;
+}
+
+// Convert raw bytes from page memory back into a Row struct (all but the id). Returns the bytes read.
+uint32_t deserialize_row_value(const void* source, Row* destination) {
+    const uint8_t* bytes = source;
+    uint8_t username_length = bytes[0];
+    memcpy(destination->username, bytes + ROW_COLUMN_LENGTH_SIZE, username_length);
+    destination->username[username_length] = '\0';
+    bytes += ROW_COLUMN_LENGTH_SIZE + username_length;
+    uint8_t email_length = bytes[0];
+    memcpy(destination->email, bytes + ROW_COLUMN_LENGTH_SIZE, email_length);
+    destination->email[email_length] = '\0';
+    return ROW_VALUE_MIN_SIZE + username_length + email_length;
+}
+
+// The whole row, id first, as it is logged and sorted. Returns the bytes written.
+uint32_t serialize_row(Row* source, void* destination) {
+    memcpy(destination, &(source->id), ID_SIZE);
+    return ID_SIZE + serialize_row_value(source, (char*)destination + ID_SIZE);
+}
+
+uint32_t deserialize_row(const void* source, Row* destination) {
+    memcpy(&(destination->id), source, ID_SIZE);
+    return ID_SIZE + deserialize_row_value((const char*)source + ID_SIZE, destination);
+}
+
+/* --- Table Management --- */
+
+Table* db_open(const char* filename, const DbOptions* options) {
+    // 1. Open the database file and get a pager
+    Pager* pager = pager_open(filename, options);
+
+    Table* table = malloc(sizeof(Table));
+    if (table == NULL) {
+        fprintf(stderr, "Error: malloc failed for Table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    table->pager = pager;
+    table->root_page_num = pager->header.root_page_num;
+    table->append_page_num = INVALID_PAGE_NUM;
+    table->scan_threads = options->scan_threads > 0 ? options->scan_threads : 1;
+    table->transaction = NULL;
+    table->backup_running = false;
+
+    // Waiting writers go first, so a steady stream of selects can't starve them
+    pthread_rwlockattr_t latch_attributes;
+    pthread_rwlockattr_init(&latch_attributes);
+    pthread_rwlockattr_setkind_np(&latch_attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&table->latch, &latch_attributes);
+    pthread_rwlockattr_destroy(&latch_attributes);
+
+    // 2. Make sure it is one of ours before anything is written: a file that fails these checks
+    // is left as it was, without a WAL
+    bool baseline = pager->num_pages > 0 && pager->header.magic != DB_HEADER_MAGIC && table_is_baseline(table);
+    if (pager->num_pages > 0 && !baseline) {
+        table_check_format(table);
+    }
+    pager_open_wal(pager, options);
+
+    // A reader sets up its own empty root once it has looked at the file. A new file is written
+    // out right away, so its header records the page size from the start.
+    if (pager->num_pages == 0 && !pager->read_only) {
+        initialize_catalog(get_page_for_write(pager, CATALOG_PAGE_NUM));
+        void* root_node = get_page_for_write(pager, table->root_page_num);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        table_checkpoint(table);
+    }
+
+    // 3. Bring an older file up to the current format. The log was written against the new
+    // format's trees, so it is replayed afterwards, and one checkpoint makes both durable.
+    bool upgraded = false;
+    if (pager->num_pages > 0 && pager->header.magic != DB_HEADER_MAGIC) {
+        if (pager->read_only) {
+            fprintf(stderr, "Error: %s is in an older format; open it for writing once to upgrade it\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        if (baseline) {
+            table_upgrade_baseline(table);
+        } else {
+            table_add_header(table);
+        }
+        table->root_page_num = pager->header.root_page_num;
+        upgraded = true;
+    }
+    if (pager->num_pages > 0 && table_format(table) < FILE_FORMAT_VERSION) {
+        if (pager->read_only) {
+            fprintf(stderr, "Error: %s is in an older format; open it for writing once to upgrade it\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        table_upgrade(table);
+        upgraded = true;
+    }
+
+    // 4. Re-apply inserts and deletes that were logged after the last checkpoint, then checkpoint them.
+    // Each run of insert records goes in as one batch; a delete ends the run.
+    Wal* wal = pager->wal;
+    if (wal != NULL && wal->replay != NULL) {
+        uint32_t max_rows = 0;
+        size_t offset = 0;
+        while (offset < wal->replay_length) {
+            uint32_t header[3];
+            memcpy(header, wal->replay + offset, WAL_RECORD_HEADER_SIZE);
+            if (header[0] == WAL_RECORD_INSERT) {
+                max_rows += header[1] / (ID_SIZE + ROW_VALUE_MIN_SIZE);
+            }
+            offset += WAL_RECORD_HEADER_SIZE + header[1];
+        }
+        Row* rows = malloc(sizeof(Row) * (max_rows + 1));
+        Row** row_pointers = malloc(sizeof(Row*) * (max_rows + 1));
+        if (rows == NULL || row_pointers == NULL) {
+            fprintf(stderr, "Error: malloc failed for WAL replay\n");
+            exit(EXIT_FAILURE);
+        }
+
+        uint32_t num_rows = 0;
+        for (offset = 0; offset < wal->replay_length;) {
+            uint32_t header[3];
+            memcpy(header, wal->replay + offset, WAL_RECORD_HEADER_SIZE);
+            const char* payload = wal->replay + offset + WAL_RECORD_HEADER_SIZE;
+            if (header[0] == WAL_RECORD_INSERT) {
+                for (size_t position = 0; position < header[1]; num_rows++) {
+                    position += deserialize_row(payload + position, &rows[num_rows]);
+                    row_pointers[num_rows] = &rows[num_rows];
+                }
+            } else if (header[1] == 2 * sizeof(uint64_t)) {
+                table_insert_batch(table, row_pointers, num_rows);
+                num_rows = 0;
+                uint64_t range[2];
+                memcpy(range, payload, sizeof(range));
+                table_delete_range(table, range[0], range[1]);
+            }
+            offset += WAL_RECORD_HEADER_SIZE + header[1];
+        }
+        table_insert_batch(table, row_pointers, num_rows);
+        free(row_pointers);
+        free(rows);
+        free(wal->replay);
+        wal->replay = NULL;
+        wal->replay_length = 0;
+        table_checkpoint(table);
+    } else if (upgraded) {
+        table_checkpoint(table);
+    }
+
+    return table;
+}
+
+// This gives the memory back to the computer so other programs can use it when we're done.
+void free_table(Table* table) {
+    Pager* pager = table->pager;
+
+    // Only modified pages are written, followed by a single sync
+    if (pager->read_only) {
+        // A reader never dirties a page, so there is nothing to write
+    } else {
+        // Like a crash before its commit, exiting drops an open transaction
+        if (table->transaction != NULL) {
+            table_rollback(table);
+        }
+        table_checkpoint(table);
+        if (pager->wal != NULL) {
+            wal_close(pager->wal);
+        }
+    }
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        free(pager->frames[i].buffer);
+    }
+    if (pager->map != NULL) {
+        munmap(pager->map, pager->map_length);
+    }
+    if (pager->page_map != NULL) {
+        page_map_close(pager->page_map);
+    }
+    if (pager->ring != NULL) {
+        io_ring_close(pager->ring);
+    }
+    free(pager->bounce);
+    backup_state_free(pager->backup);
+
+    close(pager->file_descriptor);
+    free(pager->frames);
+    free(pager->page_table);
+    free(pager->filename);
+    pthread_mutex_destroy(&pager->pool_lock);
+    pthread_cond_destroy(&pager->frame_loaded);
+    free(pager);
+    open_pagers--;
+    pthread_rwlock_destroy(&table->latch);
+    free(table);
+}
+
+// Places the row in the tree without logging it
+ExecuteResult table_insert(Table* table, Row* row) {
+    uint64_t key_to_insert = row->id;
+    Cursor cursor;
+    if (!table_find_append(table, key_to_insert, &cursor)) {
+        table_find(table, key_to_insert, &cursor);
+    }
+
+    // Check for duplicate key in the leaf the key would land in
+    void* node = get_page(table->pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cursor.cell_num < num_cells) {
+        uint64_t key_at_index = *leaf_node_key(node, cursor.cell_num);
+        if (key_at_index == key_to_insert) {
+            cursor_close(&cursor);
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    leaf_node_insert(&cursor, key_to_insert, row);
+
+    table_remember_append(table, cursor.page_num);
+    cursor_close(&cursor);
+    table_index_row(table, row, false);
+    return EXECUTE_SUCCESS;
+}
+
+int compare_row_pointers(const void* a, const void* b) {
+    const Row* row_a = *(Row* const*)a;
+    const Row* row_b = *(Row* const*)b;
+    if (row_a->id != row_b->id) {
+        return (row_a->id > row_b->id) - (row_a->id < row_b->id);
+    }
+    // Equal ids keep their order in the batch, so the first one is the one inserted
+    return (row_a > row_b) - (row_a < row_b);
+}
+
+// Places a batch of rows without logging them. The rows are sorted and each run of rows that
+// lands in the same leaf is merged into it under a single descent, moving every cell at most once.
+// Rows whose id is already present, or repeated in the batch, are skipped. The inserted rows end
+// up at the front of rows in key order; returns how many there are.
+uint32_t table_insert_batch(Table* table, Row** rows, uint32_t num_rows) {
+    Pager* pager = table->pager;
+    qsort(rows, num_rows, sizeof(Row*), compare_row_pointers);
+
+    uint32_t inserted = 0;
+    bool have_last_key = false;
+    uint64_t last_key = 0;
+    uint32_t i = 0;
+    while (i < num_rows) {
+        if (have_last_key && rows[i]->id == last_key) {
+            i++;
+            continue;
+        }
+
+        Cursor cursor;
+        if (!table_find_append(table, rows[i]->id, &cursor)) {
+            table_find(table, rows[i]->id, &cursor);
+        }
+        void* node = get_page(pager, cursor.page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+
+        if (cursor.cell_num < num_cells && *leaf_node_key(node, cursor.cell_num) == rows[i]->id) {
+            last_key = rows[i]->id;
+            have_last_key = true;
+            i++;
+            cursor_close(&cursor);
+            continue;
+        }
+
+        if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + row_value_size(rows[i])) {
+            // No room: split the leaf for this row, then descend again for the next one
+            last_key = rows[i]->id;
+            have_last_key = true;
+            leaf_node_insert(&cursor, rows[i]->id, rows[i]);
+            rows[inserted++] = rows[i];
+            i++;
+            table_remember_append(table, cursor.page_num);
+            cursor_close(&cursor);
+            continue;
+        }
+
+        // The found row belongs here; later rows do too while they are below the leaf's max key
+        // (or the leaf is the rightmost one) and there is room
+        bool rightmost = *leaf_node_next_leaf(node) == 0;
+        uint64_t max_key = num_cells > 0 ? *leaf_node_key(node, num_cells - 1) : 0;
+        uint32_t free_space = leaf_node_free_space(node);
+        uint32_t pending_bytes = 0;
+        Row* pending[LEAF_NODE_CELLS_BOUND];
+        uint32_t num_pending = 0;
+        while (i < num_rows) {
+            Row* row = rows[i];
+            if (num_pending > 0 && !rightmost && row->id > max_key) {
+                break;
+            }
+            bool duplicate = have_last_key && row->id == last_key;
+            if (!duplicate && num_cells > 0 && row->id <= max_key) {
+                uint32_t cell_num = leaf_node_find_cell(node, row->id);
+                duplicate = cell_num < num_cells && *leaf_node_key(node, cell_num) == row->id;
+            }
+            if (!duplicate) {
+                uint32_t cell_bytes = LEAF_NODE_SLOT_SIZE + row_value_size(row);
+                if (pending_bytes + cell_bytes > free_space) {
+                    break;
+                }
+                pending_bytes += cell_bytes;
+                pending[num_pending++] = row;
+            }
+            last_key = row->id;
+            have_last_key = true;
+            i++;
+        }
+
+        // Merge keys and value slots from the back so existing ones move straight to their final
+        // place; each new value is written once, into the heap
+        node = get_page_for_write(pager, cursor.page_num);
+        leaf_node_set_num_cells(node, num_cells + num_pending);
+        uint32_t destination = num_cells + num_pending;
+        uint32_t source = num_cells;
+        uint32_t remaining = num_pending;
+        while (remaining > 0) {
+            destination--;
+            if (source > 0 && *leaf_node_key(node, source - 1) > pending[remaining - 1]->id) {
+                source--;
+                *leaf_node_key(node, destination) = *leaf_node_key(node, source);
+                memcpy(leaf_node_value_slot(node, destination), leaf_node_value_slot(node, source), LEAF_NODE_VALUE_SLOT_SIZE);
+            } else {
+                remaining--;
+                leaf_node_set_row(node, destination, pending[remaining]->id, pending[remaining]);
+            }
+        }
+
+        if (num_pending > 0) {
+            tree_add_count(pager, cursor.page_num, pending[0]->id, (int32_t)num_pending);
+        }
+        for (uint32_t p = 0; p < num_pending; p++) {
+            rows[inserted++] = pending[p];
+        }
+        table_remember_append(table, cursor.page_num);
+        cursor_close(&cursor);
+    }
+
+    if (table_has_indexes(table)) {
+        for (uint32_t r = 0; r < inserted; r++) {
+            table_index_row(table, rows[r], false);
+        }
+    }
+    return inserted;
+}
+
+// Removes every row with id_min <= id <= id_max without logging it; returns how many there were.
+// The rows of one leaf go in a single pass, then the leaf is rebalanced before the next descent.
+uint32_t table_delete_range(Table* table, uint64_t id_min, uint64_t id_max) {
+    Pager* pager = table->pager;
+    bool indexed = table_has_indexes(table);
+    // Merges may free the remembered leaf, and the page may come back in another tree
+    table->append_page_num = INVALID_PAGE_NUM;
+    uint32_t deleted = 0;
+    uint64_t key = id_min;
+    while (true) {
+        Cursor cursor;
+        table_seek(table, key, &cursor);
+        if (cursor.end_of_table) {
+            cursor_close(&cursor);
+            break;
+        }
+
+        void* node = get_page(pager, cursor.page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t end = num_cells;
+        if (id_max < UINT64_MAX) {
+            end = cursor.cell_num + wide_key_lower_bound(leaf_node_key(node, cursor.cell_num), num_cells - cursor.cell_num, id_max + 1);
+        }
+        if (end == cursor.cell_num) {
+            cursor_close(&cursor);
+            break;
+        }
+
+        // The range can only go on in the next leaf if it covered the rest of this one
+        uint64_t last_key = *leaf_node_key(node, end - 1);
+        bool more = end == num_cells && last_key < id_max;
+        if (indexed) {
+            for (uint32_t cell_num = cursor.cell_num; cell_num < end; cell_num++) {
+                Row row;
+                leaf_node_read_row(get_page(pager, cursor.page_num), cell_num, &row);
+                table_index_row(table, &row, true);
+            }
+        }
+        node = get_page_for_write(pager, cursor.page_num);
+        uint64_t first_key = *leaf_node_key(node, cursor.cell_num);
+        leaf_node_remove_cells(node, cursor.cell_num, end - cursor.cell_num);
+        deleted += end - cursor.cell_num;
+
+        uint32_t page_num = cursor.page_num;
+        tree_add_count(pager, page_num, first_key, -(int32_t)(end - cursor.cell_num));
+        cursor_close(&cursor);
+        leaf_node_rebalance(table, page_num);
+        if (!more) {
+            break;
+        }
+        key = last_key + 1;
+    }
+    return deleted;
+}
+
+// Copies the row stored under key into row, returns false if there is none
+bool table_get(Table* table, uint64_t key, Row* row) {
+    Cursor cursor;
+    table_find(table, key, &cursor);
+
+    void* node = get_page(table->pager, cursor.page_num);
+    bool found = cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor.cell_num) == key;
+    if (found) {
+        leaf_node_read_row(node, cursor.cell_num, row);
+    }
+
+    cursor_close(&cursor);
+    return found;
+}
+
+// Makes every logged statement durable, checkpointing if the log or the dirty set grew too large
+void table_commit(Table* table) {
+    Wal* wal = table->pager->wal;
+    if (wal == NULL || table->transaction != NULL) {
+        // An open transaction has logged nothing yet
+        return;
+    }
+    pthread_mutex_lock(&wal->lock);
+    uint64_t lsn = wal->end_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    wal_commit(wal, lsn);
+
+    if (table_checkpoint_due(table)) {
+        table_checkpoint(table);
+    }
+}
+
+bool table_checkpoint_due(Table* table) {
+    Pager* pager = table->pager;
+    Wal* wal = pager->wal;
+    if (wal == NULL || table->transaction != NULL || table->backup_running) {
+        return false;
+    }
+    return wal->end_lsn - wal->base_lsn >= wal->autocheckpoint ||
+           pager->num_dirty >= pager->frame_budget / 2 ||
+           pager->num_frames > pager->frame_budget;
+}
+
+// Copies every dirty page back into the database file and restarts the log.
+// Must run between statements, when the tree is consistent and nothing is pinned.
+void table_checkpoint(Table* table) {
+    Pager* pager = table->pager;
+    table_write_header(table);
+    if (pager->wal == NULL) {
+        pager_flush(pager);
+    } else {
+        wal_checkpoint(pager->wal, pager);
+        pager_shrink_to_budget(pager);
+    }
+    pager_save_hot_pages(pager);
+}
+
+// Brings the header page up to date for a checkpoint. It is only dirtied when something changed,
+// so a checkpoint with nothing else to write stays free.
+void table_write_header(Table* table) {
+    Pager* pager = table->pager;
+    DbHeader* header = &pager->header;
+    header->row_count = node_row_count(get_page(pager, table->root_page_num));
+    header->num_pages = pager->num_pages;
+    header->checksum = db_header_checksum(header);
+    if (memcmp(get_page(pager, HEADER_PAGE_NUM), header, DB_HEADER_SIZE) != 0) {
+        memcpy(get_page_for_write(pager, HEADER_PAGE_NUM), header, DB_HEADER_SIZE);
+    }
+}
+
+// Rewrites the database into <file>-vacuum with only the pages reachable from the root and the
+// index roots, renumbered without gaps in their current order, then renames it over the database.
+// Free pages and pages orphaned by an interrupted import or index build are dropped. The new file
+// gets a fresh header and catalog, which also upgrades a file that predates indexes. The old file stays
+// intact until the rename, so a crash leaves one or the other. Returns the new number of pages.
+uint32_t table_vacuum(Table* table) {
+    Pager* pager = table->pager;
+    table_checkpoint(table);
+    table->append_page_num = INVALID_PAGE_NUM;
+
+    uint32_t index_roots[COLUMN_EMAIL + 1] = { 0 };
+    for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+        Table index;
+        if (table_index(table, column, &index)) {
+            index_roots[column] = index.root_page_num;
+        }
+    }
+
+    // Find the live pages; only internal nodes point at other pages that matter
+    uint32_t num_pages = pager->num_pages;
+    uint32_t* new_page_nums = malloc(sizeof(uint32_t) * num_pages);
+    uint32_t* pending = malloc(sizeof(uint32_t) * num_pages);
+    if (new_page_nums == NULL || pending == NULL) {
+        fprintf(stderr, "Error: malloc failed for vacuum\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < num_pages; i++) {
+        new_page_nums[i] = INVALID_PAGE_NUM;
+    }
+    uint32_t num_pending = 0;
+    new_page_nums[table->root_page_num] = 0;
+    pending[num_pending++] = table->root_page_num;
+    for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+        if (index_roots[column] != 0) {
+            new_page_nums[index_roots[column]] = 0;
+            pending[num_pending++] = index_roots[column];
+        }
+    }
+    while (num_pending > 0) {
+        void* node = get_page(pager, pending[--num_pending]);
+        if (get_node_type(node) != NODE_INTERNAL) {
+            continue;
+        }
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            uint32_t child = *internal_node_child(node, i);
+            if (new_page_nums[child] == INVALID_PAGE_NUM) {
+                new_page_nums[child] = 0;
+                pending[num_pending++] = child;
+            }
+        }
+    }
+    free(pending);
+
+    // The header and the catalog stay first and the root comes next; the rest follow in order
+    new_page_nums[table->root_page_num] = INVALID_PAGE_NUM;
+    uint32_t num_live = DB_ROOT_PAGE_NUM + 1;
+    for (uint32_t i = 0; i < num_pages; i++) {
+        if (new_page_nums[i] != INVALID_PAGE_NUM) {
+            new_page_nums[i] = num_live++;
+        }
+    }
+    new_page_nums[table->root_page_num] = DB_ROOT_PAGE_NUM;
+
+    size_t path_length = strlen(pager->filename) + sizeof("-vacuum");
+    char* path = malloc(path_length);
+    if (path == NULL) {
+        fprintf(stderr, "Error: malloc failed for vacuum\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, path_length, "%s-vacuum", pager->filename);
+    unlink(path);
+    DbOptions options = {
+        .cache_size = 0,
+        .wal = false,
+        .compress = pager->page_map != NULL,
+        .page_size = page_size,
+    };
+    Pager* target = pager_open(path, &options);
+
+    // Copy the live pages over with every page number in them translated
+    char page[MAX_PAGE_SIZE];
+    for (uint32_t old_page_num = 0; old_page_num < num_pages; old_page_num++) {
+        if (new_page_nums[old_page_num] == INVALID_PAGE_NUM) {
+            continue;
+        }
+        memcpy(page, get_page(pager, old_page_num), page_size);
+        if (is_node_root(page)) {
+            *node_parent(page) = 0;
+        } else {
+            *node_parent(page) = new_page_nums[*node_parent(page)];
+        }
+        if (get_node_type(page) == NODE_INTERNAL) {
+            uint32_t num_keys = *internal_node_num_keys(page);
+            for (uint32_t i = 0; i <= num_keys; i++) {
+                uint32_t* child = internal_node_child(page, i);
+                *child = new_page_nums[*child];
+            }
+        } else if (*leaf_node_next_leaf(page) != 0) {
+            *leaf_node_next_leaf(page) = new_page_nums[*leaf_node_next_leaf(page)];
+        }
+        pager_write_page(target, new_page_nums[old_page_num], page);
+    }
+    initialize_catalog(page);
+    for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+        if (index_roots[column] != 0) {
+            *catalog_index_root(page, column) = new_page_nums[index_roots[column]];
+        }
+    }
+    pager_write_page(target, CATALOG_PAGE_NUM, page);
+    DbHeader* header = &target->header;
+    header->num_pages = num_live;
+    header->row_count = pager->header.row_count;
+    header->checksum = db_header_checksum(header);
+    memset(page, 0, page_size);
+    memcpy(page, header, DB_HEADER_SIZE);
+    pager_write_page(target, HEADER_PAGE_NUM, page);
+    target->num_pages = num_live;
+    free(new_page_nums);
+
+    if (!pager_sync(target)) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (rename(path, pager->filename) == -1) {
+        fprintf(stderr, "Error replacing %s: %s\n", pager->filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+
+    // The rename is only durable once the directory is synced
+    if (!sync_directory_of(pager->filename)) {
+        fprintf(stderr, "Error syncing directory of %s: %s\n", pager->filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pager_replace_file(pager, target);
+    table->root_page_num = pager->header.root_page_num;
+    return num_live;
+}
+
+/* --- Transactions --- */
+
+// Starts a transaction. What earlier statements logged is committed first, so a crash before the
+// transaction's commit loses nothing but the transaction.
+ExecuteResult table_begin(Table* table) {
+    if (table->transaction != NULL) {
+        return EXECUTE_TRANSACTION_OPEN;
+    }
+    table_commit(table);
+
+    Transaction* transaction = calloc(1, sizeof(Transaction));
+    if (transaction == NULL) {
+        fprintf(stderr, "Error: malloc failed for transaction\n");
+        exit(EXIT_FAILURE);
+    }
+    Pager* pager = table->pager;
+    transaction->header = pager->header;
+    transaction->root_page_num = table->root_page_num;
+    pager->in_transaction = true;
+    pager->transaction_num_pages = pager->num_pages;
+    table->transaction = transaction;
+    return EXECUTE_SUCCESS;
+}
+
+// Logs an insert or delete. In a transaction the record is held back for the commit; it gets no
+// checksum of its own, since the record the commit appends covers all of them.
+void table_log(Table* table, WalRecordType type, const void* payload, uint32_t payload_length) {
+    Wal* wal = table->pager->wal;
+    Transaction* transaction = table->transaction;
+    if (wal == NULL) {
+        return;
+    }
+    if (transaction == NULL) {
+        wal_append(wal, type, payload, payload_length);
+        return;
+    }
+
+    size_t record_length = WAL_RECORD_HEADER_SIZE + payload_length;
+    if (transaction->log_length + record_length > UINT32_MAX) {
+        fprintf(stderr, "Error: transaction logged more than 4 GB\n");
+        exit(EXIT_FAILURE);
+    }
+    if (transaction->log_length + record_length > transaction->log_capacity) {
+        while (transaction->log_length + record_length > transaction->log_capacity) {
+            transaction->log_capacity = transaction->log_capacity == 0 ? 64 * ROW_MAX_SIZE : transaction->log_capacity * 2;
+        }
+        transaction->log = realloc(transaction->log, transaction->log_capacity);
+        if (transaction->log == NULL) {
+            fprintf(stderr, "Error: malloc failed for transaction\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint32_t header[3] = { type, payload_length, 0 };
+    memcpy(transaction->log + transaction->log_length, header, WAL_RECORD_HEADER_SIZE);
+    memcpy(transaction->log + transaction->log_length + WAL_RECORD_HEADER_SIZE, payload, payload_length);
+    transaction->log_length += record_length;
+}
+
+// Appends the transaction's records to the log as one, so recovery replays all of them or none.
+// The next table_commit syncs it like any other statement: one fdatasync for the whole transaction.
+ExecuteResult table_commit_transaction(Table* table) {
+    Transaction* transaction = table->transaction;
+    if (transaction == NULL) {
+        return EXECUTE_NO_TRANSACTION;
+    }
+    if (transaction->log_length > 0) {
+        wal_append(table->pager->wal, WAL_RECORD_TRANSACTION, transaction->log, (uint32_t)transaction->log_length);
+    }
+    pager_end_transaction(table->pager, false);
+    free(transaction->log);
+    free(transaction);
+    table->transaction = NULL;
+    return EXECUTE_SUCCESS;
+}
+
+// Puts the tree back as it was at begin. Nothing of the transaction has reached the file or the
+// log, so this is done in memory only.
+ExecuteResult table_rollback(Table* table) {
+    Transaction* transaction = table->transaction;
+    if (transaction == NULL) {
+        return EXECUTE_NO_TRANSACTION;
+    }
+    Pager* pager = table->pager;
+    pager_end_transaction(pager, true);
+    pager->header = transaction->header;
+    table->root_page_num = transaction->root_page_num;
+    table->append_page_num = INVALID_PAGE_NUM;
+    free(transaction->log);
+    free(transaction);
+    table->transaction = NULL;
+    return EXECUTE_SUCCESS;
+}
+
+/* --- Backup --- */
+
+// .backup: copies the database to path as of now while statements keep running. A writer
+// checkpoints first, so the file holds everything committed, and then reads it through a
+// descriptor of its own that holds the readers' lock. Inserts meanwhile only go to the WAL:
+// checkpoints that can wait are put off until the copy is done, and one that can't (an import,
+// say) waits for it. Without a WAL any eviction may write to the file, so the table stays locked
+// for the whole copy; a read-only process already holds the readers' lock for the statement.
+// A backup is written next to path and renamed over it once synced. A writer's repeat backup to
+// the same, untouched file starts from a copy of it and takes only the pages the writer wrote to
+// the database since the previous one began. Returns false with errno set when it couldn't be written.
+bool table_backup(Table* table, const char* path, bool full, BackupResult* result) {
+    Pager* pager = table->pager;
+    pthread_rwlock_wrlock(&table->latch);
+    int source_fd = pager->file_descriptor;
+    bool own_source = false;
+    uint64_t* changed = NULL;
+    uint32_t changed_capacity = 0;
+    result->incremental = false;
+    result->pages_copied = 0;
+    if (!pager->read_only) {
+        table_checkpoint(table);
+        if (pager->wal != NULL) {
+            source_fd = open(pager->filename, O_RDONLY);
+            if (source_fd == -1) {
+                pthread_rwlock_unlock(&table->latch);
+                return false;
+            }
+            own_source = true;
+            pager_lock(source_fd, F_RDLCK, LOCK_READERS_BYTE, true);
+        }
+
+        // Pages written from here on are the next backup's; compressed files move pages around
+        // in ways the bitmap can't describe, so they are always copied whole
+        if (pager->page_map == NULL) {
+            if (pager->backup == NULL) {
+                pager->backup = calloc(1, sizeof(BackupState));
+                if (pager->backup == NULL) {
+                    fprintf(stderr, "Error: malloc failed for backup\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            BackupState* backup = pager->backup;
+            result->incremental = !full && backup_matches(backup, path);
+            if (result->incremental) {
+                changed = backup->changed;
+                changed_capacity = backup->changed_capacity;
+            } else {
+                free(backup->changed);
+            }
+            backup->changed = NULL;
+            backup->changed_capacity = 0;
+            free(backup->path);
+            backup->path = NULL;
+        }
+    }
+
+    struct stat source_stat;
+    bool ok = fstat(source_fd, &source_stat) == 0;
+    off_t length = source_stat.st_size;
+    result->num_pages = pager->page_map != NULL ? pager->num_pages : (uint32_t)(length / page_size);
+    bool hold_latch = !pager->read_only && pager->wal == NULL;
+    table->backup_running = !pager->read_only;
+    if (!hold_latch) {
+        pthread_rwlock_unlock(&table->latch);
+    }
+
+    if (ok && result->incremental) {
+        ok = backup_write_changed(source_fd, path, changed, changed_capacity, length, &result->pages_copied);
+    } else if (ok) {
+        ok = backup_write_full(source_fd, path, length);
+        result->pages_copied = result->num_pages;
+    }
+    int saved_errno = errno;
+    if (own_source) {
+        // Closing the descriptor drops its lock, and a waiting checkpoint goes ahead
+        close(source_fd);
+    }
+    free(changed);
+
+    if (!hold_latch) {
+        pthread_rwlock_wrlock(&table->latch);
+    }
+    table->backup_running = false;
+    // A .vacuum that ran during the copy dropped the state
+    struct stat backup_stat;
+    if (ok && pager->backup != NULL && stat(path, &backup_stat) == 0) {
+        pager->backup->path = strdup(path);
+        pager->backup->device = backup_stat.st_dev;
+        pager->backup->inode = backup_stat.st_ino;
+        pager->backup->size = backup_stat.st_size;
+        pager->backup->mtime = backup_stat.st_mtim;
+    }
+    pthread_rwlock_unlock(&table->latch);
+    errno = saved_errno;
+    return ok;
+}
+
+// Whether path is the file the last backup wrote, unchanged since
+bool backup_matches(const BackupState* backup, const char* path) {
+    struct stat path_stat;
+    return backup->path != NULL && strcmp(backup->path, path) == 0 && stat(path, &path_stat) == 0 &&
+           path_stat.st_dev == backup->device && path_stat.st_ino == backup->inode &&
+           path_stat.st_size == backup->size && path_stat.st_mtim.tv_sec == backup->mtime.tv_sec &&
+           path_stat.st_mtim.tv_nsec == backup->mtime.tv_nsec;
+}
+
+// Copies length bytes at offset to the same offset of another file. copy_file_range keeps the
+// data in the kernel, and file systems that share extents (Btrfs, XFS) clone them instead of
+// copying. Where it isn't available, or can't copy between the two files, the bytes go through
+// a buffer. Stops early if the source ends first.
+bool backup_copy_range(int from_fd, int to_fd, off_t offset, off_t length) {
+    bool kernel_copy = true;
+    char* buffer = NULL;
+    while (length > 0) {
+        ssize_t copied;
+        if (kernel_copy) {
+            off_t from_offset = offset;
+            off_t to_offset = offset;
+            copied = copy_file_range(from_fd, &from_offset, to_fd, &to_offset, (size_t)length, 0);
+            if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                kernel_copy = false;
+                continue;
+            }
+        } else {
+            if (buffer == NULL) {
+                buffer = malloc(BACKUP_COPY_CHUNK);
+                if (buffer == NULL) {
+                    fprintf(stderr, "Error: malloc failed for backup\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            copied = pread(from_fd, buffer, length < BACKUP_COPY_CHUNK ? (size_t)length : BACKUP_COPY_CHUNK, offset);
+            for (ssize_t done = 0; copied > 0 && done < copied;) {
+                ssize_t written = pwrite(to_fd, buffer + done, (size_t)(copied - done), offset + done);
+                if (written == -1 && errno != EINTR) {
+                    copied = -1;
+                } else if (written > 0) {
+                    done += written;
+                }
+            }
+        }
+        if (copied == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return false;
+        }
+        if (copied == 0) {
+            break;
+        }
+        offset += copied;
+        length -= copied;
+    }
+    free(buffer);
+    return true;
+}
+
+// Backups are written to <path>-partial, which is synced and renamed over path, so a failed or
+// interrupted backup leaves the previous one in place. Returns the partial file's name.
+char* backup_partial_path(const char* path) {
+    size_t partial_length = strlen(path) + sizeof("-partial");
+    char* partial = malloc(partial_length);
+    if (partial == NULL) {
+        fprintf(stderr, "Error: malloc failed for backup\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(partial, partial_length, "%s-partial", path);
+    return partial;
+}
+
+// Syncs and closes the partial file fd and, if ok, renames it over path. Frees partial.
+bool backup_finish(int fd, char* partial, const char* path, bool ok) {
+    ok = ok && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(partial, path) == 0 && sync_directory_of(path);
+    if (!ok) {
+        int saved_errno = errno;
+        unlink(partial);
+        errno = saved_errno;
+    }
+    free(partial);
+    return ok;
+}
+
+// Copies the whole file
+bool backup_write_full(int source_fd, const char* path, off_t length) {
+    char* partial = backup_partial_path(path);
+    int fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        free(partial);
+        return false;
+    }
+    return backup_finish(fd, partial, path, backup_copy_range(source_fd, fd, 0, length));
+}
+
+// Brings the previous backup at path up to date: it is copied, which file systems that share
+// extents do without copying the data, and then the pages set in changed are copied over it from
+// the database, each run of consecutive pages at once. Only those count in pages_copied.
+bool backup_write_changed(int source_fd, const char* path, const uint64_t* changed, uint32_t changed_capacity,
+                          off_t length, uint32_t* pages_copied) {
+    int previous_fd = open(path, O_RDONLY);
+    if (previous_fd == -1) {
+        return false;
+    }
+    char* partial = backup_partial_path(path);
+    int fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        int saved_errno = errno;
+        close(previous_fd);
+        free(partial);
+        errno = saved_errno;
+        return false;
+    }
+    struct stat previous_stat;
+    bool ok = fstat(previous_fd, &previous_stat) == 0 &&
+              backup_copy_range(previous_fd, fd, 0, previous_stat.st_size < length ? previous_stat.st_size : length);
+    close(previous_fd);
+    uint32_t num_pages = (uint32_t)(length / page_size);
+    uint32_t end = num_pages < changed_capacity ? num_pages : changed_capacity;
+    for (uint32_t page_num = 0; ok && page_num < end;) {
+        if (changed[page_num / 64] == 0) {
+            page_num = (page_num / 64 + 1) * 64;
+            continue;
+        }
+        if ((changed[page_num / 64] >> (page_num % 64) & 1) == 0) {
+            page_num++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (page_num + run < end && (changed[(page_num + run) / 64] >> ((page_num + run) % 64) & 1) != 0) {
+            run++;
+        }
+        ok = backup_copy_range(source_fd, fd, (off_t)page_num * page_size, (off_t)run * page_size);
+        *pages_copied += run;
+        page_num += run;
+    }
+    return backup_finish(fd, partial, path, ok && ftruncate(fd, length) == 0);
+}
+
+void backup_state_free(BackupState* backup) {
+    if (backup != NULL) {
+        free(backup->path);
+        free(backup->changed);
+        free(backup);
+    }
+}
+
+// fsyncs the directory holding path, which makes a rename into it durable
+bool sync_directory_of(const char* path) {
+    const char* slash = strrchr(path, '/');
+    char* directory = slash == NULL ? strdup(".") : strndup(path, (size_t)(slash - path) + 1);
+    int directory_fd = directory == NULL ? -1 : open(directory, O_RDONLY);
+    free(directory);
+    if (directory_fd == -1) {
+        return false;
+    }
+    bool ok = fsync(directory_fd) == 0;
+    close(directory_fd);
+    return ok;
+}
+
+// .backup <path> [full], from the prompt or a server connection
+void backup_command(FILE* output, Table* table, char* arguments) {
+    char* path = strtok(arguments, " ");
+    char* mode = strtok(NULL, " ");
+    if (path == NULL || (mode != NULL && strcmp(mode, "full") != 0) || strtok(NULL, " ") != NULL) {
+        fprintf(output, "Usage: .backup <file> [full]\n");
+        return;
+    }
+    if (table->transaction != NULL) {
+        print_execute_result(output, EXECUTE_TRANSACTION_OPEN);
+        return;
+    }
+    // Renaming a copy over the database would leave this process writing to the old file
+    struct stat path_stat;
+    struct stat database_stat;
+    if (stat(path, &path_stat) == 0 && stat(table->pager->filename, &database_stat) == 0 &&
+        path_stat.st_dev == database_stat.st_dev && path_stat.st_ino == database_stat.st_ino) {
+        fprintf(output, "Error: '%s' is the database itself.\n", path);
+        return;
+    }
+
+    BackupResult result;
+    if (!table_backup(table, path, mode != NULL, &result)) {
+        fprintf(output, "Error: backup to '%s' failed: %s\n", path, strerror(errno));
+    } else if (result.incremental) {
+        fprintf(output, "Backed up %u changed pages of %u to '%s'.\n", result.pages_copied, result.num_pages, path);
+    } else {
+        fprintf(output, "Backed up %u pages to '%s'.\n", result.pages_copied, path);
+    }
+}
+
+/* --- Format Upgrade --- */
+
+// Whether the file is one the first version of the database wrote: a single page holding the
+// root leaf, whose cells fit it and have ascending keys, each the id of its row, and strings that
+// end inside their fields. A file in any later layout fails this, since page 0 then has no cells
+// laid out that way, except for an empty table, which reads as empty either way.
+bool table_is_baseline(Table* table) {
+    Pager* pager = table->pager;
+    if (pager->num_pages != 1 || page_size != DEFAULT_PAGE_SIZE) {
+        return false;
+    }
+    const uint8_t* node = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t num_cells;
+    memcpy(&num_cells, node + LEAF_NODE_NUM_CELLS_OFFSET, sizeof(uint32_t));
+    if (node[NODE_TYPE_OFFSET] != NODE_LEAF || node[IS_ROOT_OFFSET] != 1 || num_cells > BASELINE_LEAF_NODE_MAX_CELLS) {
+        return false;
+    }
+    uint32_t previous_key = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        const uint8_t* cell = node + BASELINE_LEAF_NODE_HEADER_SIZE + i * BASELINE_LEAF_NODE_CELL_SIZE;
+        uint32_t key;
+        uint32_t id;
+        memcpy(&key, cell, NARROW_KEY_SIZE);
+        memcpy(&id, cell + NARROW_KEY_SIZE, NARROW_KEY_SIZE);
+        if (key != id || (i > 0 && key <= previous_key) ||
+            memchr(cell + BASELINE_USERNAME_OFFSET, '\0', COLUMN_USERNAME_SIZE + 1) == NULL ||
+            memchr(cell + BASELINE_EMAIL_OFFSET, '\0', COLUMN_EMAIL_SIZE + 1) == NULL) {
+            return false;
+        }
+        previous_key = key;
+    }
+    return true;
+}
+
+// Nothing of the first version's layout survives, so its rows are read out and the file starts
+// over as a new database holding them. Page 0 becomes the header, and like every upgrade this
+// reaches the file only with db_open's checkpoint.
+void table_upgrade_baseline(Table* table) {
+    Pager* pager = table->pager;
+    Row rows[BASELINE_LEAF_NODE_MAX_CELLS];
+    const char* node = get_page(pager, HEADER_PAGE_NUM);
+    uint32_t num_rows;
+    memcpy(&num_rows, node + LEAF_NODE_NUM_CELLS_OFFSET, sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_rows; i++) {
+        const char* cell = node + BASELINE_LEAF_NODE_HEADER_SIZE + i * BASELINE_LEAF_NODE_CELL_SIZE;
+        uint32_t id;
+        memcpy(&id, cell + NARROW_KEY_SIZE, NARROW_KEY_SIZE);
+        rows[i].id = id;
+        strcpy(rows[i].username, cell + BASELINE_USERNAME_OFFSET);
+        strcpy(rows[i].email, cell + BASELINE_EMAIL_OFFSET);
+    }
+
+    memset(get_page_for_write(pager, HEADER_PAGE_NUM), 0, page_size);
+    db_header_init(&pager->header);
+    table->root_page_num = pager->header.root_page_num;
+    initialize_catalog(get_page_for_write(pager, CATALOG_PAGE_NUM));
+    void* root_node = get_page_for_write(pager, table->root_page_num);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    for (uint32_t i = 0; i < num_rows; i++) {
+        table_insert(table, &rows[i]);
+    }
+}
+
+// Refuses a file db_open can't bring up to date: one from a newer build, or one it would upgrade
+// whose catalog, trees or free list hold anything no earlier build wrote. Text and other files
+// that happen to be a whole number of pages long end up here too. Everything is checked before
+// the upgrade changes a page, as one found damaged halfway through would leave nothing to go back to.
+void table_check_format(Table* table) {
+    Pager* pager = table->pager;
+    bool has_header = pager->header.magic == DB_HEADER_MAGIC;
+    bool has_catalog = table_has_catalog(table);
+    uint32_t format = table_format(table);
+    if (format > FILE_FORMAT_VERSION) {
+        fprintf(stderr, "Error: %s has file format %u; this build reads up to format %u\n",
+                pager->filename, format, FILE_FORMAT_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    if (has_header && format == FILE_FORMAT_VERSION) {
+        return;
+    }
+
+    // Every file from before the header also predates 64-bit keys
+    Upgrade upgrade = { .pager = pager, .format = format, .index = false, .num_pages = pager->num_pages };
+    upgrade.visited = calloc((pager->num_pages + 63) / 64, sizeof(uint64_t));
+    if (upgrade.visited == NULL) {
+        fprintf(stderr, "Error: malloc failed for upgrade\n");
+        exit(EXIT_FAILURE);
+    }
+    bool valid = (has_header || format < 2) && upgrade_check_tree(&upgrade, table->root_page_num, 0);
+    if (valid && has_catalog) {
+        upgrade.visited[CATALOG_PAGE_NUM / 64] |= 1ull << (CATALOG_PAGE_NUM % 64);
+        upgrade.index = true;
+        for (Column column = COLUMN_USERNAME; valid && column <= COLUMN_EMAIL; column++) {
+            uint32_t root_page_num = *catalog_index_root(get_page(pager, CATALOG_PAGE_NUM), column);
+            valid = root_page_num == 0 ||
+                    (root_page_num > CATALOG_PAGE_NUM && root_page_num < pager->num_pages && upgrade_check_tree(&upgrade, root_page_num, 0));
+        }
+    }
+
+    // table_upgrade takes a free CATALOG_PAGE_NUM off the free list, whose head a file without the
+    // header keeps in its root's parent pointer
+    uint32_t page_num = has_header ? pager->header.free_list_head : *free_list_next(get_page(pager, table->root_page_num));
+    bool catalog_free = false;
+    while (valid && page_num != 0) {
+        valid = page_num < pager->num_pages && !(upgrade.visited[page_num / 64] & (1ull << (page_num % 64))) &&
+                get_node_type(get_page(pager, page_num)) == NODE_FREE;
+        if (valid) {
+            upgrade.visited[page_num / 64] |= 1ull << (page_num % 64);
+            catalog_free = catalog_free || page_num == CATALOG_PAGE_NUM;
+            page_num = *free_list_next(get_page(pager, page_num));
+        }
+    }
+    if (valid && !has_catalog && pager->num_pages > CATALOG_PAGE_NUM && !catalog_free) {
+        valid = get_node_type(get_page(pager, CATALOG_PAGE_NUM)) != NODE_FREE;
+    }
+    free(upgrade.visited);
+    if (!valid) {
+        fprintf(stderr, "Error: %s is not a database, or is damaged\n", pager->filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Files from before the header page have 4 KB pages and the table's root in page 0, with the
+// head of the free list in its parent pointer. The root moves to a new page at the end, its
+// children are pointed at it, and page 0 becomes the header. Like the rest of an upgrade this
+// reaches the file only with db_open's checkpoint.
+void table_add_header(Table* table) {
+    Pager* pager = table->pager;
+    DbHeader* header = &pager->header;
+    // Nodes from before FILE_FORMAT_VERSION 1 keep their children after room for more keys, and
+    // all files from before the header page predate FILE_FORMAT_VERSION 2
+    bool legacy_nodes = table_format(table) < 1;
+    void* old_root = pager_pin(pager, HEADER_PAGE_NUM);
+    db_header_init(header);
+    // A file of only a root has no catalog page yet either, and keeps page 1 free for it
+    header->root_page_num = pager->num_pages > DB_ROOT_PAGE_NUM ? pager->num_pages : DB_ROOT_PAGE_NUM;
+    header->free_list_head = *free_list_next(old_root);
+
+    pager_pin(pager, header->root_page_num);
+    void* root = get_page_for_write(pager, header->root_page_num);
+    memcpy(root, old_root, page_size);
+    *node_parent(root) = 0;
+    if (get_node_type(root) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(root);
+        uint32_t* old_children = (uint32_t*)(root + (legacy_nodes ? LEGACY_INTERNAL_NODE_CHILDREN_OFFSET : NARROW_INTERNAL_NODE_CHILDREN_OFFSET));
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            uint32_t child_page_num = i < num_keys ? old_children[i] : *internal_node_right_child(root);
+            *node_parent(get_page_for_write(pager, child_page_num)) = header->root_page_num;
+        }
+    }
+    pager_unpin(pager, header->root_page_num);
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    memset(get_page_for_write(pager, HEADER_PAGE_NUM), 0, page_size);
+}
+
+// Files written before FILE_FORMAT_VERSION 1 have no row counts in their internal nodes, which
+// hold up to LEGACY_INTERNAL_NODE_MAX_CELLS children, and those written before version 2 have
+// 32-bit keys. A writer's db_open rewrites every tree in place before it replays the log, and the
+// checkpoint after the replay makes both durable at once: a crash before it leaves the old file
+// and log as they were, for the next open to upgrade again. Every leaf gets its keys widened,
+// and is split in two if they no longer fit; each internal node has its children counted and is
+// split over as many evenly filled nodes as they need. As every page of the file is rewritten,
+// they all stay in the buffer pool until that checkpoint. A file that predates indexes also gets
+// its catalog, and the tree page in its place moves elsewhere.
+void table_upgrade(Table* table) {
+    Pager* pager = table->pager;
+    bool has_catalog = table_has_catalog(table);
+    Upgrade upgrade = { .pager = pager, .format = table_format(table), .index = false, .relocate = false };
+    if (!has_catalog && pager->num_pages > CATALOG_PAGE_NUM) {
+        void* page = get_page(pager, CATALOG_PAGE_NUM);
+        if (get_node_type(page) == NODE_FREE) {
+            // Take it off the free list, so it isn't handed out while the trees are rewritten
+            uint32_t next = *free_list_next(page);
+            if (pager->header.free_list_head == CATALOG_PAGE_NUM) {
+                pager->header.free_list_head = next;
+            } else {
+                uint32_t previous = pager->header.free_list_head;
+                while (*free_list_next(get_page(pager, previous)) != CATALOG_PAGE_NUM) {
+                    previous = *free_list_next(get_page(pager, previous));
+                }
+                *free_list_next(get_page_for_write(pager, previous)) = next;
+            }
+        } else {
+            upgrade.relocate = true;
+        }
+    }
+
+    upgrade_tree(&upgrade, table->root_page_num);
+    if (has_catalog) {
+        void* catalog = get_page(pager, CATALOG_PAGE_NUM);
+        for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+            uint32_t root_page_num = *catalog_index_root(catalog, column);
+            if (root_page_num != 0) {
+                upgrade.index = true;
+                upgrade.relocate = false;
+                upgrade_tree(&upgrade, root_page_num);
+                catalog = get_page(pager, CATALOG_PAGE_NUM);
+            }
+        }
+        *catalog_format(get_page_for_write(pager, CATALOG_PAGE_NUM)) = FILE_FORMAT_VERSION;
+    } else {
+        initialize_catalog(get_page_for_write(pager, CATALOG_PAGE_NUM));
+    }
+}
+
+// Rewrites the tree under root_page_num. A root whose children no longer fit in one node, or a
+// root leaf that had to be split, moves to a new page like a root split, and as many levels as
+// needed are added above it.
+void upgrade_tree(Upgrade* upgrade, uint32_t root_page_num) {
+    Pager* pager = upgrade->pager;
+    UpgradeList level = { 0 };
+    upgrade->previous_leaf = INVALID_PAGE_NUM;
+    upgrade_node(upgrade, root_page_num, UINT64_MAX, &level);
+
+    if (level.num_children > 1) {
+        char copy[MAX_PAGE_SIZE];
+        memcpy(copy, get_page(pager, root_page_num), page_size);
+        uint32_t left_page_num = get_unused_page_num(pager);
+        void* left = get_page_for_write(pager, left_page_num);
+        memcpy(left, copy, page_size);
+        set_node_root(left, false);
+        *node_parent(left) = root_page_num;
+        if (get_node_type(copy) == NODE_INTERNAL) {
+            uint32_t num_keys = *internal_node_num_keys(copy);
+            for (uint32_t i = 0; i <= num_keys; i++) {
+                *node_parent(get_page_for_write(pager, *internal_node_child(copy, i))) = left_page_num;
+            }
+        }
+        level.children[0].page_num = left_page_num;
+        level.children[0].parent = root_page_num;
+
+        while (level.num_children > INTERNAL_NODE_MAX_CELLS + 1) {
+            UpgradeList above = { 0 };
+            upgrade_write_nodes(pager, &level, INVALID_PAGE_NUM, INVALID_PAGE_NUM, &above);
+            free(level.children);
+            level = above;
+        }
+        UpgradeList root = { 0 };
+        upgrade_write_nodes(pager, &level, root_page_num, INVALID_PAGE_NUM, &root);
+        set_node_root(get_page_for_write(pager, root_page_num), true);
+        free(root.children);
+    }
+    free(level.children);
+}
+
+// Rewrites the subtree under page_num, whose keys are at most max_key, and adds what takes its
+// place under its parent to out: the leaf itself, or the nodes its children were spread over
+void upgrade_node(Upgrade* upgrade, uint32_t page_num, uint64_t max_key, UpgradeList* out) {
+    Pager* pager = upgrade->pager;
+    bool relocate = upgrade->relocate && page_num == CATALOG_PAGE_NUM;
+    void* node = get_page(pager, page_num);
+    if (get_node_type(node) != NODE_INTERNAL) {
+        upgrade_leaf(upgrade, page_num, relocate, max_key, out);
+        return;
+    }
+
+    char old[MAX_PAGE_SIZE];
+    memcpy(old, node, page_size);
+    uint32_t num_keys = *internal_node_num_keys(old);
+    uint32_t* old_keys = (uint32_t*)(old + NARROW_INTERNAL_NODE_KEYS_OFFSET);
+    uint32_t* old_children = (uint32_t*)(old + (upgrade->format < 1 ? LEGACY_INTERNAL_NODE_CHILDREN_OFFSET : NARROW_INTERNAL_NODE_CHILDREN_OFFSET));
+    UpgradeList children = { 0 };
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        uint32_t child_page_num = i < num_keys ? old_children[i] : *internal_node_right_child(old);
+        upgrade_node(upgrade, child_page_num, i < num_keys ? old_keys[i] : max_key, &children);
+    }
+
+    uint32_t home_page_num = relocate ? get_unused_page_num(pager) : page_num;
+    upgrade_write_nodes(pager, &children, home_page_num, relocate ? INVALID_PAGE_NUM : *node_parent(old), out);
+    if (is_node_root(old)) {
+        set_node_root(get_page_for_write(pager, home_page_num), true);
+    }
+    free(children.children);
+}
+
+// Spreads the children evenly over as few internal nodes as hold them and adds those to out. The
+// first goes on home_page_num, whose parent pointer holds home_parent, unless that is
+// INVALID_PAGE_NUM; the others get new pages. The keys all came from 32-bit ones, so every node
+// stores them narrow.
+void upgrade_write_nodes(Pager* pager, UpgradeList* list, uint32_t home_page_num, uint32_t home_parent, UpgradeList* out) {
+    uint32_t num_children = list->num_children;
+    uint32_t num_nodes = (num_children + INTERNAL_NODE_MAX_CELLS) / (INTERNAL_NODE_MAX_CELLS + 1);
+    for (uint32_t index = 0; index < num_nodes; index++) {
+        bool home = index == 0 && home_page_num != INVALID_PAGE_NUM;
+        uint32_t page_num = home ? home_page_num : get_unused_page_num(pager);
+        uint32_t first = (uint32_t)import_group_start(index, num_children, num_nodes);
+        uint32_t end = (uint32_t)import_group_start(index + 1, num_children, num_nodes);
+        UpgradeChild* children = list->children + first;
+
+        void* node = get_page_for_write(pager, page_num);
+        initialize_internal_node(node);
+        uint32_t num_keys = end - first - 1;
+        *internal_node_num_keys(node) = num_keys;
+        uint64_t keys[INTERNAL_NODE_CELLS_BOUND];
+        uint32_t rows = 0;
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            *internal_node_child(node, i) = children[i].page_num;
+            *internal_node_count(node, i) = children[i].count;
+            rows += children[i].count;
+            if (i < num_keys) {
+                keys[i] = children[i].max_key;
+            }
+        }
+        internal_node_set_keys(node, keys, num_keys);
+
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            if (children[i].parent != page_num) {
+                *node_parent(get_page_for_write(pager, children[i].page_num)) = page_num;
+                children[i].parent = page_num;
+            }
+        }
+        UpgradeChild written = { .page_num = page_num, .max_key = children[num_keys].max_key, .count = rows,
+                                 .parent = home ? home_parent : INVALID_PAGE_NUM };
+        upgrade_list_add(out, written);
+    }
+}
+
+// Rewrites a leaf of a file from before FILE_FORMAT_VERSION 2, whose keys and, in an index, whose
+// entries' row ids are 32 bits wide. A leaf that no longer fits its page is split in two at about
+// half of its bytes, the second half going to a new page, and a relocated one starts on a new
+// page too. What takes its place under its parent is added to out, like in upgrade_node.
+void upgrade_leaf(Upgrade* upgrade, uint32_t page_num, bool relocate, uint64_t max_key, UpgradeList* out) {
+    Pager* pager = upgrade->pager;
+    char old[MAX_PAGE_SIZE];
+    memcpy(old, get_page(pager, page_num), page_size);
+    uint32_t num_cells = *leaf_node_num_cells(old);
+    uint32_t* old_keys = (uint32_t*)(old + LEAF_NODE_KEYS_OFFSET);
+    uint16_t* old_slots = (uint16_t*)(old + LEAF_NODE_KEYS_OFFSET + num_cells * NARROW_KEY_SIZE);
+
+    // A row's value stays as it is; an index entry's id grows like the key
+    uint32_t growth = upgrade->index ? ID_SIZE - NARROW_KEY_SIZE : 0;
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        total_bytes += LEAF_NODE_SLOT_SIZE + old_slots[2 * i + 1] + growth;
+    }
+    uint32_t left_count = num_cells;
+    if (total_bytes > LEAF_NODE_SPACE_FOR_CELLS) {
+        uint32_t left_bytes = 0;
+        left_count = 0;
+        while (left_count < num_cells - 1) {
+            uint32_t cell_bytes = LEAF_NODE_SLOT_SIZE + old_slots[2 * left_count + 1] + growth;
+            if (left_count > 0 && 2 * (left_bytes + cell_bytes) > total_bytes + cell_bytes) {
+                break;
+            }
+            left_bytes += cell_bytes;
+            left_count++;
+        }
+    }
+
+    uint32_t num_pieces = left_count < num_cells ? 2 : 1;
+    uint32_t pieces[2];
+    pieces[0] = relocate ? get_unused_page_num(pager) : page_num;
+    pieces[1] = num_pieces == 2 ? get_unused_page_num(pager) : INVALID_PAGE_NUM;
+    if (pieces[0] != page_num && upgrade->previous_leaf != INVALID_PAGE_NUM) {
+        *leaf_node_next_leaf(get_page_for_write(pager, upgrade->previous_leaf)) = pieces[0];
+    }
+    for (uint32_t piece = 0; piece < num_pieces; piece++) {
+        uint32_t first = piece == 0 ? 0 : left_count;
+        uint32_t end = piece == 0 ? left_count : num_cells;
+        void* leaf = get_page_for_write(pager, pieces[piece]);
+        initialize_leaf_node(leaf);
+        set_node_root(leaf, is_node_root(old) && num_pieces == 1);
+        *node_parent(leaf) = *node_parent(old);
+        *leaf_node_next_leaf(leaf) = piece + 1 < num_pieces ? pieces[piece + 1] : *leaf_node_next_leaf(old);
+        *leaf_node_num_cells(leaf) = end - first;
+        for (uint32_t i = first; i < end; i++) {
+            const char* value = old + old_slots[2 * i];
+            uint32_t value_size = old_slots[2 * i + 1];
+            char entry[INDEX_ENTRY_MAX_SIZE];
+            if (upgrade->index) {
+                uint32_t narrow_id;
+                memcpy(&narrow_id, value, NARROW_KEY_SIZE);
+                uint64_t id = narrow_id;
+                memcpy(entry, &id, ID_SIZE);
+                memcpy(entry + ID_SIZE, value + NARROW_KEY_SIZE, value_size - NARROW_KEY_SIZE);
+                value = entry;
+                value_size += growth;
+            }
+            leaf_node_set_cell(leaf, i - first, old_keys[i], value, value_size);
+        }
+
+        UpgradeChild child = { .page_num = pieces[piece], .max_key = piece + 1 < num_pieces ? old_keys[end - 1] : max_key,
+                               .count = end - first, .parent = *node_parent(old) };
+        upgrade_list_add(out, child);
+    }
+    upgrade->previous_leaf = pieces[num_pieces - 1];
+}
+
+void upgrade_list_add(UpgradeList* list, UpgradeChild child) {
+    if (list->num_children == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->children = realloc(list->children, sizeof(UpgradeChild) * list->capacity);
+        if (list->children == NULL) {
+            fprintf(stderr, "Error: malloc failed for upgrade\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->children[list->num_children++] = child;
+}
+
+// Walks the tree under page_num of a file about to be upgraded, depth levels below its root, and
+// returns false at the first node upgrade_node_valid refuses or that was already reached. The
+// leaves have to be chained in key order, as upgraded leaves keep their next pointers.
+bool upgrade_check_tree(Upgrade* upgrade, uint32_t page_num, uint32_t depth) {
+    if (depth > UPGRADE_MAX_DEPTH || (upgrade->visited[page_num / 64] & (1ull << (page_num % 64)))) {
+        return false;
+    }
+    upgrade->visited[page_num / 64] |= 1ull << (page_num % 64);
+    void* node = get_page(upgrade->pager, page_num);
+    if (!upgrade_node_valid(upgrade, node, page_num, depth == 0)) {
+        return false;
+    }
+    if (depth == 0) {
+        upgrade->next_leaf = INVALID_PAGE_NUM;
+    }
+    if (get_node_type(node) != NODE_INTERNAL) {
+        bool chained = upgrade->next_leaf == INVALID_PAGE_NUM || upgrade->next_leaf == page_num;
+        upgrade->next_leaf = *leaf_node_next_leaf(node);
+        return chained && (depth > 0 || upgrade->next_leaf == 0);
+    }
+
+    // Fetching the children may evict the node
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t* children = malloc(sizeof(uint32_t) * (num_keys + 1));
+    if (children == NULL) {
+        fprintf(stderr, "Error: malloc failed for upgrade\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(children, node + (upgrade->format < 1 ? LEGACY_INTERNAL_NODE_CHILDREN_OFFSET : NARROW_INTERNAL_NODE_CHILDREN_OFFSET),
+           sizeof(uint32_t) * num_keys);
+    children[num_keys] = *internal_node_right_child(node);
+    bool valid = true;
+    for (uint32_t i = 0; valid && i <= num_keys; i++) {
+        valid = upgrade_check_tree(upgrade, children[i], depth + 1);
+    }
+    free(children);
+    return valid && (depth > 0 || upgrade->next_leaf == 0);
+}
+
+// Whether node, on page_num, is a tree node of the format the file is upgraded from: a leaf or an
+// internal node, marked as a root only if it is one, with no more cells than fit, keys that don't
+// go down (and in the table, rise), children inside the file, and values inside the page that are
+// well-formed rows or index entries. upgrade_node and upgrade_leaf take all of this on trust.
+bool upgrade_node_valid(Upgrade* upgrade, void* node, uint32_t page_num, bool root) {
+    uint8_t type = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+    uint8_t is_root = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    if ((type != NODE_INTERNAL && type != NODE_LEAF) || is_root != root) {
+        return false;
+    }
+
+    if (type == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        if (num_keys > (upgrade->format < 1 ? LEGACY_INTERNAL_NODE_MAX_CELLS : NARROW_INTERNAL_NODE_MAX_CELLS)) {
+            return false;
+        }
+        uint32_t* keys = (uint32_t*)(node + NARROW_INTERNAL_NODE_KEYS_OFFSET);
+        uint32_t* children = (uint32_t*)(node + (upgrade->format < 1 ? LEGACY_INTERNAL_NODE_CHILDREN_OFFSET : NARROW_INTERNAL_NODE_CHILDREN_OFFSET));
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            uint32_t child_page_num = i < num_keys ? children[i] : *internal_node_right_child(node);
+            if (child_page_num == HEADER_PAGE_NUM || child_page_num == page_num || child_page_num >= upgrade->num_pages ||
+                (i > 0 && i < num_keys && keys[i] < keys[i - 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells > (page_size - LEAF_NODE_KEYS_OFFSET) / (NARROW_KEY_SIZE + LEAF_NODE_VALUE_SLOT_SIZE) ||
+        *leaf_node_next_leaf(node) >= upgrade->num_pages) {
+        return false;
+    }
+    uint32_t directory_end = LEAF_NODE_KEYS_OFFSET + num_cells * (NARROW_KEY_SIZE + LEAF_NODE_VALUE_SLOT_SIZE);
+    uint32_t* keys = (uint32_t*)(node + LEAF_NODE_KEYS_OFFSET);
+    uint16_t* slots = (uint16_t*)(node + LEAF_NODE_KEYS_OFFSET + num_cells * NARROW_KEY_SIZE);
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t offset = slots[2 * i];
+        uint32_t length = slots[2 * i + 1];
+        if (offset < directory_end || offset + length > page_size ||
+            (i > 0 && (upgrade->index ? keys[i] < keys[i - 1] : keys[i] <= keys[i - 1]))) {
+            return false;
+        }
+        const uint8_t* value = (const uint8_t*)node + offset;
+        if (upgrade->index) {
+            if (length < NARROW_KEY_SIZE || length > NARROW_KEY_SIZE + COLUMN_EMAIL_SIZE) {
+                return false;
+            }
+            continue;
+        }
+        // [username length][username][email length][email], as deserialize_row_value reads it
+        if (length < ROW_VALUE_MIN_SIZE || value[0] > COLUMN_USERNAME_SIZE || value[0] + ROW_VALUE_MIN_SIZE > length) {
+            return false;
+        }
+        uint32_t email_length = value[ROW_COLUMN_LENGTH_SIZE + value[0]];
+        if (email_length > COLUMN_EMAIL_SIZE || ROW_VALUE_MIN_SIZE + value[0] + email_length != length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* --- Text Filters --- */
+
+// Whether the text (a like pattern when the statement's match is one) can be compared with the
+// statement's column: no longer than the column, not counting a pattern's % at either end
+bool match_fits(const Statement* statement, const char* text, size_t length) {
+    if (statement->match_like && length > 0 && text[0] == '%') {
+        text++;
+        length--;
+    }
+    if (statement->match_like && length > 0 && text[length - 1] == '%') {
+        length--;
+    }
+    return length <= column_size(statement->match_column);
+}
+
+// Compiles the statement's text predicate, taking the % off either end of a like pattern
+void text_filter_init(TextFilter* filter, const Statement* statement) {
+    const char* text = statement->match_value;
+    size_t length = strlen(text);
+    bool leading = false;
+    bool trailing = false;
+    if (statement->match_like && length > 0 && text[0] == '%') {
+        leading = true;
+        text++;
+        length--;
+    }
+    if (statement->match_like && length > 0 && text[length - 1] == '%') {
+        trailing = true;
+        length--;
+    }
+
+    filter->column = statement->match_column;
+    filter->op = leading && trailing ? MATCH_CONTAINS : leading ? MATCH_SUFFIX : trailing ? MATCH_PREFIX : MATCH_EQUAL;
+    filter->length = (uint32_t)length;
+    memset(filter->text, 0, sizeof(filter->text));
+    memcpy(filter->text, text, length);
+    memset(filter->first, length > 0 ? filter->text[0] : 0, sizeof(filter->first));
+    memset(filter->last, length > 0 ? filter->text[length - 1] : 0, sizeof(filter->last));
+}
+
+#if TEXT_VECTOR_SIZE > 0
+// Bit i is set where a[i] == b[i], over one vector of TEXT_VECTOR_SIZE bytes
+uint32_t text_vector_equal_mask(const uint8_t* a, const uint8_t* b) {
+#if defined(__AVX2__)
+    __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+    return (uint32_t)_mm256_movemask_epi8(equal);
+#elif defined(__SSE2__)
+    __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+    return (uint32_t)_mm_movemask_epi8(equal);
+#else
+    // NEON has no movemask: each byte keeps only its own bit, then the halves are summed
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t equal = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(equal)) | ((uint32_t)vaddv_u8(vget_high_u8(equal)) << 8);
+#endif
+}
+#endif
+
+// Whether the length bytes at text equal those at pattern, a vector at a time. pattern may be read a
+// vector past length; text is only read in vectors while they end at or before limit, its page's end.
+bool text_equal(const uint8_t* text, const uint8_t* pattern, uint32_t length, const uint8_t* limit) {
+    uint32_t i = 0;
+#if TEXT_VECTOR_SIZE > 0
+    while (i < length && text + i + TEXT_VECTOR_SIZE <= limit) {
+        uint32_t differ = ~text_vector_equal_mask(text + i, pattern + i) & TEXT_VECTOR_ALL;
+        if (length - i <= TEXT_VECTOR_SIZE) {
+            return (differ & (uint32_t)((1ull << (length - i)) - 1)) == 0;
+        }
+        if (differ != 0) {
+            return false;
+        }
+        i += TEXT_VECTOR_SIZE;
+    }
+#else
+    (void)limit;  // Only vector reads need to know where the page ends
+#endif
+    return i >= length || memcmp(text + i, pattern + i, length - i) == 0;
+}
+
+// Whether the filter's text occurs in text. Each vector step tests TEXT_VECTOR_SIZE start positions
+// at once against the first and last byte of the text sought, and only positions that pass both are
+// compared in full.
+bool text_contains(const uint8_t* text, uint32_t text_length, const TextFilter* filter, const uint8_t* limit) {
+    uint32_t length = filter->length;
+    if (length == 0) {
+        return true;
+    }
+    if (text_length < length) {
+        return false;
+    }
+    uint32_t last_start = text_length - length;
+    uint32_t i = 0;
+#if TEXT_VECTOR_SIZE > 0
+    for (; i <= last_start && text + i + length - 1 + TEXT_VECTOR_SIZE <= limit; i += TEXT_VECTOR_SIZE) {
+        uint32_t candidates = text_vector_equal_mask(text + i, filter->first) &
+                              text_vector_equal_mask(text + i + length - 1, filter->last);
+        if (last_start - i + 1 < TEXT_VECTOR_SIZE) {
+            candidates &= (1u << (last_start - i + 1)) - 1;
+        }
+        while (candidates != 0) {
+            uint32_t start = i + (uint32_t)__builtin_ctz(candidates);
+            if (length <= 2 || memcmp(text + start + 1, filter->text + 1, length - 2) == 0) {
+                return true;
+            }
+            candidates &= candidates - 1;
+        }
+    }
+#else
+    (void)limit;
+#endif
+    for (; i <= last_start; i++) {
+        if (text[i] == filter->text[0] && memcmp(text + i, filter->text, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a serialized row value passes the filter; limit is the end of the page holding it
+bool text_filter_match(const TextFilter* filter, const void* value, const uint8_t* limit) {
+    const uint8_t* text;
+    uint32_t text_length = value_column(value, filter->column, &text);
+    uint32_t length = filter->length;
+    switch (filter->op) {
+        case (MATCH_EQUAL):
+            return text_length == length && text_equal(text, filter->text, length, limit);
+        case (MATCH_PREFIX):
+            return text_length >= length && text_equal(text, filter->text, length, limit);
+        case (MATCH_SUFFIX):
+            return text_length >= length && text_equal(text + text_length - length, filter->text, length, limit);
+        case (MATCH_CONTAINS):
+            return text_contains(text, text_length, filter, limit);
+    }
+    return false;
+}
+
+// Checks the cells [first_cell, end_cell) of a leaf against the filter where their values lie in the
+// page, writing the numbers of those that pass to matches; returns how many did
+uint32_t leaf_node_filter(void* node, uint32_t first_cell, uint32_t end_cell, const TextFilter* filter, uint16_t* matches) {
+    const uint8_t* limit = (const uint8_t*)node + page_size;
+    uint32_t num_matches = 0;
+    for (uint32_t cell_num = first_cell; cell_num < end_cell; cell_num++) {
+        matches[num_matches] = (uint16_t)cell_num;
+        num_matches += text_filter_match(filter, leaf_node_value(node, cell_num), limit);
+    }
+    return num_matches;
+}
+
+/* --- Secondary Indexes --- */
+
+// FNV-1a over the column text, the key an index entry is filed under
+uint32_t index_hash(const void* text, uint32_t length) {
+    const uint8_t* bytes = text;
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Where the catalog records the root of the index on column
+uint32_t* catalog_index_root(void* catalog, Column column) {
+    return catalog + CATALOG_INDEX_ROOTS_OFFSET + (column - 1) * sizeof(uint32_t);
+}
+
+// The FILE_FORMAT_VERSION the file's pages are in
+uint32_t* catalog_format(void* catalog) {
+    return catalog + CATALOG_FORMAT_OFFSET;
+}
+
+void initialize_catalog(void* node) {
+    memset(node, 0, page_size);
+    set_node_type(node, NODE_CATALOG);
+    set_node_root(node, false);
+    *catalog_format(node) = FILE_FORMAT_VERSION;
+}
+
+// Format 0 for a file that predates the catalog
+uint32_t table_format(Table* table) {
+    if (!table_has_catalog(table)) {
+        return 0;
+    }
+    uint32_t format = *catalog_format(pager_pin(table->pager, CATALOG_PAGE_NUM));
+    pager_unpin(table->pager, CATALOG_PAGE_NUM);
+    return format;
+}
+
+// Files written before indexes existed keep a tree page at CATALOG_PAGE_NUM. The page count is
+// checked first, since asking for a page past the end of the file would add it. Concurrent
+// selects read the catalog too, so it is pinned: another reader's miss could reuse its frame.
+bool table_has_catalog(Table* table) {
+    Pager* pager = table->pager;
+    if (pager->num_pages <= CATALOG_PAGE_NUM) {
+        return false;
+    }
+    bool has_catalog = get_node_type(pager_pin(pager, CATALOG_PAGE_NUM)) == NODE_CATALOG;
+    pager_unpin(pager, CATALOG_PAGE_NUM);
+    return has_catalog;
+}
+
+// Fills in index as the tree of the index on column, returns false if there is none. The catalog
+// is read every time, so a reader always sees the indexes of the snapshot it is reading.
+bool table_index(Table* table, Column column, Table* index) {
+    Pager* pager = table->pager;
+    if (pager->num_pages <= CATALOG_PAGE_NUM) {
+        return false;
+    }
+    void* catalog = pager_pin(pager, CATALOG_PAGE_NUM);
+    uint32_t root_page_num = get_node_type(catalog) == NODE_CATALOG ? *catalog_index_root(catalog, column) : 0;
+    pager_unpin(pager, CATALOG_PAGE_NUM);
+    if (root_page_num == 0) {
+        return false;
+    }
+    *index = (Table){ .pager = pager, .root_page_num = root_page_num, .append_page_num = INVALID_PAGE_NUM };
+    return true;
+}
+
+bool table_has_indexes(Table* table) {
+    Table index;
+    return table_index(table, COLUMN_USERNAME, &index) || table_index(table, COLUMN_EMAIL, &index);
+}
+
+// Adds the row's entries to every index of the table, or with remove takes them out
+void table_index_row(Table* table, Row* row, bool remove) {
+    for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+        Table index;
+        if (!table_index(table, column, &index)) {
+            continue;
+        }
+        if (remove) {
+            index_delete(&index, column, row);
+        } else {
+            index_insert(&index, column, row);
+        }
+    }
+}
+
+int compare_index_build_entries(const void* a, const void* b) {
+    const IndexBuildEntry* entry_a = a;
+    const IndexBuildEntry* entry_b = b;
+    if (entry_a->hash != entry_b->hash) {
+        return (entry_a->hash > entry_b->hash) - (entry_a->hash < entry_b->hash);
+    }
+    uint64_t id_a;
+    uint64_t id_b;
+    memcpy(&id_a, entry_a->entry, ID_SIZE);
+    memcpy(&id_b, entry_b->entry, ID_SIZE);
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+// Builds the index on column from the rows already in the table and records its root in the
+// catalog. The entries are copied out of the table a batch at a time, as much as the buffer pool
+// holds, and each batch is sorted before it goes in: it then passes over the index leaves in
+// order, dirtying each at most once, and no leaf of the table stays pinned while the index grows.
+ExecuteResult table_create_index(Table* table, Column column) {
+    Pager* pager = table->pager;
+    if (!table_has_catalog(table)) {
+        return EXECUTE_NO_CATALOG;
+    }
+    Table index;
+    if (table_index(table, column, &index)) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    index = (Table){ .pager = pager, .root_page_num = get_unused_page_num(pager), .append_page_num = INVALID_PAGE_NUM };
+    void* root = get_page_for_write(pager, index.root_page_num);
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    *node_parent(root) = 0;
+
+    size_t sort_memory = (size_t)pager->frame_budget * page_size;
+    if (sort_memory < IMPORT_MIN_SORT_MEMORY) {
+        sort_memory = IMPORT_MIN_SORT_MEMORY;
+    }
+    uint32_t capacity = (uint32_t)(sort_memory / (sizeof(IndexBuildEntry) + INDEX_ENTRY_MAX_SIZE));
+    char* entries = malloc((size_t)capacity * INDEX_ENTRY_MAX_SIZE);
+    IndexBuildEntry* batch = malloc(sizeof(IndexBuildEntry) * capacity);
+    if (entries == NULL || batch == NULL) {
+        fprintf(stderr, "Error: malloc failed for index build\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t key = 0;
+    bool more = true;
+    while (more) {
+        Cursor cursor;
+        table_seek(table, key, &cursor);
+        uint32_t num_entries = 0;
+        uint64_t last_id = 0;
+        while (!cursor.end_of_table && num_entries < capacity) {
+            char* entry = entries + (size_t)num_entries * INDEX_ENTRY_MAX_SIZE;
+            const uint8_t* text;
+            uint32_t length = value_column(cursor_value(&cursor), column, &text);
+            last_id = cursor_key(&cursor);
+            memcpy(entry, &last_id, ID_SIZE);
+            memcpy(entry + ID_SIZE, text, length);
+            batch[num_entries++] = (IndexBuildEntry){ .hash = index_hash(text, length), .size = ID_SIZE + length, .entry = entry };
+            cursor_advance(&cursor);
+        }
+        more = !cursor.end_of_table && last_id < UINT64_MAX;
+        key = last_id + 1;
+        cursor_close(&cursor);
+
+        qsort(batch, num_entries, sizeof(IndexBuildEntry), compare_index_build_entries);
+        for (uint32_t i = 0; i < num_entries; i++) {
+            index_insert_entry(&index, batch[i].hash, batch[i].entry, batch[i].size);
+            if (table_checkpoint_due(table)) {
+                table_checkpoint(table);
+            }
+        }
+    }
+    free(batch);
+    free(entries);
+
+    // Until now the new pages were unreachable; a crash leaves them for .vacuum to drop
+    *catalog_index_root(get_page_for_write(pager, CATALOG_PAGE_NUM), column) = index.root_page_num;
+    table_checkpoint(table);
+    return EXECUTE_SUCCESS;
+}
+
+const char* row_column(Row* row, Column column) {
+    return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+// Finds the column in a serialized row value; returns its length and points text at it
+uint32_t value_column(const void* value, Column column, const uint8_t** text) {
+    const uint8_t* bytes = value;
+    if (column == COLUMN_EMAIL) {
+        bytes += ROW_COLUMN_LENGTH_SIZE + bytes[0];
+    }
+    *text = bytes + ROW_COLUMN_LENGTH_SIZE;
+    return bytes[0];
+}
+
+// The row id an index entry points at; the column text follows it
+uint64_t index_entry_id(void* node, uint32_t cell_num) {
+    uint64_t id;
+    memcpy(&id, leaf_node_value(node, cell_num), ID_SIZE);
+    return id;
+}
+
+// Positions a cursor (pinning its leaf) on the entry (hash, id) of index, or where it would go.
+// The descent ends on the leftmost leaf that can hold hash; entries with that hash may go on over
+// the next leaves, and a leaf whose entries all sort below (hash, id) is skipped without a scan.
+void index_seek(Table* index, uint32_t hash, uint64_t id, Cursor* cursor) {
+    Pager* pager = index->pager;
+    table_find(index, hash, cursor);
+    void* node = get_page(pager, cursor->page_num);
+    while (true) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (num_cells > 0 && *leaf_node_key(node, num_cells - 1) == hash && index_entry_id(node, num_cells - 1) < id) {
+            cursor->cell_num = num_cells;
+        } else {
+            while (cursor->cell_num < num_cells && *leaf_node_key(node, cursor->cell_num) == hash &&
+                   index_entry_id(node, cursor->cell_num) < id) {
+                cursor->cell_num++;
+            }
+            if (cursor->cell_num < num_cells) {
+                return;
+            }
+        }
+
+        // Past the end of this leaf: the position is in the next one only if it starts at or below (hash, id)
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            return;
+        }
+        void* next = pager_pin(pager, next_page_num);
+        if (*leaf_node_num_cells(next) == 0 || *leaf_node_key(next, 0) != hash || index_entry_id(next, 0) > id) {
+            pager_unpin(pager, next_page_num);
+            return;
+        }
+        pager_unpin(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        node = get_page(pager, next_page_num);
+    }
+}
+
+void index_insert(Table* index, Column column, Row* row) {
+    const char* text = row_column(row, column);
+    uint32_t length = (uint32_t)strlen(text);
+    char entry[INDEX_ENTRY_MAX_SIZE];
+    memcpy(entry, &row->id, ID_SIZE);
+    memcpy(entry + ID_SIZE, text, length);
+    index_insert_entry(index, index_hash(text, length), entry, ID_SIZE + length);
+}
+
+// Places an entry, [row id][column text], under hash
+void index_insert_entry(Table* index, uint32_t hash, const char* entry, uint32_t size) {
+    uint64_t id;
+    memcpy(&id, entry, ID_SIZE);
+    Cursor cursor;
+    index_seek(index, hash, id, &cursor);
+    leaf_node_insert_cell(&cursor, hash, entry, size);
+    cursor_close(&cursor);
+}
+
+// Takes the row's entry out of index, rebalancing its leaf like a delete from the table
+void index_delete(Table* index, Column column, Row* row) {
+    Pager* pager = index->pager;
+    const char* text = row_column(row, column);
+    uint32_t hash = index_hash(text, (uint32_t)strlen(text));
+    Cursor cursor;
+    index_seek(index, hash, row->id, &cursor);
+
+    void* node = get_page(pager, cursor.page_num);
+    bool found = cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor.cell_num) == hash &&
+                 index_entry_id(node, cursor.cell_num) == row->id;
+    if (found) {
+        leaf_node_remove_cells(get_page_for_write(pager, cursor.page_num), cursor.cell_num, 1);
+        tree_add_count(pager, cursor.page_num, hash, -1);
+    }
+    uint32_t page_num = cursor.page_num;
+    cursor_close(&cursor);
+    if (found) {
+        leaf_node_rebalance(index, page_num);
+    }
+}
+
+/* --- Cursor Management --- */
+
+// The serialized value (everything but the id) of the row under the cursor, inside its pinned leaf
+void* cursor_value(Cursor* cursor) {
+    void* page = get_page(cursor->table->pager, cursor->page_num);
+    return leaf_node_value(page, cursor->cell_num);
+}
+
+uint64_t cursor_key(Cursor* cursor) {
+    void* page = get_page(cursor->table->pager, cursor->page_num);
+    return *leaf_node_key(page, cursor->cell_num);
+}
+
+// Moves to the next cell, hopping to the next leaf through its sibling pointer at the end of a node
+void cursor_advance(Cursor* cursor) {
+    cursor->cell_num += 1;
+    cursor_skip_exhausted_leaves(cursor);
+}
+
+// If the cursor sits past the last cell of its leaf, moves it to the first cell of the next
+// non-empty leaf, or marks the end of the table
+void cursor_skip_exhausted_leaves(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    void* node = get_page(pager, cursor->page_num);
+
+    while (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            // This was the rightmost leaf
+            cursor->end_of_table = true;
+            return;
+        }
+
+        // The cursor's pin moves along with it
+        pager_pin(pager, next_page_num);
+        pager_unpin(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        node = get_page(pager, next_page_num);
+        cursor_prefetch_leaves(cursor, node);
+    }
+}
+
+// Reads ahead of a scan entering node. Plain I/O hints at the next leaf; the io_uring backend
+// submits reads for the next IO_RING_PREFETCH_LEAVES leaves under the same parent in one batch.
+void cursor_prefetch_leaves(Cursor* cursor, void* node) {
+    Pager* pager = cursor->table->pager;
+    uint32_t pages[IO_RING_PREFETCH_LEAVES + 1];
+    uint32_t num_pages = 0;
+    pages[num_pages++] = *leaf_node_next_leaf(node);
+    if (pager->ring == NULL || is_node_root(node) || *leaf_node_num_cells(node) == 0) {
+        pager_prefetch_batch(pager, pages, num_pages);
+        return;
+    }
+
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = pager_pin(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t child = internal_node_find_child(parent, *leaf_node_key(node, *leaf_node_num_cells(node) - 1));
+    for (uint32_t i = child + 2; i <= num_keys && num_pages <= IO_RING_PREFETCH_LEAVES; i++) {
+        pages[num_pages++] = *internal_node_child(parent, i);
+    }
+    pager_unpin(pager, parent_page_num);
+    pager_prefetch_batch(pager, pages, num_pages);
+}
+
+// Positions a cursor on the first row with a key >= key, ready for cursor_advance
+void table_seek(Table* table, uint64_t key, Cursor* cursor) {
+    // The cursor keeps its page pinned so a scan never reads an evicted frame
+    table_find(table, key, cursor);
+
+    // The key may sort after every cell of the leaf it would be inserted into
+    cursor_skip_exhausted_leaves(cursor);
+    if (!cursor->end_of_table) {
+        cursor_prefetch_leaves(cursor, get_page(table->pager, cursor->page_num));
+    }
+}
+
+// Positions a cursor like table_seek on the row with rank rows before it in key order, or at the
+// end of the table if there are no more. Each level's counts say which child holds that row.
+void table_seek_rank(Table* table, uint64_t rank, Cursor* cursor) {
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void* node = pager_pin(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t* counts = internal_node_counts(node);
+        uint32_t child_index = 0;
+        while (child_index < num_keys && rank >= counts[child_index]) {
+            rank -= counts[child_index];
+            child_index++;
+        }
+        uint32_t child_page_num = *internal_node_child(node, child_index);
+        node = pager_pin(pager, child_page_num);
+        pager_unpin(pager, page_num);
+        page_num = child_page_num;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = rank < num_cells ? (uint32_t)rank : num_cells;
+    cursor->end_of_table = false;
+    cursor_skip_exhausted_leaves(cursor);
+    if (!cursor->end_of_table) {
+        cursor_prefetch_leaves(cursor, get_page(pager, cursor->page_num));
+    }
+}
+
+// Number of rows with an id below key: on the way down to the leaf that covers key, the rows of
+// every child left of the one taken, then the leaf's cells below key
+uint64_t table_count_below(Table* table, uint64_t key) {
+    Pager* pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void* node = pager_pin(pager, page_num);
+    uint64_t below = 0;
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_index = internal_node_find_child(node, key);
+        uint32_t* counts = internal_node_counts(node);
+        for (uint32_t i = 0; i < child_index; i++) {
+            below += counts[i];
+        }
+        uint32_t child_page_num = *internal_node_child(node, child_index);
+        node = pager_pin(pager, child_page_num);
+        pager_unpin(pager, page_num);
+        page_num = child_page_num;
+    }
+    below += leaf_node_find_cell(node, key);
+    pager_unpin(pager, page_num);
+    return below;
+}
+
+// Rows with id_min <= id <= id_max, from two descents whatever the size of the range
+uint64_t table_count_range(Table* table, uint64_t id_min, uint64_t id_max) {
+    if (id_min > id_max) {
+        return 0;
+    }
+    uint64_t end;
+    if (id_max == UINT64_MAX) {
+        Pager* pager = table->pager;
+        end = node_row_count(pager_pin(pager, table->root_page_num));
+        pager_unpin(pager, table->root_page_num);
+    } else {
+        end = table_count_below(table, id_max + 1);
+    }
+    return end - table_count_below(table, id_min);
+}
+
+// Releases the cursor's pin on its page. Cursors live on the caller's stack.
+void cursor_close(Cursor* cursor) {
+    pager_unpin(cursor->table->pager, cursor->page_num);
+}
+
+/* --- Leaf Node Management --- */
+
+uint32_t* leaf_node_num_cells(void* node) {
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+// Page number of the leaf to the right, 0 for the rightmost leaf (page 0 is always the header)
+uint32_t* leaf_node_next_leaf(void* node) {
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+// Offset of the lowest value in the heap; the free space lies between the slots and here. The end
+// of a 64 KB page is stored as 0, which the 16-bit arithmetic placing values below it wraps past.
+uint16_t* leaf_node_heap_start(void* node) {
+    return node + LEAF_NODE_HEAP_START_OFFSET;
+}
+
+uint64_t* leaf_node_keys(void* node) {
+    return node + LEAF_NODE_KEYS_OFFSET;
+}
+
+uint64_t* leaf_node_key(void* node, uint32_t cell_num) {
+    return leaf_node_keys(node) + cell_num;
+}
+
+// The value slots follow the last key, so they move whenever num_cells changes
+void* leaf_node_value_slot(void* node, uint32_t cell_num) {
+    return node + LEAF_NODE_KEYS_OFFSET + *leaf_node_num_cells(node) * LEAF_NODE_KEY_SIZE +
+           cell_num * LEAF_NODE_VALUE_SLOT_SIZE;
+}
+
+uint16_t* leaf_node_value_offset(void* node, uint32_t cell_num) {
+    return leaf_node_value_slot(node, cell_num) + LEAF_NODE_VALUE_OFFSET_OFFSET;
+}
+
+uint16_t* leaf_node_value_length(void* node, uint32_t cell_num) {
+    return leaf_node_value_slot(node, cell_num) + LEAF_NODE_VALUE_LENGTH_OFFSET;
+}
+
+// Changes num_cells, moving the value slots of the first cells to follow the resized key array.
+// Keys and slots past the old count are left for the caller to fill in.
+void leaf_node_set_num_cells(void* node, uint32_t num_cells) {
+    uint32_t* current = leaf_node_num_cells(node);
+    uint32_t kept = num_cells < *current ? num_cells : *current;
+    void* old_slots = leaf_node_value_slot(node, 0);
+    *current = num_cells;
+    memmove(leaf_node_value_slot(node, 0), old_slots, kept * LEAF_NODE_VALUE_SLOT_SIZE);
+}
+
+// Opens up cell_num by shifting the keys and value slots at and after it one place right
+void leaf_node_open_cell(void* node, uint32_t cell_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    leaf_node_set_num_cells(node, num_cells + 1);
+    uint32_t moved = num_cells - cell_num;
+    memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num), moved * LEAF_NODE_KEY_SIZE);
+    memmove(leaf_node_value_slot(node, cell_num + 1), leaf_node_value_slot(node, cell_num), moved * LEAF_NODE_VALUE_SLOT_SIZE);
+}
+
+void* leaf_node_value(void* node, uint32_t cell_num) {
+    return node + *leaf_node_value_offset(node, cell_num);
+}
+
+// Bytes left for new slots and values
+uint32_t leaf_node_free_space(void* node) {
+    uint32_t heap_start = *leaf_node_heap_start(node) == 0 ? MAX_PAGE_SIZE : *leaf_node_heap_start(node);
+    return heap_start - (LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE);
+}
+
+// Fills in cell cell_num (which must be below num_cells) with key and a copy of value placed at
+// the top of the heap. Doesn't move other cells; the caller must have checked the free space.
+void leaf_node_set_cell(void* node, uint32_t cell_num, uint64_t key, const void* value, uint32_t value_size) {
+    uint16_t* heap_start = leaf_node_heap_start(node);
+    *heap_start -= value_size;
+    memcpy(node + *heap_start, value, value_size);
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_value_offset(node, cell_num) = *heap_start;
+    *leaf_node_value_length(node, cell_num) = value_size;
+}
+
+// Like leaf_node_set_cell, serializing the row straight into the heap
+void leaf_node_set_row(void* node, uint32_t cell_num, uint64_t key, Row* row) {
+    uint16_t* heap_start = leaf_node_heap_start(node);
+    uint32_t value_size = row_value_size(row);
+    *heap_start -= value_size;
+    serialize_row_value(row, node + *heap_start);
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_value_offset(node, cell_num) = *heap_start;
+    *leaf_node_value_length(node, cell_num) = value_size;
+}
+
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* row) {
+    row->id = *leaf_node_key(node, cell_num);
+    deserialize_row_value(leaf_node_value(node, cell_num), row);
+}
+
+// Removes count cells from first_cell on. The remaining values are packed back against the end
+// of the page, so the heap never has holes and all free space stays between slots and heap.
+void leaf_node_remove_cells(void* node, uint32_t first_cell, uint32_t count) {
+    char old_copy[MAX_PAGE_SIZE];
+    memcpy(old_copy, node, page_size);
+    uint32_t num_cells = *leaf_node_num_cells(old_copy) - count;
+
+    *leaf_node_num_cells(node) = num_cells;
+    *leaf_node_heap_start(node) = (uint16_t)page_size;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t old_cell = i < first_cell ? i : i + count;
+        leaf_node_set_cell(node, i, *leaf_node_key(old_copy, old_cell), leaf_node_value(old_copy, old_cell),
+                           *leaf_node_value_length(old_copy, old_cell));
+    }
+}
+
+// INTERNAL_NODE_KEY_SIZE for offsets from the key base, INTERNAL_NODE_WIDE_KEY_SIZE for whole keys
+uint8_t* internal_node_key_width(void* node) {
+    return node + INTERNAL_NODE_KEY_WIDTH_OFFSET;
+}
+
+uint64_t* internal_node_key_base(void* node) {
+    return node + INTERNAL_NODE_KEY_BASE_OFFSET;
+}
+
+bool internal_node_is_wide(void* node) {
+    return *internal_node_key_width(node) == INTERNAL_NODE_WIDE_KEY_SIZE;
+}
+
+// The stored keys: uint32_t offsets, or uint64_t keys in a wide node
+void* internal_node_keys(void* node){
+    return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+// Children below num_keys; the last child lives in the right child field
+uint32_t* internal_node_children(void* node){
+    return node + INTERNAL_NODE_CHILDREN_OFFSET;
+}
+uint64_t internal_node_key(void* node, uint32_t key_num){
+    if (internal_node_is_wide(node)) {
+        return ((uint64_t*)internal_node_keys(node))[key_num];
+    }
+    return *internal_node_key_base(node) + ((uint32_t*)internal_node_keys(node))[key_num];
+}
+
+// Whether key can be stored as it is, without changing how the node stores its keys
+bool internal_node_key_fits(void* node, uint64_t key) {
+    uint64_t base = *internal_node_key_base(node);
+    return internal_node_is_wide(node) || (key >= base && key - base <= UINT32_MAX);
+}
+
+// Overwrites key key_num with a key that internal_node_key_fits
+void internal_node_store_key(void* node, uint32_t key_num, uint64_t key) {
+    if (internal_node_is_wide(node)) {
+        ((uint64_t*)internal_node_keys(node))[key_num] = key;
+    } else {
+        ((uint32_t*)internal_node_keys(node))[key_num] = (uint32_t)(key - *internal_node_key_base(node));
+    }
+}
+
+// Most keys a node can hold when they are the sorted keys[0, num_keys): all it has room for if
+// they lie within 2^32 of each other, half as many if it has to store them whole
+uint32_t internal_node_capacity(const uint64_t* keys, uint32_t num_keys) {
+    return num_keys == 0 || keys[num_keys - 1] - keys[0] <= UINT32_MAX ? INTERNAL_NODE_MAX_CELLS : INTERNAL_NODE_WIDE_MAX_CELLS;
+}
+
+bool internal_node_keys_fit(const uint64_t* keys, uint32_t num_keys) {
+    return num_keys <= internal_node_capacity(keys, num_keys);
+}
+
+// Stores the sorted keys[0, num_keys), which must fit, as offsets from the first if they can be.
+// num_keys itself is left to the caller, as the children and counts depend on it too.
+void internal_node_set_keys(void* node, const uint64_t* keys, uint32_t num_keys) {
+    bool wide = num_keys > 0 && keys[num_keys - 1] - keys[0] > UINT32_MAX;
+    *internal_node_key_width(node) = wide ? INTERNAL_NODE_WIDE_KEY_SIZE : INTERNAL_NODE_KEY_SIZE;
+    *internal_node_key_base(node) = num_keys > 0 && !wide ? keys[0] : 0;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        internal_node_store_key(node, i, keys[i]);
+    }
+}
+
+// Copies the node's keys out in full, the inverse of internal_node_set_keys
+void internal_node_get_keys(void* node, uint64_t* keys) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = internal_node_key(node, i);
+    }
+}
+
+// Replaces key key_num, re-encoding the others if the new one falls outside their base. Returns
+// false, leaving the node as it was, if the keys would then no longer fit.
+bool internal_node_replace_key(void* node, uint32_t key_num, uint64_t key) {
+    if (internal_node_key_fits(node, key)) {
+        internal_node_store_key(node, key_num, key);
+        return true;
+    }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint64_t keys[INTERNAL_NODE_CELLS_BOUND];
+    internal_node_get_keys(node, keys);
+    keys[key_num] = key;
+    if (!internal_node_keys_fit(keys, num_keys)) {
+        return false;
+    }
+    internal_node_set_keys(node, keys, num_keys);
+    return true;
+}
+// Rows under each child, in child order; the right child's is at INTERNAL_NODE_MAX_CELLS
+uint32_t* internal_node_counts(void* node){
+    return node + INTERNAL_NODE_COUNTS_OFFSET;
+}
+NodeType get_node_type(void* node) {
+    uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+void set_node_type(void* node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+bool is_node_root(void* node) {
+    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+void set_node_root(void* node, bool is_root) {
+    uint8_t value = is_root;
+    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+uint32_t* node_parent(void* node) {
+    return node + PARENT_POINTER_OFFSET;
+}
+
+void initialize_leaf_node(void* node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+    *leaf_node_heap_start(node) = (uint16_t)page_size;
+}
+
+void initialize_internal_node(void* node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+    *internal_node_key_width(node) = INTERNAL_NODE_KEY_SIZE;
+    *internal_node_key_base(node) = 0;
+}
+
+// Largest key stored under this node, found by following right children down to a leaf
+uint64_t get_node_max_key(Pager* pager, void* node) {
+    while (get_node_type(node) == NODE_INTERNAL) {
+        node = get_page(pager, *internal_node_right_child(node));
+    }
+    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+}
+
+void leaf_node_insert(Cursor* cursor, uint64_t key, Row* value) {
+    void* node = get_page_for_write(cursor->table->pager, cursor->page_num);
+
+    if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + row_value_size(value)) {
+        char serialized[ROW_VALUE_MAX_SIZE];
+        uint32_t value_size = serialize_row_value(value, serialized);
+        leaf_node_split_and_insert(cursor, key, serialized, value_size);
+        return;
+    }
+
+    // Make room for the new key and slot; the value itself goes at the top of the heap
+    leaf_node_open_cell(node, cursor->cell_num);
+    leaf_node_set_row(node, cursor->cell_num, key, value);
+    tree_add_count(cursor->table->pager, cursor->page_num, key, 1);
+}
+
+// Like leaf_node_insert with a value that is already serialized, such as an index entry
+void leaf_node_insert_cell(Cursor* cursor, uint64_t key, const void* value, uint32_t value_size) {
+    void* node = get_page_for_write(cursor->table->pager, cursor->page_num);
+
+    if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + value_size) {
+        leaf_node_split_and_insert(cursor, key, value, value_size);
+        return;
+    }
+    leaf_node_open_cell(node, cursor->cell_num);
+    leaf_node_set_cell(node, cursor->cell_num, key, value, value_size);
+    tree_add_count(cursor->table->pager, cursor->page_num, key, 1);
+}
+
+// Fills in a cursor (pinning its leaf) at the position of key, or where it would be inserted
+void table_find(Table* table, uint64_t key, Cursor* cursor){
+    internal_node_find(table, table->root_page_num, key, cursor);
+}
+
+// The append fast path: when key sorts after every key in the table, positions a cursor (pinning
+// its leaf) past the last cell of the rightmost leaf without descending from the root. Returns
+// false when the rightmost leaf isn't known or key belongs further left; table_find must run then.
+// The remembered page is still a leaf of this tree (deletes forget it), so a leaf without a right
+// sibling is the rightmost one.
+bool table_find_append(Table* table, uint64_t key, Cursor* cursor) {
+    uint32_t page_num = table->append_page_num;
+    if (page_num == INVALID_PAGE_NUM) {
+        return false;
+    }
+    Pager* pager = table->pager;
+    void* node = pager_pin(pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0 || num_cells == 0 ||
+        *leaf_node_key(node, num_cells - 1) >= key) {
+        pager_unpin(pager, page_num);
+        return false;
+    }
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = num_cells;
+    cursor->end_of_table = false;
+    return true;
+}
+
+// Called with the leaf an insert went into. If that was the rightmost leaf it is remembered for
+// table_find_append, or the new leaf to its right if the insert split it.
+void table_remember_append(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    void* node = get_page(pager, page_num);
+    if (get_node_type(node) != NODE_LEAF) {
+        // The root leaf was split and is an internal node now
+        return;
+    }
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num != 0) {
+        page_num = next_page_num;
+        node = get_page(pager, next_page_num);
+        if (*leaf_node_next_leaf(node) != 0) {
+            return;
+        }
+    }
+    table->append_page_num = page_num;
+}
+
+// Whether the node is on the right edge of its tree: the right child of every ancestor
+bool node_is_rightmost(Pager* pager, uint32_t page_num) {
+    void* node = get_page(pager, page_num);
+    while (!is_node_root(node)) {
+        uint32_t parent_page_num = *node_parent(node);
+        node = get_page(pager, parent_page_num);
+        if (*internal_node_right_child(node) != page_num) {
+            return false;
+        }
+        page_num = parent_page_num;
+    }
+    return true;
+}
+
+// Walks down the internal levels to the leaf that covers key. Each node stays pinned while it is
+// searched, and the child is pinned before the parent is let go.
+void internal_node_find(Table* table, uint32_t page_num, uint64_t key, Cursor* cursor){
+    Pager* pager = table->pager;
+    void* node = pager_pin(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        node = pager_pin(pager, child_page_num);
+        pager_unpin(pager, page_num);
+        page_num = child_page_num;
+    }
+
+    // The leaf's pin is handed to the cursor
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = leaf_node_find_cell(node, key);
+    cursor->end_of_table = false;
+}
+
+
+
+// Number of keys[0, count) below key, compared a vector at a time where the CPU allows
+uint32_t key_count_below(const uint32_t* keys, uint32_t count, uint32_t key) {
+    uint32_t below = 0;
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    // There is no unsigned compare, so both sides are flipped into signed order first
+    __m256i bias = _mm256_set1_epi32((int)0x80000000u);
+    __m256i target = _mm256_xor_si256(_mm256_set1_epi32((int)key), bias);
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), bias);
+        __m256i less = _mm256_cmpgt_epi32(target, block);
+        below += (uint32_t)__builtin_popcount((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+#elif defined(__SSE2__)
+    __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    __m128i target = _mm_xor_si128(_mm_set1_epi32((int)key), bias);
+    for (; i + 4 <= count; i += 4) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+        __m128i less = _mm_cmpgt_epi32(target, block);
+        below += (uint32_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint32x4_t target = vdupq_n_u32(key);
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t less = vcltq_u32(vld1q_u32(keys + i), target);
+        below += vaddvq_u32(vshrq_n_u32(less, 31));
+    }
+#endif
+    for (; i < count; i++) {
+        below += keys[i] < key;
+    }
+    return below;
+}
+
+// Index of the first of the sorted keys[0, count) that is >= key, or count if there is none.
+// Binary search narrows the range down to a few cache lines, then one vector pass counts the rest.
+uint32_t key_lower_bound(const uint32_t* keys, uint32_t count, uint32_t key) {
+    uint32_t base = 0;
+    while (count > KEY_SEARCH_WINDOW) {
+        uint32_t half = count / 2;
+        if (keys[base + half - 1] < key) {
+            base += half;
+        }
+        count -= half;
+    }
+    return base + key_count_below(keys + base, count, key);
+}
+
+// key_count_below for 64-bit keys, half as many to a vector
+uint32_t wide_key_count_below(const uint64_t* keys, uint32_t count, uint64_t key) {
+    uint32_t below = 0;
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+    __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), bias);
+    for (; i + 4 <= count; i += 4) {
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), bias);
+        __m256i less = _mm256_cmpgt_epi64(target, block);
+        below += (uint32_t)__builtin_popcount((unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no 64-bit compare, so each key is compared by halves, both flipped into signed
+    // order: its high half decides, or its low half where the high halves are equal
+    __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    __m128i target = _mm_xor_si128(_mm_set1_epi64x((long long)key), bias);
+    for (; i + 2 <= count; i += 2) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+        __m128i greater = _mm_cmpgt_epi32(target, block);
+        __m128i equal = _mm_cmpeq_epi32(target, block);
+        __m128i high_greater = _mm_shuffle_epi32(greater, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i high_equal = _mm_shuffle_epi32(equal, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i low_greater = _mm_shuffle_epi32(greater, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i less = _mm_or_si128(high_greater, _mm_and_si128(high_equal, low_greater));
+        below += (uint32_t)__builtin_popcount((unsigned)_mm_movemask_pd(_mm_castsi128_pd(less)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint64x2_t target = vdupq_n_u64(key);
+    for (; i + 2 <= count; i += 2) {
+        uint64x2_t less = vcltq_u64(vld1q_u64(keys + i), target);
+        below += (uint32_t)vaddvq_u64(vshrq_n_u64(less, 63));
+    }
+#endif
+    for (; i < count; i++) {
+        below += keys[i] < key;
+    }
+    return below;
+}
+
+// key_lower_bound for 64-bit keys
+uint32_t wide_key_lower_bound(const uint64_t* keys, uint32_t count, uint64_t key) {
+    uint32_t base = 0;
+    while (count > KEY_SEARCH_WINDOW) {
+        uint32_t half = count / 2;
+        if (keys[base + half - 1] < key) {
+            base += half;
+        }
+        count -= half;
+    }
+    return base + wide_key_count_below(keys + base, count, key);
+}
+
+// Finds the exact "parking spot" (index) for a key inside this node.
+uint32_t leaf_node_find_cell(void* node, uint64_t key) {
+    return wide_key_lower_bound(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+}
+
+// The first child whose max key is >= key; the right child if key is above them all. Offsets
+// are searched as they are stored, after the key itself is turned into one: a key below the base
+// sorts before every key of the node and one more than 2^32 past it after all of them.
+uint32_t internal_node_find_child(void* node, uint64_t key){
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (internal_node_is_wide(node)) {
+        return wide_key_lower_bound(internal_node_keys(node), num_keys, key);
+    }
+    uint64_t base = *internal_node_key_base(node);
+    if (key < base) {
+        return 0;
+    }
+    if (key - base > UINT32_MAX) {
+        return num_keys;
+    }
+    return key_lower_bound(internal_node_keys(node), num_keys, (uint32_t)(key - base));
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_index, uint32_t new_child_page_num, uint64_t new_key) {
+    /*
+    Add new_child directly to the right of the child at child_index.
+    new_key becomes the max key of the child at child_index, and the new
+    child takes over the key (or right child slot) that child used to own.
+    The two share the rows the split child was counted with.
+    */
+    Pager* pager = table->pager;
+    pager_pin(pager, parent_page_num);
+    void* parent = get_page_for_write(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t child_count = (uint32_t)node_row_count(get_page(pager, *internal_node_child(parent, child_index)));
+    uint32_t new_child_count = (uint32_t)node_row_count(get_page(pager, new_child_page_num));
+    uint32_t capacity = internal_node_is_wide(parent) ? INTERNAL_NODE_WIDE_MAX_CELLS : INTERNAL_NODE_MAX_CELLS;
+
+    if (num_keys >= capacity || !internal_node_key_fits(parent, new_key)) {
+        uint64_t temp_keys[INTERNAL_NODE_CELLS_BOUND + 1];
+        uint32_t temp_children[INTERNAL_NODE_CELLS_BOUND + 2];
+        uint32_t temp_counts[INTERNAL_NODE_CELLS_BOUND + 2];
+
+        /* load existing children, the right child last */
+        internal_node_get_keys(parent, temp_keys);
+        for (uint32_t i = 0; i < num_keys + 1; i++) {
+            temp_children[i] = *internal_node_child(parent, i);
+            temp_counts[i] = *internal_node_count(parent, i);
+        }
+
+        /* insert the key at child_index and the child just after it */
+        for (uint32_t i = num_keys; i > child_index; i--) {
+            temp_keys[i] = temp_keys[i - 1];
+        }
+        for (uint32_t i = num_keys + 1; i > child_index + 1; i--) {
+            temp_children[i] = temp_children[i - 1];
+            temp_counts[i] = temp_counts[i - 1];
+        }
+        temp_keys[child_index] = new_key;
+        temp_children[child_index + 1] = new_child_page_num;
+        temp_counts[child_index] = child_count;
+        temp_counts[child_index + 1] = new_child_count;
+        uint32_t total_keys = num_keys + 1;
+
+        if (internal_node_keys_fit(temp_keys, total_keys)) {
+            /* The keys only needed storing another way: a new base, or whole keys */
+            *internal_node_num_keys(parent) = total_keys;
+            internal_node_set_keys(parent, temp_keys, total_keys);
+            for (uint32_t i = 0; i <= total_keys; i++) {
+                *internal_node_child(parent, i) = temp_children[i];
+                *internal_node_count(parent, i) = temp_counts[i];
+            }
+            *node_parent(get_page_for_write(pager, new_child_page_num)) = parent_page_num;
+            pager_unpin(pager, parent_page_num);
+            return;
+        }
+
+        stats.internal_splits++;
+        /* create new right node */
+        uint32_t right_page_num = get_unused_page_num(pager);
+        pager_pin(pager, right_page_num);
+        void* right_node = get_page_for_write(pager, right_page_num);
+        initialize_internal_node(right_node);
+
+        /* redistribute keys, the middle key moves up to the grandparent. Halves fit whatever
+           the keys, as a wide node holds half a narrow one. A node on the right edge of the tree
+           that grew at its right end keeps all but one key, like an appending leaf, if they fit. */
+        uint32_t left_key_count = num_keys / 2;
+        if (child_index == num_keys && node_is_rightmost(pager, parent_page_num) &&
+            internal_node_keys_fit(temp_keys, total_keys - 2)) {
+            left_key_count = total_keys - 2;
+        }
+        uint32_t right_key_count = total_keys - left_key_count - 1;
+        uint64_t middle_key = temp_keys[left_key_count];
+
+        /* left keeps its page: keys and children [0, left_key_count] */
+        *internal_node_num_keys(parent) = left_key_count;
+        internal_node_set_keys(parent, temp_keys, left_key_count);
+        for (uint32_t i = 0; i < left_key_count; i++) {
+            *internal_node_child(parent, i) = temp_children[i];
+            *internal_node_count(parent, i) = temp_counts[i];
+        }
+        *internal_node_right_child(parent) = temp_children[left_key_count];
+        *internal_node_count(parent, left_key_count) = temp_counts[left_key_count];
+
+        /* right gets everything after the middle key */
+        *internal_node_num_keys(right_node) = right_key_count;
+        internal_node_set_keys(right_node, temp_keys + left_key_count + 1, right_key_count);
+        for (uint32_t i = 0; i < right_key_count; i++) {
+            *internal_node_child(right_node, i) = temp_children[left_key_count + 1 + i];
+            *internal_node_count(right_node, i) = temp_counts[left_key_count + 1 + i];
+        }
+        *internal_node_right_child(right_node) = temp_children[total_keys];
+        *internal_node_count(right_node, right_key_count) = temp_counts[total_keys];
+
+        /* children that moved to the right node need their parent pointer updated */
+        for (uint32_t i = left_key_count + 1; i <= total_keys; i++) {
+            void* child = get_page_for_write(pager, temp_children[i]);
+            *node_parent(child) = right_page_num;
+        }
+        if (child_index + 1 <= left_key_count) {
+            void* child = get_page_for_write(pager, new_child_page_num);
+            *node_parent(child) = parent_page_num;
+        }
+
+        if (is_node_root(parent)) {
+            /* left child is parent_page_num, right child is right_page_num */
+            create_new_root(table, right_page_num);
+        } else {
+            uint32_t grandparent_page_num = *node_parent(parent);
+            void* grandparent = get_page(pager, grandparent_page_num);
+            uint32_t parent_index = internal_node_child_index(grandparent, parent_page_num);
+            internal_node_insert(table, grandparent_page_num, parent_index, right_page_num, middle_key);
+        }
+
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, parent_page_num);
+        return;
+    }
+
+    if (child_index == num_keys) {
+        /* The old right child becomes the last cell and the new child takes its place */
+        uint32_t old_right_child = *internal_node_right_child(parent);
+        *internal_node_num_keys(parent) = num_keys + 1;
+        *internal_node_child(parent, num_keys) = old_right_child;
+        internal_node_store_key(parent, num_keys, new_key);
+        *internal_node_right_child(parent) = new_child_page_num;
+    } else {
+        /* Shift keys, children and counts right to make room */
+        uint32_t moved = num_keys - child_index - 1;
+        uint32_t key_size = *internal_node_key_width(parent);
+        void* keys = internal_node_keys(parent);
+        memmove(keys + (child_index + 2) * key_size, keys + (child_index + 1) * key_size, moved * key_size);
+        uint32_t* children = internal_node_children(parent);
+        memmove(children + child_index + 2, children + child_index + 1, moved * INTERNAL_NODE_CHILD_SIZE);
+        uint32_t* counts = internal_node_counts(parent);
+        memmove(counts + child_index + 2, counts + child_index + 1, moved * INTERNAL_NODE_COUNT_SIZE);
+        *internal_node_num_keys(parent) = num_keys + 1;
+
+        /* The new child inherits the old key, the split child gets the new max key */
+        *internal_node_child(parent, child_index + 1) = new_child_page_num;
+        internal_node_store_key(parent, child_index + 1, internal_node_key(parent, child_index));
+        internal_node_store_key(parent, child_index, new_key);
+    }
+    *internal_node_count(parent, child_index) = child_count;
+    *internal_node_count(parent, child_index + 1) = new_child_count;
+
+    /* Update parent pointer on the child */
+    void* child = get_page_for_write(pager, new_child_page_num);
+    *node_parent(child) = parent_page_num;
+    pager_unpin(pager, parent_page_num);
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint64_t key, const void* value, uint32_t value_size) {
+    /*
+    Create a new node and move the upper half of the bytes over.
+    Insert the new value in one of the two nodes.
+    Update parent or create a new parent.
+    */
+
+    Pager* pager = cursor->table->pager;
+    stats.leaf_splits++;
+    tree_add_count(pager, cursor->page_num, key, 1);
+    void* old_node = get_page_for_write(pager, cursor->page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    pager_pin(pager, new_page_num);
+    void* new_node = get_page_for_write(pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+
+    /* Both pages are rebuilt from a copy of the old one plus the new value */
+    char old_copy[MAX_PAGE_SIZE];
+    memcpy(old_copy, old_node, page_size);
+    uint32_t old_num_cells = *leaf_node_num_cells(old_copy);
+    uint32_t total_cells = old_num_cells + 1;
+
+    uint64_t keys[LEAF_NODE_CELLS_BOUND + 1];
+    const void* values[LEAF_NODE_CELLS_BOUND + 1];
+    uint32_t value_sizes[LEAF_NODE_CELLS_BOUND + 1];
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total_cells; i++) {
+        if (i == cursor->cell_num) {
+            keys[i] = key;
+            values[i] = value;
+            value_sizes[i] = value_size;
+        } else {
+            uint32_t old_cell = i < cursor->cell_num ? i : i - 1;
+            keys[i] = *leaf_node_key(old_copy, old_cell);
+            values[i] = leaf_node_value(old_copy, old_cell);
+            value_sizes[i] = *leaf_node_value_length(old_copy, old_cell);
+        }
+        total_bytes += LEAF_NODE_SLOT_SIZE + value_sizes[i];
+    }
+
+    /*
+    The left node keeps the first cells up to about half of the bytes,
+    the right node gets the rest. Each side keeps at least one cell.
+    An append past the last key of the rightmost leaf leaves the old
+    cells where they are and starts the new leaf with just the new one,
+    so ascending inserts fill every leaf instead of leaving them half empty.
+    */
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    if (*leaf_node_next_leaf(old_copy) == 0 && cursor->cell_num == old_num_cells) {
+        left_count = old_num_cells;
+    }
+    while (left_count < total_cells - 1) {
+        uint32_t cell_bytes = LEAF_NODE_SLOT_SIZE + value_sizes[left_count];
+        if (left_count > 0 && 2 * (left_bytes + cell_bytes) > total_bytes + cell_bytes) {
+            break;
+        }
+        left_bytes += cell_bytes;
+        left_count++;
+    }
+
+    bool is_root = is_node_root(old_copy);
+    initialize_leaf_node(old_node);
+    set_node_root(old_node, is_root);
+    *node_parent(old_node) = *node_parent(old_copy);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    /* The cell counts go in first since they place the value slots */
+    *(leaf_node_num_cells(old_node)) = left_count;
+    *(leaf_node_num_cells(new_node)) = total_cells - left_count;
+    for (uint32_t i = 0; i < left_count; i++) {
+        leaf_node_set_cell(old_node, i, keys[i], values[i], value_sizes[i]);
+    }
+    for (uint32_t i = left_count; i < total_cells; i++) {
+        leaf_node_set_cell(new_node, i - left_count, keys[i], values[i], value_sizes[i]);
+    }
+
+    if (is_root) {
+        create_new_root(cursor->table, new_page_num);
+    } else {
+        // The child is found by page number: in an index, neighbors may share their max key
+        uint32_t parent_page_num = *node_parent(old_node);
+        uint64_t new_left_max_key = keys[left_count - 1];
+        void* parent = get_page(pager, parent_page_num);
+        uint32_t child_index = internal_node_child_index(parent, cursor->page_num);
+        internal_node_insert(cursor->table, parent_page_num, child_index, new_page_num, new_left_max_key);
+    }
+    pager_unpin(pager, new_page_num);
+}
+
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+    /*
+    Handle splitting the root.
+    Old root copied to new page, becomes left child.
+    Address of right child passed in.
+    Re-initialize root page to contain the new root node.
+    New root node points to two children.
+    */
+
+    Pager* pager = table->pager;
+    pager_pin(pager, table->root_page_num);
+    void* root = get_page_for_write(pager, table->root_page_num);
+    pager_pin(pager, right_child_page_num);
+    void* right_child = get_page_for_write(pager, right_child_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(pager);
+    pager_pin(pager, left_child_page_num);
+    void* left_child = get_page_for_write(pager, left_child_page_num);
+
+    /* Left child has data from old root */
+    memcpy(left_child, root, page_size);
+    set_node_root(left_child, false);
+
+    /* An internal left child's children still point at the root page */
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(left_child);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            void* child = get_page_for_write(pager, *internal_node_child(left_child, i));
+            *node_parent(child) = left_child_page_num;
+        }
+    }
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint64_t left_child_max_key = get_node_max_key(pager, left_child);
+    internal_node_set_keys(root, &left_child_max_key, 1);
+    *internal_node_right_child(root) = right_child_page_num;
+    *internal_node_count(root, 0) = (uint32_t)node_row_count(left_child);
+    *internal_node_count(root, 1) = (uint32_t)node_row_count(right_child);
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    pager_unpin(pager, left_child_page_num);
+    pager_unpin(pager, right_child_page_num);
+    pager_unpin(pager, table->root_page_num);
+}
+
+// Runs after cells were removed from a leaf. A non-root leaf left underfull is merged with a
+// sibling under the same parent when the two fit in one page; otherwise their cells are split
+// about evenly between them. A merge takes a child from the parent, which may then need the same.
+void leaf_node_rebalance(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    void* node = get_page(pager, page_num);
+    if (is_node_root(node) || LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node) >= LEAF_NODE_MIN_FILL) {
+        return;
+    }
+
+    uint32_t parent_page_num = *node_parent(node);
+    pager_pin(pager, parent_page_num);
+    void* parent = get_page_for_write(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    if (num_keys == 0) {
+        pager_unpin(pager, parent_page_num);
+        return;
+    }
+
+    /* Pair the leaf with its right sibling, or its left one if it is the right child */
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_index = index < num_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    pager_pin(pager, left_page_num);
+    void* left = get_page_for_write(pager, left_page_num);
+    pager_pin(pager, right_page_num);
+    void* right = get_page_for_write(pager, right_page_num);
+
+    uint32_t left_cells = *leaf_node_num_cells(left);
+    uint32_t right_cells = *leaf_node_num_cells(right);
+    uint32_t used_bytes = 2 * LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(left) - leaf_node_free_space(right);
+
+    if (used_bytes <= LEAF_NODE_SPACE_FOR_CELLS) {
+        /* Everything fits in the left leaf; the right one goes on the free list */
+        leaf_node_set_num_cells(left, left_cells + right_cells);
+        for (uint32_t i = 0; i < right_cells; i++) {
+            leaf_node_set_cell(left, left_cells + i, *leaf_node_key(right, i), leaf_node_value(right, i),
+                               *leaf_node_value_length(right, i));
+        }
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+        internal_node_merge_children(parent, left_index);
+
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, left_page_num);
+        pager_unpin(pager, parent_page_num);
+        release_page_num(pager, right_page_num);
+        internal_node_rebalance(table, parent_page_num);
+        return;
+    }
+
+    /* Both pages are rebuilt from copies, the left one getting the first half of the bytes */
+    char left_copy[MAX_PAGE_SIZE];
+    char right_copy[MAX_PAGE_SIZE];
+    memcpy(left_copy, left, page_size);
+    memcpy(right_copy, right, page_size);
+    uint32_t total_cells = left_cells + right_cells;
+    uint64_t keys[2 * LEAF_NODE_CELLS_BOUND];
+    const void* values[2 * LEAF_NODE_CELLS_BOUND];
+    uint32_t value_sizes[2 * LEAF_NODE_CELLS_BOUND];
+    for (uint32_t i = 0; i < total_cells; i++) {
+        void* source = i < left_cells ? left_copy : right_copy;
+        uint32_t cell = i < left_cells ? i : i - left_cells;
+        keys[i] = *leaf_node_key(source, cell);
+        values[i] = leaf_node_value(source, cell);
+        value_sizes[i] = *leaf_node_value_length(source, cell);
+    }
+
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    while (left_count < total_cells - 1) {
+        uint32_t cell_bytes = LEAF_NODE_SLOT_SIZE + value_sizes[left_count];
+        if (left_count > 0 && 2 * (left_bytes + cell_bytes) > used_bytes + cell_bytes) {
+            break;
+        }
+        left_bytes += cell_bytes;
+        left_count++;
+    }
+
+    /* A separator the parent can't store without outgrowing its page leaves the two as they are */
+    if (!internal_node_replace_key(parent, left_index, keys[left_count - 1])) {
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, left_page_num);
+        pager_unpin(pager, parent_page_num);
+        return;
+    }
+    *leaf_node_num_cells(left) = left_count;
+    *leaf_node_heap_start(left) = (uint16_t)page_size;
+    *leaf_node_num_cells(right) = total_cells - left_count;
+    *leaf_node_heap_start(right) = (uint16_t)page_size;
+    for (uint32_t i = 0; i < left_count; i++) {
+        leaf_node_set_cell(left, i, keys[i], values[i], value_sizes[i]);
+    }
+    for (uint32_t i = left_count; i < total_cells; i++) {
+        leaf_node_set_cell(right, i - left_count, keys[i], values[i], value_sizes[i]);
+    }
+    *internal_node_count(parent, left_index) = left_count;
+    *internal_node_count(parent, left_index + 1) = total_cells - left_count;
+
+    pager_unpin(pager, right_page_num);
+    pager_unpin(pager, left_page_num);
+    pager_unpin(pager, parent_page_num);
+}
+
+// The internal counterpart of leaf_node_rebalance, for a node that lost a child. Merging pulls
+// the parent's key between the two nodes down into the merged node; otherwise the keys are split
+// evenly and the middle one goes up. A root left with a single child is replaced by that child.
+void internal_node_rebalance(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    void* node = get_page(pager, page_num);
+
+    if (is_node_root(node)) {
+        /* The root has to stay on its page, so the only child is copied up into it */
+        pager_pin(pager, page_num);
+        void* root = get_page_for_write(pager, page_num);
+        while (get_node_type(root) == NODE_INTERNAL && *internal_node_num_keys(root) == 0) {
+            uint32_t child_page_num = *internal_node_right_child(root);
+            uint32_t free_list = *free_list_next(root);
+            memcpy(root, get_page(pager, child_page_num), page_size);
+            set_node_root(root, true);
+            *free_list_next(root) = free_list;
+            if (get_node_type(root) == NODE_INTERNAL) {
+                uint32_t num_keys = *internal_node_num_keys(root);
+                for (uint32_t i = 0; i <= num_keys; i++) {
+                    void* child = get_page_for_write(pager, *internal_node_child(root, i));
+                    *node_parent(child) = page_num;
+                }
+            }
+            release_page_num(pager, child_page_num);
+        }
+        pager_unpin(pager, page_num);
+        return;
+    }
+    if (*internal_node_num_keys(node) >= INTERNAL_NODE_MIN_KEYS) {
+        return;
+    }
+
+    uint32_t parent_page_num = *node_parent(node);
+    pager_pin(pager, parent_page_num);
+    void* parent = get_page_for_write(pager, parent_page_num);
+    uint32_t parent_keys = *internal_node_num_keys(parent);
+    if (parent_keys == 0) {
+        pager_unpin(pager, parent_page_num);
+        return;
+    }
+
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_index = index < parent_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    pager_pin(pager, left_page_num);
+    void* left = get_page_for_write(pager, left_page_num);
+    pager_pin(pager, right_page_num);
+    void* right = get_page_for_write(pager, right_page_num);
+
+    /* load both nodes with the parent's key in between, which bounds the left's right child */
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+    uint32_t total_keys = left_keys + 1 + right_keys;
+    uint64_t temp_keys[2 * INTERNAL_NODE_CELLS_BOUND + 1];
+    uint32_t temp_children[2 * INTERNAL_NODE_CELLS_BOUND + 2];
+    uint32_t temp_counts[2 * INTERNAL_NODE_CELLS_BOUND + 2];
+    internal_node_get_keys(left, temp_keys);
+    temp_keys[left_keys] = internal_node_key(parent, left_index);
+    internal_node_get_keys(right, temp_keys + left_keys + 1);
+    for (uint32_t i = 0; i <= left_keys; i++) {
+        temp_children[i] = *internal_node_child(left, i);
+        temp_counts[i] = *internal_node_count(left, i);
+    }
+    for (uint32_t i = 0; i <= right_keys; i++) {
+        temp_children[left_keys + 1 + i] = *internal_node_child(right, i);
+        temp_counts[left_keys + 1 + i] = *internal_node_count(right, i);
+    }
+
+    /* Two nodes whose keys can't be split so that both halves and the parent's new key fit are left as they are */
+    bool merge = internal_node_keys_fit(temp_keys, total_keys);
+    uint32_t left_key_count = merge ? total_keys : total_keys / 2;
+    uint32_t right_key_count = total_keys - left_key_count - 1;
+    if (!merge && (!internal_node_keys_fit(temp_keys, left_key_count) ||
+                   !internal_node_keys_fit(temp_keys + left_key_count + 1, right_key_count) ||
+                   !internal_node_replace_key(parent, left_index, temp_keys[left_key_count]))) {
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, left_page_num);
+        pager_unpin(pager, parent_page_num);
+        return;
+    }
+    *internal_node_num_keys(left) = left_key_count;
+    internal_node_set_keys(left, temp_keys, left_key_count);
+    for (uint32_t i = 0; i < left_key_count; i++) {
+        *internal_node_child(left, i) = temp_children[i];
+        *internal_node_count(left, i) = temp_counts[i];
+    }
+    *internal_node_right_child(left) = temp_children[left_key_count];
+    *internal_node_count(left, left_key_count) = temp_counts[left_key_count];
+
+    if (!merge) {
+        *internal_node_num_keys(right) = right_key_count;
+        internal_node_set_keys(right, temp_keys + left_key_count + 1, right_key_count);
+        for (uint32_t i = 0; i < right_key_count; i++) {
+            *internal_node_child(right, i) = temp_children[left_key_count + 1 + i];
+            *internal_node_count(right, i) = temp_counts[left_key_count + 1 + i];
+        }
+        *internal_node_right_child(right) = temp_children[total_keys];
+        *internal_node_count(right, right_key_count) = temp_counts[total_keys];
+        *internal_node_count(parent, left_index) = (uint32_t)node_row_count(left);
+        *internal_node_count(parent, left_index + 1) = (uint32_t)node_row_count(right);
+    }
+
+    /* children that changed nodes need their parent pointer updated */
+    for (uint32_t i = 0; i <= total_keys; i++) {
+        bool was_left = i <= left_keys;
+        bool is_left = i <= left_key_count;
+        if (was_left != is_left) {
+            void* child = get_page_for_write(pager, temp_children[i]);
+            *node_parent(child) = is_left ? left_page_num : right_page_num;
+        }
+    }
+
+    if (merge) {
+        internal_node_merge_children(parent, left_index);
+    }
+    pager_unpin(pager, right_page_num);
+    pager_unpin(pager, left_page_num);
+    pager_unpin(pager, parent_page_num);
+    if (merge) {
+        release_page_num(pager, right_page_num);
+        internal_node_rebalance(table, parent_page_num);
+    }
+}
+
+// Position of child_page_num among the node's children, num_keys for the right child
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t* children = internal_node_children(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        if (children[i] == child_page_num) {
+            return i;
+        }
+    }
+    return num_keys;
+}
+
+// Drops the child after left_index once its contents were merged into the child at left_index,
+// which takes over the dropped child's key (or right child slot) and its rows in the count
+void internal_node_merge_children(void* node, uint32_t left_index) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t key_size = *internal_node_key_width(node);
+    void* keys = internal_node_keys(node);
+    uint32_t* children = internal_node_children(node);
+    uint32_t* counts = internal_node_counts(node);
+    uint32_t merged_count = *internal_node_count(node, left_index) + *internal_node_count(node, left_index + 1);
+    if (left_index + 1 == num_keys) {
+        *internal_node_right_child(node) = children[left_index];
+    } else {
+        uint32_t moved = num_keys - left_index - 2;
+        memmove(keys + left_index * key_size, keys + (left_index + 1) * key_size, (moved + 1) * key_size);
+        memmove(children + left_index + 1, children + left_index + 2, moved * INTERNAL_NODE_CHILD_SIZE);
+        memmove(counts + left_index + 1, counts + left_index + 2, moved * INTERNAL_NODE_COUNT_SIZE);
+    }
+    *internal_node_num_keys(node) = num_keys - 1;
+    *internal_node_count(node, left_index) = merged_count;
+}
+
+uint32_t* internal_node_child(void* node, uint32_t child_num){
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys){
+        fprintf(stderr, "Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys){
+        return internal_node_right_child(node);
+    } else {
+        return internal_node_children(node) + child_num;
+    }
+}
+
+// The number of rows in the subtree of the child at child_num, numbered like internal_node_child
+uint32_t* internal_node_count(void* node, uint32_t child_num){
+    return internal_node_counts(node) + (child_num == *internal_node_num_keys(node) ? INTERNAL_NODE_MAX_CELLS : child_num);
+}
+
+// Rows in the subtree under node: a leaf's cells, or the sum of an internal node's child counts
+uint64_t node_row_count(void* node) {
+    if (get_node_type(node) != NODE_INTERNAL) {
+        return *leaf_node_num_cells(node);
+    }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t* counts = internal_node_counts(node);
+    uint64_t total = counts[INTERNAL_NODE_MAX_CELLS];
+    for (uint32_t i = 0; i < num_keys; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+// Adds delta to the count every ancestor keeps for the subtree holding page_num, after rows
+// around key were added to or removed from that leaf. The child is looked for by key first and
+// by page number if that misses, as it can in an index, where neighbors may share their max key.
+// Runs before a split or merge restructures the path, which then keeps the counts exact.
+void tree_add_count(Pager* pager, uint32_t page_num, uint64_t key, int32_t delta) {
+    void* node = get_page(pager, page_num);
+    while (!is_node_root(node)) {
+        uint32_t parent_page_num = *node_parent(node);
+        node = get_page_for_write(pager, parent_page_num);
+        uint32_t child_index = internal_node_find_child(node, key);
+        if (*internal_node_child(node, child_index) != page_num) {
+            child_index = internal_node_child_index(node, page_num);
+        }
+        *internal_node_count(node, child_index) += (uint32_t)delta;
+        page_num = parent_page_num;
+    }
+}
+
+// The header holds the first page of the free list (0 when the list is empty, page 0 being the
+// header). Each free page points at the next one with its parent pointer.
+uint32_t* free_list_next(void* node) {
+    return node_parent(node);
+}
+
+// Pages freed by merges are reused before the file grows
+uint32_t get_unused_page_num(Pager* pager) {
+    uint32_t free_page_num = pager->header.free_list_head;
+    if (free_page_num != 0) {
+        pager->header.free_list_head = *free_list_next(get_page(pager, free_page_num));
+        return free_page_num;
+    }
+
+    if (pager->num_pages == INVALID_PAGE_NUM) {
+        fprintf(stderr, "Error: Maximum number of pages (%u) reached.\n", INVALID_PAGE_NUM);
+        exit(EXIT_FAILURE);
+    }
+    return pager->num_pages;
+}
+
+// Puts a page no longer in the tree at the head of the free list
+void release_page_num(Pager* pager, uint32_t page_num) {
+    void* page = get_page_for_write(pager, page_num);
+    set_node_type(page, NODE_FREE);
+    set_node_root(page, false);
+    *free_list_next(page) = pager->header.free_list_head;
+    pager->header.free_list_head = page_num;
+}
+
+/* --- Bulk Import --- */
+
+/*
+.import sorts the input into runs of leaf cells, spilling runs to a
+temporary file when they don't all fit in the sort memory (the buffer
+pool budget), then merges them in key order. Into an empty table the
+merged cells are packed straight into leaves, the internal levels are
+built from the leaves' max keys, and every page but the root is written
+sequentially to the end of the file. The root is written last, through
+the buffer pool and a checkpoint, so a crash part way through leaves an
+empty table (plus some unreachable pages). A table that already has rows
+gets the merged rows through ordinary inserts instead.
+*/
+
+int compare_import_entries(const void* a, const void* b) {
+    const ImportSortEntry* entry_a = a;
+    const ImportSortEntry* entry_b = b;
+    if (entry_a->key != entry_b->key) {
+        return (entry_a->key > entry_b->key) - (entry_a->key < entry_b->key);
+    }
+    return (entry_a->index > entry_b->index) - (entry_a->index < entry_b->index);
+}
+
+void import_pwrite_all(int file_descriptor, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(file_descriptor, data, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing import run: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+}
+
+// Sorts count buffered cells into a new run. A spilled run is written out in key order and the
+// buffer can be reused; otherwise the run takes ownership of cells.
+void import_add_run(ImportMerge* merge, char* cells, uint64_t count, uint32_t* value_sizes, bool spill) {
+    merge->runs = realloc(merge->runs, sizeof(ImportRun) * (merge->num_runs + 1));
+    ImportSortEntry* entries = malloc(sizeof(ImportSortEntry) * count);
+    if (merge->runs == NULL || entries == NULL) {
+        fprintf(stderr, "Error: malloc failed for import\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        memcpy(&entries[i].key, cells + i * IMPORT_CELL_SIZE, ID_SIZE);
+        entries[i].index = (uint32_t)i;
+        entries[i].value_size = value_sizes[i];
+    }
+    qsort(entries, count, sizeof(ImportSortEntry), compare_import_entries);
+
+    ImportRun* run = &merge->runs[merge->num_runs++];
+    run->entries = entries;
+    run->count = count;
+    run->position = 0;
+    run->spilled = spill;
+    run->buffer_start = 0;
+    run->buffer_count = 0;
+    run->file_offset = 0;
+    if (!spill) {
+        run->cells = cells;
+        return;
+    }
+
+    if (merge->spill_file == NULL) {
+        merge->spill_file = tmpfile();
+        if (merge->spill_file == NULL) {
+            fprintf(stderr, "Error creating import spill file: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    run->cells = malloc(IMPORT_RUN_BUFFER_CELLS * IMPORT_CELL_SIZE);
+    if (run->cells == NULL) {
+        fprintf(stderr, "Error: malloc failed for import\n");
+        exit(EXIT_FAILURE);
+    }
+    run->file_offset = merge->spill_length;
+
+    // The read buffer doubles as the write buffer while the run is spilled
+    int spill_fd = fileno(merge->spill_file);
+    uint64_t i = 0;
+    while (i < count) {
+        uint32_t batched = 0;
+        off_t offset = merge->spill_length;
+        while (i < count && batched < IMPORT_RUN_BUFFER_CELLS) {
+            memcpy(run->cells + (size_t)batched * IMPORT_CELL_SIZE,
+                   cells + (size_t)entries[i].index * IMPORT_CELL_SIZE, IMPORT_CELL_SIZE);
+            batched++;
+            i++;
+        }
+        import_pwrite_all(spill_fd, run->cells, (size_t)batched * IMPORT_CELL_SIZE, offset);
+        merge->spill_length += (off_t)batched * IMPORT_CELL_SIZE;
+    }
+}
+
+// The cell at the run's current position, reading the next chunk of a spilled run when needed
+void* import_run_cell(ImportMerge* merge, ImportRun* run) {
+    if (!run->spilled) {
+        return run->cells + (size_t)run->entries[run->position].index * IMPORT_CELL_SIZE;
+    }
+
+    if (run->position < run->buffer_start || run->position >= run->buffer_start + run->buffer_count) {
+        uint64_t count = run->count - run->position;
+        if (count > IMPORT_RUN_BUFFER_CELLS) {
+            count = IMPORT_RUN_BUFFER_CELLS;
+        }
+        size_t length = (size_t)count * IMPORT_CELL_SIZE;
+        off_t offset = run->file_offset + (off_t)run->position * IMPORT_CELL_SIZE;
+        size_t done = 0;
+        while (done < length) {
+            ssize_t bytes_read = pread(fileno(merge->spill_file), run->cells + done, length - done, offset + (off_t)done);
+            if (bytes_read <= 0) {
+                if (bytes_read == -1 && errno == EINTR) continue;
+                fprintf(stderr, "Error reading import run: %s\n", bytes_read == 0 ? "unexpected end of file" : strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            done += (size_t)bytes_read;
+        }
+        run->buffer_start = run->position;
+        run->buffer_count = count;
+    }
+    return run->cells + (size_t)(run->position - run->buffer_start) * IMPORT_CELL_SIZE;
+}
+
+bool import_run_before(ImportMerge* merge, uint32_t a, uint32_t b) {
+    ImportRun* run_a = &merge->runs[a];
+    ImportRun* run_b = &merge->runs[b];
+    uint64_t key_a = run_a->entries[run_a->position].key;
+    uint64_t key_b = run_b->entries[run_b->position].key;
+    return key_a < key_b || (key_a == key_b && a < b);
+}
+
+void import_heap_sift_down(ImportMerge* merge, uint32_t slot) {
+    while (true) {
+        uint32_t smallest = slot;
+        uint32_t left = 2 * slot + 1;
+        uint32_t right = left + 1;
+        if (left < merge->heap_size && import_run_before(merge, merge->heap[left], merge->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < merge->heap_size && import_run_before(merge, merge->heap[right], merge->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == slot) {
+            return;
+        }
+        uint32_t swap = merge->heap[slot];
+        merge->heap[slot] = merge->heap[smallest];
+        merge->heap[smallest] = swap;
+        slot = smallest;
+    }
+}
+
+// Starts the merge over from the first entry of every run
+void import_merge_rewind(ImportMerge* merge) {
+    merge->heap = realloc(merge->heap, sizeof(uint32_t) * (merge->num_runs + 1));
+    if (merge->heap == NULL) {
+        fprintf(stderr, "Error: malloc failed for import\n");
+        exit(EXIT_FAILURE);
+    }
+    merge->heap_size = 0;
+    for (uint32_t i = 0; i < merge->num_runs; i++) {
+        merge->runs[i].position = 0;
+        if (merge->runs[i].count > 0) {
+            merge->heap[merge->heap_size++] = i;
+        }
+    }
+    for (uint32_t slot = merge->heap_size / 2; slot-- > 0;) {
+        import_heap_sift_down(merge, slot);
+    }
+    merge->have_last_key = false;
+}
+
+// Pops the smallest entry off the merge. Returns false once it is a repeat of the previous key.
+bool import_merge_advance(ImportMerge* merge, ImportSortEntry* entry) {
+    ImportRun* run = &merge->runs[merge->heap[0]];
+    *entry = run->entries[run->position];
+    bool repeat = merge->have_last_key && entry->key == merge->last_key;
+    merge->have_last_key = true;
+    merge->last_key = entry->key;
+
+    run->position++;
+    if (run->position == run->count) {
+        merge->heap[0] = merge->heap[--merge->heap_size];
+    }
+    import_heap_sift_down(merge, 0);
+    return !repeat;
+}
+
+// Returns the next serialized row in key order, dropping repeated keys, or NULL when the runs
+// are used up. The row stays valid until the next call.
+void* import_merge_next(ImportMerge* merge, ImportStats* stats, uint32_t* value_size) {
+    while (merge->heap_size > 0) {
+        ImportRun* run = &merge->runs[merge->heap[0]];
+        void* cell = import_run_cell(merge, run);
+        ImportSortEntry entry;
+        if (import_merge_advance(merge, &entry)) {
+            *value_size = entry.value_size;
+            return cell;
+        }
+        stats->duplicates++;
+    }
+    return NULL;
+}
+
+// Whether a value of value_size no longer fits a leaf that already holds used bytes of slots and
+// values, packing leaves to at most leaf_bytes
+bool import_leaf_full(uint32_t used, uint32_t value_size, uint32_t leaf_bytes) {
+    uint32_t needed = used + LEAF_NODE_SLOT_SIZE + value_size;
+    return needed > leaf_bytes && used > 0;
+}
+
+// Lays the distinct rows of all runs out over leaves, from the in-memory entries alone, and
+// returns the number of leaves
+uint64_t import_merge_count_leaves(ImportMerge* merge, uint32_t leaf_bytes, uint64_t* num_rows, uint64_t** leaf_max_keys) {
+    uint64_t num_leaves = 0;
+    uint64_t capacity = 0;
+    uint32_t used = 0;
+    *num_rows = 0;
+    *leaf_max_keys = NULL;
+    import_merge_rewind(merge);
+    while (merge->heap_size > 0) {
+        ImportSortEntry entry;
+        if (!import_merge_advance(merge, &entry)) {
+            continue;
+        }
+        if (num_leaves == 0 || import_leaf_full(used, entry.value_size, leaf_bytes)) {
+            if (num_leaves == capacity) {
+                capacity = capacity == 0 ? 1024 : capacity * 2;
+                *leaf_max_keys = realloc(*leaf_max_keys, sizeof(uint64_t) * capacity);
+                if (*leaf_max_keys == NULL) {
+                    fprintf(stderr, "Error: malloc failed for import\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            num_leaves++;
+            used = 0;
+        }
+        (*leaf_max_keys)[num_leaves - 1] = entry.key;
+        used += LEAF_NODE_SLOT_SIZE + entry.value_size;
+        (*num_rows)++;
+    }
+    import_merge_rewind(merge);
+    return num_leaves;
+}
+
+void import_merge_free(ImportMerge* merge) {
+    for (uint32_t i = 0; i < merge->num_runs; i++) {
+        free(merge->runs[i].entries);
+        free(merge->runs[i].cells);
+    }
+    free(merge->runs);
+    free(merge->heap);
+    if (merge->spill_file != NULL) {
+        fclose(merge->spill_file);
+    }
+}
+
+// First of items spread evenly over groups that belongs to group, and the inverse
+uint64_t import_group_start(uint64_t group, uint64_t items, uint64_t groups) {
+    return group * items / groups;
+}
+
+uint64_t import_group_of(uint64_t item, uint64_t items, uint64_t groups) {
+    return ((item + 1) * groups - 1) / items;
+}
+
+// Nodes of the level above num_children nodes whose max keys are max_keys, each taking up to
+// capacity of them. If the keys of one would be too far apart to fit, every node of the level
+// takes no more than a wide node holds. max_keys is overwritten with the max keys of those nodes.
+uint64_t import_level_nodes(uint64_t* max_keys, uint64_t num_children, uint64_t capacity) {
+    uint64_t num_nodes = (num_children + capacity - 1) / capacity;
+    for (uint64_t index = 0; index < num_nodes; index++) {
+        uint64_t first = import_group_start(index, num_children, num_nodes);
+        uint64_t end = import_group_start(index + 1, num_children, num_nodes);
+        if (!internal_node_keys_fit(max_keys + first, (uint32_t)(end - first - 1))) {
+            capacity = capacity < INTERNAL_NODE_WIDE_MAX_CELLS + 1 ? capacity : INTERNAL_NODE_WIDE_MAX_CELLS + 1;
+            num_nodes = (num_children + capacity - 1) / capacity;
+            break;
+        }
+    }
+    for (uint64_t index = 0; index < num_nodes; index++) {
+        max_keys[index] = max_keys[import_group_start(index + 1, num_children, num_nodes) - 1];
+    }
+    return num_nodes;
+}
+
+void import_writer_flush(ImportWriter* writer) {
+    if (writer->num_batched == 0) {
+        return;
+    }
+    struct iovec iov = { .iov_base = writer->pages, .iov_len = (size_t)writer->num_batched * page_size };
+    pager_write_run(writer->pager, writer->first_page_num, &iov, 1);
+    writer->first_page_num += writer->num_batched;
+    writer->num_batched = 0;
+}
+
+// A zeroed buffer for page_num. Pages other than the root must be asked for in order.
+void* import_writer_page(ImportWriter* writer, uint32_t page_num) {
+    void* page;
+    if (page_num == writer->root_page_num) {
+        page = writer->root;
+    } else {
+        if (writer->num_batched == IMPORT_WRITE_BATCH_PAGES) {
+            import_writer_flush(writer);
+        }
+        page = writer->pages + (size_t)writer->num_batched * page_size;
+        writer->num_batched++;
+    }
+    memset(page, 0, page_size);
+    return page;
+}
+
+// Builds the whole tree of an empty table from the num_rows distinct rows coming out of the
+// merge, packed into num_leaves leaves of at most leaf_bytes as import_merge_count_leaves laid them out.
+// leaf_max_keys, the last key of each of those leaves, is used up planning the levels above.
+void import_build_tree(Table* table, ImportMerge* merge, uint64_t num_rows, uint64_t num_leaves, uint64_t* leaf_max_keys,
+                       uint32_t leaf_bytes, uint32_t fill_percent, ImportStats* stats) {
+    Pager* pager = table->pager;
+
+    uint64_t internal_capacity = (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+    if (internal_capacity < 2) {
+        internal_capacity = 2;
+    }
+
+    // Node counts per level, leaves first. Every level spreads its children evenly over its nodes.
+    uint64_t level_count[IMPORT_MAX_LEVELS];
+    uint64_t level_start[IMPORT_MAX_LEVELS];
+    uint32_t num_levels = 1;
+    level_count[0] = num_leaves;
+    while (level_count[num_levels - 1] > 1) {
+        level_count[num_levels] = import_level_nodes(leaf_max_keys, level_count[num_levels - 1], internal_capacity);
+        num_levels++;
+    }
+    uint32_t top = num_levels - 1;
+
+    // The single node of the top level is the root; every other level follows the existing pages
+    uint64_t next_page_num = pager->num_pages;
+    for (uint32_t level = 0; level < top; level++) {
+        level_start[level] = next_page_num;
+        next_page_num += level_count[level];
+    }
+    level_start[top] = table->root_page_num;
+    if (next_page_num >= INVALID_PAGE_NUM) {
+        fprintf(stderr, "Error: Maximum number of pages (%u) reached.\n", INVALID_PAGE_NUM);
+        exit(EXIT_FAILURE);
+    }
+
+    ImportWriter writer = {
+        .pager = pager,
+        .pages = aligned_alloc(page_size, (size_t)IMPORT_WRITE_BATCH_PAGES * page_size),
+        .first_page_num = pager->num_pages,
+        .num_batched = 0,
+        .root_page_num = table->root_page_num,
+        .root = aligned_alloc(page_size, page_size),
+    };
+    uint64_t* max_keys = malloc(sizeof(uint64_t) * level_count[0]);
+    uint32_t* row_counts = malloc(sizeof(uint32_t) * level_count[0]);
+    if (writer.pages == NULL || writer.root == NULL || max_keys == NULL || row_counts == NULL) {
+        fprintf(stderr, "Error: malloc failed for import\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t value_size;
+    void* cell = import_merge_next(merge, stats, &value_size);
+    for (uint64_t leaf = 0; leaf < level_count[0]; leaf++) {
+        uint32_t page_num = (uint32_t)(level_start[0] + leaf);
+        void* node = import_writer_page(&writer, page_num);
+        initialize_leaf_node(node);
+        if (top == 0) {
+            set_node_root(node, true);
+        } else {
+            *node_parent(node) = (uint32_t)(level_start[1] + import_group_of(leaf, level_count[0], level_count[1]));
+        }
+        *leaf_node_next_leaf(node) = leaf + 1 < level_count[0] ? page_num + 1 : 0;
+
+        // The row that overflows a leaf opens the next one. The value slots can only be placed
+        // once the number of keys is known.
+        uint32_t num_cells = 0;
+        uint32_t used = 0;
+        uint16_t* heap_start = leaf_node_heap_start(node);
+        uint16_t value_slots[LEAF_NODE_CELLS_BOUND][2];
+        while (cell != NULL && !import_leaf_full(used, value_size, leaf_bytes)) {
+            memcpy(leaf_node_key(node, num_cells), cell, ID_SIZE);
+            *heap_start -= value_size;
+            memcpy(node + *heap_start, (char*)cell + ID_SIZE, value_size);
+            value_slots[num_cells][0] = *heap_start;
+            value_slots[num_cells][1] = (uint16_t)value_size;
+            used += LEAF_NODE_SLOT_SIZE + value_size;
+            num_cells++;
+            cell = import_merge_next(merge, stats, &value_size);
+        }
+        *leaf_node_num_cells(node) = num_cells;
+        for (uint32_t i = 0; i < num_cells; i++) {
+            *leaf_node_value_offset(node, i) = value_slots[i][0];
+            *leaf_node_value_length(node, i) = value_slots[i][1];
+        }
+        max_keys[leaf] = *leaf_node_key(node, num_cells - 1);
+        row_counts[leaf] = num_cells;
+    }
+
+    for (uint32_t level = 1; level <= top; level++) {
+        uint64_t num_children = level_count[level - 1];
+        uint64_t* level_max_keys = malloc(sizeof(uint64_t) * level_count[level]);
+        uint32_t* level_row_counts = malloc(sizeof(uint32_t) * level_count[level]);
+        if (level_max_keys == NULL || level_row_counts == NULL) {
+            fprintf(stderr, "Error: malloc failed for import\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (uint64_t index = 0; index < level_count[level]; index++) {
+            void* node = import_writer_page(&writer, (uint32_t)(level_start[level] + index));
+            initialize_internal_node(node);
+            if (level == top) {
+                set_node_root(node, true);
+            } else {
+                *node_parent(node) = (uint32_t)(level_start[level + 1] + import_group_of(index, level_count[level], level_count[level + 1]));
+            }
+
+            // key[i] is the max key of child[i]; the last child becomes the right child
+            uint64_t first_child = import_group_start(index, num_children, level_count[level]);
+            uint64_t end_child = import_group_start(index + 1, num_children, level_count[level]);
+            uint32_t num_keys = (uint32_t)(end_child - first_child - 1);
+            *internal_node_num_keys(node) = num_keys;
+            internal_node_set_keys(node, max_keys + first_child, num_keys);
+            uint32_t level_rows = 0;
+            for (uint32_t i = 0; i <= num_keys; i++) {
+                *internal_node_child(node, i) = (uint32_t)(level_start[level - 1] + first_child + i);
+                *internal_node_count(node, i) = row_counts[first_child + i];
+                level_rows += row_counts[first_child + i];
+            }
+            level_max_keys[index] = max_keys[end_child - 1];
+            level_row_counts[index] = level_rows;
+        }
+
+        free(max_keys);
+        free(row_counts);
+        max_keys = level_max_keys;
+        row_counts = level_row_counts;
+    }
+    free(max_keys);
+    free(row_counts);
+
+    // The new pages must be durable before the root points at them. Readers can't reach them
+    // yet, but a compressed file commits a new page map here.
+    import_writer_flush(&writer);
+    pager_exclude_readers(pager);
+    if (!pager_sync(pager)) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pager_admit_readers(pager);
+    pager->num_pages = (uint32_t)next_page_num;
+
+    table->append_page_num = INVALID_PAGE_NUM;
+    memcpy(get_page_for_write(pager, table->root_page_num), writer.root, page_size);
+    table_checkpoint(table);
+
+    free(writer.pages);
+    free(writer.root);
+    stats->rows_loaded = num_rows;
+}
+
+// Bulk loads <id> <username> <email> lines from input. An empty table is built bottom-up with
+// leaves and internal nodes filled to fill_percent; otherwise the sorted rows are inserted one
+// by one. Returns false if nothing could be loaded.
+bool table_import(Table* table, FILE* input, uint32_t fill_percent, ImportStats* stats) {
+    Pager* pager = table->pager;
+    memset(stats, 0, sizeof(ImportStats));
+    if (fill_percent < IMPORT_MIN_FILL_PERCENT) {
+        fill_percent = IMPORT_MIN_FILL_PERCENT;
+    }
+    if (fill_percent > 100) {
+        fill_percent = 100;
+    }
+
+    // The sort gets as much memory as the buffer pool
+    size_t sort_memory = (size_t)pager->frame_budget * page_size;
+    if (sort_memory < IMPORT_MIN_SORT_MEMORY) {
+        sort_memory = IMPORT_MIN_SORT_MEMORY;
+    }
+    uint64_t capacity = sort_memory / (IMPORT_CELL_SIZE + sizeof(uint32_t) + sizeof(ImportSortEntry));
+    if (capacity > UINT32_MAX) {
+        capacity = UINT32_MAX;
+    }
+    char* cells = malloc((size_t)capacity * IMPORT_CELL_SIZE);
+    uint32_t* value_sizes = malloc((size_t)capacity * sizeof(uint32_t));
+    if (cells == NULL || value_sizes == NULL) {
+        fprintf(stderr, "Error: malloc failed for import\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ImportMerge merge = { 0 };
+    uint64_t num_cells = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, input)) != -1) {
+        while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+            line[--line_length] = '\0';
+        }
+        if (line_length == 0) {
+            continue;
+        }
+        Row row;
+        if (parse_row(line, &row, NULL) != PREPARE_SUCCESS) {
+            stats->rejected++;
+            continue;
+        }
+
+        if (num_cells == capacity) {
+            import_add_run(&merge, cells, num_cells, value_sizes, true);
+            num_cells = 0;
+        }
+        serialize_row(&row, cells + (size_t)num_cells * IMPORT_CELL_SIZE);
+        value_sizes[num_cells] = row_value_size(&row);
+        num_cells++;
+    }
+    free(line);
+
+    // The last run only needs to go to disk if others already did
+    if (merge.num_runs > 0) {
+        import_add_run(&merge, cells, num_cells, value_sizes, true);
+        free(cells);
+    } else {
+        import_add_run(&merge, cells, num_cells, value_sizes, false);
+    }
+    free(value_sizes);
+
+    void* root = get_page(pager, table->root_page_num);
+    // The bottom-up build writes the table's tree only, so an indexed table takes the inserts
+    bool empty_table = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0 && !table_has_indexes(table);
+    uint32_t leaf_bytes = (uint32_t)((uint64_t)LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100);
+    uint64_t num_rows;
+    uint64_t* leaf_max_keys;
+    uint64_t num_leaves = import_merge_count_leaves(&merge, leaf_bytes, &num_rows, &leaf_max_keys);
+
+    if (num_rows == 0) {
+        // Nothing to load
+    } else if (empty_table) {
+        import_build_tree(table, &merge, num_rows, num_leaves, leaf_max_keys, leaf_bytes, fill_percent, stats);
+    } else {
+        // Sorted inserts at least walk the tree in order
+        Wal* wal = pager->wal;
+        void* cell;
+        uint32_t value_size;
+        while ((cell = import_merge_next(&merge, stats, &value_size)) != NULL) {
+            Row row;
+            deserialize_row(cell, &row);
+            if (table_insert(table, &row) == EXECUTE_DUPLICATE_KEY) {
+                stats->duplicates++;
+                continue;
+            }
+            if (wal != NULL) {
+                wal_append(wal, WAL_RECORD_INSERT, cell, ID_SIZE + value_size);
+            }
+            stats->rows_loaded++;
+            if (table_checkpoint_due(table)) {
+                table_checkpoint(table);
+            }
+        }
+    }
+
+    free(leaf_max_keys);
+    import_merge_free(&merge);
+    return stats->rows_loaded > 0;
+}
+
+/* --- Compressed Page Storage --- */
+
+/*
+Pages are compressed with a small LZ4 block codec. An image is a sequence of runs:
+a token (literal count << 4 | match length - 4), longer counts continued in extra
+bytes of up to 255, the literals, then a 2 byte little-endian offset back to the
+match. The last run has literals only.
+
+A compressed file starts with a page holding two PageMapHeader copies. Everything
+after that is a heap of EXTENT_SECTOR_SIZE sectors holding page images and the
+PageExtent array, found through the current header.
+*/
+
+uint32_t lz4_read32(const uint8_t* bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(uint32_t));
+    return value;
+}
+
+// Appends a literal or match length above 15 as extension bytes
+uint32_t lz4_write_length(uint8_t* destination, uint32_t out, uint32_t length) {
+    while (length >= 255) {
+        destination[out++] = 255;
+        length -= 255;
+    }
+    destination[out++] = (uint8_t)length;
+    return out;
+}
+
+// Compresses length bytes of source. Returns the compressed size, or 0 if it would exceed capacity.
+uint32_t lz4_compress(const uint8_t* source, uint32_t length, uint8_t* destination, uint32_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];  // Last position + 1 of each hashed 4 byte sequence
+    memset(table, 0, sizeof(table));
+    uint32_t anchor = 0;
+    uint32_t out = 0;
+
+    if (length > LZ4_MATCH_FIND_LIMIT) {
+        uint32_t match_end_limit = length - LZ4_LAST_LITERALS;
+        uint32_t position = 0;
+        while (position < length - LZ4_MATCH_FIND_LIMIT) {
+            uint32_t sequence = lz4_read32(source + position);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            uint32_t candidate = table[hash];
+            table[hash] = position + 1;
+            if (candidate == 0 || position - (candidate - 1) > LZ4_MAX_OFFSET ||
+                lz4_read32(source + candidate - 1) != sequence) {
+                position++;
+                continue;
+            }
+
+            uint32_t match = candidate - 1;
+            uint32_t match_length = LZ4_MIN_MATCH;
+            while (position + match_length < match_end_limit && source[match + match_length] == source[position + match_length]) {
+                match_length++;
+            }
+
+            // Worst case for this run: token, both length extensions, literals, offset
+            uint32_t literal_length = position - anchor;
+            if ((uint64_t)out + 1 + literal_length / 255 + 1 + literal_length + 2 + (match_length - LZ4_MIN_MATCH) / 255 + 1 > capacity) {
+                return 0;
+            }
+            uint32_t token = out++;
+            destination[token] = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+            if (literal_length >= 15) {
+                out = lz4_write_length(destination, out, literal_length - 15);
+            }
+            memcpy(destination + out, source + anchor, literal_length);
+            out += literal_length;
+            uint32_t offset = position - match;
+            destination[out++] = (uint8_t)offset;
+            destination[out++] = (uint8_t)(offset >> 8);
+            uint32_t extra = match_length - LZ4_MIN_MATCH;
+            destination[token] |= (uint8_t)(extra >= 15 ? 15 : extra);
+            if (extra >= 15) {
+                out = lz4_write_length(destination, out, extra - 15);
+            }
+
+            position += match_length;
+            anchor = position;
+        }
+    }
+
+    uint32_t literal_length = length - anchor;
+    if ((uint64_t)out + 1 + literal_length / 255 + 1 + literal_length > capacity) {
+        return 0;
+    }
+    destination[out++] = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15) {
+        out = lz4_write_length(destination, out, literal_length - 15);
+    }
+    memcpy(destination + out, source + anchor, literal_length);
+    return out + literal_length;
+}
+
+// Reads a length extension, returns false if it runs past the input
+bool lz4_read_length(const uint8_t* source, uint32_t source_length, uint32_t* in, uint32_t* length) {
+    uint8_t byte;
+    do {
+        if (*in >= source_length) {
+            return false;
+        }
+        byte = source[(*in)++];
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Returns false unless source is a valid image that decompresses to exactly length bytes
+bool lz4_decompress(const uint8_t* source, uint32_t source_length, uint8_t* destination, uint32_t length) {
+    uint32_t in = 0;
+    uint32_t out = 0;
+    while (in < source_length) {
+        uint8_t token = source[in++];
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !lz4_read_length(source, source_length, &in, &literal_length)) {
+            return false;
+        }
+        if (literal_length > source_length - in || literal_length > length - out) {
+            return false;
+        }
+        memcpy(destination + out, source + in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == source_length) {
+            break;
+        }
+
+        if (source_length - in < 2) {
+            return false;
+        }
+        uint32_t offset = source[in] | ((uint32_t)source[in + 1] << 8);
+        in += 2;
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !lz4_read_length(source, source_length, &in, &match_length)) {
+            return false;
+        }
+        match_length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > length - out) {
+            return false;
+        }
+        // Byte by byte: the match may overlap the bytes it produces
+        for (uint32_t i = 0; i < match_length; i++) {
+            destination[out + i] = destination[out - offset + i];
+        }
+        out += match_length;
+    }
+    return out == length;
+}
+
+uint32_t page_map_sectors_for(uint64_t length) {
+    return (uint32_t)((length + EXTENT_SECTOR_SIZE - 1) / EXTENT_SECTOR_SIZE);
+}
+
+void page_map_write_all(int file_descriptor, const void* data, size_t length, off_t offset) {
+    const char* bytes = data;
+    while (length > 0) {
+        ssize_t written = pwrite(file_descriptor, bytes, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&stats.bytes_written, (uint64_t)written);
+        bytes += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+}
+
+bool page_map_read_all(int file_descriptor, void* data, size_t length, off_t offset) {
+    char* bytes = data;
+    while (length > 0) {
+        ssize_t bytes_read = pread(file_descriptor, bytes, length, offset);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) continue;
+            return false;
+        }
+        stats_add(&stats.bytes_read, (uint64_t)bytes_read);
+        bytes += bytes_read;
+        length -= (size_t)bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
+
+void* page_map_grow_array(void* array, uint32_t* capacity, uint32_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    uint64_t new_capacity = *capacity == 0 ? 64 : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    if (new_capacity > UINT32_MAX) {
+        new_capacity = UINT32_MAX;
+    }
+    array = realloc(array, (size_t)new_capacity * item_size);
+    if (array == NULL) {
+        fprintf(stderr, "Error: malloc failed for page map\n");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = (uint32_t)new_capacity;
+    return array;
+}
+
+// Makes room for extents of pages below num_pages; new entries are never-written pages
+void page_map_reserve(PageMap* map, uint32_t num_pages) {
+    uint32_t old_capacity = map->capacity;
+    map->extents = page_map_grow_array(map->extents, &map->capacity, num_pages, sizeof(PageExtent));
+    if (map->capacity == old_capacity) {
+        return;
+    }
+    memset(map->extents + old_capacity, 0, (size_t)(map->capacity - old_capacity) * sizeof(PageExtent));
+    map->written_in = realloc(map->written_in, sizeof(uint32_t) * map->capacity);
+    if (map->written_in == NULL) {
+        fprintf(stderr, "Error: malloc failed for page map\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(map->written_in + old_capacity, 0, (size_t)(map->capacity - old_capacity) * sizeof(uint32_t));
+}
+
+// Hands count sectors starting at sector to the allocator, in pieces no larger than a page image
+void page_map_free_run(PageMap* map, uint32_t sector, uint32_t count) {
+    while (count > 0) {
+        uint32_t size = count < EXTENT_MAX_SECTORS ? count : EXTENT_MAX_SECTORS;
+        map->free_extents[size] = page_map_grow_array(map->free_extents[size], &map->free_capacity[size],
+                                                      map->free_count[size] + 1, sizeof(uint32_t));
+        map->free_extents[size][map->free_count[size]++] = sector;
+        sector += size;
+        count -= size;
+    }
+}
+
+// Sectors still referenced by the durable map become reusable at the next commit
+void page_map_release(PageMap* map, uint32_t sector, uint32_t count) {
+    map->pending = page_map_grow_array(map->pending, &map->pending_capacity, map->num_pending + 2, sizeof(uint32_t));
+    map->pending[map->num_pending++] = sector;
+    map->pending[map->num_pending++] = count;
+}
+
+// The smallest free extent that fits, split if needed, or new sectors at the end of the file
+uint32_t page_map_allocate(PageMap* map, uint32_t count) {
+    for (uint32_t size = count; size <= EXTENT_MAX_SECTORS; size++) {
+        if (map->free_count[size] > 0) {
+            uint32_t sector = map->free_extents[size][--map->free_count[size]];
+            if (size > count) {
+                page_map_free_run(map, sector + count, size - count);
+            }
+            return sector;
+        }
+    }
+    if (map->end_sector > UINT32_MAX - count) {
+        fprintf(stderr, "Error: compressed database file is full\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t sector = map->end_sector;
+    map->end_sector += count;
+    return sector;
+}
+
+void page_map_write_flush(Pager* pager) {
+    PageMap* map = pager->page_map;
+    if (map->write_sectors == 0) {
+        return;
+    }
+    off_t offset = (off_t)map->write_start * EXTENT_SECTOR_SIZE;
+    off_t length = (off_t)map->write_sectors * EXTENT_SECTOR_SIZE;
+    page_map_write_all(pager->file_descriptor, map->write_buffer, (size_t)length, offset);
+    if (offset + length > pager->file_length) {
+        pager->file_length = offset + length;
+    }
+    map->write_sectors = 0;
+}
+
+// Queues an image for its extent; images for consecutive extents go out in one write
+void page_map_write_extent(Pager* pager, uint32_t sector, const void* image, uint32_t length) {
+    PageMap* map = pager->page_map;
+    uint32_t count = page_map_sectors_for(length);
+    if (map->write_sectors > 0 && (sector != map->write_start + map->write_sectors ||
+                                   (size_t)(map->write_sectors + count) * EXTENT_SECTOR_SIZE > PAGE_MAP_WRITE_BUFFER)) {
+        page_map_write_flush(pager);
+    }
+    if (map->write_sectors == 0) {
+        map->write_start = sector;
+    }
+    char* destination = map->write_buffer + (size_t)map->write_sectors * EXTENT_SECTOR_SIZE;
+    memcpy(destination, image, length);
+    memset(destination + length, 0, (size_t)count * EXTENT_SECTOR_SIZE - length);
+    map->write_sectors += count;
+}
+
+// Compresses a page into a fresh extent. Pages that don't shrink are stored as they are.
+void page_map_write_page(Pager* pager, uint32_t page_num, const void* data) {
+    PageMap* map = pager->page_map;
+    page_map_reserve(map, page_num + 1);
+
+    const void* image = map->scratch;
+    uint32_t length = lz4_compress(data, page_size, (uint8_t*)map->scratch, page_size - 1);
+    if (length == 0) {
+        image = data;
+        length = page_size;
+    }
+
+    // An extent the durable map doesn't know about yet can be reused right away
+    PageExtent* extent = &map->extents[page_num];
+    if (extent->length > 0 && map->written_in[page_num] == map->sequence + 1) {
+        page_map_free_run(map, extent->sector, page_map_sectors_for(extent->length));
+    } else if (extent->length > 0) {
+        page_map_release(map, extent->sector, page_map_sectors_for(extent->length));
+    }
+    extent->sector = page_map_allocate(map, page_map_sectors_for(length));
+    extent->length = length;
+    map->written_in[page_num] = map->sequence + 1;
+    map->dirty = true;
+    page_map_write_extent(pager, extent->sector, image, length);
+
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+}
+
+// Where page_num's image is, with a length of 0 if it was never written. The image may still be
+// waiting in the write buffer, so that goes to the file first.
+PageExtent page_map_locate(Pager* pager, uint32_t page_num) {
+    PageMap* map = pager->page_map;
+    if (page_num >= map->capacity || map->extents[page_num].length == 0) {
+        return (PageExtent){ 0 };
+    }
+    page_map_write_flush(pager);
+    return map->extents[page_num];
+}
+
+// Reads the image at extent into page, decompressing through scratch, a page-sized buffer. It
+// doesn't touch the page map, so a miss runs it without holding the pool lock.
+void page_map_load(Pager* pager, uint32_t page_num, PageExtent extent, void* page, void* scratch) {
+    if (extent.length == 0) {
+        memset(page, 0, page_size);
+        return;
+    }
+    off_t offset = (off_t)extent.sector * EXTENT_SECTOR_SIZE;
+    bool valid;
+    if (extent.length == page_size) {
+        valid = page_map_read_all(pager->file_descriptor, page, page_size, offset);
+    } else {
+        valid = extent.length < page_size &&
+                page_map_read_all(pager->file_descriptor, scratch, extent.length, offset) &&
+                lz4_decompress((const uint8_t*)scratch, extent.length, page, page_size);
+    }
+    if (!valid) {
+        fprintf(stderr, "Error: compressed page %u is unreadable\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void page_map_read_page(Pager* pager, uint32_t page_num, void* page) {
+    page_map_load(pager, page_num, page_map_locate(pager, page_num), page, pager->page_map->scratch);
+}
+
+uint32_t page_map_header_checksum(const PageMapHeader* header) {
+    return crc32_update(0, header, offsetof(PageMapHeader, checksum));
+}
+
+// Reads both header copies and picks the current one. Returns false if neither is valid,
+// which is the case for every plain database file.
+bool page_map_read_header(int file_descriptor, PageMapHeader* header) {
+    bool found = false;
+    for (uint32_t copy = 0; copy < 2; copy++) {
+        PageMapHeader candidate;
+        if (!page_map_read_all(file_descriptor, &candidate, sizeof(candidate), (off_t)copy * EXTENT_SECTOR_SIZE) ||
+            candidate.magic != PAGE_MAP_MAGIC || candidate.checksum != page_map_header_checksum(&candidate)) {
+            continue;
+        }
+        if (!found || candidate.sequence > header->sequence) {
+            *header = candidate;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Makes every page written so far durable: the images are synced along with the extent array,
+// written to the region of the older header copy, then that copy is switched over to it
+void page_map_commit(Pager* pager) {
+    PageMap* map = pager->page_map;
+    page_map_write_flush(pager);
+    if (!map->dirty) {
+        return;
+    }
+
+    uint32_t num_pages = pager->num_pages;
+    page_map_reserve(map, num_pages);
+    size_t map_bytes = (size_t)num_pages * sizeof(PageExtent);
+    uint32_t map_sectors = page_map_sectors_for(map_bytes);
+    uint32_t copy = (map->sequence + 1) % 2;
+    if (map->map_capacity[copy] < map_sectors) {
+        // Outgrown: move to a bigger region at the end, with room to grow
+        if (map->map_capacity[copy] > 0) {
+            page_map_release(map, map->map_sector[copy], map->map_capacity[copy]);
+        }
+        uint32_t capacity = map_sectors < EXTENT_MAX_SECTORS ? EXTENT_MAX_SECTORS : map_sectors;
+        if (capacity <= UINT32_MAX / 2) {
+            capacity *= 2;
+        }
+        if (map->end_sector > UINT32_MAX - capacity) {
+            fprintf(stderr, "Error: compressed database file is full\n");
+            exit(EXIT_FAILURE);
+        }
+        map->map_sector[copy] = map->end_sector;
+        map->map_capacity[copy] = capacity;
+        map->end_sector += capacity;
+    }
+    uint32_t map_sector = map->map_sector[copy];
+    page_map_write_all(pager->file_descriptor, map->extents, map_bytes, (off_t)map_sector * EXTENT_SECTOR_SIZE);
+    if (stats_fdatasync(pager->file_descriptor, &stats.syncs) == -1) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    PageMapHeader header = {
+        .magic = PAGE_MAP_MAGIC,
+        .sequence = map->sequence + 1,
+        .map_sector = map_sector,
+        .map_capacity = map->map_capacity[copy],
+        .num_pages = num_pages,
+        .map_checksum = crc32_update(0, map->extents, map_bytes),
+    };
+    header.page_size = page_size;
+    header.checksum = page_map_header_checksum(&header);
+    page_map_write_all(pager->file_descriptor, &header, sizeof(header), (off_t)copy * EXTENT_SECTOR_SIZE);
+    if (stats_fdatasync(pager->file_descriptor, &stats.syncs) == -1) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    off_t map_end = (off_t)map_sector * EXTENT_SECTOR_SIZE + (off_t)map_bytes;
+    if (map_end > pager->file_length) {
+        pager->file_length = map_end;
+    }
+
+    // Nothing points at the replaced images any more
+    for (uint32_t i = 0; i < map->num_pending; i += 2) {
+        page_map_free_run(map, map->pending[i], map->pending[i + 1]);
+    }
+    map->num_pending = 0;
+    map->sequence = header.sequence;
+    map->dirty = false;
+}
+
+int compare_extents_by_sector(const void* a, const void* b) {
+    uint32_t sector_a = ((const PageExtent*)a)->sector;
+    uint32_t sector_b = ((const PageExtent*)b)->sector;
+    return (sector_a > sector_b) - (sector_a < sector_b);
+}
+
+// Sets up compressed storage for pager. With a header the map is loaded and every sector it
+// doesn't use becomes free; without one the file is new and gets an empty map right away.
+void page_map_open(Pager* pager, const PageMapHeader* header) {
+    PageMap* map = calloc(1, sizeof(PageMap));
+    if (map == NULL) {
+        fprintf(stderr, "Error: malloc failed for page map\n");
+        exit(EXIT_FAILURE);
+    }
+    map->write_buffer = malloc(PAGE_MAP_WRITE_BUFFER);
+    map->scratch = malloc(page_size);
+    if (map->write_buffer == NULL || map->scratch == NULL) {
+        fprintf(stderr, "Error: malloc failed for page map\n");
+        exit(EXIT_FAILURE);
+    }
+    map->end_sector = PAGE_MAP_DATA_START_SECTOR;
+    pager->page_map = map;
+
+    if (header == NULL) {
+        pager->num_pages = 0;
+        map->dirty = true;
+        page_map_commit(pager);
+        return;
+    }
+
+    page_map_reserve(map, header->num_pages);
+    size_t map_bytes = (size_t)header->num_pages * sizeof(PageExtent);
+    if (!page_map_read_all(pager->file_descriptor, map->extents, map_bytes, (off_t)header->map_sector * EXTENT_SECTOR_SIZE) ||
+        crc32_update(0, map->extents, map_bytes) != header->map_checksum) {
+        fprintf(stderr, "Error: page map of compressed database is corrupt\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->num_pages = header->num_pages;
+    map->sequence = header->sequence;
+    // The other copy's region is left to the free space; the next commit picks a new one
+    map->map_sector[header->sequence % 2] = header->map_sector;
+    map->map_capacity[header->sequence % 2] = header->map_capacity;
+
+    // Walk the used extents in file order (as sector counts); the gaps between them are free
+    PageExtent* used = malloc(sizeof(PageExtent) * ((size_t)header->num_pages + 1));
+    if (used == NULL) {
+        fprintf(stderr, "Error: malloc failed for page map\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t num_used = 0;
+    for (uint32_t i = 0; i < header->num_pages; i++) {
+        if (map->extents[i].length > 0) {
+            used[num_used++] = (PageExtent){ .sector = map->extents[i].sector, .length = page_map_sectors_for(map->extents[i].length) };
+        }
+    }
+    used[num_used++] = (PageExtent){ .sector = header->map_sector, .length = header->map_capacity };
+    qsort(used, num_used, sizeof(PageExtent), compare_extents_by_sector);
+    uint32_t next_free = PAGE_MAP_DATA_START_SECTOR;
+    for (uint32_t i = 0; i < num_used; i++) {
+        if (used[i].sector > next_free) {
+            page_map_free_run(map, next_free, used[i].sector - next_free);
+        }
+        uint32_t end = used[i].sector + used[i].length;
+        if (end > next_free) {
+            next_free = end;
+        }
+    }
+    map->end_sector = next_free;
+    free(used);
+}
+
+void page_map_close(PageMap* map) {
+    for (uint32_t size = 0; size <= EXTENT_MAX_SECTORS; size++) {
+        free(map->free_extents[size]);
+    }
+    free(map->extents);
+    free(map->written_in);
+    free(map->pending);
+    free(map->write_buffer);
+    free(map->scratch);
+    free(map);
+}
+
+/* --- Database Header --- */
+
+// Pages are 4 KB to 64 KB, in powers of two so they stay aligned for O_DIRECT
+bool page_size_valid(uint32_t size) {
+    return size >= MIN_PAGE_SIZE && size <= MAX_PAGE_SIZE && (size & (size - 1)) == 0;
+}
+
+uint32_t db_header_checksum(const DbHeader* header) {
+    return crc32_update(0, header, offsetof(DbHeader, checksum));
+}
+
+// The header of a new database: the catalog and an empty root come right after it
+void db_header_init(DbHeader* header) {
+    *header = (DbHeader){
+        .magic = DB_HEADER_MAGIC,
+        .version = DB_HEADER_VERSION,
+        .page_size = page_size,
+        .root_page_num = DB_ROOT_PAGE_NUM,
+    };
+}
+
+// The page size a file was created with, 0 if it is empty. It is the first thing pager_open needs,
+// before recovery may rewrite page 0, so it comes from bytes that never change once written: the
+// start of the header page, or the map header of a compressed file.
+uint32_t pager_file_page_size(int file_descriptor, off_t file_length, const PageMapHeader* map_header) {
+    uint32_t size;
+    if (map_header != NULL) {
+        size = map_header->page_size == 0 ? DEFAULT_PAGE_SIZE : map_header->page_size;
+    } else if (file_length == 0) {
+        return 0;
+    } else {
+        DbHeader header;
+        if (pread(file_descriptor, &header, DB_HEADER_SIZE, 0) != (ssize_t)DB_HEADER_SIZE || header.magic != DB_HEADER_MAGIC) {
+            // Page 0 is the root of a file from before the header, when pages were always 4 KB
+            return DEFAULT_PAGE_SIZE;
+        }
+        size = header.page_size;
+    }
+    if (!page_size_valid(size)) {
+        fprintf(stderr, "Error: database header is corrupt (page size %u)\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return size;
+}
+
+// Loads page 0 into pager->header and checks it, which takes the same few reads however large the
+// file is. The page count comes from the header, not the file length: pages past it were appended
+// after the last checkpoint and nothing in the tree points at them. An empty file gets the header
+// of a new database; a file from before the header page is sized the old way.
+void pager_read_header(Pager* pager) {
+    DbHeader* header = &pager->header;
+    bool empty = pager->page_map != NULL ? pager->num_pages == 0 : pager->file_length == 0;
+    if (empty) {
+        db_header_init(header);
+        pager->num_pages = 0;
+        return;
+    }
+
+    if (pager->page_map != NULL) {
+        char* page = malloc(page_size);
+        if (page == NULL) {
+            fprintf(stderr, "Error: malloc failed for database header\n");
+            exit(EXIT_FAILURE);
+        }
+        page_map_read_page(pager, HEADER_PAGE_NUM, page);
+        memcpy(header, page, DB_HEADER_SIZE);
+        free(page);
+    } else if (pread(pager->file_descriptor, header, DB_HEADER_SIZE, 0) != (ssize_t)DB_HEADER_SIZE) {
+        memset(header, 0, sizeof(DbHeader));
+    }
+
+    if (header->magic != DB_HEADER_MAGIC) {
+        memset(header, 0, sizeof(DbHeader));
+        if (pager->page_map == NULL) {
+            if (pager->file_length % page_size != 0) {
+                printf("Db file is not a whole number of pages. Corrupt file.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (pager->file_length / page_size >= INVALID_PAGE_NUM) {
+                fprintf(stderr, "Error: database file too large. Max pages = %u\n", INVALID_PAGE_NUM);
+                exit(EXIT_FAILURE);
+            }
+            pager->num_pages = (uint32_t)(pager->file_length / page_size);
+        }
+        return;
+    }
+
+    if (header->version > DB_HEADER_VERSION) {
+        fprintf(stderr, "Error: %s has header version %u; this build reads up to version %u\n",
+                pager->filename, header->version, DB_HEADER_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    if (header->checksum != db_header_checksum(header) || header->page_size != page_size || header->num_pages <= CATALOG_PAGE_NUM ||
+        header->num_pages == INVALID_PAGE_NUM || header->root_page_num <= CATALOG_PAGE_NUM ||
+        header->root_page_num >= header->num_pages || header->free_list_head >= header->num_pages) {
+        fprintf(stderr, "Error: database header of %s is corrupt\n", pager->filename);
+        exit(EXIT_FAILURE);
+    }
+    bool truncated = pager->page_map != NULL ? header->num_pages > pager->num_pages
+                                             : (off_t)header->num_pages * page_size > pager->file_length;
+    if (truncated) {
+        fprintf(stderr, "Error: %s is shorter than the %u pages its header records. Corrupt file.\n",
+                pager->filename, header->num_pages);
+        exit(EXIT_FAILURE);
+    }
+    pager->num_pages = header->num_pages;
+}
+
+/* --- Pager (Storage) Implementation --- */
+
+// Home slot of a page in the page table (Fibonacci hashing spreads sequential page numbers)
+uint32_t page_table_slot(Pager* pager, uint32_t page_num) {
+    return (uint32_t)(page_num * 2654435761u) >> (32 - pager->page_table_bits);
+}
+
+// Returns the frame holding page_num, or INVALID_FRAME if the page is not cached
+uint32_t page_table_lookup(Pager* pager, uint32_t page_num) {
+    uint32_t mask = (1u << pager->page_table_bits) - 1;
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        uint32_t frame_index = pager->page_table[slot];
+        if (pager->frames[frame_index].page_num == page_num) {
+            return frame_index;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return INVALID_FRAME;
+}
+
+void page_table_insert(Pager* pager, uint32_t page_num, uint32_t frame_index) {
+    uint32_t mask = (1u << pager->page_table_bits) - 1;
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        slot = (slot + 1) & mask;
+    }
+    pager->page_table[slot] = frame_index;
+}
+
+// Linear probing removal: shift later entries of the same probe run back into the hole
+void page_table_remove(Pager* pager, uint32_t page_num) {
+    uint32_t mask = (1u << pager->page_table_bits) - 1;
+    uint32_t hole = page_table_slot(pager, page_num);
+    while (pager->frames[pager->page_table[hole]].page_num != page_num) {
+        hole = (hole + 1) & mask;
+    }
+
+    uint32_t slot = hole;
+    while (true) {
+        slot = (slot + 1) & mask;
+        uint32_t frame_index = pager->page_table[slot];
+        if (frame_index == INVALID_FRAME) {
+            break;
+        }
+        uint32_t home = page_table_slot(pager, pager->frames[frame_index].page_num);
+        // Entries whose home lies cyclically in (hole, slot] are still reachable
+        bool reachable = (hole <= slot) ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if (!reachable) {
+            pager->page_table[hole] = frame_index;
+            hole = slot;
+        }
+    }
+    pager->page_table[hole] = INVALID_FRAME;
+}
+
+// Writes one page image at its offset, retrying partial writes and signal interrupts
+void pager_write_page(Pager* pager, uint32_t page_num, void* data) {
+    if (pager->page_map != NULL) {
+        page_map_write_page(pager, page_num, data);
+        return;
+    }
+
+    pager_ring_forget(pager, page_num, 1);
+    if (pager->direct_io && (uintptr_t)data % page_size != 0) {
+        memcpy(pager->bounce, data, page_size);
+        data = pager->bounce;
+    }
+
+    off_t offset = (off_t)page_num * page_size;
+    size_t to_write = page_size;
+    char* buf = (char*)data;
+    while (to_write > 0) {
+        ssize_t written = pwrite(pager->file_descriptor, buf, to_write, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&stats.bytes_written, (uint64_t)written);
+        to_write -= (size_t)written;
+        buf += written;
+        offset += written;
+    }
+    pager_track_write(pager, page_num, 1);
+
+    if (offset > pager->file_length) {
+        pager->file_length = offset;
+    }
+}
+
+// CLOCK sweep: skip pinned frames, give referenced frames a second chance, write back the victim.
+// With the WAL on, the database file only changes at checkpoints, so dirty frames are skipped too,
+// and so they are in a transaction, which must not reach the file before its commit.
+// Returns INVALID_FRAME when no frame can be evicted.
+uint32_t pager_evict_frame(Pager* pager) {
+    for (uint32_t scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+        uint32_t frame_index = pager->clock_hand;
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        Frame* frame = &pager->frames[frame_index];
+        if (frame->page_num == INVALID_PAGE_NUM) {
+            // Emptied by pager_drop_frames
+            return frame_index;
+        }
+        if (frame->pin_count > 0 || (frame->dirty && (pager->wal != NULL || pager->in_transaction))) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        // Clean frames can simply be dropped; dirty ones are written back (synced at the next flush)
+        if (frame->dirty) {
+            pager_write_page(pager, frame->page_num, frame->data);
+            frame->dirty = false;
+            pager->num_dirty--;
+        }
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        return frame_index;
+    }
+
+    return INVALID_FRAME;
+}
+
+// Sizes the page table for num_frames and re-inserts every cached page
+void pager_rebuild_page_table(Pager* pager) {
+    free(pager->page_table);
+    pager->page_table_bits = 1;
+    while ((1u << pager->page_table_bits) < 2 * pager->num_frames) {
+        pager->page_table_bits++;
+    }
+    pager->page_table = malloc(sizeof(uint32_t) << pager->page_table_bits);
+    if (pager->page_table == NULL) {
+        fprintf(stderr, "Error: malloc failed for buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < (1u << pager->page_table_bits); i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].page_num != INVALID_PAGE_NUM) {
+            page_table_insert(pager, pager->frames[i].page_num, i);
+        }
+    }
+}
+
+// Adds frames beyond the budget when every frame is pinned or waiting for a checkpoint
+void pager_grow(Pager* pager) {
+    uint32_t extra = pager->frame_budget / 4;
+    if (extra < PAGER_MIN_FRAMES) {
+        extra = PAGER_MIN_FRAMES;
+    }
+    pager->num_frames += extra;
+    pager->frames = realloc(pager->frames, sizeof(Frame) * pager->num_frames);
+    if (pager->frames == NULL) {
+        fprintf(stderr, "Error: malloc failed for buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+    pager_rebuild_page_table(pager);
+}
+
+// Gives back frames added by pager_grow once they are clean and unpinned
+void pager_shrink_to_budget(Pager* pager) {
+    if (pager->num_frames <= pager->frame_budget) {
+        return;
+    }
+    for (uint32_t i = pager->frame_budget; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].pin_count > 0 || pager->frames[i].dirty) {
+            return;
+        }
+    }
+    for (uint32_t i = pager->frame_budget; i < pager->frames_in_use; i++) {
+        free(pager->frames[i].buffer);
+    }
+    if (pager->frames_in_use > pager->frame_budget) {
+        pager->frames_in_use = pager->frame_budget;
+    }
+    pager->num_frames = pager->frame_budget;
+    pager->clock_hand = 0;
+    pager->frames = realloc(pager->frames, sizeof(Frame) * pager->num_frames);
+    pager_rebuild_page_table(pager);
+}
+
+// Open a database file using pager
+Pager* pager_open(const char* filename, const DbOptions* options) {
+    // This stores our flags like write, read, create, close. A reader needs an existing file.
+    int fd = options->read_only ? open(filename, O_RDONLY) : open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    // Checks if file failed to open (fd = -1 means error)
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // One writer at a time; readers wait while it recovers and checks the file
+    if (!options->read_only) {
+        if (!pager_lock(fd, F_WRLCK, LOCK_WRITER_BYTE, false)) {
+            fprintf(stderr, "Error: database is locked by another process\n");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        pager_lock(fd, F_WRLCK, LOCK_READERS_BYTE, true);
+    }
+
+    // Creates memory in RAM for Pager
+    Pager* pager = malloc(sizeof(Pager));
+    if (pager == NULL) {
+        fprintf(stderr, "Error: malloc failed for Pager\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->file_descriptor = fd;
+    pager->read_only = options->read_only;
+    pager->snapshot.valid = false;
+    pager->filename = strdup(filename);
+    if (pager->filename == NULL) {
+        fprintf(stderr, "Error: malloc failed for Pager\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->file_length = lseek(fd, 0, SEEK_END);
+    pager->num_pages = 0;
+    pager->map = NULL;
+    pager->map_length = 0;
+
+    // A compressed file is recognized by its map header; only new files take the --compress choice.
+    // The page size has to be known from here on, and every page buffer is sized by it.
+    PageMapHeader map_header;
+    bool compressed = page_map_read_header(fd, &map_header);
+    uint32_t file_page_size = pager_file_page_size(fd, pager->file_length, compressed ? &map_header : NULL);
+    if (file_page_size == 0) {
+        file_page_size = options->page_size == 0 || options->read_only ? DEFAULT_PAGE_SIZE : options->page_size;
+    } else if (options->page_size != 0 && options->page_size != file_page_size && !options->read_only) {
+        fprintf(stderr, "Warning: --page-size only applies to new databases, '%s' keeps its %u-byte pages\n", filename, file_page_size);
+    }
+    // page_size is one global, so every database open in the process has to share it
+    if (open_pagers > 0 && file_page_size != page_size) {
+        fprintf(stderr, "Error: '%s' has %u-byte pages, but a database with %u-byte pages is already open\n",
+                filename, file_page_size, page_size);
+        exit(EXIT_FAILURE);
+    }
+    page_size = file_page_size;
+    open_pagers++;
+    pager->page_map = NULL;
+    // Recovery already writes pages, and pager_write_page looks at these (a backup tracks them)
+    pager->direct_io = false;
+    pager->bounce = NULL;
+    pager->ring = NULL;
+    pager->backup = NULL;
+    if (options->read_only) {
+        // Everything else about the file is read at the first statement
+        db_header_init(&pager->header);
+    } else if (compressed) {
+        page_map_open(pager, &map_header);
+    } else if (options->compress && pager->file_length == 0) {
+        page_map_open(pager, NULL);
+    } else if (options->compress) {
+        fprintf(stderr, "Warning: --compress only applies to new databases, '%s' stays uncompressed\n", filename);
+    }
+
+    // Finish an interrupted checkpoint before looking at the file. Without a log there is nothing
+    // to finish: db_open creates it once the file has passed its checks, so a refused file gets none.
+    Wal* wal = NULL;
+    if (options->wal && !options->read_only && wal_exists(filename)) {
+        wal = wal_open(filename, options);
+        wal_recover(wal, pager);
+    }
+
+    if (!options->read_only) {
+        if (pager->page_map == NULL) {
+            pager->file_length = lseek(fd, 0, SEEK_END);
+        }
+        pager_read_header(pager);
+    }
+
+    // The memory budget decides how many frames the pool may hold
+    size_t num_frames = options->cache_size / page_size;
+    if (num_frames < PAGER_MIN_FRAMES) {
+        num_frames = PAGER_MIN_FRAMES;
+    }
+    if (num_frames > (1u << 30)) {
+        num_frames = 1u << 30;
+    }
+    pager->num_frames = (uint32_t)num_frames;
+    pager->frame_budget = pager->num_frames;
+    pager->frames_in_use = 0;
+    pager->clock_hand = 0;
+    pager->num_dirty = 0;
+    pager->wal = wal;
+    pager->frames = malloc(sizeof(Frame) * pager->num_frames);
+    if (pager->frames == NULL) {
+        fprintf(stderr, "Error: malloc failed for buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep the page table at most half full so probe runs stay short
+    pager->page_table = NULL;
+    pager_rebuild_page_table(pager);
+
+    // Compressed pages have to be decoded into frames, so they can't be served from a mapping
+    pager->use_mmap = options->mmap && pager->page_map == NULL;
+    if (options->mmap && pager->page_map != NULL) {
+        fprintf(stderr, "Warning: --mmap is ignored for compressed databases\n");
+    }
+    pager->access_pattern = PAGER_ACCESS_RANDOM;
+    pager->concurrent = false;
+    pager->in_transaction = false;
+    pager->transaction_num_pages = 0;
+    pthread_mutex_init(&pager->pool_lock, NULL);
+    pthread_cond_init(&pager->frame_loaded, NULL);
+    pager_remap(pager);
+
+    // O_DIRECT is switched on only now: recovery and the header check above read and write
+    // through unaligned buffers
+    if (options->direct_io) {
+        if (pager->page_map != NULL || pager->use_mmap || options->read_only) {
+            fprintf(stderr, "Warning: --direct-io is ignored for compressed, mmap and read-only databases\n");
+        } else if (!pager_enable_direct_io(pager)) {
+            fprintf(stderr, "Warning: O_DIRECT is unavailable for '%s' (%s), using the page cache\n", filename, strerror(errno));
+        }
+    }
+    if (options->io_uring) {
+        pager->ring = io_ring_open();
+        if (pager->ring == NULL) {
+            fprintf(stderr, "Warning: io_uring is unavailable (%s), using synchronous I/O\n", strerror(errno));
+        }
+    }
+
+    // Before the first statement, bring back what the last session had cached
+    pager->warm_start = options->warm_start && !options->read_only;
+    if (pager->warm_start) {
+        pager_load_hot_pages(pager);
+    }
+
+    // With a WAL the file only changes at checkpoints, which take the readers' lock themselves.
+    // Without one, any eviction may write, so readers are kept out for the whole session.
+    if (wal != NULL) {
+        pager_lock(fd, F_UNLCK, LOCK_READERS_BYTE, true);
+    }
+    return pager;
+}
+
+// Creates the WAL that pager_open left to db_open because the file had none
+void pager_open_wal(Pager* pager, const DbOptions* options) {
+    if (!options->wal || pager->read_only || pager->wal != NULL) {
+        return;
+    }
+    pager->wal = wal_open(pager->filename, options);
+    wal_recover(pager->wal, pager);
+    pager_lock(pager->file_descriptor, F_UNLCK, LOCK_READERS_BYTE, true);
+}
+
+// Locks (or with F_UNLCK unlocks) one byte of the database file past all pages. The locks belong
+// to the open file, so they are dropped on close or exit. A writer holds LOCK_WRITER_BYTE for its
+// whole session. Readers share LOCK_READERS_BYTE during each statement, and the writer takes it
+// exclusively whenever it changes the file. Returns false when wait is false and the byte is taken.
+bool pager_lock(int file_descriptor, short type, off_t byte, bool wait) {
+    struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1 };
+    while (fcntl(file_descriptor, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == -1) {
+        if (errno == EINTR) continue;
+        if (!wait && (errno == EAGAIN || errno == EACCES)) {
+            return false;
+        }
+        fprintf(stderr, "Error locking database file: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+// Waits for running read statements to finish and keeps new ones out. A writer without a WAL
+// already holds the lock for its session.
+void pager_exclude_readers(Pager* pager) {
+    if (pager->wal != NULL) {
+        pager_lock(pager->file_descriptor, F_WRLCK, LOCK_READERS_BYTE, true);
+    }
+}
+
+void pager_admit_readers(Pager* pager) {
+    if (pager->wal != NULL) {
+        pager_lock(pager->file_descriptor, F_UNLCK, LOCK_READERS_BYTE, true);
+    }
+}
+
+// Read-only mode: brackets one statement. The readers' lock keeps the writer from changing the
+// file meanwhile. Cached pages are dropped first if the file changed since the last statement,
+// and the file is reopened if .vacuum replaced it.
+void pager_begin_read(Pager* pager) {
+    pager_lock(pager->file_descriptor, F_RDLCK, LOCK_READERS_BYTE, true);
+
+    struct stat path_stat;
+    struct stat file_stat;
+    if (stat(pager->filename, &path_stat) == -1 || fstat(pager->file_descriptor, &file_stat) == -1) {
+        fprintf(stderr, "Error: unable to stat %s: %s\n", pager->filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (path_stat.st_dev != file_stat.st_dev || path_stat.st_ino != file_stat.st_ino) {
+        int fd = open(pager->filename, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Error: unable to reopen %s: %s\n", pager->filename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        pager_lock(fd, F_RDLCK, LOCK_READERS_BYTE, true);
+        close(pager->file_descriptor);
+        pager->file_descriptor = fd;
+        if (fstat(fd, &file_stat) == -1) {
+            fprintf(stderr, "Error: unable to stat %s: %s\n", pager->filename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FileSnapshot snapshot = {
+        .valid = true,
+        .device = file_stat.st_dev,
+        .inode = file_stat.st_ino,
+        .size = file_stat.st_size,
+        .mtime = file_stat.st_mtim,
+    };
+    snapshot.has_wal = wal_read_salt(pager->filename, &snapshot.wal_salt);
+    FileSnapshot* cached = &pager->snapshot;
+    if (!cached->valid || cached->device != snapshot.device || cached->inode != snapshot.inode ||
+        cached->size != snapshot.size || cached->mtime.tv_sec != snapshot.mtime.tv_sec ||
+        cached->mtime.tv_nsec != snapshot.mtime.tv_nsec || cached->has_wal != snapshot.has_wal ||
+        cached->wal_salt != snapshot.wal_salt) {
+        pager_load_snapshot(pager);
+        *cached = snapshot;
+    }
+}
+
+// The same for the table, whose root may have moved if .vacuum replaced the file
+void table_begin_read(Table* table) {
+    pager_begin_read(table->pager);
+    table->root_page_num = table->pager->header.root_page_num;
+}
+
+void pager_end_read(Pager* pager) {
+    pager_lock(pager->file_descriptor, F_UNLCK, LOCK_READERS_BYTE, true);
+}
+
+// Read-only mode: forgets the cached pages and reads the file's format and size again
+void pager_load_snapshot(Pager* pager) {
+    if (wal_checkpoint_interrupted(pager->filename)) {
+        fprintf(stderr, "Error: a checkpoint of %s was interrupted; open it for writing once to recover it\n", pager->filename);
+        exit(EXIT_FAILURE);
+    }
+
+    pager_drop_frames(pager);
+    if (pager->page_map != NULL) {
+        page_map_close(pager->page_map);
+        pager->page_map = NULL;
+    }
+
+    pager->file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+    PageMapHeader header;
+    bool compressed = page_map_read_header(pager->file_descriptor, &header);
+    uint32_t file_page_size = pager_file_page_size(pager->file_descriptor, pager->file_length, compressed ? &header : NULL);
+    if (file_page_size != 0 && file_page_size != page_size) {
+        // The file was still empty when this reader opened it, and every frame is sized for the default
+        fprintf(stderr, "Error: %s was created with %u-byte pages after it was opened; open it again\n",
+                pager->filename, file_page_size);
+        exit(EXIT_FAILURE);
+    }
+    if (compressed) {
+        page_map_open(pager, &header);
+        pager->use_mmap = false;
+    }
+    // The header leaves out any pages a bulk import is appending, which no tree node points at yet
+    pager_read_header(pager);
+    if (pager->header.magic != DB_HEADER_MAGIC) {
+        fprintf(stderr, "Error: %s is in an older format; open it for writing once to upgrade it\n", pager->filename);
+        exit(EXIT_FAILURE);
+    }
+    pager_remap(pager);
+
+    // Until the writer has created the file the table is empty. The root only lives in the cache.
+    if (pager->num_pages == 0) {
+        void* root_node = get_page(pager, pager->header.root_page_num);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+    }
+}
+
+// Empties the buffer pool and unmaps the file. Nothing may be dirty or pinned.
+void pager_drop_frames(Pager* pager) {
+    pager_ring_forget(pager, 0, INVALID_PAGE_NUM);
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame* frame = &pager->frames[i];
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->referenced = false;
+        frame->mapped = false;
+        frame->data = frame->buffer;
+    }
+    pager_rebuild_page_table(pager);
+    if (pager->map != NULL) {
+        munmap(pager->map, pager->map_length);
+        pager->map = NULL;
+        pager->map_length = 0;
+    }
+}
+
+// Drops the shadow copies. A rollback first copies each back over its page, which is dirty again
+// only if it was at begin, and forgets the pages the transaction added to the end of the file.
+// Their frames hold no data worth writing, and no dirty frame was evicted in the meantime.
+void pager_end_transaction(Pager* pager, bool rollback) {
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame* frame = &pager->frames[i];
+        if (rollback && frame->page_num != INVALID_PAGE_NUM && frame->page_num >= pager->transaction_num_pages) {
+            if (frame->dirty) {
+                pager->num_dirty--;
+            }
+            page_table_remove(pager, frame->page_num);
+            frame->page_num = INVALID_PAGE_NUM;
+            frame->dirty = false;
+        } else if (rollback && frame->shadow != NULL) {
+            memcpy(frame->data, frame->shadow, page_size);
+            if (frame->dirty && !frame->shadow_dirty) {
+                pager->num_dirty--;
+            }
+            frame->dirty = frame->shadow_dirty;
+        }
+        free(frame->shadow);
+        frame->shadow = NULL;
+    }
+    if (rollback) {
+        pager->num_pages = pager->transaction_num_pages;
+    }
+    pager->in_transaction = false;
+}
+
+// Every entry point to the buffer pool brackets its work with these. A single-threaded process
+// skips the mutex.
+void pager_lock_pool(Pager* pager) {
+    if (pager->concurrent) {
+        pthread_mutex_lock(&pager->pool_lock);
+    }
+}
+
+void pager_unlock_pool(Pager* pager) {
+    if (pager->concurrent) {
+        pthread_mutex_unlock(&pager->pool_lock);
+    }
+}
+
+// Finds the frame for page_num, loading the page from disk (and evicting another one) on a miss.
+// Called with the pool locked. The read itself runs with the lock dropped: the frame is published
+// pinned and loading first, so other threads fetching the same page wait for it and nobody evicts it.
+uint32_t pager_fetch_frame(Pager* pager, uint32_t page_num) {
+    if (page_num == INVALID_PAGE_NUM) {
+        fprintf(stderr, "Tried to fetch page number out of bounds. %u\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    while (frame_index != INVALID_FRAME && pager->frames[frame_index].loading) {
+        // Only happens while concurrent: the lock is held, and the loader broadcasts under it
+        pthread_cond_wait(&pager->frame_loaded, &pager->pool_lock);
+        frame_index = page_table_lookup(pager, page_num);
+    }
+    if (frame_index == INVALID_FRAME) {
+        // Cache miss. Claim a frame and load from file.
+        if (pager->frames_in_use < pager->num_frames) {
+            frame_index = pager->frames_in_use++;
+            pager->frames[frame_index].buffer = NULL;
+            pager->frames[frame_index].shadow = NULL;
+            pager->frames[frame_index].loading = false;
+        } else {
+            frame_index = pager_evict_frame(pager);
+            if (frame_index == INVALID_FRAME) {
+                pager_grow(pager);
+                return pager_fetch_frame(pager, page_num);
+            }
+        }
+        stats.page_misses++;
+
+        Frame* frame = &pager->frames[frame_index];
+        size_t page_offset = (size_t)page_num * page_size;
+        if (pager->map != NULL && page_offset + page_size <= pager->map_length) {
+            // mmap mode: no copy, the frame just points at the kernel's page cache
+            frame->data = pager->map + page_offset;
+            frame->mapped = true;
+        } else {
+            if (frame->buffer == NULL) {
+                // Aligned so the page can go to and from an O_DIRECT file as it is
+                frame->buffer = aligned_alloc(page_size, page_size);
+                if (frame->buffer == NULL) {
+                    fprintf(stderr, "Error: malloc failed for page\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            frame->data = frame->buffer;
+            frame->mapped = false;
+        }
+
+        frame->page_num = page_num;
+        frame->pin_count = 0;
+        frame->dirty = false;
+        page_table_insert(pager, page_num, frame_index);
+
+        if (page_num >= pager->num_pages) {
+            pager->num_pages = page_num + 1;
+        }
+
+        if (!frame->mapped) {
+            // Everything the read needs from the pager is taken under the lock. The ring and the
+            // page map's write buffer aren't thread-safe, so they are only used here too.
+            void* page = frame->buffer;
+            PageExtent extent = { 0 };
+            ssize_t bytes_read = 0;
+            if (pager->page_map != NULL) {
+                extent = page_map_locate(pager, page_num);
+            } else if ((off_t)page_offset < pager->file_length) {
+                // The io_uring backend may have read the page ahead already
+                bytes_read = pager->ring != NULL ? pager_ring_take(pager, page_num, page) : -1;
+            }
+            frame->pin_count = 1;
+            frame->loading = true;
+            pager_unlock_pool(pager);
+
+            if (pager->page_map != NULL) {
+                // Only the I/O path deals with compression; the frame holds the plain page
+                void* scratch = malloc(page_size);
+                if (scratch == NULL) {
+                    fprintf(stderr, "Error: malloc failed for page\n");
+                    exit(EXIT_FAILURE);
+                }
+                page_map_load(pager, page_num, extent, page, scratch);
+                free(scratch);
+                bytes_read = page_size;
+            } else if (bytes_read == -1) {
+                bytes_read = pread(pager->file_descriptor, page, page_size, (off_t)page_offset);
+                if (bytes_read == -1) {
+                    fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                stats_add(&stats.bytes_read, (uint64_t)bytes_read);
+            }
+            if (bytes_read < (ssize_t)page_size) {
+                memset((char*)page + bytes_read, 0, page_size - (size_t)bytes_read);
+            }
+
+            // pager_grow may have moved the frames while the lock was dropped
+            pager_lock_pool(pager);
+            frame = &pager->frames[frame_index];
+            frame->loading = false;
+            frame->pin_count--;
+            if (pager->concurrent) {
+                pthread_cond_broadcast(&pager->frame_loaded);
+            }
+        }
+    } else {
+        stats.page_hits++;
+    }
+
+    pager->frames[frame_index].referenced = true;
+    return frame_index;
+}
+
+// This finds the data in RAM first. If it's not there, it goes to the (Hard Drive) to fetch it.
+// The pointer stays valid until the page is evicted; pin it to hold it across other get_page calls.
+// In server mode other readers fetch pages at the same time, so readers pin every page they use.
+void* get_page(Pager* pager, uint32_t page_num) {
+    pager_lock_pool(pager);
+    uint32_t frame_index = pager_fetch_frame(pager, page_num);
+    void* data = pager->frames[frame_index].data;
+    pager_unlock_pool(pager);
+    return data;
+}
+
+// Like get_page, but marks the page as modified. Anything that changes a page must fetch it this way
+// so the change is written back on eviction and flush, and can be rolled back in a transaction. In mmap mode the returned pointer differs
+// from earlier get_page results for the same page, so don't keep using those.
+void* get_page_for_write(Pager* pager, uint32_t page_num) {
+    // Fetch first: a miss may grow (and move) the frame array
+    pager_lock_pool(pager);
+    uint32_t frame_index = pager_fetch_frame(pager, page_num);
+    Frame* frame = &pager->frames[frame_index];
+    if (frame->mapped) {
+        // The mapping is read-only: copy the page into the frame's own buffer before changing it
+        if (frame->buffer == NULL) {
+            frame->buffer = aligned_alloc(page_size, page_size);
+            if (frame->buffer == NULL) {
+                fprintf(stderr, "Error: malloc failed for page\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(frame->buffer, frame->data, page_size);
+        frame->data = frame->buffer;
+        frame->mapped = false;
+    }
+    if (pager->in_transaction && frame->shadow == NULL && page_num < pager->transaction_num_pages) {
+        // First change since begin: keep the page as it was for a rollback
+        frame->shadow = malloc(page_size);
+        if (frame->shadow == NULL) {
+            fprintf(stderr, "Error: malloc failed for transaction\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(frame->shadow, frame->data, page_size);
+        frame->shadow_dirty = frame->dirty;
+    }
+    if (!frame->dirty) {
+        frame->dirty = true;
+        pager->num_dirty++;
+    }
+    void* data = frame->data;
+    pager_unlock_pool(pager);
+    return data;
+}
+
+// Like get_page, but the frame cannot be evicted until the matching pager_unpin
+void* pager_pin(Pager* pager, uint32_t page_num) {
+    pager_lock_pool(pager);
+    uint32_t frame_index = pager_fetch_frame(pager, page_num);
+    Frame* frame = &pager->frames[frame_index];
+    frame->pin_count++;
+    void* data = frame->data;
+    pager_unlock_pool(pager);
+    return data;
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num) {
+    pager_lock_pool(pager);
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    if (frame_index == INVALID_FRAME || pager->frames[frame_index].pin_count == 0) {
+        fprintf(stderr, "Tried to unpin page %u that is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_index].pin_count--;
+    pager_unlock_pool(pager);
+}
+
+int compare_frames_by_page_num(const void* a, const void* b) {
+    uint32_t page_a = (*(Frame* const*)a)->page_num;
+    uint32_t page_b = (*(Frame* const*)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+// Writes a run of consecutive pages starting at first_page_num with one vectored write per call.
+// Every buffer must hold whole pages.
+void pager_write_run(Pager* pager, uint32_t first_page_num, struct iovec* iov, int iov_count) {
+    if (pager->page_map != NULL) {
+        uint32_t page_num = first_page_num;
+        for (int i = 0; i < iov_count; i++) {
+            for (size_t done = 0; done < iov[i].iov_len; done += page_size) {
+                page_map_write_page(pager, page_num++, (char*)iov[i].iov_base + done);
+            }
+        }
+        return;
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < iov_count; i++) {
+        length += iov[i].iov_len;
+    }
+    pager_ring_forget(pager, first_page_num, (uint32_t)(length / page_size));
+    pager_track_write(pager, first_page_num, (uint32_t)(length / page_size));
+
+    off_t offset = (off_t)first_page_num * page_size;
+    while (iov_count > 0) {
+        ssize_t written = pwritev(pager->file_descriptor, iov, iov_count, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&stats.bytes_written, (uint64_t)written);
+        offset += written;
+
+        // Skip past fully written buffers and trim a partially written one
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    if (offset > pager->file_length) {
+        pager->file_length = offset;
+    }
+}
+
+// Records pages written to a plain file for the next incremental .backup
+void pager_track_write(Pager* pager, uint32_t first_page_num, uint32_t num_pages) {
+    BackupState* backup = pager->backup;
+    if (backup == NULL) {
+        return;
+    }
+    uint32_t end = first_page_num + num_pages;
+    if (end > backup->changed_capacity) {
+        uint32_t capacity = backup->changed_capacity * 2 > end ? backup->changed_capacity * 2 : end;
+        capacity = (capacity + 63) / 64 * 64;
+        backup->changed = realloc(backup->changed, capacity / 8);
+        if (backup->changed == NULL) {
+            fprintf(stderr, "Error: malloc failed for backup\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(backup->changed + backup->changed_capacity / 64, 0, (capacity - backup->changed_capacity) / 8);
+        backup->changed_capacity = capacity;
+    }
+    for (uint32_t page_num = first_page_num; page_num < end; page_num++) {
+        backup->changed[page_num / 64] |= 1ull << (page_num % 64);
+    }
+}
+
+// Writes data from RAM to the hard drive: every dirty page in page order, adjacent pages
+// coalesced into one pwritev, then a single fdatasync
+void pager_flush(Pager* pager) {
+    Frame** dirty = malloc(sizeof(Frame*) * (pager->frames_in_use + 1));
+    if (dirty == NULL) {
+        fprintf(stderr, "Error: malloc failed for flush\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame* frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+            dirty[num_dirty++] = frame;
+        }
+    }
+    qsort(dirty, num_dirty, sizeof(Frame*), compare_frames_by_page_num);
+
+    // Compressed files place pages through the page map, which the ring doesn't know about
+    if (pager->ring != NULL && pager->page_map == NULL) {
+        pager_ring_flush(pager, dirty, num_dirty);
+        free(dirty);
+        pager_remap(pager);
+        return;
+    }
+
+    struct iovec* iov = malloc(sizeof(struct iovec) * FLUSH_MAX_IOV);
+    if (iov == NULL) {
+        fprintf(stderr, "Error: malloc failed for flush\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t i = 0;
+    while (i < num_dirty) {
+        uint32_t first_page_num = dirty[i]->page_num;
+        int iov_count = 0;
+        while (i < num_dirty && iov_count < FLUSH_MAX_IOV && dirty[i]->page_num == first_page_num + (uint32_t)iov_count) {
+            iov[iov_count].iov_base = dirty[i]->data;
+            iov[iov_count].iov_len = page_size;
+            dirty[i]->dirty = false;
+            pager->num_dirty--;
+            iov_count++;
+            i++;
+        }
+        pager_write_run(pager, first_page_num, iov, iov_count);
+    }
+
+    free(iov);
+    free(dirty);
+
+    // Like wal_sync: the WAL is reset once this returns, so a page that may not be durable must stop
+    // the process while the log still holds it
+    if (!pager_sync(pager)) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Flushes happen between statements, a safe point to extend the mapping over new pages
+    pager_remap(pager);
+}
+
+// Switches the pager over to the file replacement was opened on (now holding the same name) and
+// frees replacement. Every cached page is dropped, so nothing may be dirty or pinned.
+void pager_replace_file(Pager* pager, Pager* replacement) {
+    pager_drop_frames(pager);
+    // Every page moved, so the next backup copies the whole file
+    backup_state_free(pager->backup);
+    pager->backup = NULL;
+    if (pager->page_map != NULL) {
+        page_map_close(pager->page_map);
+    }
+
+    // Closing the old descriptor drops its locks; the new file was locked when it was opened, but
+    // without a WAL, so it still keeps readers out
+    close(pager->file_descriptor);
+    pager->file_descriptor = replacement->file_descriptor;
+    if (pager->wal != NULL) {
+        pager_lock(pager->file_descriptor, F_UNLCK, LOCK_READERS_BYTE, true);
+    }
+    pager->file_length = replacement->file_length;
+    pager->num_pages = replacement->num_pages;
+    pager->header = replacement->header;
+    pager->page_map = replacement->page_map;
+    if (pager->direct_io && !pager_enable_direct_io(pager)) {
+        pager->direct_io = false;
+    }
+    if (replacement->ring != NULL) {
+        io_ring_close(replacement->ring);
+    }
+    free(replacement->bounce);
+    free(replacement->frames);
+    free(replacement->page_table);
+    free(replacement->filename);
+    pthread_mutex_destroy(&replacement->pool_lock);
+    pthread_cond_destroy(&replacement->frame_loaded);
+    free(replacement);
+    open_pagers--;
+    pager_remap(pager);
+}
+
+// Makes every page written so far durable. A compressed file also commits its page map.
+bool pager_sync(Pager* pager) {
+    if (pager->page_map != NULL) {
+        page_map_commit(pager);
+        return true;
+    }
+    return stats_fdatasync(pager->file_descriptor, &stats.syncs) == 0;
+}
+
+// mmap mode: grows the mapping to cover the whole file. Frames pointing into the old mapping
+// are moved along with it, so this is skipped while any of them is pinned.
+void pager_remap(Pager* pager) {
+    if (!pager->use_mmap || (size_t)pager->file_length <= pager->map_length) {
+        return;
+    }
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        if (pager->frames[i].mapped && pager->frames[i].pin_count > 0) {
+            return;
+        }
+    }
+
+    size_t new_length = (size_t)pager->file_length;
+    void* map;
+    if (pager->map == NULL) {
+        map = mmap(NULL, new_length, PROT_READ, MAP_SHARED, pager->file_descriptor, 0);
+    } else {
+        map = mremap(pager->map, pager->map_length, new_length, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping database file: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+        Frame* frame = &pager->frames[i];
+        if (frame->mapped) {
+            frame->data = (char*)map + (size_t)frame->page_num * page_size;
+        }
+    }
+    pager->map = map;
+    pager->map_length = new_length;
+    pager_set_access_pattern(pager, pager->access_pattern);
+}
+
+// Starts reading a page the caller expects to need soon, without waiting for it
+void pager_prefetch(Pager* pager, uint32_t page_num) {
+    pager_prefetch_batch(pager, &page_num, 1);
+}
+
+// pager_prefetch for several pages. The io_uring backend hands all their reads to the kernel at once.
+void pager_prefetch_batch(Pager* pager, const uint32_t* page_nums, uint32_t count) {
+    // An eviction on another thread may be moving compressed pages around
+    pager_lock_pool(pager);
+    bool queued = false;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_num = page_nums[i];
+        off_t offset = (off_t)page_num * page_size;
+        off_t length = page_size;
+        if (pager->page_map != NULL) {
+            if (page_num >= pager->page_map->capacity) {
+                continue;
+            }
+            offset = (off_t)pager->page_map->extents[page_num].sector * EXTENT_SECTOR_SIZE;
+            length = pager->page_map->extents[page_num].length;
+        }
+        if (page_num == 0 || length == 0 || offset >= pager->file_length || page_table_lookup(pager, page_num) != INVALID_FRAME) {
+            continue;
+        }
+        if (pager->ring != NULL && pager->page_map == NULL && pager->map == NULL) {
+            // The ring reads the page into a slot of its own; the pool lock also guards the ring
+            queued = pager_ring_prefetch(pager, page_num) || queued;
+            continue;
+        }
+        // The hints may block for a while; other threads can use the pool meanwhile
+        pager_unlock_pool(pager);
+        if (pager->map != NULL && (size_t)offset + page_size <= pager->map_length) {
+            madvise(pager->map + offset, page_size, MADV_WILLNEED);
+        } else {
+            posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+        }
+        pager_lock_pool(pager);
+    }
+    if (queued) {
+        io_ring_enter(pager->ring, 0);
+    }
+    pager_unlock_pool(pager);
+}
+
+// Tells the kernel how pages are about to be read so it can tune readahead
+void pager_set_access_pattern(Pager* pager, PagerAccessPattern pattern) {
+    pager_lock_pool(pager);
+    pager->access_pattern = pattern;
+    if (pager->map != NULL) {
+        madvise(pager->map, pager->map_length, pattern == PAGER_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+    } else {
+        posix_fadvise(pager->file_descriptor, 0, 0, pattern == PAGER_ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+    }
+    pager_unlock_pool(pager);
+}
+
+// <db_filename>-hot, allocated
+char* hot_pages_path(const char* db_filename) {
+    size_t path_length = strlen(db_filename) + sizeof("-hot");
+    char* path = malloc(path_length);
+    if (path == NULL) {
+        fprintf(stderr, "Error: malloc failed for hot page list\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, path_length, "%s-hot", db_filename);
+    return path;
+}
+
+// Writes the numbers of the cached pages to <file>-hot. The header, the catalog and internal
+// nodes go first, since every lookup passes through them, then leaves used since the CLOCK hand
+// last went by, then the rest. Failing to write it only costs the next open its warm start.
+void pager_save_hot_pages(Pager* pager) {
+    if (!pager->warm_start) {
+        return;
+    }
+    uint32_t* page_nums = malloc(sizeof(uint32_t) * (pager->frames_in_use + 1));
+    if (page_nums == NULL) {
+        fprintf(stderr, "Error: malloc failed for hot page list\n");
+        exit(EXIT_FAILURE);
+    }
+    pager_lock_pool(pager);
+    uint32_t count = 0;
+    for (uint32_t rank = 0; rank < 3; rank++) {
+        for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+            Frame* frame = &pager->frames[i];
+            if (frame->page_num == INVALID_PAGE_NUM) {
+                continue;
+            }
+            uint32_t frame_rank = frame->page_num <= CATALOG_PAGE_NUM || get_node_type(frame->data) == NODE_INTERNAL ? 0 :
+                                  frame->referenced ? 1 : 2;
+            if (frame_rank == rank) {
+                page_nums[count++] = frame->page_num;
+            }
+        }
+    }
+    pager_unlock_pool(pager);
+
+    HotPagesHeader header = {
+        .magic = HOT_PAGES_MAGIC,
+        .count = count,
+        .checksum = crc32_update(0, page_nums, sizeof(uint32_t) * count),
+    };
+    char* path = hot_pages_path(pager->filename);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd != -1) {
+        struct iovec iov[2] = {
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = page_nums, .iov_len = sizeof(uint32_t) * count },
+        };
+        if (writev(fd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+            unlink(path);
+        }
+        close(fd);
+    }
+    free(path);
+    free(page_nums);
+}
+
+int compare_page_nums(const void* a, const void* b) {
+    uint32_t page_a = *(const uint32_t*)a;
+    uint32_t page_b = *(const uint32_t*)b;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+// Reads the pages listed in <file>-hot into free frames before the first statement has to wait
+// for them. The most important pages that fit are taken and read in page order: the kernel hears
+// about every run of consecutive pages first, so it can work on all of them at once, then each run
+// goes into its frames with one preadv. The frames start unreferenced, so pages that turn out cold
+// are the first to be evicted.
+void pager_load_hot_pages(Pager* pager) {
+    char* path = hot_pages_path(pager->filename);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return;
+    }
+    HotPagesHeader header;
+    uint32_t* page_nums = NULL;
+    off_t length = lseek(fd, 0, SEEK_END);
+    if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.magic == HOT_PAGES_MAGIC &&
+        length == (off_t)(sizeof(header) + sizeof(uint32_t) * (size_t)header.count)) {
+        page_nums = malloc(sizeof(uint32_t) * ((size_t)header.count + 1));
+        if (page_nums == NULL) {
+            fprintf(stderr, "Error: malloc failed for hot page list\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t list_length = sizeof(uint32_t) * header.count;
+        if (pread(fd, page_nums, list_length, sizeof(header)) != (ssize_t)list_length ||
+            crc32_update(0, page_nums, list_length) != header.checksum) {
+            free(page_nums);
+            page_nums = NULL;
+        }
+    }
+    close(fd);
+    if (page_nums == NULL) {
+        return;
+    }
+
+    // Pages the file no longer has (after a crash, say) are left out
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < header.count && pager->frames_in_use + count < pager->num_frames; i++) {
+        if (page_nums[i] < pager->num_pages && page_table_lookup(pager, page_nums[i]) == INVALID_FRAME) {
+            page_nums[count++] = page_nums[i];
+        }
+    }
+    qsort(page_nums, count, sizeof(uint32_t), compare_page_nums);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (unique == 0 || page_nums[i] != page_nums[unique - 1]) {
+            page_nums[unique++] = page_nums[i];
+        }
+    }
+    count = unique;
+
+    bool plain = pager->page_map == NULL && pager->map == NULL;
+    if (plain) {
+        for (uint32_t start = 0, run = 1; start < count; start += run, run = 1) {
+            while (start + run < count && page_nums[start + run] == page_nums[start] + run) {
+                run++;
+            }
+            posix_fadvise(pager->file_descriptor, (off_t)page_nums[start] * page_size, (off_t)run * page_size, POSIX_FADV_WILLNEED);
+        }
+    } else {
+        pager_prefetch_batch(pager, page_nums, count);
+    }
+
+    struct iovec* iov = malloc(sizeof(struct iovec) * FLUSH_MAX_IOV);
+    if (iov == NULL) {
+        fprintf(stderr, "Error: malloc failed for hot page list\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t start = 0, run = 1; start < count; start += run, run = 1) {
+        while (start + run < count && run < FLUSH_MAX_IOV && page_nums[start + run] == page_nums[start] + run) {
+            run++;
+        }
+        // In mmap mode only the pages past the end of the mapping are read, and they come last
+        uint32_t first_read = INVALID_PAGE_NUM;
+        int iov_count = 0;
+        for (uint32_t i = 0; i < run; i++) {
+            uint32_t page_num = page_nums[start + i];
+            uint32_t frame_index = pager->frames_in_use++;
+            Frame* frame = &pager->frames[frame_index];
+            frame->page_num = page_num;
+            frame->pin_count = 0;
+            frame->referenced = false;
+            frame->dirty = false;
+            frame->mapped = false;
+            frame->loading = false;
+            frame->buffer = NULL;
+            frame->shadow = NULL;
+            size_t page_offset = (size_t)page_num * page_size;
+            if (pager->map != NULL && page_offset + page_size <= pager->map_length) {
+                frame->data = pager->map + page_offset;
+                frame->mapped = true;
+            } else {
+                frame->buffer = aligned_alloc(page_size, page_size);
+                if (frame->buffer == NULL) {
+                    fprintf(stderr, "Error: malloc failed for page\n");
+                    exit(EXIT_FAILURE);
+                }
+                frame->data = frame->buffer;
+                if (pager->page_map != NULL) {
+                    page_map_read_page(pager, page_num, frame->data);
+                } else {
+                    if (iov_count == 0) {
+                        first_read = page_num;
+                    }
+                    iov[iov_count++] = (struct iovec){ .iov_base = frame->data, .iov_len = page_size };
+                }
+            }
+            page_table_insert(pager, page_num, frame_index);
+        }
+        if (iov_count > 0) {
+            ssize_t bytes_read = preadv(pager->file_descriptor, iov, iov_count, (off_t)first_read * page_size);
+            if (bytes_read == -1) {
+                fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            stats_add(&stats.bytes_read, (uint64_t)bytes_read);
+            // Pages past the end of the file read as zeros, as in pager_fetch_frame
+            for (int i = 0; i < iov_count; i++) {
+                ssize_t page_start = (ssize_t)i * page_size;
+                if (bytes_read < page_start + (ssize_t)page_size) {
+                    size_t valid = bytes_read > page_start ? (size_t)(bytes_read - page_start) : 0;
+                    memset((char*)iov[i].iov_base + valid, 0, page_size - valid);
+                }
+            }
+        }
+    }
+    stats.pages_warmed += count;
+    free(iov);
+    free(page_nums);
+}
+
+// Parses a byte count such as 4096, 512K, 64M or 2G
+bool parse_size(const char* text, size_t* size) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; /* fall through */
+        case 'M': case 'm': value <<= 10; /* fall through */
+        case 'K': case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    *size = (size_t)value;
+    return true;
+}
+
+/* --- io_uring Backend --- */
+
+// Sets up a ring and the prefetch buffers. Returns NULL with errno set when the kernel has no
+// io_uring (or forbids it), in which case the pager keeps using plain system calls.
+IoRing* io_ring_open(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring_fd == -1) {
+        return NULL;
+    }
+
+    IoRing* ring = calloc(1, sizeof(IoRing));
+    if (ring == NULL) {
+        fprintf(stderr, "Error: malloc failed for io_uring\n");
+        exit(EXIT_FAILURE);
+    }
+    ring->ring_fd = ring_fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring_fd);
+        free(ring);
+        errno = error;
+        return NULL;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    ring->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    char* cq = ring->cq_ring;
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cq_entries = params.cq_entries;
+
+    // Registered buffers spare the kernel from mapping the pages for every read. Without them
+    // (locked memory limits, old kernels) the slots are read with plain IORING_OP_READ.
+    ring->slot_buffers = aligned_alloc(page_size, (size_t)IO_RING_READ_SLOTS * page_size);
+    if (ring->slot_buffers == NULL) {
+        fprintf(stderr, "Error: malloc failed for io_uring\n");
+        exit(EXIT_FAILURE);
+    }
+    struct iovec buffers[IO_RING_READ_SLOTS];
+    for (uint32_t i = 0; i < IO_RING_READ_SLOTS; i++) {
+        ring->slots[i].page_num = INVALID_PAGE_NUM;
+        buffers[i].iov_base = ring->slot_buffers + (size_t)i * page_size;
+        buffers[i].iov_len = page_size;
+    }
+    ring->buffers_registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers, IO_RING_READ_SLOTS) == 0;
+    return ring;
+}
+
+// Waits for whatever is still in flight, then tears the ring down
+void io_ring_close(IoRing* ring) {
+    while (ring->in_flight > 0) {
+        io_ring_reap(ring, true);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    free(ring->slot_buffers);
+    free(ring);
+}
+
+// Hands the kernel everything queued and, with min_complete, waits until that many completions
+// are available
+void io_ring_enter(IoRing* ring, uint32_t min_complete) {
+    while (true) {
+        int submitted = (int)syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit, min_complete,
+                                     min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: io_uring_enter failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ring->to_submit -= (uint32_t)submitted;
+        if (ring->to_submit == 0) {
+            return;
+        }
+    }
+}
+
+// A zeroed submission entry for the caller to fill in and io_ring_push. When the submission queue
+// is full, the queued entries are handed over first; when the completion queue could fill up,
+// completions are reaped first.
+struct io_uring_sqe* io_ring_get_sqe(IoRing* ring) {
+    while (true) {
+        uint32_t tail = *ring->sq_tail;
+        if (ring->in_flight >= ring->cq_entries) {
+            io_ring_reap(ring, true);
+        } else if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            io_ring_enter(ring, 0);
+        } else {
+            struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+    }
+}
+
+// Publishes the entry io_ring_get_sqe returned; the kernel sees it at the next io_ring_enter
+void io_ring_push(IoRing* ring) {
+    uint32_t tail = *ring->sq_tail;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->in_flight++;
+}
+
+// Takes every available completion off the ring and records its result where its user_data
+// points. With wait, blocks for at least one first.
+void io_ring_reap(IoRing* ring, bool wait) {
+    if (wait) {
+        io_ring_enter(ring, 1);
+    }
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        uint32_t index = (uint32_t)cqe->user_data;
+        switch (cqe->user_data & IO_RING_TAG_MASK) {
+            case IO_RING_TAG_READ:
+                if (cqe->res > 0) {
+                    stats_add(&stats.bytes_read, (uint64_t)cqe->res);
+                }
+                ring->slots[index].result = cqe->res;
+                ring->slots[index].in_flight = false;
+                break;
+            case IO_RING_TAG_WRITE:
+                if (cqe->res > 0) {
+                    stats_add(&stats.bytes_written, (uint64_t)cqe->res);
+                }
+                ring->writes[index].result = cqe->res;
+                break;
+            case IO_RING_TAG_SYNC:
+                ring->sync_result = cqe->res;
+                break;
+        }
+        ring->in_flight--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Queues a read of page_num into a free slot; returns false if nothing was queued. With the next
+// slot still waiting on the disk the prefetch is dropped; a completed slot nobody took is given
+// up for the newer page.
+bool pager_ring_prefetch(Pager* pager, uint32_t page_num) {
+    IoRing* ring = pager->ring;
+    io_ring_reap(ring, false);
+    for (uint32_t i = 0; i < IO_RING_READ_SLOTS; i++) {
+        if (ring->slots[i].page_num == page_num) {
+            return false;
+        }
+    }
+    uint32_t index = ring->next_slot;
+    IoRingReadSlot* slot = &ring->slots[index];
+    if (slot->in_flight) {
+        return false;
+    }
+    ring->next_slot = (index + 1) % IO_RING_READ_SLOTS;
+
+    struct io_uring_sqe* sqe = io_ring_get_sqe(ring);
+    sqe->opcode = ring->buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = pager->file_descriptor;
+    sqe->addr = (uint64_t)(uintptr_t)(ring->slot_buffers + (size_t)index * page_size);
+    sqe->len = page_size;
+    sqe->off = (uint64_t)page_num * page_size;
+    sqe->buf_index = (uint16_t)index;
+    sqe->user_data = IO_RING_TAG_READ | index;
+    slot->page_num = page_num;
+    slot->in_flight = true;
+    io_ring_push(ring);
+    return true;
+}
+
+// Cache miss: copies page_num out of its prefetch slot, waiting for the read if it is still going.
+// Returns the bytes read, or -1 when the page wasn't prefetched (or the read failed) and the
+// caller has to read it itself.
+ssize_t pager_ring_take(Pager* pager, uint32_t page_num, void* page) {
+    IoRing* ring = pager->ring;
+    for (uint32_t i = 0; i < IO_RING_READ_SLOTS; i++) {
+        IoRingReadSlot* slot = &ring->slots[i];
+        if (slot->page_num != page_num) {
+            continue;
+        }
+        while (slot->in_flight) {
+            io_ring_reap(ring, true);
+        }
+        slot->page_num = INVALID_PAGE_NUM;
+        if (slot->result < 0) {
+            return -1;
+        }
+        memcpy(page, ring->slot_buffers + (size_t)i * page_size, (size_t)slot->result);
+        return slot->result;
+    }
+    return -1;
+}
+
+// Throws away prefetched copies of pages about to be overwritten, so a later miss can't see stale data
+void pager_ring_forget(Pager* pager, uint32_t first_page_num, uint32_t num_pages) {
+    IoRing* ring = pager->ring;
+    if (ring == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < IO_RING_READ_SLOTS; i++) {
+        IoRingReadSlot* slot = &ring->slots[i];
+        if (slot->page_num != INVALID_PAGE_NUM && slot->page_num - first_page_num < num_pages) {
+            while (slot->in_flight) {
+                io_ring_reap(ring, true);
+            }
+            slot->page_num = INVALID_PAGE_NUM;
+        }
+    }
+}
+
+// pager_flush with the ring: one vectored write per run of consecutive dirty pages, all submitted
+// together, and a data sync queued behind them. The sync is drained (IOSQE_IO_DRAIN) rather than
+// linked: a link chain would make every write wait for the one before it. A run the kernel wrote
+// only partly is written again synchronously and synced on its own.
+void pager_ring_flush(Pager* pager, Frame** dirty, uint32_t num_dirty) {
+    IoRing* ring = pager->ring;
+    struct iovec* iov = malloc(sizeof(struct iovec) * (num_dirty + 1));
+    IoRingWrite* writes = malloc(sizeof(IoRingWrite) * (num_dirty + 1));
+    if (iov == NULL || writes == NULL) {
+        fprintf(stderr, "Error: malloc failed for flush\n");
+        exit(EXIT_FAILURE);
+    }
+    ring->writes = writes;
+
+    uint32_t num_writes = 0;
+    uint32_t i = 0;
+    while (i < num_dirty) {
+        IoRingWrite* write = &writes[num_writes];
+        write->first_page_num = dirty[i]->page_num;
+        write->iov = &iov[i];
+        write->iov_count = 0;
+        write->result = 0;
+        while (i < num_dirty && write->iov_count < FLUSH_MAX_IOV &&
+               dirty[i]->page_num == write->first_page_num + (uint32_t)write->iov_count) {
+            iov[i].iov_base = dirty[i]->data;
+            iov[i].iov_len = page_size;
+            dirty[i]->dirty = false;
+            pager->num_dirty--;
+            write->iov_count++;
+            i++;
+        }
+
+        struct io_uring_sqe* sqe = io_ring_get_sqe(ring);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = pager->file_descriptor;
+        sqe->addr = (uint64_t)(uintptr_t)write->iov;
+        sqe->len = (uint32_t)write->iov_count;
+        sqe->off = (uint64_t)write->first_page_num * page_size;
+        sqe->user_data = IO_RING_TAG_WRITE | num_writes;
+        io_ring_push(ring);
+        num_writes++;
+    }
+
+    struct io_uring_sqe* sqe = io_ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = pager->file_descriptor;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = IO_RING_TAG_SYNC;
+    ring->sync_result = 0;
+    uint64_t start_ns = stats_now_ns();
+    io_ring_push(ring);
+
+    // Waits for prefetches too, which is harmless: the sync already waits for everything before it
+    while (ring->in_flight > 0) {
+        io_ring_reap(ring, true);
+    }
+    ring->writes = NULL;
+    // The drained sync can't be told apart from the writes ahead of it: this times the whole flush
+    latency_record(&stats.syncs, stats_now_ns() - start_ns);
+
+    bool synced = ring->sync_result == 0;
+    for (uint32_t w = 0; w < num_writes; w++) {
+        IoRingWrite* write = &writes[w];
+        size_t length = (size_t)write->iov_count * page_size;
+        if (write->result < 0 && write->result != -EINTR && write->result != -EAGAIN) {
+            fprintf(stderr, "Error writing: %s\n", strerror(-write->result));
+            exit(EXIT_FAILURE);
+        }
+        if (write->result < (int32_t)length) {
+            pager_write_run(pager, write->first_page_num, write->iov, write->iov_count);
+            synced = false;
+        }
+        pager_track_write(pager, write->first_page_num, (uint32_t)write->iov_count);
+        off_t end = (off_t)(write->first_page_num + (uint32_t)write->iov_count) * page_size;
+        if (end > pager->file_length) {
+            pager->file_length = end;
+        }
+    }
+    free(writes);
+    free(iov);
+
+    if (!synced && !pager_sync(pager)) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// --direct-io: switches the open file to O_DIRECT, which needs page-aligned buffers, offsets and
+// lengths from then on. Frames and import batches always are; pager_write_page copies anything
+// else through the bounce page. Returns false when the file system doesn't support it.
+bool pager_enable_direct_io(Pager* pager) {
+    int flags = fcntl(pager->file_descriptor, F_GETFL);
+    if (flags == -1 || fcntl(pager->file_descriptor, F_SETFL, flags | O_DIRECT) == -1) {
+        return false;
+    }
+    if (pager->bounce == NULL) {
+        pager->bounce = aligned_alloc(page_size, page_size);
+        if (pager->bounce == NULL) {
+            fprintf(stderr, "Error: malloc failed for pager\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pager->direct_io = true;
+    return true;
+}
+
+/* --- Write-Ahead Log --- */
+
+/*
+Log layout: an 8 byte header (magic, salt) followed by records of
+[type][payload length][checksum][payload]. The checksum covers the salt,
+so records left over from before the last reset never validate.
+
+Inserts are logged as serialized rows. The database file itself is only
+written by checkpoints: the dirty pages are first appended to the log as
+page images followed by a checkpoint record, the log is synced, and only
+then are the pages written to the database file and the log reset. A
+crash in the middle of writing the database file is repaired on the next
+open by copying the images again.
+*/
+
+uint32_t crc32_table[256];
+pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+void crc32_build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc32_table[i] = crc;
+    }
+}
+
+// CRC-32 (IEEE 802.3), chainable: pass the previous result as crc, 0 to start
+uint32_t crc32_update(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&crc32_table_once, crc32_build_table);
+    const uint8_t* bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t wal_record_checksum(uint32_t salt, uint32_t type, uint32_t length, const void* payload) {
+    uint32_t header[3] = { salt, type, length };
+    uint32_t crc = crc32_update(0, header, sizeof(header));
+    return crc32_update(crc, payload, length);
+}
+
+void wal_write_all(Wal* wal, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(wal->file_descriptor, data, length, offset);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing WAL: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        stats_add(&stats.wal_bytes_written, (uint64_t)written);
+        data += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+}
+
+void wal_sync(Wal* wal) {
+    if (stats_fdatasync(wal->file_descriptor, &stats.wal_syncs) == -1) {
+        fprintf(stderr, "Error: WAL fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Empties the log and starts a new salt generation
+void wal_reset(Wal* wal) {
+    wal->salt++;
+    if (ftruncate(wal->file_descriptor, 0) == -1) {
+        fprintf(stderr, "Error truncating WAL: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    uint32_t header[2] = { WAL_MAGIC, wal->salt };
+    wal_write_all(wal, (const char*)header, WAL_HEADER_SIZE, 0);
+    wal_sync(wal);
+
+    // A server worker may still be about to wait for a record the checkpoint just made durable
+    pthread_mutex_lock(&wal->lock);
+    wal->buffer_length = 0;
+    wal->base_lsn = wal->end_lsn;
+    wal->end_lsn = wal->base_lsn + WAL_HEADER_SIZE;
+    wal->flushed_lsn = wal->end_lsn;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// <db_filename>-wal, allocated
+char* wal_path(const char* db_filename) {
+    size_t path_length = strlen(db_filename) + sizeof("-wal");
+    char* path = malloc(path_length);
+    if (path == NULL) {
+        fprintf(stderr, "Error: malloc failed for WAL\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, path_length, "%s-wal", db_filename);
+    return path;
+}
+
+bool wal_exists(const char* db_filename) {
+    char* path = wal_path(db_filename);
+    bool exists = access(path, F_OK) == 0;
+    free(path);
+    return exists;
+}
+
+Wal* wal_open(const char* db_filename, const DbOptions* options) {
+    Wal* wal = malloc(sizeof(Wal));
+    if (wal == NULL) {
+        fprintf(stderr, "Error: malloc failed for WAL\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wal->path = wal_path(db_filename);
+    wal->buffer_capacity = 1 << 16;
+    wal->buffer = malloc(wal->buffer_capacity);
+    wal->spare_buffer = malloc(wal->buffer_capacity);
+    wal->spare_capacity = wal->buffer_capacity;
+    if (wal->buffer == NULL || wal->spare_buffer == NULL) {
+        fprintf(stderr, "Error: malloc failed for WAL\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wal->file_descriptor = open(wal->path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        fprintf(stderr, "Unable to open WAL file %s: %s\n", wal->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    wal->salt = 0;
+    wal->buffer_length = 0;
+    wal->base_lsn = 0;
+    wal->end_lsn = 0;
+    wal->flushed_lsn = 0;
+    wal->flushing = false;
+    wal->group_commit_window_us = options->group_commit_window_us;
+    wal->autocheckpoint = options->wal_autocheckpoint;
+    wal->replay = NULL;
+    wal->replay_length = 0;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+    return wal;
+}
+
+// Reads the whole log. Returns NULL (and no salt) when it doesn't start with a valid header;
+// narrow_ids tells whether its records still have 32-bit ids.
+char* wal_read_log(int file_descriptor, off_t* length, uint32_t* salt, bool* narrow_ids) {
+    *length = lseek(file_descriptor, 0, SEEK_END);
+    if (*length < WAL_HEADER_SIZE) {
+        return NULL;
+    }
+    char* log = malloc((size_t)*length);
+    if (log == NULL) {
+        fprintf(stderr, "Error: malloc failed for WAL recovery\n");
+        exit(EXIT_FAILURE);
+    }
+    off_t done = 0;
+    while (done < *length) {
+        ssize_t bytes_read = pread(file_descriptor, log + done, (size_t)(*length - done), done);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) continue;
+            *length = done;
+            break;
+        }
+        done += bytes_read;
+    }
+
+    uint32_t magic = 0;
+    if (*length >= WAL_HEADER_SIZE) {
+        memcpy(&magic, log, sizeof(uint32_t));
+        memcpy(salt, log + sizeof(uint32_t), sizeof(uint32_t));
+    }
+    if (magic != WAL_MAGIC && magic != WAL_NARROW_MAGIC) {
+        free(log);
+        return NULL;
+    }
+    *narrow_ids = magic == WAL_NARROW_MAGIC;
+    return log;
+}
+
+// Copies a run of records from a log with 32-bit ids into out (twice length is always enough),
+// with the ids of the inserted rows and deleted ranges widened. Returns the bytes written. The
+// copies are only replayed, so their checksums are left 0 like those inside a transaction.
+size_t wal_widen_records(const char* records, size_t length, char* out) {
+    size_t out_length = 0;
+    for (size_t offset = 0; offset < length;) {
+        uint32_t header[3];
+        memcpy(header, records + offset, WAL_RECORD_HEADER_SIZE);
+        const char* payload = records + offset + WAL_RECORD_HEADER_SIZE;
+        char* out_payload = out + out_length + WAL_RECORD_HEADER_SIZE;
+        uint32_t out_payload_length = 0;
+        if (header[0] == WAL_RECORD_INSERT) {
+            for (uint32_t position = 0; position < header[1];) {
+                uint32_t id;
+                memcpy(&id, payload + position, NARROW_KEY_SIZE);
+                Row row;
+                row.id = id;
+                position += NARROW_KEY_SIZE + deserialize_row_value(payload + position + NARROW_KEY_SIZE, &row);
+                out_payload_length += serialize_row(&row, out_payload + out_payload_length);
+            }
+        } else if (header[0] == WAL_RECORD_DELETE && header[1] == 2 * NARROW_KEY_SIZE) {
+            uint32_t range[2];
+            memcpy(range, payload, sizeof(range));
+            uint64_t wide_range[2] = { range[0], range[1] };
+            memcpy(out_payload, wide_range, sizeof(wide_range));
+            out_payload_length = sizeof(wide_range);
+        }
+        uint32_t out_header[3] = { header[0], out_payload_length, 0 };
+        memcpy(out + out_length, out_header, WAL_RECORD_HEADER_SIZE);
+        out_length += WAL_RECORD_HEADER_SIZE + out_payload_length;
+        offset += WAL_RECORD_HEADER_SIZE + header[1];
+    }
+    return out_length;
+}
+
+// Walks the records of a log read by wal_read_log up to the first torn or stale one and returns
+// where the valid ones end. last_checkpoint is the end of the last checkpoint record (0 if there
+// is none) and previous_checkpoint the end of the one before it, where that checkpoint's pages start.
+size_t wal_scan(const char* log, size_t length, uint32_t salt, size_t* previous_checkpoint, size_t* last_checkpoint) {
+    size_t valid_end = WAL_HEADER_SIZE;
+    size_t segment_start = WAL_HEADER_SIZE;
+    *previous_checkpoint = WAL_HEADER_SIZE;
+    *last_checkpoint = 0;
+    while (valid_end + WAL_RECORD_HEADER_SIZE <= length) {
+        uint32_t header[3];
+        memcpy(header, log + valid_end, WAL_RECORD_HEADER_SIZE);
+        uint32_t type = header[0];
+        uint32_t payload_length = header[1];
+        if (payload_length > length - valid_end - WAL_RECORD_HEADER_SIZE) {
+            break;
+        }
+        const char* payload = log + valid_end + WAL_RECORD_HEADER_SIZE;
+        if (wal_record_checksum(salt, type, payload_length, payload) != header[2]) {
+            break;
+        }
+        valid_end += WAL_RECORD_HEADER_SIZE + payload_length;
+        if (type == WAL_RECORD_CHECKPOINT) {
+            *previous_checkpoint = segment_start;
+            *last_checkpoint = valid_end;
+            segment_start = valid_end;
+        }
+    }
+    return valid_end;
+}
+
+// Read-only mode: whether the log next to db_filename ends in a checkpoint that was never
+// finished, so the database file may be torn. Checked under the readers' lock, where a live
+// writer has either not written the checkpoint record yet or already reset the log after it.
+bool wal_checkpoint_interrupted(const char* db_filename) {
+    char* path = wal_path(db_filename);
+    int file_descriptor = open(path, O_RDONLY);
+    free(path);
+    if (file_descriptor == -1) {
+        return false;
+    }
+
+    off_t length;
+    uint32_t salt;
+    bool narrow_ids;
+    char* log = wal_read_log(file_descriptor, &length, &salt, &narrow_ids);
+    close(file_descriptor);
+    if (log == NULL) {
+        return false;
+    }
+    size_t previous_checkpoint;
+    size_t last_checkpoint;
+    wal_scan(log, (size_t)length, salt, &previous_checkpoint, &last_checkpoint);
+    free(log);
+    return last_checkpoint != 0;
+}
+
+// Read-only mode: the salt of the log next to db_filename, false if there is no log
+bool wal_read_salt(const char* db_filename, uint32_t* salt) {
+    char* path = wal_path(db_filename);
+    int file_descriptor = open(path, O_RDONLY);
+    free(path);
+    if (file_descriptor == -1) {
+        return false;
+    }
+    uint32_t header[2] = { 0, 0 };
+    ssize_t bytes_read = pread(file_descriptor, header, WAL_HEADER_SIZE, 0);
+    close(file_descriptor);
+    *salt = header[1];
+    return bytes_read == WAL_HEADER_SIZE && (header[0] == WAL_MAGIC || header[0] == WAL_NARROW_MAGIC);
+}
+
+// Scans the log after a restart. Page images of the last complete checkpoint are copied into
+// the database file; inserts and deletes logged after that checkpoint are kept in wal->replay for db_open,
+// with their ids widened if the log came from before 64-bit ids.
+void wal_recover(Wal* wal, Pager* pager) {
+    off_t length;
+    bool narrow_ids;
+    char* log = wal_read_log(wal->file_descriptor, &length, &wal->salt, &narrow_ids);
+    if (log == NULL) {
+        // A new salt that no earlier log of this database is likely to have used
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        wal->salt = (uint32_t)getpid() ^ (uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec ^ (uint32_t)pager->file_length;
+        wal_reset(wal);
+        return;
+    }
+
+    // First pass: find where the valid records end and where the last two checkpoints are
+    size_t previous_checkpoint;
+    size_t last_checkpoint;
+    size_t valid_end = wal_scan(log, (size_t)length, wal->salt, &previous_checkpoint, &last_checkpoint);
+
+    // Second pass: redo the last checkpoint's page images and collect later inserts
+    bool applied_pages = false;
+    size_t replay_capacity = 0;
+    size_t offset = WAL_HEADER_SIZE;
+    while (offset < valid_end) {
+        uint32_t header[3];
+        memcpy(header, log + offset, WAL_RECORD_HEADER_SIZE);
+        const char* payload = log + offset + WAL_RECORD_HEADER_SIZE;
+        if (header[0] == WAL_RECORD_PAGE && offset >= previous_checkpoint && offset < last_checkpoint) {
+            if (header[1] != sizeof(uint32_t) + page_size) {
+                fprintf(stderr, "Error: the WAL of %s holds %u-byte pages; reopen it with --page-size=%u\n",
+                        pager->filename, header[1] - (uint32_t)sizeof(uint32_t), header[1] - (uint32_t)sizeof(uint32_t));
+                exit(EXIT_FAILURE);
+            }
+            uint32_t page_num;
+            memcpy(&page_num, payload, sizeof(uint32_t));
+            pager_write_page(pager, page_num, (void*)(payload + sizeof(uint32_t)));
+            applied_pages = true;
+        } else if ((header[0] == WAL_RECORD_INSERT || header[0] == WAL_RECORD_DELETE ||
+                    header[0] == WAL_RECORD_TRANSACTION) && offset >= last_checkpoint && header[1] > 0) {
+            // Whole records are kept, so db_open sees inserts and deletes in their original order.
+            // A transaction's are kept without the record around them.
+            const char* record = header[0] == WAL_RECORD_TRANSACTION ? payload : log + offset;
+            size_t record_length = header[0] == WAL_RECORD_TRANSACTION ? header[1] : WAL_RECORD_HEADER_SIZE + header[1];
+            char* widened = NULL;
+            if (narrow_ids) {
+                widened = malloc(2 * record_length);
+                if (widened == NULL) {
+                    fprintf(stderr, "Error: malloc failed for WAL recovery\n");
+                    exit(EXIT_FAILURE);
+                }
+                record_length = wal_widen_records(record, record_length, widened);
+                record = widened;
+            }
+            while (wal->replay_length + record_length > replay_capacity) {
+                replay_capacity = replay_capacity == 0 ? 64 * ROW_MAX_SIZE : replay_capacity * 2;
+                wal->replay = realloc(wal->replay, replay_capacity);
+                if (wal->replay == NULL) {
+                    fprintf(stderr, "Error: malloc failed for WAL recovery\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(wal->replay + wal->replay_length, record, record_length);
+            wal->replay_length += record_length;
+            free(widened);
+        }
+        offset += WAL_RECORD_HEADER_SIZE + header[1];
+    }
+    free(log);
+
+    if (applied_pages && !pager_sync(pager)) {
+        fprintf(stderr, "Error: fdatasync failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (wal->replay == NULL) {
+        // Everything in the log is already in the database file
+        wal_reset(wal);
+    } else {
+        // Keep the records until db_open has re-applied and checkpointed them; drop any torn tail
+        if (ftruncate(wal->file_descriptor, (off_t)valid_end) == -1) {
+            fprintf(stderr, "Error truncating WAL: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        wal->end_lsn = valid_end;
+        wal->flushed_lsn = valid_end;
+    }
+}
+
+// Buffers a record and returns its LSN. Large buffers are written out early but not synced.
+uint64_t wal_append(Wal* wal, WalRecordType type, const void* payload, uint32_t payload_length) {
+    pthread_mutex_lock(&wal->lock);
+
+    size_t record_length = WAL_RECORD_HEADER_SIZE + payload_length;
+    if (wal->buffer_length + record_length > wal->buffer_capacity) {
+        while (wal->buffer_length + record_length > wal->buffer_capacity) {
+            wal->buffer_capacity *= 2;
+        }
+        wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+        if (wal->buffer == NULL) {
+            fprintf(stderr, "Error: malloc failed for WAL buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t header[3] = { type, payload_length, wal_record_checksum(wal->salt, type, payload_length, payload) };
+    memcpy(wal->buffer + wal->buffer_length, header, WAL_RECORD_HEADER_SIZE);
+    if (payload_length > 0) {
+        memcpy(wal->buffer + wal->buffer_length + WAL_RECORD_HEADER_SIZE, payload, payload_length);
+    }
+    wal->buffer_length += record_length;
+    wal->end_lsn += record_length;
+    uint64_t lsn = wal->end_lsn;
+
+    if (wal->buffer_length >= WAL_BUFFER_FLUSH_SIZE) {
+        wal_write_all(wal, wal->buffer, wal->buffer_length, (off_t)(wal->end_lsn - wal->buffer_length - wal->base_lsn));
+        wal->buffer_length = 0;
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// Group commit: waits until every record up to lsn is synced. The first waiter becomes the
+// leader and syncs everything appended so far, so concurrent committers share one fdatasync.
+void wal_commit(Wal* wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushed_lsn < lsn) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+            continue;
+        }
+
+        wal->flushing = true;
+        if (wal->group_commit_window_us > 0) {
+            // Give other writers a moment to join this sync
+            pthread_mutex_unlock(&wal->lock);
+            usleep(wal->group_commit_window_us);
+            pthread_mutex_lock(&wal->lock);
+        }
+
+        // Write the buffer outside the lock; appends meanwhile go to the spare buffer
+        char* data = wal->buffer;
+        size_t data_length = wal->buffer_length;
+        size_t data_capacity = wal->buffer_capacity;
+        uint64_t target_lsn = wal->end_lsn;
+        off_t offset = (off_t)(target_lsn - data_length - wal->base_lsn);
+        wal->buffer = wal->spare_buffer;
+        wal->buffer_capacity = wal->spare_capacity;
+        wal->buffer_length = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        wal_write_all(wal, data, data_length, offset);
+        wal_sync(wal);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->spare_buffer = data;
+        wal->spare_capacity = data_capacity;
+        wal->flushed_lsn = target_lsn;
+        wal->flushing = false;
+        pthread_cond_broadcast(&wal->flushed);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Moves every dirty page into the database file. Caller must hold off all writers.
+void wal_checkpoint(Wal* wal, Pager* pager) {
+    if (pager->num_dirty > 0) {
+        char image[sizeof(uint32_t) + MAX_PAGE_SIZE];
+        for (uint32_t i = 0; i < pager->frames_in_use; i++) {
+            Frame* frame = &pager->frames[i];
+            if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+                memcpy(image, &frame->page_num, sizeof(uint32_t));
+                memcpy(image + sizeof(uint32_t), frame->data, page_size);
+                wal_append(wal, WAL_RECORD_PAGE, image, sizeof(uint32_t) + page_size);
+            }
+        }
+        // Readers are kept out from the checkpoint record until the log is reset, so none of
+        // them reads the file half-written or mistakes a live checkpoint for an interrupted one
+        pager_exclude_readers(pager);
+        wal_commit(wal, wal_append(wal, WAL_RECORD_CHECKPOINT, NULL, 0));
+        pager_flush(pager);
+        wal_reset(wal);
+        pager_admit_readers(pager);
+        return;
+    }
+    wal_reset(wal);
+}
+
+// Called after a final checkpoint, so the log holds nothing worth keeping
+void wal_close(Wal* wal) {
+    close(wal->file_descriptor);
+    unlink(wal->path);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->flushed);
+    free(wal->replay);
+    free(wal->buffer);
+    free(wal->spare_buffer);
+    free(wal->path);
+    free(wal);
+}
+
+/* --- Server --- */
+
+// Opens the listening socket: "unix:<path>" for a Unix socket, otherwise "[host:]port" over TCP,
+// where the host defaults to 127.0.0.1
+int server_listen(const char* address, char** socket_path) {
+    int listen_fd;
+    *socket_path = NULL;
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char* path = address + 5;
+        struct sockaddr_un unix_address = { .sun_family = AF_UNIX };
+        if (path[0] == '\0' || strlen(path) >= sizeof(unix_address.sun_path)) {
+            fprintf(stderr, "Error: invalid socket path '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(unix_address.sun_path, path);
+
+        // A socket left behind by a server that was killed would make bind fail
+        struct stat path_stat;
+        if (stat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+            unlink(path);
+        }
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&unix_address, sizeof(unix_address)) == -1) {
+            fprintf(stderr, "Error: unable to listen on %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        *socket_path = strdup(path);
+    } else {
+        char host[256] = "127.0.0.1";
+        const char* port = address;
+        const char* colon = strrchr(address, ':');
+        if (colon != NULL) {
+            // [::1]:port for IPv6 addresses
+            const char* host_start = address;
+            size_t host_length = (size_t)(colon - address);
+            if (host_length >= 2 && address[0] == '[' && colon[-1] == ']') {
+                host_start++;
+                host_length -= 2;
+            }
+            if (host_length == 0 || host_length >= sizeof(host)) {
+                fprintf(stderr, "Error: invalid listen address '%s'\n", address);
+                exit(EXIT_FAILURE);
+            }
+            memcpy(host, host_start, host_length);
+            host[host_length] = '\0';
+            port = colon + 1;
+        }
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+        struct addrinfo* addresses;
+        int status = getaddrinfo(host, port, &hints, &addresses);
+        if (status != 0) {
+            fprintf(stderr, "Error: unable to resolve '%s': %s\n", address, gai_strerror(status));
+            exit(EXIT_FAILURE);
+        }
+        int reuse = 1;
+        listen_fd = socket(addresses->ai_family, addresses->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addresses->ai_protocol);
+        if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+            bind(listen_fd, addresses->ai_addr, addresses->ai_addrlen) == -1) {
+            fprintf(stderr, "Error: unable to listen on %s: %s\n", address, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        freeaddrinfo(addresses);
+    }
+
+    if (listen(listen_fd, SERVER_LISTEN_BACKLOG) == -1) {
+        fprintf(stderr, "Error: unable to listen on %s: %s\n", address, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+// Serves clients until SIGINT or SIGTERM, then checkpoints and exits. This thread accepts
+// connections and watches their sockets; num_workers threads run the statements.
+void server_run(Table* table, const char* address, uint32_t num_workers) {
+    Server server = { .table = table };
+    table->pager->concurrent = true;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    server.listen_fd = server_listen(address, &server.socket_path);
+
+    // Blocked before the workers start so they inherit the mask and only the event loop sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    server.signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.signal_fd == -1 || server.epoll_fd == -1) {
+        fprintf(stderr, "Error: unable to start the server: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &server.listen_fd };
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    event.data.ptr = &server.signal_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &event);
+
+    pthread_t* workers = malloc(sizeof(pthread_t) * num_workers);
+    if (workers == NULL) {
+        fprintf(stderr, "Error: malloc failed for server\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < num_workers; i++) {
+        int error = pthread_create(&workers[i], NULL, server_worker, &server);
+        if (error != 0) {
+            fprintf(stderr, "Error: unable to start worker thread: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Listening on %s with %u workers.\n", address, num_workers);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int count = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: epoll_wait failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &server.signal_fd) {
+                running = false;
+            } else if (source == &server.listen_fd) {
+                server_accept(&server);
+            } else {
+                server_enqueue(&server, source);
+            }
+        }
+    }
+
+    // Workers finish the batch they are on; input still queued is dropped with its connection
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (uint32_t i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (server.socket_path != NULL) {
+        unlink(server.socket_path);
+        free(server.socket_path);
+    }
+    close(server.listen_fd);
+    close(server.signal_fd);
+    close(server.epoll_fd);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    free_table(table);
+    exit(EXIT_SUCCESS);
+}
+
+// Accepts every pending connection and starts watching it for input
+void server_accept(Server* server) {
+    while (true) {
+        int socket = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Warning: accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        // Results of pipelined statements are sent in one piece, so don't hold back the last segment
+        int no_delay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        if (connection == NULL) {
+            fprintf(stderr, "Error: malloc failed for connection\n");
+            exit(EXIT_FAILURE);
+        }
+        connection->socket = socket;
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = connection };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1) {
+            fprintf(stderr, "Warning: unable to watch connection: %s\n", strerror(errno));
+            close(socket);
+            free(connection);
+        }
+    }
 }
 
-Cursor* table_find(Table* table, uint32_t key){
-    uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
-    if (get_node_type(root_node) == NODE_LEAF){
-        return leaf_node_find(table, root_page_num, key);
+// Hands a connection with new input to the workers
+void server_enqueue(Server* server, Connection* connection) {
+    pthread_mutex_lock(&server->lock);
+    connection->next_ready = NULL;
+    if (server->ready_tail == NULL) {
+        server->ready_head = connection;
     } else {
-        return internal_node_find(table, root_page_num, key);
+        server->ready_tail->next_ready = connection;
     }
+    server->ready_tail = connection;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key){
-    void* node = get_page(table->pager, page_num);
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys;
-
-    while (min_index != max_index){
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key){
-            max_index = index;
-        } else {
-            min_index = index + 1;
+void* server_worker(void* argument) {
+    Server* server = argument;
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->ready_head == NULL && !server->stopping) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
         }
+        Connection* connection = server->ready_head;
+        server->ready_head = connection->next_ready;
+        if (server->ready_head == NULL) {
+            server->ready_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        server_serve(server, connection);
     }
+}
 
-    uint32_t child_page_num = *internal_node_child(node, min_index);
-    void* child_node = get_page(table->pager, child_page_num);
+// Reads what the client sent and runs every complete line (or binary frame) in order. The results
+// of the whole batch go back in one send, once the writes among them are durable.
+void server_serve(Server* server, Connection* connection) {
+    bool open = server_receive(connection);
 
-    if (get_node_type(child_node) == NODE_LEAF){
-        return leaf_node_find(table, child_page_num, key);
-    } else {
-        return internal_node_find(table, child_page_num, key);
+    char* response = NULL;
+    size_t response_length = 0;
+    FILE* output = open_memstream(&response, &response_length);
+    if (output == NULL) {
+        fprintf(stderr, "Error: malloc failed for response\n");
+        exit(EXIT_FAILURE);
     }
+    connection->statement.output = output;
+
+    uint64_t commit_lsn = 0;
+    bool done = false;
+    size_t start = 0;
+    if (!connection->protocol_known && connection->input_length > 0) {
+        if (connection->input[0] != '\0') {
+            connection->protocol_known = true;
+        } else if (connection->input_length >= PROTOCOL_MAGIC_SIZE) {
+            connection->protocol_known = true;
+            connection->binary = memcmp(connection->input, PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE) == 0;
+            if (connection->binary) {
+                // Echoed so the client knows it reached a server that speaks the protocol
+                fwrite(PROTOCOL_MAGIC, PROTOCOL_MAGIC_SIZE, 1, output);
+                start = PROTOCOL_MAGIC_SIZE;
+            } else {
+                done = true;
+            }
+        }
     }
 
-
-
-// Uses Binary Search to quickly find the exact "parking spot" (index) for a key inside this node.
-uint32_t leaf_node_find_cell(void* node, uint32_t key) {
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            return index;
-        }
-        if (key < key_at_index) {
-            one_past_max_index = index;
+    while (!done && connection->protocol_known) {
+        char* data = connection->input + start;
+        size_t available = connection->input_length - start;
+        if (connection->binary) {
+            uint32_t payload_length;
+            if (available < PROTOCOL_HEADER_SIZE) break;
+            memcpy(&payload_length, data, sizeof(payload_length));
+            if (payload_length > SERVER_MAX_LINE - PROTOCOL_HEADER_SIZE) {
+                protocol_write_error(output, "Error: message is too long.");
+                done = true;
+                break;
+            }
+            if (available < PROTOCOL_HEADER_SIZE + (size_t)payload_length) break;
+            start += PROTOCOL_HEADER_SIZE + payload_length;
+            done = !server_execute_message(server, connection, (MessageType)(uint8_t)data[sizeof(payload_length)],
+                                           data + PROTOCOL_HEADER_SIZE, payload_length, &commit_lsn);
         } else {
-            min_index = index + 1;
+            char* newline = memchr(data, '\n', available);
+            if (newline == NULL) break;
+            size_t line_length = (size_t)(newline - data);
+            start += line_length + 1;
+            if (line_length > 0 && data[line_length - 1] == '\r') {
+                line_length--;
+            }
+            data[line_length] = '\0';
+            done = !server_execute(server, connection, data, line_length, &commit_lsn);
         }
     }
+    connection->input_length -= start;
+    memmove(connection->input, connection->input + start, connection->input_length);
+    if (connection->input_length >= SERVER_MAX_LINE && !done) {
+        fprintf(output, "Error: statement is too long.\n");
+        done = true;
+    }
+    fclose(output);
 
-    return min_index;
-}
-
-uint32_t internal_node_find_child(void* node, uint32_t key){
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys;
+    server_commit(server, commit_lsn);
+    if (!server_send(connection->socket, response, response_length)) {
+        done = true;
+    }
+    free(response);
 
-    while (min_index != max_index){
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key){
-            max_index = index;
-        } else {
-            min_index = index + 1;
+    if (open && !done) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = connection };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->socket, &event) == 0) {
+            return;
         }
     }
-
-    return min_index;
+    server_close(connection);
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_index, uint32_t new_child_page_num, uint32_t new_key) {
-    void* parent = get_page(table->pager, parent_page_num);
-    uint32_t num_keys = *internal_node_num_keys(parent);
-
-    if (num_keys >= LEAF_NODE_MAX_CELLS) {
-        uint32_t temp_keys[INTERNAL_NODE_MAX_CELLS + 1];
-        uint32_t temp_children[INTERNAL_NODE_MAX_CELLS + 2];
+void server_close(Connection* connection) {
+    // Closing the socket also removes it from epoll
+    close(connection->socket);
+    for (uint32_t i = 0; i < connection->num_prepared; i++) {
+        free_prepared_statement(connection->prepared[i]);
+    }
+    free(connection->prepared);
+    free(connection->input);
+    free(connection->statement.rows);
+    free(connection);
+}
 
-        /* load existing children */
-        for (uint32_t i = 0; i < num_keys; i++) {
-            temp_keys[i] = *internal_node_key(parent, i);
-        }
-        for (uint32_t i = 0; i < num_keys + 1; i++) {
-            temp_children[i] = *internal_node_child(parent, i);
+// Reads everything the socket has buffered (up to SERVER_MAX_LINE). Returns false once the
+// client has closed its side or the connection failed.
+bool server_receive(Connection* connection) {
+    while (connection->input_length < SERVER_MAX_LINE) {
+        if (connection->input_capacity - connection->input_length < SERVER_READ_SIZE) {
+            size_t capacity = connection->input_capacity == 0 ? SERVER_READ_SIZE : connection->input_capacity * 2;
+            connection->input = realloc(connection->input, capacity);
+            if (connection->input == NULL) {
+                fprintf(stderr, "Error: malloc failed for connection\n");
+                exit(EXIT_FAILURE);
+            }
+            connection->input_capacity = capacity;
         }
 
-        
-        for (int i = (int)num_keys; i > (int)child_index; i--) {
-            temp_keys[i] = temp_keys[i - 1];
-        }
-        for (int i = (int)num_keys + 1; i > (int)child_index + 1; i--) {
-            temp_children[i] = temp_children[i - 1];
+        ssize_t received = recv(connection->socket, connection->input + connection->input_length,
+                                connection->input_capacity - connection->input_length, 0);
+        if (received > 0) {
+            connection->input_length += (size_t)received;
+        } else if (received == 0) {
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
         }
-        temp_keys[child_index] = new_key;
-        temp_children[child_index + 1] = new_child_page_num;
-
-        /* create new right node */
-        uint32_t right_page_num = get_unused_page_num(table->pager);
-        void* right_node = get_page(table->pager, right_page_num);
-        set_node_type(right_node, NODE_INTERNAL);
-        set_node_root(right_node, false);
-
-        /* reset left (parent) node */
-        *(internal_node_num_keys(parent)) = 0;
-
-        /* redistribute keys */
-        uint32_t left_key_count = INTERNAL_NODE_LEFT_SPLIT_COUNT;
-        uint32_t right_key_count = (num_keys + 1) - left_key_count - 1;
+    }
+    // The rest stays in the socket; epoll reports it again once this batch is done
+    return true;
+}
 
-        /* left keys */
-        for (uint32_t i = 0; i < left_key_count; i++) {
-            *internal_node_key(parent, i) = temp_keys[i];
-        }
-        /* left children */
-        for (uint32_t i = 0; i < left_key_count + 1; i++) {
-            *internal_node_child(parent, i) = temp_children[i];
-            
-            void* child = get_page(table->pager, temp_children[i]);
-            *((uint32_t*)(child + PARENT_POINTER_OFFSET)) = parent_page_num;
+// Runs one line from a client, taking the table latch shared for reads and exclusive for writes.
+// Returns false when the client asked to close the connection.
+bool server_execute(Server* server, Connection* connection, char* line, size_t line_length, uint64_t* commit_lsn) {
+    Statement* statement = &connection->statement;
+    FILE* output = statement->output;
+    if (line[0] == '.') {
+        if (strcmp(line, ".exit") == 0) {
+            return false;
         }
-        *internal_node_num_keys(parent) = left_key_count;
-
-        /* right keys */
-        for (uint32_t i = 0; i < right_key_count; i++) {
-            *internal_node_key(right_node, i) = temp_keys[left_key_count + 1 + i];
+        if (strcmp(line, ".stats") == 0 || strcmp(line, ".stats json") == 0) {
+            pthread_rwlock_rdlock(&server->table->latch);
+            print_stats(output, server->table, line[6] != '\0');
+            pthread_rwlock_unlock(&server->table->latch);
+            return true;
         }
-        /* right children */
-        for (uint32_t i = 0; i < right_key_count + 1; i++) {
-            *internal_node_child(right_node, i) = temp_children[left_key_count + 1 + i];
-            void* child = get_page(table->pager, temp_children[left_key_count + 1 + i]);
-            *((uint32_t*)(child + PARENT_POINTER_OFFSET)) = right_page_num;
+        if (strcmp(line, ".stats reset") == 0) {
+            pthread_rwlock_wrlock(&server->table->latch);
+            stats_reset(server->table->pager);
+            pthread_rwlock_unlock(&server->table->latch);
+            return true;
         }
-        *internal_node_num_keys(right_node) = right_key_count;
-
-        
-        uint32_t middle_key = temp_keys[left_key_count];
-
-        /* set right node's right child if needed */
-        *internal_node_right_child(right_node) = temp_children[left_key_count + 1 + right_key_count];
-
-        /* if parent was root, create new root */
-        if (is_node_root(parent)) {
-            /* parent_page_num is root page */
-            /* left child is parent_page_num, right child is right_page_num */
-            create_new_root(table, right_page_num);
-            /* set the promoted key in new root */
-            void* root = get_page(table->pager, table->root_page_num);
-            *internal_node_key(root, 0) = middle_key;
-            return;
-        } else {
-            uint32_t parent_parent_page = *((uint32_t*)(parent + PARENT_POINTER_OFFSET));
-            void* parent_parent = get_page(table->pager, parent_parent_page);
-            uint32_t parent_index = internal_node_find_child(parent_parent, middle_key);
-            internal_node_insert(table, parent_parent_page, parent_index, right_page_num, middle_key);
-            return;
+        if (strncmp(line, ".backup ", 8) == 0) {
+            // Takes the latch itself, and only briefly
+            backup_command(output, server->table, line + 8);
+            return true;
         }
+        fprintf(output, "Unrecognized command: '%s'.\n", line);
+        return true;
     }
 
-    /* Shift keys and children right to make room */
-    for (int i = (int)num_keys; i > (int)child_index; i--) {
-        *internal_node_key(parent, i) = *internal_node_key(parent, i - 1);
-        *internal_node_child(parent, i + 1) = *internal_node_child(parent, i);
+    InputBuffer input_buffer = { .buffer = line, .buffer_length = line_length + 1, .input_length = (ssize_t)line_length };
+    if (print_prepare_error(output, prepare_statement(&input_buffer, statement), line)) {
+        return true;
     }
-
-    /* Insert the new key and child */
-    *internal_node_key(parent, child_index) = new_key;
-    *internal_node_child(parent, child_index + 1) = new_child_page_num;
-    *internal_node_num_keys(parent) += 1;
-    /* Update parent pointer on the child */
-    void* child = get_page(table->pager, new_child_page_num);
-    *((uint32_t*)(child + PARENT_POINTER_OFFSET)) = parent_page_num;
+    print_execute_result(output, server_execute_statement(server, statement, commit_lsn));
+    return true;
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-    /*
-    Create a new node and move half the cells over.
-    Insert the new value in one of the two nodes.
-    Update parent or create a new parent.
-    */
-
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void* new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
+// Answers one binary protocol request. Returns false when the frame is malformed, which closes
+// the connection since the client and server no longer agree on the stream.
+bool server_execute_message(Server* server, Connection* connection, MessageType type, const char* payload, uint32_t length, uint64_t* commit_lsn) {
+    FILE* output = connection->statement.output;
+    uint32_t handle;
+    switch (type) {
+        case (MESSAGE_PREPARE):
+        case (MESSAGE_QUERY): {
+            char* text = strndup(payload, length);
+            if (text == NULL) {
+                fprintf(stderr, "Error: malloc failed for prepared statement\n");
+                exit(EXIT_FAILURE);
+            }
+            PreparedStatement* prepared;
+            PrepareResult result = db_prepare(text, &prepared);
+            if (result != PREPARE_SUCCESS) {
+                protocol_write_prepare_error(output, result, text);
+                free(text);
+                return true;
+            }
+            free(text);
+            prepared->statement.format = RESULT_BINARY;
+            prepared->statement.output = output;
+
+            if (type == MESSAGE_QUERY) {
+                // A query with placeholders never gets its values
+                ExecuteResult execute_result = EXECUTE_UNBOUND_PARAMETER;
+                if (prepared_fill(prepared)) {
+                    execute_result = server_execute_statement(server, &prepared->statement, commit_lsn);
+                }
+                protocol_write_done(output, execute_result, prepared->statement.rows_affected);
+                free_prepared_statement(prepared);
+                return true;
+            }
 
-    /*
-    All existing keys plus new key should be divided
-    evenly between old (left) and new (right) nodes.
-    Starting from the right, move each key to correct position.
-    */
-    for (uint32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void* destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destination_node = new_node;
-        } else {
-            destination_node = old_node;
+            // Reuse the lowest closed handle
+            for (handle = 0; handle < connection->num_prepared && connection->prepared[handle] != NULL; handle++) {
+            }
+            if (handle == PROTOCOL_MAX_PREPARED) {
+                protocol_write_error(output, "Error: too many prepared statements.");
+                free_prepared_statement(prepared);
+                return true;
+            }
+            if (handle == connection->num_prepared) {
+                connection->prepared = realloc(connection->prepared, sizeof(PreparedStatement*) * (handle + 1));
+                if (connection->prepared == NULL) {
+                    fprintf(stderr, "Error: malloc failed for prepared statement\n");
+                    exit(EXIT_FAILURE);
+                }
+                connection->num_prepared++;
+            }
+            connection->prepared[handle] = prepared;
+
+            uint32_t num_parameters = prepared->statement.num_parameters;
+            uint8_t reply[2 * sizeof(uint32_t)];
+            memcpy(reply, &handle, sizeof(handle));
+            memcpy(reply + sizeof(handle), &num_parameters, sizeof(num_parameters));
+            protocol_write_header(output, MESSAGE_PREPARED, (uint32_t)sizeof(reply) + num_parameters);
+            fwrite(reply, sizeof(reply), 1, output);
+            for (uint32_t i = 0; i < num_parameters; i++) {
+                ParameterKind kind = prepared->statement.parameters[i].kind;
+                fputc(parameter_is_text(kind) ? 1 : 0, output);
+            }
+            return true;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leaf_node_cell(destination_node, index_within_node);
-
-        if (i == (int32_t)cursor->cell_num) {
-            serialize_row(value, destination);
-        } else if (i > (int32_t)cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+        case (MESSAGE_EXECUTE): {
+            if (length < sizeof(handle)) return false;
+            memcpy(&handle, payload, sizeof(handle));
+            if (handle >= connection->num_prepared || connection->prepared[handle] == NULL) {
+                protocol_write_error(output, "Error: no prepared statement with that handle.");
+                return true;
+            }
+            PreparedStatement* prepared = connection->prepared[handle];
+            Statement* statement = &prepared->statement;
+
+            uint32_t position = sizeof(handle);
+            for (uint32_t i = 0; i < statement->num_parameters; i++) {
+                ParameterKind kind = statement->parameters[i].kind;
+                PrepareResult result;
+                if (parameter_is_text(kind)) {
+                    if (position + 1 > length || position + 1 + (uint8_t)payload[position] > length) return false;
+                    uint8_t text_length = (uint8_t)payload[position];
+                    result = prepared_bind_text(prepared, i, payload + position + 1, text_length);
+                    position += 1 + text_length;
+                } else {
+                    uint64_t value;
+                    if (position + sizeof(value) > length) return false;
+                    memcpy(&value, payload + position, sizeof(value));
+                    result = prepared_bind_uint64(prepared, i, value);
+                    position += sizeof(value);
+                }
+                if (result != PREPARE_SUCCESS) {
+                    protocol_write_prepare_error(output, result, "");
+                    return true;
+                }
+            }
+            if (position != length) return false;
+
+            // Every parameter was just bound
+            prepared_fill(prepared);
+            statement->output = output;
+            ExecuteResult result = server_execute_statement(server, statement, commit_lsn);
+            protocol_write_done(output, result, statement->rows_affected);
+            return true;
         }
+        case (MESSAGE_CLOSE):
+            if (length != sizeof(handle)) return false;
+            memcpy(&handle, payload, sizeof(handle));
+            if (handle < connection->num_prepared) {
+                free_prepared_statement(connection->prepared[handle]);
+                connection->prepared[handle] = NULL;
+            }
+            protocol_write_done(output, EXECUTE_SUCCESS, 0);
+            return true;
+        default:
+            return false;
     }
+}
 
-    /* Update cell count on both leaf nodes */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+// Runs a parsed statement, taking the table latch shared for reads and exclusive for writes.
+// For writes, commit_lsn is raised to the end of the log so the batch waits for it to be synced.
+ExecuteResult server_execute_statement(Server* server, Statement* statement, uint64_t* commit_lsn) {
+    Table* table = server->table;
+    ExecuteResult result;
+    if (statement->type == STATEMENT_BEGIN || statement->type == STATEMENT_COMMIT || statement->type == STATEMENT_ROLLBACK) {
+        // A transaction would have to keep every other connection's writes out until it ends
+        statement->rows_affected = 0;
+        return EXECUTE_NO_SERVER_TRANSACTIONS;
+    }
+    if (statement_writes(statement)) {
+        pthread_rwlock_wrlock(&table->latch);
+        result = execute_statement(statement, table);
+        if (table->pager->wal != NULL) {
+            *commit_lsn = table->pager->wal->end_lsn;
+        }
+        pthread_rwlock_unlock(&table->latch);
     } else {
-        uint32_t parent_page_num = *((uint32_t*)(old_node + PARENT_POINTER_OFFSET));
-        void* parent = get_page(cursor->table->pager, parent_page_num);
-        
-        uint32_t new_key = *leaf_node_key(new_node, 0);
-        uint32_t child_index = internal_node_find_child(parent, new_key);
-        internal_node_insert(cursor->table, parent_page_num, child_index, new_page_num, new_key);
+        pthread_rwlock_rdlock(&table->latch);
+        result = execute_statement(statement, table);
+        pthread_rwlock_unlock(&table->latch);
     }
+    return result;
 }
 
+// Waits until the log is synced through commit_lsn (0 when the batch wrote nothing). Without the
+// latch, so writers on other connections can join the same fdatasync. Then checkpoints if due.
+void server_commit(Server* server, uint64_t commit_lsn) {
+    if (commit_lsn == 0) {
+        return;
+    }
+    Table* table = server->table;
+    wal_commit(table->pager->wal, commit_lsn);
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-    /*
-    Handle splitting the root.
-    Old root copied to new page, becomes left child.
-    Address of right child passed in.
-    Re-initialize root page to contain the new root node.
-    New root node points to two children.
-    */
+    pthread_rwlock_wrlock(&table->latch);
+    if (table_checkpoint_due(table)) {
+        table_checkpoint(table);
+    }
+    pthread_rwlock_unlock(&table->latch);
+}
 
-    void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void* left_child = get_page(table->pager, left_child_page_num);
+// Sends all of data, waiting while the client's receive buffer is full. Returns false if the
+// connection failed or the client stopped reading.
+bool server_send(int socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            struct pollfd pfd = { .fd = socket, .events = POLLOUT };
+            if (poll(&pfd, 1, SERVER_SEND_TIMEOUT_MS) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
 
-    /* Left child has data from old root */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+/* --- Statistics --- */
+
+/*
+Counters are kept from process start in the global stats and cost an
+increment or two where they are bumped: buffer pool and split counters
+are plain, since the pool lock or the exclusive table latch already
+orders them; I/O bytes, syncs and statement latencies use relaxed
+atomics because they also happen outside any lock. .stats snapshots the
+counters, then walks every tree for its height and fill, so it reads
+(and counts) every page once.
+*/
+
+uint64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
 
-    set_node_type(root, NODE_INTERNAL);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    uint32_t left_child_max_key = *leaf_node_key(left_child, *leaf_node_num_cells(left_child) - 1);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_child(root, 0) = left_child_page_num;
-    *internal_node_right_child(root) = right_child_page_num;
-    void* left_child_page = get_page(table->pager, left_child_page_num);
-    void* right_child_page = get_page(table->pager, right_child_page_num);
-    *((uint32_t*)(left_child_page + PARENT_POINTER_OFFSET)) = table->root_page_num;
-    *((uint32_t*)(right_child_page + PARENT_POINTER_OFFSET)) = table->root_page_num;
+void stats_add(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
 }
 
-uint32_t* internal_node_child(void* node, uint32_t child_num){
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys){
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys){
-        return internal_node_right_child(node);
-    } else {
-        return internal_node_cell(node, child_num);
+// Values below LATENCY_SUB_BUCKETS are their own bucket; above that the top five bits of the
+// value (the leading one and four more) pick the bucket
+uint32_t latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (uint32_t)ns;
     }
+    uint32_t magnitude = 63 - (uint32_t)__builtin_clzll(ns);
+    uint32_t sub_bucket = (uint32_t)(ns >> (magnitude - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (magnitude - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub_bucket;
 }
 
-uint32_t get_unused_page_num(Pager* pager) {
-    if (pager->num_pages >= TABLE_MAX_PAGES) {
-        fprintf(stderr, "Error: Maximum number of pages (%d) reached.\n", TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+// The largest value that lands in bucket
+uint64_t latency_bucket_max(uint32_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
     }
-    return pager->num_pages;
+    uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lowest + ((1ull << shift) - 1);
 }
 
-void print_leaf_node(void* node) {
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    printf("leaf (size %d)\n", num_cells);
-    for (uint32_t i = 0; i < num_cells; i++) {
-        uint32_t key = *leaf_node_key(node, i);
-        printf("   -%d : %d\n", i, key);
+void latency_record(LatencyHistogram* histogram, uint64_t ns) {
+    stats_add(&histogram->count, 1);
+    stats_add(&histogram->total_ns, ns);
+    stats_add(&histogram->buckets[latency_bucket(ns)], 1);
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
 }
 
-/* --- Pager (Storage) Implementation --- */
-
-// Open a database file using pager
-Pager* pager_open(const char* filename) {
-    // This stores our flags like write, read, create, close
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-
-    // Checks if file failed to open (fd = -1 means error)
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+// The value at or below which fraction of the recorded values lie, rounded up to its bucket's
+// top (but never past the largest value seen)
+uint64_t latency_percentile(const LatencyHistogram* histogram, double fraction) {
+    if (histogram->count == 0) {
+        return 0;
     }
-
-    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-        if (errno == EWOULDBLOCK) {
-            fprintf(stderr, "Error: database is locked by another process\n");
-            close(fd);
-            exit(EXIT_FAILURE);
-        } else {
-            fprintf(stderr, "Error locking database file: %s\n", strerror(errno));
-            close(fd);
-            exit(EXIT_FAILURE);
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank) {
+            uint64_t value = latency_bucket_max(bucket);
+            return value < histogram->max_ns ? value : histogram->max_ns;
         }
     }
+    // A snapshot taken while values were being recorded can count them before their buckets
+    return histogram->max_ns;
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+// fdatasync, timed into histogram
+int stats_fdatasync(int file_descriptor, LatencyHistogram* histogram) {
+    uint64_t start_ns = stats_now_ns();
+    int result = fdatasync(file_descriptor);
+    latency_record(histogram, stats_now_ns() - start_ns);
+    return result;
+}
 
-    // Creates memory in RAM for Pager
-    Pager* pager = malloc(sizeof(Pager));
-    if (pager == NULL) {
-        fprintf(stderr, "Error: malloc failed for Pager\n");
-        exit(EXIT_FAILURE);
+const char* statement_type_name(StatementType type) {
+    switch (type) {
+        case (STATEMENT_INSERT):
+            return "insert";
+        case (STATEMENT_INSERT_BATCH):
+            return "insert_values";
+        case (STATEMENT_SELECT):
+            return "select";
+        case (STATEMENT_LOOKUP):
+            return "lookup";
+        case (STATEMENT_COUNT):
+            return "count";
+        case (STATEMENT_DELETE):
+            return "delete";
+        case (STATEMENT_CREATE_INDEX):
+            return "create_index";
+        case (STATEMENT_BEGIN):
+            return "begin";
+        case (STATEMENT_COMMIT):
+            return "commit";
+        case (STATEMENT_ROLLBACK):
+            return "rollback";
     }
+    return "unknown";
+}
 
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
-
-    if (pager->num_pages > TABLE_MAX_PAGES) {
-        fprintf(stderr, "Error: database file too large. Max pages = %d\n", TABLE_MAX_PAGES);
-        close(fd);
-        free(pager);
-        exit(EXIT_FAILURE);
+// Copies the counters. The pool lock holds off the plain buffer pool counters; in server mode the
+// caller holds the table latch, which holds off the split counters.
+void stats_snapshot(Pager* pager, Stats* snapshot) {
+    uint64_t* from = (uint64_t*)&stats;
+    uint64_t* to = (uint64_t*)snapshot;
+    pager_lock_pool(pager);
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
     }
+    pager_unlock_pool(pager);
+}
 
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
+// Zeroes the counters. In server mode the caller holds the table latch exclusively.
+void stats_reset(Pager* pager) {
+    uint64_t* counters = (uint64_t*)&stats;
+    pager_lock_pool(pager);
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
+    pager_unlock_pool(pager);
+}
 
-    // Sets index of pages to NULL
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+// Adds the subtree under page_num, which sits depth levels below the root, to tree
+void tree_stats(Pager* pager, uint32_t page_num, uint32_t depth, TreeStats* tree) {
+    void* node = pager_pin(pager, page_num);
+    if (depth + 1 > tree->height) {
+        tree->height = depth + 1;
+    }
+    if (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        tree->internal_nodes++;
+        tree->internal_keys += num_keys;
+        tree->wide_nodes += internal_node_is_wide(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            tree_stats(pager, *internal_node_child(node, i), depth + 1, tree);
+        }
+    } else {
+        tree->leaves++;
+        tree->cells += *leaf_node_num_cells(node);
+        tree->leaf_bytes_used += LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
     }
+    pager_unpin(pager, page_num);
+}
 
-    return pager;
+// Follows the free list, giving up after num_pages in case it loops
+uint32_t count_free_pages(Pager* pager) {
+    uint32_t page_num = pager->header.free_list_head;
+    uint32_t count = 0;
+    while (page_num != 0 && count < pager->num_pages) {
+        count++;
+        void* page = pager_pin(pager, page_num);
+        uint32_t next = *free_list_next(page);
+        pager_unpin(pager, page_num);
+        page_num = next;
+    }
+    return count;
 }
 
-// This finds the data in RAM first. If it's not there, it goes to the (Hard Drive) to fetch it.
-void* get_page(Pager* pager, uint32_t page_num) {
-    // Checks if TABLE_MAX_PAGES is greater than page_num if yes then return EXIT_FAILURE
-    if (page_num >= TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+void print_latency(FILE* output, const char* name, const LatencyHistogram* histogram, bool json) {
+    double mean = histogram->count == 0 ? 0 : (double)histogram->total_ns / (double)histogram->count;
+    double p50 = (double)latency_percentile(histogram, 0.5);
+    double p90 = (double)latency_percentile(histogram, 0.9);
+    double p99 = (double)latency_percentile(histogram, 0.99);
+    double p999 = (double)latency_percentile(histogram, 0.999);
+    double max = (double)histogram->max_ns;
+    if (json) {
+        fprintf(output, "\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                name, (unsigned long long)histogram->count, mean / 1000, p50 / 1000, p90 / 1000, p99 / 1000,
+                p999 / 1000, max / 1000);
+    } else {
+        fprintf(output, "%-14s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+                (unsigned long long)histogram->count, mean / 1000, p50 / 1000, p90 / 1000, p99 / 1000,
+                p999 / 1000, max / 1000);
     }
+}
 
-    // Checks if pages struct and inside that page_num and if it equals to NULL if not then we just return it
-    if (pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        if (page == NULL) {
-            fprintf(stderr, "Error: malloc failed for page\n");
-            exit(EXIT_FAILURE);
+void print_tree_stats(FILE* output, const char* name, const TreeStats* tree, bool json) {
+    // Fill: bytes of the leaves' cell space in use, keys out of what the internal nodes can hold
+    double leaf_fill = tree->leaves == 0 ? 0 : (double)tree->leaf_bytes_used / ((double)tree->leaves * LEAF_NODE_SPACE_FOR_CELLS);
+    double internal_capacity = (double)(tree->internal_nodes - tree->wide_nodes) * INTERNAL_NODE_MAX_CELLS +
+                               (double)tree->wide_nodes * INTERNAL_NODE_WIDE_MAX_CELLS;
+    double internal_fill = tree->internal_nodes == 0 ? 0 : (double)tree->internal_keys / internal_capacity;
+    if (json) {
+        fprintf(output, "\"%s\":{\"height\":%u,\"leaves\":%llu,\"internal_nodes\":%llu,\"wide_nodes\":%llu,\"cells\":%llu,\"leaf_fill\":%.3f,\"internal_fill\":%.3f}",
+                name, tree->height, (unsigned long long)tree->leaves, (unsigned long long)tree->internal_nodes,
+                (unsigned long long)tree->wide_nodes, (unsigned long long)tree->cells, leaf_fill, internal_fill);
+    } else {
+        fprintf(output, "Tree %s: height %u, %llu cells, %llu leaves %.1f%% full, %llu internal nodes %.1f%% full",
+                name, tree->height, (unsigned long long)tree->cells, (unsigned long long)tree->leaves,
+                leaf_fill * 100, (unsigned long long)tree->internal_nodes, internal_fill * 100);
+        if (tree->wide_nodes > 0) {
+            fprintf(output, " (%llu with wide keys)", (unsigned long long)tree->wide_nodes);
         }
+        fputc('\n', output);
+    }
+}
 
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        // We might save a partial page at the end of the file
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
+// .stats: the counters, then the shape of the table and every index. json prints it all as one
+// object on one line for scripts.
+void print_stats(FILE* output, Table* table, bool json) {
+    static const char* const tree_names[] = { "table", "username", "email" };
+    Pager* pager = table->pager;
+    Stats* snapshot = malloc(sizeof(Stats));
+    if (snapshot == NULL) {
+        fprintf(stderr, "Error: malloc failed for stats\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_snapshot(pager, snapshot);
+
+    TreeStats trees[COLUMN_EMAIL + 1] = { 0 };
+    bool present[COLUMN_EMAIL + 1] = { true };
+    tree_stats(pager, table->root_page_num, 0, &trees[COLUMN_NONE]);
+    for (Column column = COLUMN_USERNAME; column <= COLUMN_EMAIL; column++) {
+        Table index;
+        present[column] = table_index(table, column, &index);
+        if (present[column]) {
+            tree_stats(pager, index.root_page_num, 0, &trees[column]);
         }
-
-        if (page_num < num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                fprintf(stderr, "Error reading file: %s\n", strerror(errno));
-                exit(EXIT_FAILURE);
+    }
+    uint32_t free_pages = count_free_pages(pager);
+
+    unsigned long long lookups = (unsigned long long)(snapshot->page_hits + snapshot->page_misses);
+    if (json) {
+        fprintf(output, "{\"pages\":%u,\"page_size\":%u,\"free_pages\":%u,\"page_hits\":%llu,\"page_misses\":%llu,"
+                        "\"bytes_read\":%llu,\"bytes_written\":%llu,\"wal_bytes_written\":%llu,"
+                        "\"leaf_splits\":%llu,\"internal_splits\":%llu,\"pages_warmed\":%llu,\"trees\":{",
+                pager->num_pages, page_size, free_pages, (unsigned long long)snapshot->page_hits,
+                (unsigned long long)snapshot->page_misses, (unsigned long long)snapshot->bytes_read,
+                (unsigned long long)snapshot->bytes_written, (unsigned long long)snapshot->wal_bytes_written,
+                (unsigned long long)snapshot->leaf_splits, (unsigned long long)snapshot->internal_splits,
+                (unsigned long long)snapshot->pages_warmed);
+        const char* separator = "";
+        for (Column column = COLUMN_NONE; column <= COLUMN_EMAIL; column++) {
+            if (present[column]) {
+                fputs(separator, output);
+                print_tree_stats(output, tree_names[column], &trees[column], true);
+                separator = ",";
             }
-            if (bytes_read < (ssize_t)PAGE_SIZE) {
-                memset((char*)page + bytes_read, 0, PAGE_SIZE - (size_t)bytes_read);
+        }
+        fputs("},\"latency_us\":{", output);
+        print_latency(output, "sync", &snapshot->syncs, true);
+        fputs(",", output);
+        print_latency(output, "wal_sync", &snapshot->wal_syncs, true);
+        for (StatementType type = 0; type < NUM_STATEMENT_TYPES; type++) {
+            fputs(",", output);
+            print_latency(output, statement_type_name(type), &snapshot->statements[type], true);
+        }
+        fputs("}}\n", output);
+    } else {
+        fprintf(output, "Pages: %u of %u bytes (%u free)\n", pager->num_pages, page_size, free_pages);
+        fprintf(output, "Buffer pool: %llu hits, %llu misses (%.1f%% hits)\n",
+                (unsigned long long)snapshot->page_hits, (unsigned long long)snapshot->page_misses,
+                lookups == 0 ? 0 : 100.0 * (double)snapshot->page_hits / (double)lookups);
+        fprintf(output, "I/O: %llu bytes read, %llu bytes written, %llu bytes to the WAL\n",
+                (unsigned long long)snapshot->bytes_read, (unsigned long long)snapshot->bytes_written,
+                (unsigned long long)snapshot->wal_bytes_written);
+        fprintf(output, "Splits: %llu leaf, %llu internal\n", (unsigned long long)snapshot->leaf_splits,
+                (unsigned long long)snapshot->internal_splits);
+        if (snapshot->pages_warmed > 0) {
+            fprintf(output, "Warm start: %llu pages read back in at open\n", (unsigned long long)snapshot->pages_warmed);
+        }
+        for (Column column = COLUMN_NONE; column <= COLUMN_EMAIL; column++) {
+            if (present[column]) {
+                print_tree_stats(output, tree_names[column], &trees[column], false);
             }
         }
-
-        pager->pages[page_num] = page;
-
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+        fprintf(output, "%-14s %10s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", "p50",
+                "p90", "p99", "p99.9", "max");
+        print_latency(output, "sync", &snapshot->syncs, false);
+        print_latency(output, "wal_sync", &snapshot->wal_syncs, false);
+        for (StatementType type = 0; type < NUM_STATEMENT_TYPES; type++) {
+            if (snapshot->statements[type].count > 0) {
+                print_latency(output, statement_type_name(type), &snapshot->statements[type], false);
+            }
         }
     }
-
-    return pager->pages[page_num];
+    free(snapshot);
 }
 
-// Writes data from RAM to the hard drive
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        fprintf(stderr, "Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
-
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        fprintf(stderr, "Error seeking: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
     }
+}
 
-    size_t to_write = PAGE_SIZE;
-    char* buf = (char*)pager->pages[page_num];
-    while (to_write > 0) {
-        ssize_t written = write(pager->file_descriptor, buf, to_write);
-        if (written == -1) {
-            if (errno == EINTR) continue;
-            fprintf(stderr, "Error writing: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
+// .btree: every node of the tree under page_num, keys between the children of internal nodes
+// and each leaf's key range and fill
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+    void* node = pager_pin(pager, page_num);
+    if (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        indent(indentation_level);
+        printf("- internal (page %u, size %u, rows %llu%s)\n", page_num, num_keys, (unsigned long long)node_row_count(node),
+               internal_node_is_wide(node) ? ", wide keys" : "");
+        for (uint32_t i = 0; i < num_keys; i++) {
+            print_tree(pager, *internal_node_child(node, i), indentation_level + 1);
+            indent(indentation_level + 1);
+            printf("- key %llu\n", (unsigned long long)internal_node_key(node, i));
+        }
+        print_tree(pager, *internal_node_right_child(node), indentation_level + 1);
+    } else {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+        indent(indentation_level);
+        if (num_cells == 0) {
+            printf("- leaf (page %u, size 0)\n", page_num);
+        } else {
+            printf("- leaf (page %u, size %u, keys %llu..%llu, %u%% full)\n", page_num, num_cells,
+                   (unsigned long long)*leaf_node_key(node, 0), (unsigned long long)*leaf_node_key(node, num_cells - 1),
+                   (uint32_t)(used * 100 / LEAF_NODE_SPACE_FOR_CELLS));
         }
-        to_write -= (size_t)written;
-        buf += written;
-    }
-
-    if (fsync(pager->file_descriptor) == -1) {
-        fprintf(stderr, "Warning: fsync failed: %s\n", strerror(errno));
     }
+    pager_unpin(pager, page_num);
 }
 
 /* --- Application Entry Point --- */
 
+// bench.c includes this file with DB_NO_MAIN defined and brings its own main
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
     // Checks if you gave a database filename if not then exit
-    if (argc < 2) {
+    DbOptions options = {
+        .cache_size = DEFAULT_CACHE_SIZE,
+        .wal = true,
+        .group_commit_window_us = 0,
+        .wal_autocheckpoint = DEFAULT_WAL_AUTOCHECKPOINT,
+        .mmap = false,
+        .compress = false,
+        .read_only = false,
+        .io_uring = false,
+        .direct_io = false,
+        .warm_start = true,
+    };
+    char* filename = NULL;
+    const char* listen_address = NULL;
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    options.scan_threads = num_workers < 1 ? 1 : (uint32_t)num_workers;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+            if (!parse_size(argv[i] + 13, &options.cache_size)) {
+                printf("Invalid cache size '%s'.\n", argv[i] + 13);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+            size_t size;
+            if (!parse_size(argv[i] + 12, &size) || size > MAX_PAGE_SIZE || !page_size_valid((uint32_t)size)) {
+                printf("Invalid page size '%s' (a power of two from 4K to 64K).\n", argv[i] + 12);
+                exit(EXIT_FAILURE);
+            }
+            options.page_size = (uint32_t)size;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.mmap = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--no-wal") == 0) {
+            options.wal = false;
+        } else if (strcmp(argv[i], "--read-only") == 0) {
+            options.read_only = true;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            options.io_uring = true;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            options.direct_io = true;
+        } else if (strcmp(argv[i], "--no-warm-start") == 0) {
+            options.warm_start = false;
+        } else if (strncmp(argv[i], "--group-commit-us=", 18) == 0) {
+            options.group_commit_window_us = (uint32_t)strtoul(argv[i] + 18, NULL, 10);
+        } else if (strncmp(argv[i], "--wal-autocheckpoint=", 21) == 0) {
+            if (!parse_size(argv[i] + 21, &options.wal_autocheckpoint)) {
+                printf("Invalid checkpoint size '%s'.\n", argv[i] + 21);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--scan-threads=", 15) == 0) {
+            long scan_threads = strtol(argv[i] + 15, NULL, 10);
+            if (scan_threads < 1 || scan_threads > PARALLEL_SCAN_MAX_THREADS) {
+                printf("Invalid scan thread count '%s'.\n", argv[i] + 15);
+                exit(EXIT_FAILURE);
+            }
+            options.scan_threads = (uint32_t)scan_threads;
+        } else if (strncmp(argv[i], "--listen=", 9) == 0) {
+            listen_address = argv[i] + 9;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            num_workers = strtol(argv[i] + 10, NULL, 10);
+            if (num_workers < 1 || num_workers > 1024) {
+                printf("Invalid thread count '%s'.\n", argv[i] + 10);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unrecognized option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    char* filename = argv[1];
-    Table* table = db_open(filename);
+    if (listen_address != NULL && options.read_only) {
+        printf("--listen can't be combined with --read-only.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Table* table = db_open(filename, &options);
+    if (listen_address != NULL) {
+        server_run(table, listen_address, num_workers < 1 ? 1 : (uint32_t)num_workers);
+    }
+
+    // Results are held by the console until the statements they acknowledge are durable
+    console_open();
 
     InputBuffer* input_buffer = new_input_buffer();
-    Statement statement;
+    Statement statement = { .output = stdout, .output_direct = true };
     while (true) {
-        print_prompt();
-        read_input(input_buffer);
+        // In binary mode stdout carries nothing but protocol frames
+        bool binary = statement.format == RESULT_BINARY;
+        if (!binary) print_prompt();
+        // Statements the client already queued share one commit (and one fsync)
+        if (!input_pending() || table_checkpoint_due(table) || console_full()) {
+            table_commit(table);
+            console_release();
+        }
+        if (!read_input(input_buffer)) {
+            close_input_buffer(input_buffer);
+            free_table(table);
+            console_release();
+            exit(EXIT_FAILURE);
+        }
+        // A reader looks at the file as the writer last checkpointed it, one statement at a time
+        bool read_only = table->pager->read_only;
         // Checks if the first character in the input_buffer is . then execute do_meta_command
         if (input_buffer->buffer[0] == '.') {
-            switch (do_meta_command(input_buffer, table)) {
+            if (read_only) table_begin_read(table);
+            MetaCommandResult meta_result = do_meta_command(input_buffer, table, &statement);
+            if (read_only) pager_end_read(table->pager);
+            switch (meta_result) {
                 case (META_COMMAND_SUCCESS):
                     continue;
                 case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -1010,33 +10398,23 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        switch (prepare_statement(input_buffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long.\n");
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-                continue;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive.\n");
-                continue;
+        PrepareResult prepare_result = prepare_statement(input_buffer, &statement);
+        if (binary && prepare_result != PREPARE_SUCCESS) {
+            protocol_write_prepare_error(stdout, prepare_result, input_buffer->buffer);
+            continue;
+        }
+        if (print_prepare_error(stdout, prepare_result, input_buffer->buffer)) {
+            continue;
         }
 
-        switch (execute_statement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table full.\n");
-                break;
-            case (EXECUTE_DUPLICATE_KEY):
-                printf("Error: Duplicate key.\n");
-                break;
+        if (read_only) table_begin_read(table);
+        ExecuteResult execute_result = execute_statement(&statement, table);
+        if (read_only) pager_end_read(table->pager);
+        if (binary) {
+            protocol_write_done(stdout, execute_result, statement.rows_affected);
+        } else {
+            print_execute_result(stdout, execute_result);
         }
     }
 }
+#endif